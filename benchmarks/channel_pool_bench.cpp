@@ -0,0 +1,189 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <grpcpp/grpcpp.h>
+#include "../src/storage/storage.h"
+#include "../src/replication/replication_manager.h"
+#include "../src/service/kvstore_service.h"
+#include "../src/sharding/shard_router.h"
+
+// Async GETs through ShardRouter with 1, 2, 4, ... channels per shard.
+// The server runs in a child process; its connections are counted from
+// /proc/net/tcp to show each channel is a connection of its own.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kKeys = 1000;
+
+struct Result {
+    double seconds;
+    int failures;
+};
+
+void RunServer(const std::string& address) {
+    auto storage = std::make_shared<Storage>();
+    auto replication = std::make_shared<ReplicationManager>(NodeRole::MASTER);
+    storage->SetReplicationManager(replication);
+    KeyValueStoreServiceImpl service(storage, replication);
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    auto server = builder.BuildAndStart();
+    server->Wait();
+}
+
+std::shared_ptr<HashRing> SingleShard(const std::string& address) {
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", address);
+    return hash_ring;
+}
+
+std::string Key(int i) {
+    return "bench:" + std::to_string(i % kKeys);
+}
+
+// Established connections to `port`, client side only
+int ConnectionsTo(int port) {
+    int connections = 0;
+    for (const char* table : {"/proc/net/tcp", "/proc/net/tcp6"}) {
+        std::ifstream tcp(table);
+        std::string line;
+        std::getline(tcp, line);  // Header
+        while (std::getline(tcp, line)) {
+            std::istringstream fields(line);
+            std::string slot, local, remote, state;
+            fields >> slot >> local >> remote >> state;
+            // Addresses are hex "ADDR:PORT"; state 01 is ESTABLISHED
+            int remote_port = std::stoi(remote.substr(remote.find(':') + 1), nullptr, 16);
+            if (remote_port == port && state == "01") {
+                connections++;
+            }
+        }
+    }
+    return connections;
+}
+
+Result RunAsync(ShardRouter& router, int requests, int concurrency) {
+    std::atomic<int> issued{0};
+    std::atomic<int> failures{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    int completed = 0;
+
+    // Each completion issues the next request, keeping `concurrency` in flight
+    std::function<void()> issue = [&] {
+        int i = issued++;
+        if (i >= requests) return;
+        router.GetAsync(Key(i), [&](std::optional<std::string> value) {
+            if (!value) failures++;
+            issue();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++completed == requests) cv.notify_all();
+        });
+    };
+
+    auto start = Clock::now();
+    for (int i = 0; i < concurrency && i < requests; ++i) {
+        issue();
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return completed == requests; });
+    }
+    return {std::chrono::duration<double>(Clock::now() - start).count(), failures};
+}
+
+std::vector<size_t> ParseList(const std::string& list) {
+    std::vector<size_t> values;
+    std::istringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        values.push_back(std::stoul(value));
+    }
+    return values;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int requests = 100000;
+    int concurrency = 1000;
+    size_t completion_threads = ShardRouter::kDefaultCompletionThreads;
+    std::vector<size_t> sweep = {1, 2, 4, 8};
+    ChannelSelection selection = ChannelSelection::ROUND_ROBIN;
+    std::string address = "127.0.0.1:50072";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--requests" && i + 1 < argc) {
+            requests = std::stoi(argv[++i]);
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            concurrency = std::stoi(argv[++i]);
+        } else if (arg == "--completion-threads" && i + 1 < argc) {
+            completion_threads = std::stoul(argv[++i]);
+        } else if (arg == "--channels" && i + 1 < argc) {
+            sweep = ParseList(argv[++i]);
+        } else if (arg == "--least-loaded") {
+            selection = ChannelSelection::LEAST_LOADED;
+        } else if (arg == "--address" && i + 1 < argc) {
+            address = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--requests N] [--concurrency N] [--completion-threads N]"
+                      << " [--channels 1,2,4,8] [--least-loaded] [--address host:port]" << std::endl;
+            return 1;
+        }
+    }
+    int port = std::stoi(address.substr(address.rfind(':') + 1));
+
+    // Forked before gRPC starts any threads in this process
+    pid_t server = fork();
+    if (server == 0) {
+        RunServer(address);
+        _exit(0);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    std::cout << requests << " async GETs, " << concurrency << " in flight, "
+              << (selection == ChannelSelection::ROUND_ROBIN ? "round-robin" : "least-loaded") << std::endl;
+    std::cout << std::setw(10) << "channels" << std::setw(14) << "connections"
+              << std::setw(12) << "req/s" << std::setw(10) << "failed" << std::endl;
+
+    int failures = 0;
+    for (size_t channels : sweep) {
+        ChannelPoolOptions pool;
+        pool.channels_per_shard = channels;
+        pool.selection = selection;
+        ShardRouter router(SingleShard(address), completion_threads, pool);
+        int connections = ConnectionsTo(port);
+        for (int i = 0; i < kKeys; ++i) {
+            router.Set(Key(i), "value-" + std::to_string(i));
+        }
+
+        Result result = RunAsync(router, requests, concurrency);
+        std::cout << std::setw(10) << channels << std::setw(14) << connections
+                  << std::setw(12) << std::fixed << std::setprecision(0) << requests / result.seconds
+                  << std::setw(10) << result.failures << std::endl;
+        failures += result.failures;
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    return failures == 0 ? 0 : 1;
+}
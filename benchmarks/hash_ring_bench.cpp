@@ -0,0 +1,171 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/sharding/hash_ring.h"
+
+// Key -> shard lookups: HashRing's compiled table against the path it
+// replaced (std::map under a mutex, returning a copy of the shard id) and
+// a plain binary search over the same sorted hashes.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// As HashRing hashes keys and virtual nodes
+uint32_t Hash(const std::string& data) {
+    return RingHash(data);
+}
+
+// The lookup before the compiled table
+class MapRing {
+public:
+    explicit MapRing(std::map<uint32_t, std::string> ring) : ring_(std::move(ring)) {}
+
+    std::string GetShardForKey(const std::string& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = ring_.lower_bound(Hash(key));
+        if (it == ring_.end()) {
+            it = ring_.begin();
+        }
+        return it->second;
+    }
+
+private:
+    std::map<uint32_t, std::string> ring_;
+    mutable std::mutex mutex_;
+};
+
+// std::lower_bound over the hashes in sorted order
+class SortedRing {
+public:
+    explicit SortedRing(const std::map<uint32_t, std::string>& ring) {
+        for (const auto& [hash, shard_id] : ring) {
+            hashes_.push_back(hash);
+            shard_ids_.push_back(shard_id);
+        }
+    }
+
+    const std::string& GetShardForKey(const std::string& key) const {
+        auto it = std::lower_bound(hashes_.begin(), hashes_.end(), Hash(key));
+        return shard_ids_[it == hashes_.end() ? 0 : it - hashes_.begin()];
+    }
+
+private:
+    std::vector<uint32_t> hashes_;
+    std::vector<std::string> shard_ids_;
+};
+
+// Lookups per second over `threads` threads, each walking all the keys
+double Measure(int threads, const std::vector<std::string>& keys, int rounds,
+               const std::function<size_t(const std::string&)>& lookup) {
+    std::atomic<size_t> checksum{0};
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            size_t sum = 0;
+            for (int r = 0; r < rounds; ++r) {
+                for (const auto& key : keys) {
+                    sum += lookup(key);
+                }
+            }
+            checksum += sum;
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    // Keeps the lookups from being optimized away
+    if (checksum == 0) {
+        std::cout << "(no lookups)" << std::endl;
+    }
+    return static_cast<double>(keys.size()) * rounds * threads / seconds;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int shards = 16;
+    int virtual_nodes = 150;
+    int num_keys = 100000;
+    int rounds = 10;
+    std::vector<int> thread_counts = {1, 4};
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            shards = std::stoi(argv[++i]);
+        } else if (arg == "--virtual-nodes" && i + 1 < argc) {
+            virtual_nodes = std::stoi(argv[++i]);
+        } else if (arg == "--keys" && i + 1 < argc) {
+            num_keys = std::stoi(argv[++i]);
+        } else if (arg == "--rounds" && i + 1 < argc) {
+            rounds = std::stoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            thread_counts = {1, std::stoi(argv[++i])};
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--shards N] [--virtual-nodes N] [--keys N] [--rounds N] [--threads N]" << std::endl;
+            return 1;
+        }
+    }
+
+    HashRing hash_ring(virtual_nodes);
+    std::map<uint32_t, std::string> ring;
+    for (int s = 0; s < shards; ++s) {
+        std::string shard_id = "shard-" + std::to_string(s);
+        hash_ring.AddShard(shard_id, "localhost:" + std::to_string(50051 + s));
+        for (int v = 0; v < virtual_nodes; ++v) {
+            ring[Hash(shard_id + ":" + std::to_string(v))] = shard_id;
+        }
+    }
+    MapRing map_ring(ring);
+    SortedRing sorted_ring(ring);
+
+    std::vector<std::string> keys;
+    keys.reserve(num_keys);
+    for (int i = 0; i < num_keys; ++i) {
+        keys.push_back("user:" + std::to_string(i));
+    }
+    for (const auto& key : keys) {
+        if (map_ring.GetShardForKey(key) != hash_ring.GetShardForKey(key) ||
+            sorted_ring.GetShardForKey(key) != hash_ring.GetShardForKey(key)) {
+            std::cerr << "Lookups disagree for " << key << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "\n" << shards << " shards x " << virtual_nodes << " virtual nodes, "
+              << num_keys << " keys x " << rounds << " rounds" << std::endl;
+    std::cout << std::left << std::setw(26) << "lookup" << std::right << std::setw(10) << "threads"
+              << std::setw(14) << "M lookups/s" << std::setw(12) << "ns/lookup" << std::endl;
+
+    struct Variant {
+        const char* name;
+        std::function<size_t(const std::string&)> lookup;
+    };
+    std::vector<Variant> variants = {
+        {"map + mutex + copy", [&](const std::string& key) { return map_ring.GetShardForKey(key).size(); }},
+        {"sorted array", [&](const std::string& key) { return sorted_ring.GetShardForKey(key).size(); }},
+        {"HashRing (Eytzinger)", [&](const std::string& key) { return hash_ring.GetShardForKey(key).size(); }},
+    };
+    for (int threads : thread_counts) {
+        for (const auto& variant : variants) {
+            double rate = Measure(threads, keys, rounds, variant.lookup);
+            std::cout << std::left << std::setw(26) << variant.name << std::right << std::setw(10) << threads
+                      << std::setw(14) << std::fixed << std::setprecision(2) << rate / 1e6
+                      << std::setw(12) << std::setprecision(1) << 1e9 / rate << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <grpcpp/grpcpp.h>
+#include "../src/storage/storage.h"
+#include "../src/replication/replication_manager.h"
+#include "../src/service/kvstore_service.h"
+#include "../src/sharding/shard_router.h"
+
+// Fetching N keys spread over several shards: a Get per key in turn
+// against one MultiGet, which sends a request per shard at once. The
+// shards run in child processes.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kKeys = 10000;
+
+void RunServer(const std::string& address) {
+    auto storage = std::make_shared<Storage>();
+    auto replication = std::make_shared<ReplicationManager>(NodeRole::MASTER);
+    storage->SetReplicationManager(replication);
+    KeyValueStoreServiceImpl service(storage, replication);
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    auto server = builder.BuildAndStart();
+    server->Wait();
+}
+
+std::string Key(int i) {
+    return "bench:" + std::to_string(i % kKeys);
+}
+
+double Percentile(std::vector<double> samples, double p) {
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// Latency of each of `fetches` fetches of `batch` keys, in microseconds
+std::vector<double> Measure(int fetches, int batch, const std::function<bool(const std::vector<std::string>&)>& fetch,
+                            int* failures) {
+    std::vector<double> latencies;
+    for (int f = 0; f < fetches; ++f) {
+        std::vector<std::string> keys;
+        for (int i = 0; i < batch; ++i) {
+            keys.push_back(Key((f * batch + i) * 7919));
+        }
+        auto start = Clock::now();
+        if (!fetch(keys)) (*failures)++;
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+    return latencies;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int shards = 4;
+    int fetches = 200;
+    std::vector<int> batches = {10, 100, 1000};
+    int base_port = 50071;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            shards = std::stoi(argv[++i]);
+        } else if (arg == "--fetches" && i + 1 < argc) {
+            fetches = std::stoi(argv[++i]);
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batches = {std::stoi(argv[++i])};
+        } else if (arg == "--base-port" && i + 1 < argc) {
+            base_port = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--shards N] [--fetches N] [--batch KEYS] [--base-port N]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    // Forked before gRPC starts any threads in this process
+    std::vector<std::string> addresses;
+    std::vector<pid_t> servers;
+    for (int s = 0; s < shards; ++s) {
+        addresses.push_back("127.0.0.1:" + std::to_string(base_port + s));
+        pid_t server = fork();
+        if (server == 0) {
+            std::cout.setstate(std::ios::failbit);
+            RunServer(addresses.back());
+            _exit(0);
+        }
+        servers.push_back(server);
+    }
+    for (const auto& address : addresses) {
+        auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+        channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(10));
+    }
+
+    int failures = 0;
+    {
+        // The ring and router report every shard; only the table is wanted
+        std::ostringstream discard;
+        std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+        auto hash_ring = std::make_shared<HashRing>(150);
+        for (int s = 0; s < shards; ++s) {
+            hash_ring->AddShard("shard-" + std::to_string(s + 1), addresses[s]);
+        }
+        ShardRouter router(hash_ring);
+        std::vector<std::pair<std::string, std::string>> entries;
+        for (int i = 0; i < kKeys; ++i) {
+            entries.emplace_back(Key(i), "value-" + std::to_string(i));
+        }
+        router.MultiSet(entries);
+        std::cout.rdbuf(out);
+
+        std::cout << fetches << " fetches per batch size, " << shards << " shards (latencies in us)" << std::endl;
+        std::cout << std::left << std::setw(8) << "keys" << std::setw(14) << "api" << std::right
+                  << std::setw(12) << "p50" << std::setw(12) << "p99" << std::setw(14) << "keys/s" << std::endl;
+
+        auto sequential = [&](const std::vector<std::string>& keys) {
+            bool ok = true;
+            for (const auto& key : keys) {
+                ok = router.Get(key).has_value() && ok;
+            }
+            return ok;
+        };
+        auto multi = [&](const std::vector<std::string>& keys) {
+            bool ok = true;
+            for (const auto& result : router.MultiGet(keys)) {
+                ok = result.found && ok;
+            }
+            return ok;
+        };
+        for (int batch : batches) {
+            for (const auto& [name, fetch] : {std::make_pair("Get per key", std::function<bool(
+                                                  const std::vector<std::string>&)>(sequential)),
+                                              std::make_pair("MultiGet", std::function<bool(
+                                                  const std::vector<std::string>&)>(multi))}) {
+                // Fewer sequential fetches of large batches, or this takes minutes
+                int runs = std::string(name) == "MultiGet" ? fetches : std::max(10, fetches * 10 / batch);
+                std::vector<double> latencies = Measure(runs, batch, fetch, &failures);
+                double mean = 0;
+                for (double latency : latencies) {
+                    mean += latency / latencies.size();
+                }
+                std::cout << std::left << std::setw(8) << batch << std::setw(14) << name << std::right
+                          << std::fixed << std::setprecision(0) << std::setw(12) << Percentile(latencies, 0.5)
+                          << std::setw(12) << Percentile(latencies, 0.99)
+                          << std::setw(14) << batch * 1e6 / mean << std::endl;
+            }
+        }
+    }
+
+    for (pid_t server : servers) {
+        kill(server, SIGKILL);
+        waitpid(server, nullptr, 0);
+    }
+    return failures == 0 ? 0 : 1;
+}
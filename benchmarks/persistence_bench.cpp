@@ -0,0 +1,137 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include "../src/persistence/file_writer.h"
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    double seconds;
+    double p50_us;
+    double p99_us;
+};
+
+double Percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) return 0.0;
+    size_t index = static_cast<size_t>(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// AOF-style workload: one small record per write, flushed (or synced) each time
+Result RunAppends(IOBackend backend, const std::string& path, int records, bool sync) {
+    auto writer = CreateFileWriter(backend);
+    std::remove(path.c_str());
+    writer->Open(path, true);
+
+    std::string record(120, 'x');
+    record += "\n";
+
+    std::vector<double> latencies;
+    latencies.reserve(records);
+
+    auto start = Clock::now();
+    for (int i = 0; i < records; ++i) {
+        auto op_start = Clock::now();
+        writer->Append(record);
+        if (sync) {
+            writer->Sync();
+        } else {
+            writer->Flush();
+        }
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - op_start).count());
+    }
+    writer->Close();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::remove(path.c_str());
+    return {seconds, Percentile(latencies, 0.50), Percentile(latencies, 0.99)};
+}
+
+// RDB-style workload: one large sequential file written in 1 MB chunks, synced at the end
+Result RunSnapshot(IOBackend backend, const std::string& path, size_t megabytes, bool direct_io) {
+    auto writer = CreateFileWriter(backend, direct_io);
+    std::remove(path.c_str());
+    writer->Open(path, false);
+
+    std::string chunk(1 << 20, 'y');
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < megabytes; ++i) {
+        writer->Append(chunk);
+    }
+    writer->Sync();
+    writer->Close();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::remove(path.c_str());
+    return {seconds, 0.0, 0.0};
+}
+
+void PrintAppendRow(const std::string& name, int records, const Result& r) {
+    std::cout << "  " << std::left << std::setw(22) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(0) << (records / r.seconds) << " ops/s"
+              << "   p50 " << std::setw(8) << std::setprecision(2) << r.p50_us << " us"
+              << "   p99 " << std::setw(8) << r.p99_us << " us" << std::endl;
+}
+
+void PrintSnapshotRow(const std::string& name, size_t megabytes, const Result& r) {
+    std::cout << "  " << std::left << std::setw(22) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(1) << (megabytes / r.seconds) << " MB/s"
+              << "   (" << std::setprecision(3) << r.seconds << " s)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string dir = ".";
+    int records = 100000;
+    int synced_records = 2000;
+    size_t snapshot_mb = 256;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--dir" && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (arg == "--records" && i + 1 < argc) {
+            records = std::stoi(argv[++i]);
+        } else if (arg == "--synced-records" && i + 1 < argc) {
+            synced_records = std::stoi(argv[++i]);
+        } else if (arg == "--snapshot-mb" && i + 1 < argc) {
+            snapshot_mb = std::stoul(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--dir <path>] [--records N] [--synced-records N] [--snapshot-mb N]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::string path = dir + "/persistence_bench.dat";
+    const IOBackend backends[] = {IOBackend::STREAM, IOBackend::PWRITE, IOBackend::IO_URING};
+
+    std::cout << "==================================" << std::endl;
+    std::cout << "Persistence I/O Benchmark" << std::endl;
+    std::cout << "==================================" << std::endl;
+
+    std::cout << "\n[1] Small-record appends, flushed per record (" << records << " x 121 B)" << std::endl;
+    for (IOBackend backend : backends) {
+        PrintAppendRow(IOBackendName(backend), records, RunAppends(backend, path, records, false));
+    }
+
+    std::cout << "\n[2] Small-record appends, synced per record (" << synced_records << " x 121 B)" << std::endl;
+    for (IOBackend backend : backends) {
+        PrintAppendRow(IOBackendName(backend), synced_records, RunAppends(backend, path, synced_records, true));
+    }
+
+    std::cout << "\n[3] Sequential snapshot write (" << snapshot_mb << " MB, synced at end)" << std::endl;
+    for (IOBackend backend : backends) {
+        PrintSnapshotRow(IOBackendName(backend), snapshot_mb, RunSnapshot(backend, path, snapshot_mb, false));
+    }
+    PrintSnapshotRow("io_uring + O_DIRECT", snapshot_mb, RunSnapshot(IOBackend::IO_URING, path, snapshot_mb, true));
+
+    std::cout << "\nNote: the stream backend cannot fsync, so its 'synced' numbers only flush." << std::endl;
+    return 0;
+}
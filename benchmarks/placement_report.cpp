@@ -0,0 +1,168 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../src/sharding/hash_ring.h"
+
+// For each placement strategy: how evenly keys spread over the shards,
+// how many move when a shard is added or removed, and what a lookup costs.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    int shards = 10;
+    int virtual_nodes = 150;
+    int num_keys = 200000;
+    double epsilon = 0.25;
+};
+
+std::string ShardId(int i) {
+    return "shard-" + std::to_string(i);
+}
+
+// HashRing reports every shard it adds; not wanted here
+std::unique_ptr<HashRing> BuildRing(const Options& options, std::shared_ptr<const PlacementStrategy> strategy,
+                                    int shards) {
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    auto ring = std::make_unique<HashRing>(options.virtual_nodes, std::move(strategy));
+    for (int i = 0; i < shards; ++i) {
+        ring->AddShard(ShardId(i), "localhost:" + std::to_string(50051 + i));
+    }
+    std::cout.rdbuf(out);
+    return ring;
+}
+
+void RemoveShard(HashRing& ring, const std::string& shard_id) {
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    ring.RemoveShard(shard_id);
+    std::cout.rdbuf(out);
+}
+
+std::vector<std::string> Assign(const HashRing& ring, const std::vector<std::string>& keys) {
+    std::vector<std::string> owners;
+    owners.reserve(keys.size());
+    for (const auto& key : keys) {
+        owners.push_back(ring.GetShardForKey(key));
+    }
+    return owners;
+}
+
+double PercentMoved(const std::vector<std::string>& before, const std::vector<std::string>& after) {
+    size_t moved = 0;
+    for (size_t i = 0; i < before.size(); ++i) {
+        if (before[i] != after[i]) moved++;
+    }
+    return 100.0 * moved / before.size();
+}
+
+void Report(const Options& options, std::shared_ptr<const PlacementStrategy> strategy,
+            const std::vector<std::string>& keys) {
+    auto ring = BuildRing(options, strategy, options.shards);
+    std::vector<std::string> owners = Assign(*ring, keys);
+
+    // Spread: standard deviation and the fullest shard, against the mean
+    std::unordered_map<std::string, size_t> load;
+    for (const auto& owner : owners) {
+        load[owner]++;
+    }
+    double mean = static_cast<double>(keys.size()) / options.shards;
+    double variance = 0;
+    size_t most = 0;
+    for (int i = 0; i < options.shards; ++i) {
+        double count = static_cast<double>(load[ShardId(i)]);
+        variance += (count - mean) * (count - mean);
+        most = std::max<size_t>(most, load[ShardId(i)]);
+    }
+    double stddev = 100.0 * std::sqrt(variance / options.shards) / mean;
+
+    // Movement: one shard added, or one from the middle removed
+    auto grown = BuildRing(options, strategy, options.shards + 1);
+    double moved_on_add = PercentMoved(owners, Assign(*grown, keys));
+    auto shrunk = BuildRing(options, strategy, options.shards);
+    RemoveShard(*shrunk, ShardId(options.shards / 2));
+    double moved_on_remove = PercentMoved(owners, Assign(*shrunk, keys));
+
+    // Lookup cost, key hashing included
+    size_t checksum = 0;
+    auto start = Clock::now();
+    for (int round = 0; round < 5; ++round) {
+        for (const auto& key : keys) {
+            checksum += ring->GetShardForKey(key).size();
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (5.0 * keys.size());
+    if (checksum == 0) {
+        std::cout << "(no lookups)" << std::endl;
+    }
+
+    std::cout << std::left << std::setw(24) << strategy->Name() << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << stddev << "%"
+              << std::setw(10) << most / mean
+              << std::setw(11) << moved_on_add << "%"
+              << std::setw(13) << moved_on_remove << "%"
+              << std::setprecision(1) << std::setw(11) << ns << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            options.shards = std::stoi(argv[++i]);
+        } else if (arg == "--virtual-nodes" && i + 1 < argc) {
+            options.virtual_nodes = std::stoi(argv[++i]);
+        } else if (arg == "--keys" && i + 1 < argc) {
+            options.num_keys = std::stoi(argv[++i]);
+        } else if (arg == "--epsilon" && i + 1 < argc) {
+            options.epsilon = std::stod(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--shards N] [--virtual-nodes N] [--keys N] [--epsilon E]" << std::endl;
+            return 1;
+        }
+    }
+    if (options.shards < 2) {
+        std::cerr << "--shards must be at least 2" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> keys;
+    keys.reserve(options.num_keys);
+    for (int i = 0; i < options.num_keys; ++i) {
+        keys.push_back("user:" + std::to_string(i));
+    }
+
+    std::cout << options.shards << " shards, " << options.virtual_nodes << " virtual nodes each (ring, bounded-load), "
+              << options.num_keys << " keys" << std::endl;
+    std::cout << "Moving the minimum: " << std::fixed << std::setprecision(2)
+              << 100.0 / (options.shards + 1) << "% on add, " << 100.0 / options.shards << "% on remove"
+              << std::endl << std::endl;
+    std::cout << std::left << std::setw(24) << "strategy" << std::right << std::setw(11) << "load sd"
+              << std::setw(10) << "max/mean" << std::setw(12) << "moved add" << std::setw(14) << "moved remove"
+              << std::setw(11) << "ns/lookup" << std::endl;
+
+    std::vector<std::shared_ptr<const PlacementStrategy>> strategies = {
+        std::make_shared<RingStrategy>(),
+        std::make_shared<RingStrategy>(RingHashVersion::FNV1A_FINALIZED),
+        std::make_shared<JumpHashStrategy>(),
+        std::make_shared<RendezvousStrategy>(),
+        std::make_shared<BoundedLoadStrategy>(options.epsilon),
+        std::make_shared<BoundedLoadStrategy>(options.epsilon, RingHashVersion::FNV1A_FINALIZED),
+    };
+    for (const auto& strategy : strategies) {
+        Report(options, strategy, keys);
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+#include "../src/storage/storage.h"
+#include "../src/replication/replication_manager.h"
+#include "../src/service/kvstore_service.h"
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+// One in-memory node (no persistence files) serving gRPC on `address`
+struct Node {
+    std::shared_ptr<Storage> storage;
+    std::shared_ptr<ReplicationManager> replication;
+    std::unique_ptr<KeyValueStoreServiceImpl> service;
+    std::unique_ptr<grpc::Server> server;
+
+    Node(const std::string& address, NodeRole role) {
+        storage = std::make_shared<Storage>();
+        replication = std::make_shared<ReplicationManager>(role);
+        storage->SetReplicationManager(replication);
+        service = std::make_unique<KeyValueStoreServiceImpl>(storage, replication);
+
+        grpc::ServerBuilder builder;
+        builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+        builder.RegisterService(service.get());
+        server = builder.BuildAndStart();
+    }
+
+    ~Node() {
+        replication->Stop();
+        server->Shutdown();
+    }
+};
+
+struct Result {
+    double write_seconds;   // Time for the master to accept every write
+    double total_seconds;   // Time until the replica applied the last one
+};
+
+Result Run(bool streaming, int commands, size_t value_size, const std::string& master_address,
+           const std::string& replica_address) {
+    Node master(master_address, NodeRole::MASTER);
+    Node replica(replica_address, NodeRole::REPLICA);
+
+    if (streaming) {
+        replica.replication->SetMasterAddress(master_address);
+        std::shared_ptr<Storage> storage = replica.storage;
+        ReplicationManager::ReplicaHandlers handlers;
+        handlers.apply = [storage](const ReplicationBatch& batch) {
+            return storage->ApplyReplicated(batch) != Storage::ReplicationResult::GAP;
+        };
+        handlers.last_applied = [storage] { return storage->LastSequence(); };
+        replica.replication->SetReplicaHandlers(replica_address, std::move(handlers));
+        replica.replication->StartStreaming();
+    } else {
+        master.replication->AddReplica(replica_address);
+    }
+
+    // Let the stream or channel connect before timing
+    master.storage->Set("warmup", "x");
+    while (replica.storage->LastSequence() < 1) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::string value(value_size, 'v');
+    auto start = Clock::now();
+    for (int i = 0; i < commands; ++i) {
+        master.storage->Set("key:" + std::to_string(i), value);
+    }
+    double write_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    int64_t target = commands + 1;
+    while (replica.storage->LastSequence() < target) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    double total_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return {write_seconds, total_seconds};
+}
+
+// Replica apply alone: batches fed straight into an in-memory replica's
+// storage, timed until every command is applied
+double RunApply(size_t threads, int commands, size_t value_size) {
+    constexpr int kBatchSize = 1000;
+    StorageOptions options;
+    options.replica_apply_threads = threads;
+    Storage storage("", "", options);
+    
+    std::vector<ReplicationBatch> batches((commands + kBatchSize - 1) / kBatchSize);
+    std::string value(value_size, 'v');
+    for (int i = 0; i < commands; ++i) {
+        ReplicationCommand* command = batches[i / kBatchSize].add_commands();
+        command->set_type(ReplicationCommand::SET);
+        command->set_key("key:" + std::to_string(i));
+        command->set_value(value);
+        command->set_sequence_id(i + 1);
+    }
+    
+    auto start = Clock::now();
+    for (const ReplicationBatch& batch : batches) {
+        storage.ApplyReplicated(batch);
+    }
+    while (storage.LastSequence() < commands) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void PrintRow(const std::string& name, int commands, const Result& r) {
+    std::cout << "  " << std::left << std::setw(22) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(0) << (commands / r.total_seconds) << " cmds/s"
+              << "   master writes " << std::setw(10) << (commands / r.write_seconds) << " ops/s"
+              << "   (" << std::setprecision(3) << r.total_seconds << " s)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int commands = 50000;
+    size_t value_size = 100;
+    std::string master_address = "127.0.0.1:50091";
+    std::string replica_address = "127.0.0.1:50092";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--commands" && i + 1 < argc) {
+            commands = std::stoi(argv[++i]);
+        } else if (arg == "--value-size" && i + 1 < argc) {
+            value_size = std::stoul(argv[++i]);
+        } else if (arg == "--master" && i + 1 < argc) {
+            master_address = argv[++i];
+        } else if (arg == "--replica" && i + 1 < argc) {
+            replica_address = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--commands N] [--value-size BYTES] [--master addr:port] [--replica addr:port]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "==================================" << std::endl;
+    std::cout << "Replication Benchmark" << std::endl;
+    std::cout << "==================================" << std::endl;
+    std::cout << "\n" << commands << " SETs with " << value_size << " B values, master -> 1 replica" << std::endl;
+
+    PrintRow("push", commands, Run(false, commands, value_size, master_address, replica_address));
+    PrintRow("stream", commands, Run(true, commands, value_size, master_address, replica_address));
+    
+    std::cout << "\nReplica apply, " << commands << " SETs in batches of 1000 (no network)" << std::endl;
+    for (size_t threads : {0, 1, 2, 4, 8}) {
+        double seconds = RunApply(threads, commands, value_size);
+        std::string name = threads == 0 ? "inline" : std::to_string(threads) + " worker" + (threads > 1 ? "s" : "");
+        std::cout << "  " << std::left << std::setw(22) << name << std::right
+                  << std::setw(12) << std::fixed << std::setprecision(0) << (commands / seconds) << " cmds/s"
+                  << "   (" << std::setprecision(3) << seconds << " s)" << std::endl;
+    }
+
+    return 0;
+}
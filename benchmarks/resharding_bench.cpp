@@ -0,0 +1,216 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <grpcpp/grpcpp.h>
+#include "../src/storage/storage.h"
+#include "../src/replication/replication_manager.h"
+#include "../src/service/kvstore_service.h"
+#include "../src/sharding/shard_router.h"
+
+// Adding a third shard to a loaded two-shard cluster: how fast keys move at
+// a few throttle settings, and what foreground GETs see meanwhile against
+// the same GETs before the move. Each run starts fresh shards in child
+// processes.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    int keys = 50000;
+    int value_size = 100;
+    int readers = 4;
+    std::vector<int64_t> rates = {20000, 100000, 0};
+    int base_port = 50071;
+};
+
+struct Latencies {
+    std::vector<double> before;
+    std::vector<double> during;
+};
+
+void RunServer(const std::string& address) {
+    auto storage = std::make_shared<Storage>();
+    auto replication = std::make_shared<ReplicationManager>(NodeRole::MASTER);
+    storage->SetReplicationManager(replication);
+    KeyValueStoreServiceImpl service(storage, replication);
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    auto server = builder.BuildAndStart();
+    server->Wait();
+}
+
+std::string Key(int i) {
+    return "bench:" + std::to_string(i);
+}
+
+double Percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) return 0;
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+bool Load(ShardRouter& router, const Options& options) {
+    std::string value(options.value_size, 'x');
+    std::vector<std::future<bool>> writes;
+    for (int i = 0; i < options.keys; ++i) {
+        writes.push_back(router.SetAsync(Key(i), value));
+        if (writes.size() == 1000 || i + 1 == options.keys) {
+            for (auto& write : writes) {
+                if (!write.get()) return false;
+            }
+            writes.clear();
+        }
+    }
+    return true;
+}
+
+// One cluster of fresh shards: GETs for a second, then GETs while shard-3 joins
+bool Run(const Options& options, int64_t rate, const std::vector<std::string>& addresses) {
+    // The rings and router report every change; only the table is wanted
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+
+    bool ok = true;
+    {
+        auto hash_ring = std::make_shared<HashRing>(150);
+        hash_ring->AddShard("shard-1", addresses[0]);
+        hash_ring->AddShard("shard-2", addresses[1]);
+        ShardRouter router(hash_ring);
+        ok = Load(router, options);
+
+        std::atomic<int> phase{0};  // 0 before, 1 during, 2 done
+        std::atomic<int> failures{0};
+        std::vector<Latencies> latencies(options.readers);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < options.readers; ++t) {
+            readers.emplace_back([&, t] {
+                uint64_t n = t;
+                int current;
+                while ((current = phase.load()) < 2) {
+                    int i = static_cast<int>((n++ * 2654435761u) % options.keys);
+                    auto start = Clock::now();
+                    if (!router.Get(Key(i))) failures++;
+                    double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+                    (current == 0 ? latencies[t].before : latencies[t].during).push_back(us);
+                }
+            });
+        }
+
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        phase = 1;
+        MigrationOptions migration;
+        migration.max_keys_per_second = rate;
+        auto start = Clock::now();
+        ok = router.AddShard("shard-3", addresses[2], {}, 1.0, migration) && ok;
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        phase = 2;
+        for (auto& reader : readers) {
+            reader.join();
+        }
+
+        Latencies all;
+        for (auto& each : latencies) {
+            all.before.insert(all.before.end(), each.before.begin(), each.before.end());
+            all.during.insert(all.during.end(), each.during.begin(), each.during.end());
+        }
+        MigrationStats stats = router.GetMigrationStats();
+        std::cout.rdbuf(out);
+        std::cout << std::left << std::setw(12) << (rate > 0 ? std::to_string(rate) : "unlimited") << std::right
+                  << std::setw(10) << stats.keys_copied
+                  << std::setw(12) << std::fixed << std::setprecision(0) << stats.keys_copied / stats.copy_seconds
+                  << std::setw(10) << std::setprecision(2) << seconds
+                  << std::setw(12) << std::setprecision(0) << Percentile(all.before, 0.5)
+                  << std::setw(10) << Percentile(all.before, 0.99)
+                  << std::setw(12) << Percentile(all.during, 0.5)
+                  << std::setw(10) << Percentile(all.during, 0.99)
+                  << std::setw(9) << failures << std::endl;
+        ok = ok && failures == 0;
+        std::cout.rdbuf(discard.rdbuf());
+    }
+    std::cout.rdbuf(out);
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--keys" && i + 1 < argc) {
+            options.keys = std::stoi(argv[++i]);
+        } else if (arg == "--value-size" && i + 1 < argc) {
+            options.value_size = std::stoi(argv[++i]);
+        } else if (arg == "--readers" && i + 1 < argc) {
+            options.readers = std::stoi(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            options.rates = {std::stoll(argv[++i])};
+        } else if (arg == "--base-port" && i + 1 < argc) {
+            options.base_port = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--keys N] [--value-size N] [--readers N] [--rate KEYS_PER_SEC] [--base-port N]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << options.keys << " keys of " << options.value_size << " bytes, 2 -> 3 shards, "
+              << options.readers << " blocking readers (latencies in us)" << std::endl;
+    std::cout << std::left << std::setw(12) << "throttle" << std::right << std::setw(10) << "moved"
+              << std::setw(12) << "keys/s" << std::setw(10) << "seconds"
+              << std::setw(12) << "p50 before" << std::setw(10) << "p99"
+              << std::setw(12) << "p50 during" << std::setw(10) << "p99" << std::setw(9) << "failed" << std::endl;
+
+    // Three shards per run, all forked before gRPC starts any threads in
+    // this process
+    std::vector<std::vector<std::string>> clusters(options.rates.size());
+    std::vector<pid_t> servers;
+    for (size_t run = 0; run < options.rates.size(); ++run) {
+        for (int s = 0; s < 3; ++s) {
+            clusters[run].push_back("127.0.0.1:" + std::to_string(options.base_port + 3 * run + s));
+            pid_t server = fork();
+            if (server == 0) {
+                std::cout.setstate(std::ios::failbit);
+                RunServer(clusters[run].back());
+                _exit(0);
+            }
+            servers.push_back(server);
+        }
+    }
+    bool ok = true;
+    for (const auto& cluster : clusters) {
+        for (const auto& address : cluster) {
+            auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+            if (!channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(10))) {
+                std::cerr << "Shard at " << address << " did not start" << std::endl;
+                ok = false;
+            }
+        }
+    }
+    for (size_t run = 0; ok && run < options.rates.size(); ++run) {
+        ok = Run(options, options.rates[run], clusters[run]);
+    }
+
+    for (pid_t server : servers) {
+        kill(server, SIGKILL);
+        waitpid(server, nullptr, 0);
+    }
+    return ok ? 0 : 1;
+}
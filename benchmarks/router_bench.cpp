@@ -0,0 +1,213 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <grpcpp/grpcpp.h>
+#include "../src/storage/storage.h"
+#include "../src/replication/replication_manager.h"
+#include "../src/service/kvstore_service.h"
+#include "../src/sharding/shard_router.h"
+
+// Blocking ShardRouter calls (one thread per request in flight) against
+// GetAsync with the same number in flight on a few completion threads.
+// The server runs in a child process, so the thread counts are the router's.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kKeys = 1000;
+
+// Threads in this process, from /proc
+int ThreadCount() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("Threads:", 0) == 0) {
+            return std::stoi(line.substr(8));
+        }
+    }
+    return -1;
+}
+
+// Highest thread count seen while a run is in progress
+class ThreadSampler {
+public:
+    ThreadSampler() : thread_([this] {
+        while (!done_) {
+            int threads = ThreadCount() - 1;  // Not counting the sampler
+            if (threads > peak_) peak_ = threads;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }) {}
+
+    int Stop() {
+        done_ = true;
+        thread_.join();
+        return peak_;
+    }
+
+private:
+    std::atomic<bool> done_{false};
+    std::atomic<int> peak_{0};
+    std::thread thread_;
+};
+
+struct Result {
+    double seconds;
+    int peak_threads;
+    int failures;
+};
+
+void RunServer(const std::string& address) {
+    auto storage = std::make_shared<Storage>();
+    auto replication = std::make_shared<ReplicationManager>(NodeRole::MASTER);
+    storage->SetReplicationManager(replication);
+    KeyValueStoreServiceImpl service(storage, replication);
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    auto server = builder.BuildAndStart();
+    server->Wait();
+}
+
+std::shared_ptr<HashRing> SingleShard(const std::string& address) {
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", address);
+    return hash_ring;
+}
+
+std::string Key(int i) {
+    return "bench:" + std::to_string(i % kKeys);
+}
+
+Result RunBlocking(ShardRouter& router, int requests, int concurrency) {
+    std::atomic<int> failures{0};
+    ThreadSampler sampler;
+    auto start = Clock::now();
+
+    std::vector<std::thread> threads;
+    threads.reserve(concurrency);
+    for (int t = 0; t < concurrency; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = t; i < requests; i += concurrency) {
+                if (!router.Get(Key(i))) failures++;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return {seconds, sampler.Stop(), failures};
+}
+
+Result RunAsync(ShardRouter& router, int requests, int concurrency) {
+    std::atomic<int> issued{0};
+    std::atomic<int> failures{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    int completed = 0;
+
+    // Each completion issues the next request, keeping `concurrency` in flight
+    std::function<void()> issue = [&] {
+        int i = issued++;
+        if (i >= requests) return;
+        router.GetAsync(Key(i), [&](std::optional<std::string> value) {
+            if (!value) failures++;
+            issue();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++completed == requests) cv.notify_all();
+        });
+    };
+
+    ThreadSampler sampler;
+    auto start = Clock::now();
+    for (int i = 0; i < concurrency && i < requests; ++i) {
+        issue();
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return completed == requests; });
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return {seconds, sampler.Stop(), failures};
+}
+
+void Print(const char* name, int requests, const Result& result) {
+    std::cout << std::left << std::setw(10) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(0) << requests / result.seconds
+              << std::setw(10) << result.peak_threads
+              << std::setw(10) << result.failures << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int requests = 100000;
+    int concurrency = 10000;
+    size_t completion_threads = ShardRouter::kDefaultCompletionThreads;
+    std::string address = "127.0.0.1:50071";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--requests" && i + 1 < argc) {
+            requests = std::stoi(argv[++i]);
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            concurrency = std::stoi(argv[++i]);
+        } else if (arg == "--completion-threads" && i + 1 < argc) {
+            completion_threads = std::stoul(argv[++i]);
+        } else if (arg == "--address" && i + 1 < argc) {
+            address = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--requests N] [--concurrency N] [--completion-threads N] [--address host:port]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    // Forked before gRPC starts any threads in this process
+    pid_t server = fork();
+    if (server == 0) {
+        RunServer(address);
+        _exit(0);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    int failures = 0;
+    {
+        ShardRouter router(SingleShard(address), completion_threads);
+        for (int i = 0; i < kKeys; ++i) {
+            router.Set(Key(i), "value-" + std::to_string(i));
+        }
+
+        std::cout << requests << " GETs, " << concurrency << " in flight, one shard" << std::endl;
+        std::cout << std::left << std::setw(10) << "api" << std::right << std::setw(12) << "req/s"
+                  << std::setw(10) << "threads" << std::setw(10) << "failed" << std::endl;
+
+        Result async_result = RunAsync(router, requests, concurrency);
+        Print("async", requests, async_result);
+        Result blocking_result = RunBlocking(router, requests, concurrency);
+        Print("blocking", requests, blocking_result);
+        failures = async_result.failures + blocking_result.failures;
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    return failures == 0 ? 0 : 1;
+}
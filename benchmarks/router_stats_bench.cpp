@@ -0,0 +1,141 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../src/sharding/router_metrics.h"
+
+// Counting a finished request, as ShardRouter does after every call:
+// RouterMetrics (striped counters and histograms, no lock) against the
+// path it replaced (one mutex over the totals and a per-shard map).
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// The counting before RouterMetrics
+class LockedStats {
+public:
+    void Count(const std::string& shard_id, bool success) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        total_requests_++;
+        per_shard_requests_[shard_id]++;
+        if (success) {
+            successful_requests_++;
+        } else {
+            failed_requests_++;
+        }
+    }
+
+    uint64_t Total() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return total_requests_;
+    }
+
+private:
+    std::mutex mutex_;
+    uint64_t total_requests_{0};
+    uint64_t successful_requests_{0};
+    uint64_t failed_requests_{0};
+    std::unordered_map<std::string, uint64_t> per_shard_requests_;
+};
+
+// Requests counted per second over `threads` threads, each spreading its
+// requests over the shards
+double Measure(int threads, int requests, const std::vector<std::string>& shard_ids,
+               const std::function<void(const std::string&, int)>& count) {
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < requests; ++i) {
+                count(shard_ids[(i + t) % shard_ids.size()], i);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return static_cast<double>(requests) * threads / seconds;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int shards = 8;
+    int requests = 2000000;
+    std::vector<int> thread_counts = {1, 4, 16};
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            shards = std::stoi(argv[++i]);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            requests = std::stoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            thread_counts = {1, std::stoi(argv[++i])};
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--shards N] [--requests N_PER_THREAD] [--threads N]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::string> shard_ids;
+    for (int s = 0; s < shards; ++s) {
+        shard_ids.push_back("shard-" + std::to_string(s));
+    }
+
+    std::cout << "\n" << shards << " shards, " << requests << " requests per thread, "
+              << std::thread::hardware_concurrency() << " cores" << std::endl;
+    std::cout << std::left << std::setw(34) << "counting" << std::right << std::setw(10) << "threads"
+              << std::setw(14) << "M counts/s" << std::setw(12) << "ns/count" << std::endl;
+
+    for (int threads : thread_counts) {
+        LockedStats locked;
+        RouterMetrics metrics;
+        // A fixed latency, so the histograms are written but the clock is
+        // not part of the measurement
+        auto start = Clock::now();
+        auto end = start + std::chrono::microseconds(450);
+
+        struct Variant {
+            const char* name;
+            std::function<void(const std::string&, int)> count;
+        };
+        std::vector<Variant> variants = {
+            {"mutex + map (before)", [&](const std::string& shard_id, int i) { locked.Count(shard_id, i % 64 != 0); }},
+            {"RouterMetrics, counts only", [&](const std::string& shard_id, int i) {
+                ShardMetrics& shard = metrics.ForShard(shard_id);
+                shard.Add(ShardCounter::REQUESTS);
+                shard.Add(i % 64 != 0 ? ShardCounter::SUCCESSES : ShardCounter::FAILURES);
+            }},
+            {"RouterMetrics + in flight + latency", [&](const std::string& shard_id, int i) {
+                ShardMetrics& shard = metrics.ForShard(shard_id);
+                shard.Add(ShardCounter::IN_FLIGHT);
+                shard.Add(ShardCounter::IN_FLIGHT, -1);
+                shard.Add(ShardCounter::REQUESTS);
+                shard.Add(i % 64 != 0 ? ShardCounter::SUCCESSES : ShardCounter::FAILURES);
+                shard.RecordLatency(RouterOp::GET, start, end);
+            }},
+        };
+        for (const auto& variant : variants) {
+            double rate = Measure(threads, requests, shard_ids, variant.count);
+            std::cout << std::left << std::setw(34) << variant.name << std::right << std::setw(10) << threads
+                      << std::setw(14) << std::fixed << std::setprecision(2) << rate / 1e6
+                      << std::setw(12) << std::setprecision(1) << 1e9 / rate << std::endl;
+        }
+        if (locked.Total() != static_cast<uint64_t>(requests) * threads) {
+            std::cerr << "Locked counts are off" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
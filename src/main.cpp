@@ -1,18 +1,43 @@
 #include "server/server.h"
 #include <csignal>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
+#include <algorithm>
 
 std::unique_ptr<kvstore::Server> g_server;
+std::atomic<kvstore::Server*> g_running{nullptr};
 
-void SignalHandler(int signal) {
+// SIGINT and SIGTERM are taken here rather than in a handler: shutting down
+// inside one would need locks the interrupted thread may hold
+void WaitForSignal(sigset_t signals) {
+    int signal = 0;
+    sigwait(&signals, &signal);
     std::cout << "\nReceived signal " << signal << std::endl;
-    if (g_server) {
-        g_server->Shutdown();
+    kvstore::Server* server = g_running;
+    if (!server) {
+        // Still loading the dataset
+        std::exit(0);
     }
-    exit(0);
+    server->Shutdown();
+}
+
+std::vector<std::string> SplitList(std::string list) {
+    std::vector<std::string> items;
+    size_t pos = 0;
+    while ((pos = list.find(',')) != std::string::npos) {
+        items.push_back(list.substr(0, pos));
+        list.erase(0, pos + 1);
+    }
+    if (!list.empty()) {
+        items.push_back(list);
+    }
+    return items;
 }
 
 void PrintUsage(const char* program_name) {
@@ -21,11 +46,27 @@ void PrintUsage(const char* program_name) {
               << "  --master                Start as master node (default)\n"
               << "  --replica               Start as replica node\n"
               << "  --address <addr:port>   Server address (default: 0.0.0.0:50051)\n"
-              << "  --master-address <addr:port>  Master address (required for replicas)\n"
+              << "  --master-address <addr:port>  Upstream address (required for replicas): the master, or a replica to chain from\n"
               << "  --replicas <addr1,addr2,...>   Comma-separated replica addresses (for master)\n"
+              << "  --io-backend <stream|pwrite|io_uring>  Persistence I/O backend (default: stream)\n"
+              << "  --aof-fsync               fsync the AOF after every write\n"
+              << "  --lazy-load               Serve requests while the dataset loads in the background\n"
+              << "  --replication-mode <stream|push>  Replica pulls from the master (default) or waits for the master's pushes\n"
+              << "  --backlog-mb <n>          Recent commands the master keeps in memory for streaming replicas (default: 64)\n"
+              << "  --replica-buffer-mb <n>   Buffered replication data per replica before it must catch up from the AOF (default: 64)\n"
+              << "  --apply-threads <n>       Replica threads applying replicated writes (default: half the cores, up to 4; 0 = on the receiving thread)\n"
+              << "  --snapshot-interval <s>   Seconds between background snapshots (default: 60)\n"
+              << "  --max-deltas <n>          Delta snapshots before merging into a new base (default: 10, 0 = always full)\n"
+              << "  --cluster <addr1,addr2,...>   Consensus mode: every member of the shard, this node included; the master is elected\n"
+              << "  --advertise-address <addr:port>  Address the other members reach this node at (default: --address)\n"
+              << "  --election-timeout-ms <n>  Consensus mode: silence from the leader before an election (default: 1000)\n"
+              << "  --metrics-port <n>        Serve node and per-replica metrics over HTTP at /metrics (default: off)\n"
               << "\nExamples:\n"
-              << "  Master:  " << program_name << " --master --address 0.0.0.0:50051 --replicas localhost:50052,localhost:50053\n"
+              << "  Master:  " << program_name << " --master --address 0.0.0.0:50051\n"
               << "  Replica: " << program_name << " --replica --address 0.0.0.0:50052 --master-address localhost:50051\n"
+              << "  Push:    " << program_name << " --master --address 0.0.0.0:50051 --replicas localhost:50052,localhost:50053\n"
+              << "           (replicas started with --replication-mode push)\n"
+              << "  Elected: " << program_name << " --address 127.0.0.1:50051 --cluster 127.0.0.1:50051,127.0.0.1:50052,127.0.0.1:50053\n"
               << std::endl;
 }
 
@@ -34,6 +75,12 @@ int main(int argc, char** argv) {
     std::string master_address;
     std::vector<std::string> replica_addresses;
     bool is_master = true;
+    kvstore::StorageOptions storage_options;
+    kvstore::ReplicationOptions replication_options;
+    std::vector<std::string> cluster;
+    std::string advertise_address;
+    kvstore::RaftOptions raft_options;
+    int metrics_port = 0;
     
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -49,16 +96,45 @@ int main(int argc, char** argv) {
             server_address = argv[++i];
         } else if (arg == "--master-address" && i + 1 < argc) {
             master_address = argv[++i];
-        } else if (arg == "--replicas" && i + 1 < argc) {
-            std::string replicas_str = argv[++i];
-            size_t pos = 0;
-            while ((pos = replicas_str.find(',')) != std::string::npos) {
-                replica_addresses.push_back(replicas_str.substr(0, pos));
-                replicas_str.erase(0, pos + 1);
+        } else if (arg == "--io-backend" && i + 1 < argc) {
+            std::string backend = argv[++i];
+            if (!kvstore::ParseIOBackend(backend, storage_options.io_backend)) {
+                std::cerr << "Unknown I/O backend: " << backend << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
             }
-            if (!replicas_str.empty()) {
-                replica_addresses.push_back(replicas_str);
+        } else if (arg == "--aof-fsync") {
+            storage_options.aof_fsync_always = true;
+        } else if (arg == "--lazy-load") {
+            storage_options.lazy_load = true;
+        } else if (arg == "--replication-mode" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode != "stream" && mode != "push") {
+                std::cerr << "Unknown replication mode: " << mode << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
             }
+            replication_options.stream_from_master = mode == "stream";
+        } else if (arg == "--backlog-mb" && i + 1 < argc) {
+            replication_options.backlog_bytes = std::stoull(argv[++i]) << 20;
+        } else if (arg == "--replica-buffer-mb" && i + 1 < argc) {
+            replication_options.max_buffer_bytes = std::stoull(argv[++i]) << 20;
+        } else if (arg == "--apply-threads" && i + 1 < argc) {
+            storage_options.replica_apply_threads = std::stoul(argv[++i]);
+        } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+            storage_options.snapshot_interval_seconds = std::stoi(argv[++i]);
+        } else if (arg == "--max-deltas" && i + 1 < argc) {
+            storage_options.max_delta_snapshots = std::stoi(argv[++i]);
+        } else if (arg == "--replicas" && i + 1 < argc) {
+            replica_addresses = SplitList(argv[++i]);
+        } else if (arg == "--cluster" && i + 1 < argc) {
+            cluster = SplitList(argv[++i]);
+        } else if (arg == "--advertise-address" && i + 1 < argc) {
+            advertise_address = argv[++i];
+        } else if (arg == "--election-timeout-ms" && i + 1 < argc) {
+            raft_options.election_timeout_ms = std::stoi(argv[++i]);
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            metrics_port = std::stoi(argv[++i]);
         } else {
             std::cerr << "Unknown argument: " << arg << std::endl;
             PrintUsage(argv[0]);
@@ -66,7 +142,20 @@ int main(int argc, char** argv) {
         }
     }
     
-    if (!is_master && master_address.empty()) {
+    // Consensus mode: every member starts as a replica and the shard elects its master
+    bool consensus = !cluster.empty();
+    if (consensus) {
+        raft_options.self = advertise_address.empty() ? server_address : advertise_address;
+        auto self = std::find(cluster.begin(), cluster.end(), raft_options.self);
+        if (self == cluster.end()) {
+            std::cerr << "Error: --cluster must list this node's address (" << raft_options.self
+                      << "); set --advertise-address if it differs from --address" << std::endl;
+            return 1;
+        }
+        cluster.erase(self);
+        raft_options.peers = cluster;
+        is_master = false;
+    } else if (!is_master && master_address.empty()) {
         std::cerr << "Error: --master-address is required for replica nodes" << std::endl;
         PrintUsage(argv[0]);
         return 1;
@@ -74,11 +163,23 @@ int main(int argc, char** argv) {
     
     std::cout << "Starting Distributed Key-Value Store Server" << std::endl;
     std::cout << "=============================================" << std::endl;
-    std::cout << "Role: " << (is_master ? "MASTER" : "REPLICA") << std::endl;
+    std::cout << "Role: " << (consensus ? "ELECTED" : is_master ? "MASTER" : "REPLICA") << std::endl;
     std::cout << "Address: " << server_address << std::endl;
+    std::cout << "I/O backend: " << kvstore::IOBackendName(storage_options.io_backend) << std::endl;
+    if (storage_options.lazy_load) {
+        std::cout << "Dataset load: background" << std::endl;
+    }
     
-    if (!is_master) {
-        std::cout << "Master: " << master_address << std::endl;
+    if (consensus) {
+        std::cout << "Cluster peers: ";
+        for (size_t i = 0; i < raft_options.peers.size(); ++i) {
+            std::cout << raft_options.peers[i];
+            if (i < raft_options.peers.size() - 1) std::cout << ", ";
+        }
+        std::cout << std::endl;
+    } else if (!is_master) {
+        std::cout << "Master: " << master_address
+                  << (replication_options.stream_from_master ? " (streaming)" : " (push)") << std::endl;
     }
     
     if (is_master && !replica_addresses.empty()) {
@@ -91,13 +192,22 @@ int main(int argc, char** argv) {
     }
     std::cout << std::endl;
     
-    std::signal(SIGINT, SignalHandler);
-    std::signal(SIGTERM, SignalHandler);
+    // Blocked before any other thread starts, so they all inherit it
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread signal_thread(WaitForSignal, signals);
     
     try {
-        g_server = std::make_unique<kvstore::Server>(server_address, is_master);
+        g_server = std::make_unique<kvstore::Server>(server_address, is_master, storage_options,
+                                                     replication_options);
+        g_running = g_server.get();
         
-        if (is_master) {
+        if (consensus) {
+            g_server->EnableConsensus(raft_options);
+        } else if (is_master) {
             for (const auto& replica_addr : replica_addresses) {
                 g_server->AddReplica(replica_addr);
             }
@@ -105,11 +215,21 @@ int main(int argc, char** argv) {
             g_server->SetMaster(master_address);
         }
         
+        if (metrics_port > 0) {
+            g_server->EnableMetrics(metrics_port);
+        }
+        
         g_server->Run();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
+        std::exit(1);
     }
     
+    // Wake the signal thread if the server stopped on its own, and let it
+    // finish shutting down before the server goes
+    kill(getpid(), SIGTERM);
+    signal_thread.join();
+    g_running = nullptr;
+    g_server.reset();
     return 0;
 }
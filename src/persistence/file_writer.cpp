@@ -0,0 +1,159 @@
+#include "file_writer.h"
+#include "uring_file_writer.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kvstore {
+
+std::unique_ptr<FileWriter> CreateFileWriter(IOBackend backend, bool direct_io) {
+    switch (backend) {
+        case IOBackend::IO_URING: {
+#ifdef KVSTORE_HAVE_IO_URING
+            auto writer = std::make_unique<UringFileWriter>(direct_io);
+            if (writer->Initialize()) {
+                return writer;
+            }
+            std::cerr << "io_uring unavailable, falling back to pwrite" << std::endl;
+#else
+            std::cerr << "Built without io_uring support, falling back to pwrite" << std::endl;
+#endif
+            return std::make_unique<PwriteFileWriter>();
+        }
+        case IOBackend::PWRITE:
+            return std::make_unique<PwriteFileWriter>();
+        case IOBackend::STREAM:
+        default:
+            return std::make_unique<StreamFileWriter>();
+    }
+}
+
+bool ParseIOBackend(const std::string& name, IOBackend& backend) {
+    if (name == "stream") {
+        backend = IOBackend::STREAM;
+    } else if (name == "pwrite") {
+        backend = IOBackend::PWRITE;
+    } else if (name == "io_uring") {
+        backend = IOBackend::IO_URING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* IOBackendName(IOBackend backend) {
+    switch (backend) {
+        case IOBackend::PWRITE:   return "pwrite";
+        case IOBackend::IO_URING: return "io_uring";
+        case IOBackend::STREAM:
+        default:                  return "stream";
+    }
+}
+
+// StreamFileWriter
+
+bool StreamFileWriter::Open(const std::string& path, bool append) {
+    file_.open(path, std::ios::binary | std::ios::out | (append ? std::ios::app : std::ios::trunc));
+    return file_.is_open();
+}
+
+bool StreamFileWriter::Append(const char* data, size_t size) {
+    file_.write(data, static_cast<std::streamsize>(size));
+    return file_.good();
+}
+
+bool StreamFileWriter::Flush() {
+    file_.flush();
+    return file_.good();
+}
+
+bool StreamFileWriter::Sync() {
+    // std::ofstream has no way to reach fsync; flushing is the best it can do
+    return Flush();
+}
+
+void StreamFileWriter::Close() {
+    if (file_.is_open()) {
+        file_.flush();
+        file_.close();
+    }
+}
+
+// PwriteFileWriter
+
+PwriteFileWriter::~PwriteFileWriter() {
+    Close();
+}
+
+bool PwriteFileWriter::Open(const std::string& path, bool append) {
+    Close();
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+    fd_ = ::open(path.c_str(), flags, 0644);
+    if (fd_ < 0) {
+        std::cerr << "Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    offset_ = (append && ::fstat(fd_, &st) == 0) ? static_cast<uint64_t>(st.st_size) : 0;
+    buffer_.clear();
+    return true;
+}
+
+bool PwriteFileWriter::Append(const char* data, size_t size) {
+    if (fd_ < 0) return false;
+
+    buffer_.append(data, size);
+    if (buffer_.size() >= kFlushThreshold) {
+        return Flush();
+    }
+    return true;
+}
+
+bool PwriteFileWriter::Flush() {
+    if (fd_ < 0) return false;
+
+    size_t written = 0;
+    while (written < buffer_.size()) {
+        ssize_t n = ::pwrite(fd_, buffer_.data() + written, buffer_.size() - written,
+                             static_cast<off_t>(offset_ + written));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "pwrite failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    offset_ += written;
+    buffer_.clear();
+    return true;
+}
+
+bool PwriteFileWriter::Sync() {
+    if (!Flush()) return false;
+
+    if (::fdatasync(fd_) != 0) {
+        std::cerr << "fdatasync failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int PwriteFileWriter::PrepareSync() {
+    return Flush() ? fd_ : -1;
+}
+
+void PwriteFileWriter::Close() {
+    if (fd_ < 0) return;
+
+    Flush();
+    ::close(fd_);
+    fd_ = -1;
+}
+
+} // namespace kvstore
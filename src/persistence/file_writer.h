@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+/**
+ * I/O backend used by the persistence writers
+ *
+ * STREAM   - std::ofstream (original behaviour, Sync() only flushes)
+ * PWRITE   - buffered pwrite(2) at explicit offsets plus fdatasync(2)
+ * IO_URING - asynchronous io_uring submissions with registered buffers;
+ *            falls back to PWRITE when io_uring is unavailable
+ */
+enum class IOBackend {
+    STREAM,
+    PWRITE,
+    IO_URING
+};
+
+/**
+ * Append-only file writer shared by AOF and RDB persistence
+ */
+class FileWriter {
+public:
+    virtual ~FileWriter() = default;
+
+    /**
+     * Open a file for writing
+     * @param path File to open (created if missing)
+     * @param append Keep existing content and write after it, otherwise truncate
+     */
+    virtual bool Open(const std::string& path, bool append) = 0;
+
+    /**
+     * Queue bytes at the end of the file (may stay buffered until Flush/Sync)
+     */
+    virtual bool Append(const char* data, size_t size) = 0;
+
+    /**
+     * Hand buffered bytes to the kernel without waiting for stable storage
+     */
+    virtual bool Flush() = 0;
+
+    /**
+     * Make everything appended so far durable
+     */
+    virtual bool Sync() = 0;
+
+    /**
+     * Hand everything appended so far to the kernel and wait until it has
+     * it, for a caller that fsyncs the file itself (outside whatever lock
+     * serialises appends)
+     * @return The file's descriptor, or -1 if the backend has none to offer
+     *         (Sync() must be used instead)
+     */
+    virtual int PrepareSync() { return -1; }
+
+    virtual void Close() = 0;
+    virtual bool IsOpen() const = 0;
+
+    bool Append(const std::string& data) { return Append(data.data(), data.size()); }
+};
+
+/**
+ * Create a writer for the given backend
+ * @param direct_io Bypass the page cache (O_DIRECT) where the backend supports it;
+ *                  intended for large sequential writes such as snapshots
+ */
+std::unique_ptr<FileWriter> CreateFileWriter(IOBackend backend, bool direct_io = false);
+
+/**
+ * Parse a backend name ("stream", "pwrite", "io_uring")
+ * @return true if the name was recognised
+ */
+bool ParseIOBackend(const std::string& name, IOBackend& backend);
+
+const char* IOBackendName(IOBackend backend);
+
+class StreamFileWriter : public FileWriter {
+public:
+    bool Open(const std::string& path, bool append) override;
+    bool Append(const char* data, size_t size) override;
+    bool Flush() override;
+    bool Sync() override;
+    void Close() override;
+    bool IsOpen() const override { return file_.is_open(); }
+
+    using FileWriter::Append;
+
+private:
+    std::ofstream file_;
+};
+
+class PwriteFileWriter : public FileWriter {
+public:
+    ~PwriteFileWriter() override;
+
+    bool Open(const std::string& path, bool append) override;
+    bool Append(const char* data, size_t size) override;
+    bool Flush() override;
+    bool Sync() override;
+    int PrepareSync() override;
+    void Close() override;
+    bool IsOpen() const override { return fd_ >= 0; }
+
+    using FileWriter::Append;
+
+private:
+    static constexpr size_t kFlushThreshold = 1 << 20;
+
+    int fd_{-1};
+    uint64_t offset_{0};
+    std::string buffer_;
+};
+
+} // namespace kvstore
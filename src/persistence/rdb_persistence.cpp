@@ -2,86 +2,295 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <sys/stat.h>
 
 namespace kvstore {
 
-using namespace std::chrono;
+namespace {
 
-RDBPersistence::RDBPersistence(const std::string& filename)
-    : filename_(filename) {
+constexpr size_t kChunkSize = 1 << 20;
+
+std::string EscapeValue(const std::string& value) {
+    std::string escaped_value = value;
+    size_t pos = 0;
+    while ((pos = escaped_value.find('\n', pos)) != std::string::npos) {
+        escaped_value.replace(pos, 1, "\\n");
+        pos += 2;
+    }
+    return escaped_value;
+}
+
+bool FileExists(const std::string& filename) {
+    std::ifstream file(filename);
+    return file.is_open();
+}
+
+uint64_t FileSize(const std::string& filename) {
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
 }
 
-bool RDBPersistence::SaveSnapshot(
-    const std::unordered_map<std::string, std::string>& data,
-    const std::unordered_map<std::string, TimePoint>& expiration
-) {
-    std::string temp_file = filename_ + ".tmp";
-    std::ofstream file(temp_file, std::ios::binary);
+bool StartsWith(const std::string& line, const char* prefix) {
+    return line.compare(0, std::char_traits<char>::length(prefix), prefix) == 0;
+}
+
+} // namespace
+
+// Read position within one snapshot file
+struct RDBPersistence::LoadCursor {
+    std::string filename;
+    std::ifstream file;
+    int64_t sequence{0};
+    size_t partitions{0};        // 0 if the file has no partition markers
+    std::string pending_marker;  // Marker of a partition not requested yet
+    bool finished{false};
+    size_t entries{0};
+};
+
+RDBPersistence::RDBPersistence(const std::string& filename, IOBackend backend)
+    : filename_(filename),
+      writer_(CreateFileWriter(backend, true)) {
+}
+
+RDBPersistence::~RDBPersistence() = default;
+
+std::string RDBPersistence::DeltaFilename(int index) const {
+    return filename_ + ".delta." + std::to_string(index);
+}
+
+bool RDBPersistence::BeginSnapshot(SnapshotType type, int64_t sequence, size_t partition_count) {
+    type_ = type;
+    sequence_ = sequence;
+    entries_ = 0;
+    deletions_ = 0;
+    temp_file_ = (type == SnapshotType::FULL ? filename_ : DeltaFilename(delta_count_ + 1)) + ".tmp";
     
-    if (!file.is_open()) {
-        std::cerr << "Failed to create snapshot: " << temp_file << std::endl;
+    if (!writer_->Open(temp_file_, false)) {
+        std::cerr << "Failed to create snapshot: " << temp_file_ << std::endl;
+        ok_ = false;
         return false;
     }
     
-    file << "REDIS0011" << "\n";
+    // Serialise into large chunks so the writer sees big sequential appends
+    chunk_.clear();
+    chunk_.reserve(kChunkSize + 4096);
+    chunk_ += "REDIS0011\n";
+    chunk_ += "SEQUENCE " + std::to_string(sequence) + "\n";
+    if (partition_count > 0) {
+        chunk_ += "PARTITIONS " + std::to_string(partition_count) + "\n";
+    }
+    ok_ = true;
+    return true;
+}
+
+void RDBPersistence::BeginPartition(size_t partition) {
+    chunk_ += "PARTITION " + std::to_string(partition) + "\n";
+}
+
+bool RDBPersistence::WriteEntry(const std::string& key, const std::string& value, int ttl_seconds) {
+    if (ttl_seconds >= 0) {
+        chunk_ += "EXPIRE " + key + " " + std::to_string(ttl_seconds) + "\n";
+    }
+    chunk_ += "SET " + key + " " + EscapeValue(value) + "\n";
+    entries_++;
+    
+    if (chunk_.size() >= kChunkSize) {
+        ok_ = ok_ && writer_->Append(chunk_);
+        chunk_.clear();
+    }
+    return ok_;
+}
+
+bool RDBPersistence::WriteDeletion(const std::string& key) {
+    chunk_ += "DEL " + key + "\n";
+    deletions_++;
     
-    auto now = steady_clock::now();
+    if (chunk_.size() >= kChunkSize) {
+        ok_ = ok_ && writer_->Append(chunk_);
+        chunk_.clear();
+    }
+    return ok_;
+}
+
+bool RDBPersistence::CommitSnapshot() {
+    chunk_ += "EOF\n";
+    ok_ = ok_ && writer_->Append(chunk_) && writer_->Sync();
+    writer_->Close();
+    chunk_.clear();
+    
+    if (!ok_) {
+        std::cerr << "Failed to write snapshot: " << temp_file_ << std::endl;
+        std::remove(temp_file_.c_str());
+        return false;
+    }
     
-    for (const auto& [key, value] : data) {
-        auto exp_it = expiration.find(key);
+    if (type_ == SnapshotType::FULL) {
+        std::rename(temp_file_.c_str(), filename_.c_str());
+        // The new base already covers every delta, and their sequences are
+        // no newer than its own, so a crash before this point is harmless
+        RemoveDeltas(1);
+        delta_count_ = 0;
+        has_base_ = true;
         
-        if (exp_it != expiration.end()) {
-            if (exp_it->second <= now) {
-                continue;
-            }
-            
-            auto remaining = duration_cast<seconds>(exp_it->second - now);
-            file << "EXPIRE " << key << " " << remaining.count() << "\n";
-        }
+        std::cout << "Snapshot saved: " << filename_ << " (" << entries_ << " keys, sequence "
+                  << sequence_ << ")" << std::endl;
+    } else {
+        delta_count_++;
+        std::string delta_file = DeltaFilename(delta_count_);
+        std::rename(temp_file_.c_str(), delta_file.c_str());
         
-        std::string escaped_value = value;
-        size_t pos = 0;
-        while ((pos = escaped_value.find('\n', pos)) != std::string::npos) {
-            escaped_value.replace(pos, 1, "\\n");
-            pos += 2;
+        std::cout << "Delta snapshot saved: " << delta_file << " (" << entries_ << " changed, "
+                  << deletions_ << " deleted, sequence " << sequence_ << ")" << std::endl;
+    }
+    return true;
+}
+
+void RDBPersistence::AbortSnapshot() {
+    writer_->Close();
+    chunk_.clear();
+    std::remove(temp_file_.c_str());
+}
+
+void RDBPersistence::RemoveDeltas(int from_index) {
+    for (int index = from_index; ; ++index) {
+        std::string delta_file = DeltaFilename(index);
+        if (std::remove(delta_file.c_str()) != 0) {
+            break;
         }
-        
-        file << "SET " << key << " " << escaped_value << "\n";
     }
+}
+
+bool RDBPersistence::LoadSnapshot(LoadCallback callback, int64_t& sequence) {
+    if (!OpenForLoad(0, sequence)) {
+        return false;
+    }
+    LoadPartition(kAllPartitions, callback);
+    FinishLoad();
+    return true;
+}
+
+bool RDBPersistence::OpenForLoad(size_t partition_count, int64_t& sequence) {
+    FinishLoad();
+    sequence = 0;
+    delta_count_ = 0;
+    snapshot_bytes_ = 0;
+    bytes_loaded_ = 0;
     
-    file << "EOF\n";
-    file.close();
+    auto base = std::make_unique<LoadCursor>();
+    if (!OpenCursor(filename_, *base)) {
+        // Deltas are meaningless without the base they were stacked on
+        RemoveDeltas(1);
+        return false;
+    }
+    has_base_ = true;
+    sequence = base->sequence;
+    cursors_.push_back(std::move(base));
     
-    std::rename(temp_file.c_str(), filename_.c_str());
+    // Validate the delta chain from the headers alone; anything not newer
+    // than what precedes it is a leftover from before the last base was written
+    for (int index = 1; FileExists(DeltaFilename(index)); ++index) {
+        std::string delta_file = DeltaFilename(index);
+        auto delta = std::make_unique<LoadCursor>();
+        
+        if (!OpenCursor(delta_file, *delta) || delta->sequence <= sequence) {
+            std::cerr << "Discarding stale delta snapshots from " << delta_file << std::endl;
+            delta->file.close();
+            RemoveDeltas(index);
+            break;
+        }
+        
+        sequence = delta->sequence;
+        delta_count_ = index;
+        cursors_.push_back(std::move(delta));
+    }
     
-    std::cout << "Snapshot saved: " << filename_ << " (" << data.size() << " keys)" << std::endl;
+    partitioned_ = partition_count > 0;
+    for (const auto& cursor : cursors_) {
+        snapshot_bytes_ += FileSize(cursor->filename);
+        partitioned_ = partitioned_ && cursor->partitions == partition_count;
+    }
     return true;
 }
 
-bool RDBPersistence::LoadSnapshot(
-    std::unordered_map<std::string, std::string>& data,
-    std::unordered_map<std::string, TimePoint>& expiration
-) {
-    std::ifstream file(filename_);
+void RDBPersistence::LoadPartition(size_t partition, LoadCallback& callback) {
+    for (auto& cursor : cursors_) {
+        ReadEntries(*cursor, partition, callback);
+    }
+}
+
+void RDBPersistence::FinishLoad() {
+    for (auto& cursor : cursors_) {
+        if (cursor->finished) {
+            std::cout << "Snapshot loaded: " << cursor->filename << " (" << cursor->entries
+                      << " entries, sequence " << cursor->sequence << ")" << std::endl;
+        }
+    }
+    cursors_.clear();
+}
+
+bool RDBPersistence::OpenCursor(const std::string& filename, LoadCursor& cursor) {
+    cursor.filename = filename;
+    cursor.file.open(filename);
     
-    if (!file.is_open()) {
+    if (!cursor.file.is_open()) {
         return false;
     }
     
     std::string line;
-    std::getline(file, line);
+    std::getline(cursor.file, line);
     
     if (line != "REDIS0011") {
-        std::cerr << "Invalid RDB format" << std::endl;
+        std::cerr << "Invalid RDB format: " << filename << std::endl;
         return false;
     }
+    bytes_loaded_ += line.size() + 1;
+    
+    // Header lines come before any entry
+    while (cursor.file.peek() == 'S' || cursor.file.peek() == 'P') {
+        std::streampos position = cursor.file.tellg();
+        std::getline(cursor.file, line);
+        
+        if (StartsWith(line, "SEQUENCE ")) {
+            cursor.sequence = std::stoll(line.substr(9));
+        } else if (StartsWith(line, "PARTITIONS ")) {
+            cursor.partitions = std::stoul(line.substr(11));
+        } else {
+            cursor.file.seekg(position);
+            break;
+        }
+        bytes_loaded_ += line.size() + 1;
+    }
+    return true;
+}
+
+void RDBPersistence::ReadEntries(LoadCursor& cursor, size_t partition, LoadCallback& callback) {
+    if (cursor.finished) return;
+    
+    // A marker read past the end of the previous partition
+    if (!cursor.pending_marker.empty()) {
+        if (std::stoul(cursor.pending_marker.substr(10)) > partition) return;
+        cursor.pending_marker.clear();
+    }
     
-    std::unordered_map<std::string, int> pending_expires;
+    std::string pending_expire_key;
+    int pending_expire_seconds = -1;
+    std::string line;
     
-    while (std::getline(file, line)) {
+    while (std::getline(cursor.file, line)) {
+        bytes_loaded_.fetch_add(line.size() + 1, std::memory_order_relaxed);
+        
         if (line == "EOF") break;
         if (line.empty()) continue;
         
+        if (StartsWith(line, "PARTITION ")) {
+            if (std::stoul(line.substr(10)) > partition) {
+                cursor.pending_marker = line;
+                return;
+            }
+            continue;
+        }
+        
         std::istringstream iss(line);
         std::string cmd, key, value;
         
@@ -99,23 +308,22 @@ bool RDBPersistence::LoadSnapshot(
                 pos += 1;
             }
             
-            data[key] = value;
-            
-            auto exp_it = pending_expires.find(key);
-            if (exp_it != pending_expires.end()) {
-                auto expiry_time = steady_clock::now() + seconds(exp_it->second);
-                expiration[key] = expiry_time;
-            }
+            // An EXPIRE line always directly precedes the SET it applies to
+            int ttl_seconds = key == pending_expire_key ? pending_expire_seconds : -1;
+            callback(key, &value, ttl_seconds);
+            pending_expire_key.clear();
+            cursor.entries++;
         } else if (cmd == "EXPIRE") {
             iss >> value;
-            pending_expires[key] = std::stoi(value);
+            pending_expire_key = key;
+            pending_expire_seconds = std::stoi(value);
+        } else if (cmd == "DEL") {
+            callback(key, nullptr, -1);
+            cursor.entries++;
         }
     }
     
-    file.close();
-    
-    std::cout << "Snapshot loaded: " << filename_ << " (" << data.size() << " keys)" << std::endl;
-    return true;
+    cursor.finished = true;
 }
 
 } // namespace kvstore
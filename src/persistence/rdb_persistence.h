@@ -1,29 +1,163 @@
 #pragma once
 
+#include "file_writer.h"
 #include <string>
-#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <functional>
 #include <chrono>
+#include <cstdint>
 
 namespace kvstore {
 
+/**
+ * Snapshot files: a full base (filename) plus numbered delta files
+ * (filename.delta.1, .2, ...) holding only the keys changed since the
+ * previous snapshot. Recovery loads the base and then every delta written
+ * after it, in order.
+ *
+ * Writers that keep data in partitions can group entries under
+ * "PARTITION n" markers, which lets a reader load the chain one partition
+ * at a time (see OpenForLoad / LoadPartition).
+ */
 class RDBPersistence {
 public:
     using TimePoint = std::chrono::steady_clock::time_point;
+
+    enum class SnapshotType {
+        FULL,
+        DELTA
+    };
+
+    // value is nullptr when a delta records that the key was deleted;
+    // ttl_seconds is -1 when the key has no expiration
+    using LoadCallback = std::function<void(const std::string& key, const std::string* value, int ttl_seconds)>;
+
+    // Pass to LoadPartition to read every remaining entry
+    static constexpr size_t kAllPartitions = static_cast<size_t>(-1);
+
+    /**
+     * @param backend I/O backend used to write snapshots; the io_uring
+     *                backend writes them with O_DIRECT
+     */
+    explicit RDBPersistence(const std::string& filename, IOBackend backend = IOBackend::STREAM);
+    ~RDBPersistence();
+
+    /**
+     * Start writing a snapshot
+     * @param sequence Last mutation reflected in the snapshot; AOF commands
+     *                 up to and including it never need to be replayed on top of it
+     * @param partition_count Number of partitions the entries are grouped
+     *                        into, or 0 if they are not grouped
+     */
+    bool BeginSnapshot(SnapshotType type, int64_t sequence, size_t partition_count = 0);
+
+    /**
+     * Start the entries of a partition; partitions must be written in
+     * ascending order
+     */
+    void BeginPartition(size_t partition);
+
+    /**
+     * Record a live key (ttl_seconds -1 for no expiration)
+     */
+    bool WriteEntry(const std::string& key, const std::string& value, int ttl_seconds);
+
+    /**
+     * Record that a key no longer exists (delta snapshots only)
+     */
+    bool WriteDeletion(const std::string& key);
+
+    /**
+     * Durably publish the snapshot. A full snapshot replaces the base and
+     * discards all deltas; a delta is appended to the chain.
+     */
+    bool CommitSnapshot();
+
+    /**
+     * Drop a snapshot that failed part-way
+     */
+    void AbortSnapshot();
+
+    /**
+     * Load the base snapshot and every delta written after it
+     * @param sequence Set to the sequence covered by the last file loaded
+     * @return false if there is no base snapshot
+     */
+    bool LoadSnapshot(LoadCallback callback, int64_t& sequence);
+
+    /**
+     * Open the base and its valid deltas for incremental loading. Only the
+     * file headers are read.
+     * @param partition_count Partitioning the caller will load by
+     * @param sequence Set to the sequence covered by the whole chain
+     * @return false if there is no base snapshot
+     */
+    bool OpenForLoad(size_t partition_count, int64_t& sequence);
+
+    /**
+     * Whether every open file is grouped into the requested partitions. If
+     * not, entries can only be loaded all at once with kAllPartitions.
+     */
+    bool IsPartitioned() const { return partitioned_; }
+
+    /**
+     * Feed the callback every entry of a partition, base first and then
+     * each delta in order. Partitions must be requested in ascending order.
+     */
+    void LoadPartition(size_t partition, LoadCallback& callback);
+
+    /**
+     * Close the files opened by OpenForLoad
+     */
+    void FinishLoad();
+
+    /**
+     * Total size of the files opened by OpenForLoad, and how much of it
+     * has been read so far
+     */
+    uint64_t GetSnapshotBytes() const { return snapshot_bytes_; }
+    uint64_t GetBytesLoaded() const { return bytes_loaded_.load(std::memory_order_relaxed); }
+
+    /**
+     * Number of deltas stacked on the current base
+     */
+    int GetDeltaCount() const { return delta_count_; }
     
-    explicit RDBPersistence(const std::string& filename);
-    
-    bool SaveSnapshot(
-        const std::unordered_map<std::string, std::string>& data,
-        const std::unordered_map<std::string, TimePoint>& expiration
-    );
-    
-    bool LoadSnapshot(
-        std::unordered_map<std::string, std::string>& data,
-        std::unordered_map<std::string, TimePoint>& expiration
-    );
-    
+    /**
+     * Whether a base exists that deltas can be stacked on
+     */
+    bool HasBaseSnapshot() const { return has_base_; }
+
 private:
+    struct LoadCursor;
+
+    std::string DeltaFilename(int index) const;
+    bool OpenCursor(const std::string& filename, LoadCursor& cursor);
+    void ReadEntries(LoadCursor& cursor, size_t partition, LoadCallback& callback);
+    void RemoveDeltas(int from_index);
+
     std::string filename_;
+    std::unique_ptr<FileWriter> writer_;
+
+    // State of the snapshot being written
+    SnapshotType type_{SnapshotType::FULL};
+    int64_t sequence_{0};
+    std::string temp_file_;
+    std::string chunk_;
+    size_t entries_{0};
+    size_t deletions_{0};
+    bool ok_{false};
+
+    int delta_count_{0};
+    bool has_base_{false};
+
+    // Files being loaded, base first
+    std::vector<std::unique_ptr<LoadCursor>> cursors_;
+    bool partitioned_{false};
+    uint64_t snapshot_bytes_{0};
+    std::atomic<uint64_t> bytes_loaded_{0};
 };
 
 } // namespace kvstore
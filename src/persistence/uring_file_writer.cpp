@@ -0,0 +1,434 @@
+#include "uring_file_writer.h"
+
+#ifdef KVSTORE_HAVE_IO_URING
+
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace kvstore {
+
+namespace {
+
+int SysSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int SysEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                                      flags, nullptr, 0));
+}
+
+int SysRegister(int ring_fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+size_t AlignDown(size_t value, size_t alignment) {
+    return value & ~(alignment - 1);
+}
+
+size_t AlignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// A write's user_data holds its buffer index and, above it, its length, so
+// its completion can tell a short write from a whole one
+uint64_t WriteTag(size_t buffer, uint32_t length) {
+    return (static_cast<uint64_t>(length) << 32) | buffer;
+}
+
+} // namespace
+
+UringFileWriter::UringFileWriter(bool direct_io)
+    : direct_io_(direct_io) {
+}
+
+UringFileWriter::~UringFileWriter() {
+    Close();
+    ReleaseRing();
+}
+
+bool UringFileWriter::Initialize() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    ring_fd_ = SysSetup(kQueueDepth, &params);
+    if (ring_fd_ < 0) {
+        return false;
+    }
+
+    sq_entries_ = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        ReleaseRing();
+        return false;
+    }
+
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            ReleaseRing();
+            return false;
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        ReleaseRing();
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Page-aligned buffers satisfy O_DIRECT and are pinned once by the kernel
+    buffers_.resize(kBufferCount);
+    std::vector<iovec> iovecs(kBufferCount);
+    for (size_t i = 0; i < kBufferCount; ++i) {
+        void* memory = nullptr;
+        if (::posix_memalign(&memory, kDirectAlignment, kBufferSize) != 0) {
+            ReleaseRing();
+            return false;
+        }
+        buffers_[i].data = static_cast<char*>(memory);
+        iovecs[i].iov_base = memory;
+        iovecs[i].iov_len = kBufferSize;
+    }
+
+    if (SysRegister(ring_fd_, IORING_REGISTER_BUFFERS, iovecs.data(), kBufferCount) < 0) {
+        std::cerr << "io_uring buffer registration failed: " << std::strerror(errno) << std::endl;
+        ReleaseRing();
+        return false;
+    }
+
+    return true;
+}
+
+void UringFileWriter::ReleaseRing() {
+    for (auto& buffer : buffers_) {
+        std::free(buffer.data);
+    }
+    buffers_.clear();
+
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+    sqes_ = nullptr;
+    cq_ring_ = nullptr;
+    sq_ring_ = nullptr;
+
+    if (ring_fd_ >= 0) {
+        ::close(ring_fd_);
+        ring_fd_ = -1;
+    }
+}
+
+bool UringFileWriter::Open(const std::string& path, bool append) {
+    Close();
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+    if (direct_io_) {
+        flags |= O_DIRECT;
+    }
+
+    fd_ = ::open(path.c_str(), flags, 0644);
+    if (fd_ < 0 && direct_io_ && errno == EINVAL) {
+        // Filesystem (e.g. tmpfs) does not support O_DIRECT
+        direct_io_ = false;
+        fd_ = ::open(path.c_str(), flags & ~O_DIRECT, 0644);
+    }
+    if (fd_ < 0) {
+        std::cerr << "Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    logical_size_ = (append && ::fstat(fd_, &st) == 0) ? static_cast<uint64_t>(st.st_size) : 0;
+    failed_ = false;
+
+    // Direct writes must start on a block boundary, so re-read the partial tail block
+    current_ = 0;
+    Buffer& buffer = buffers_[current_];
+    buffer.file_offset = direct_io_ ? AlignDown(logical_size_, kDirectAlignment) : logical_size_;
+    buffer.filled = static_cast<size_t>(logical_size_ - buffer.file_offset);
+    buffer.submitted = buffer.filled;
+    if (buffer.filled > 0) {
+        int read_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        ssize_t n = read_fd >= 0 ? ::pread(read_fd, buffer.data, buffer.filled,
+                                           static_cast<off_t>(buffer.file_offset)) : -1;
+        if (read_fd >= 0) ::close(read_fd);
+        if (n != static_cast<ssize_t>(buffer.filled)) {
+            std::cerr << "Failed to read tail block of " << path << std::endl;
+            Close();
+            return false;
+        }
+        buffer.submitted = 0;
+    }
+
+    return true;
+}
+
+bool UringFileWriter::Append(const char* data, size_t size) {
+    if (fd_ < 0 || failed_) return false;
+
+    while (size > 0) {
+        Buffer& buffer = buffers_[current_];
+        size_t chunk = std::min(size, kBufferSize - buffer.filled);
+
+        std::memcpy(buffer.data + buffer.filled, data, chunk);
+        buffer.filled += chunk;
+        logical_size_ += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (buffer.filled == kBufferSize && !AdvanceBuffer()) {
+            return false;
+        }
+    }
+
+    return !failed_;
+}
+
+bool UringFileWriter::AdvanceBuffer() {
+    if (!SubmitPending(false)) {
+        return false;
+    }
+
+    Buffer& previous = buffers_[current_];
+    uint64_t next_offset = previous.file_offset + kBufferSize;
+
+    current_ = (current_ + 1) % buffers_.size();
+    Buffer& next = buffers_[current_];
+    if (!WaitForBuffer(next)) {
+        return false;
+    }
+
+    next.file_offset = next_offset;
+    next.filled = 0;
+    next.submitted = 0;
+    return true;
+}
+
+io_uring_sqe* UringFileWriter::NextSqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail_;
+
+    if (tail - head >= sq_entries_) {
+        return nullptr;
+    }
+
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+    return sqe;
+}
+
+bool UringFileWriter::SubmitPending(bool sync) {
+    Buffer& buffer = buffers_[current_];
+
+    size_t start = buffer.submitted;
+    size_t end = buffer.filled;
+    if (direct_io_) {
+        // Only whole blocks can be written; the tail block is padded on Sync/Close
+        start = AlignDown(start, kDirectAlignment);
+        end = sync || buffer.filled == kBufferSize ? AlignUp(end, kDirectAlignment)
+                                                   : AlignDown(end, kDirectAlignment);
+        if (end > buffer.filled) {
+            std::memset(buffer.data + buffer.filled, 0, end - buffer.filled);
+        }
+        if (start < buffer.submitted && buffer.inflight > 0 && !WaitForBuffer(buffer)) {
+            return false;
+        }
+    }
+
+    bool has_write = end > start && buffer.filled > buffer.submitted;
+    unsigned needed = (has_write ? 1 : 0) + (sync ? 1 : 0);
+    if (needed == 0) {
+        return true;
+    }
+
+    // Keep the completion queue from overflowing
+    while (inflight_ + needed > kQueueDepth) {
+        if (!Submit(1)) return false;
+    }
+
+    bool drain = inflight_ > 0;
+
+    if (has_write) {
+        io_uring_sqe* sqe = NextSqe();
+        if (!sqe) return false;
+
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = fd_;
+        sqe->off = buffer.file_offset + start;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer.data + start);
+        sqe->len = static_cast<uint32_t>(end - start);
+        sqe->buf_index = static_cast<uint16_t>(current_);
+        sqe->user_data = WriteTag(current_, sqe->len);
+        if (sync) {
+            // The fsync below must only run once this write has landed...
+            sqe->flags |= IOSQE_IO_LINK;
+            // ...and once every earlier write has as well
+            if (drain) sqe->flags |= IOSQE_IO_DRAIN;
+        }
+
+        buffer.inflight++;
+        inflight_++;
+        buffer.submitted = std::min(end, buffer.filled);
+    }
+
+    if (sync) {
+        io_uring_sqe* sqe = NextSqe();
+        if (!sqe) return false;
+
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd_;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = kFsyncTag;
+        if (!has_write && drain) sqe->flags |= IOSQE_IO_DRAIN;
+
+        inflight_++;
+    }
+
+    return Submit(0);
+}
+
+bool UringFileWriter::Submit(unsigned min_complete) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    while (to_submit_ > 0 || min_complete > 0) {
+        int ret = SysEnter(ring_fd_, to_submit_, min_complete, flags);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+            failed_ = true;
+            return false;
+        }
+        to_submit_ -= std::min<unsigned>(to_submit_, static_cast<unsigned>(ret));
+        if (min_complete > 0) break;
+    }
+
+    ReapCompletions();
+    return !failed_;
+}
+
+void UringFileWriter::ReapCompletions() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+
+        if (cqe.res < 0) {
+            std::cerr << "io_uring " << (cqe.user_data == kFsyncTag ? "fsync" : "write")
+                      << " failed: " << std::strerror(-cqe.res) << std::endl;
+            failed_ = true;
+        }
+
+        if (cqe.user_data != kFsyncTag) {
+            size_t index = static_cast<size_t>(cqe.user_data & 0xFFFFFFFFu);
+            uint32_t length = static_cast<uint32_t>(cqe.user_data >> 32);
+            // The rest is not retried: a linked fsync has already been
+            // cancelled, and the file has a hole where it should be
+            if (cqe.res >= 0 && static_cast<uint32_t>(cqe.res) != length) {
+                std::cerr << "io_uring short write: " << cqe.res << " of " << length << " bytes" << std::endl;
+                failed_ = true;
+            }
+            if (index < buffers_.size()) {
+                buffers_[index].inflight--;
+            }
+        }
+        inflight_--;
+        head++;
+    }
+
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+bool UringFileWriter::WaitForBuffer(Buffer& buffer) {
+    while (buffer.inflight > 0) {
+        if (!Submit(1)) return false;
+    }
+    return !failed_;
+}
+
+bool UringFileWriter::WaitForAll() {
+    while (inflight_ > 0) {
+        if (!Submit(1)) return false;
+    }
+    return !failed_;
+}
+
+bool UringFileWriter::Flush() {
+    if (fd_ < 0 || failed_) return false;
+    return SubmitPending(false);
+}
+
+bool UringFileWriter::Sync() {
+    if (fd_ < 0 || failed_) return false;
+    return SubmitPending(true) && WaitForAll();
+}
+
+int UringFileWriter::PrepareSync() {
+    // A direct I/O file's last partial block is only written by Sync()
+    if (fd_ < 0 || failed_ || direct_io_) return -1;
+    return SubmitPending(false) && WaitForAll() ? fd_ : -1;
+}
+
+void UringFileWriter::Close() {
+    if (fd_ < 0) return;
+
+    const Buffer& buffer = buffers_[current_];
+    if (buffer.submitted < buffer.filled) {
+        SubmitPending(direct_io_);
+    }
+    WaitForAll();
+
+    if (direct_io_ && ::ftruncate(fd_, static_cast<off_t>(logical_size_)) != 0) {
+        std::cerr << "Failed to trim direct I/O padding: " << std::strerror(errno) << std::endl;
+    }
+
+    ::close(fd_);
+    fd_ = -1;
+}
+
+} // namespace kvstore
+
+#endif // KVSTORE_HAVE_IO_URING
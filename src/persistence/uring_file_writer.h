@@ -0,0 +1,106 @@
+#pragma once
+
+#ifdef KVSTORE_HAVE_IO_URING
+
+#include "file_writer.h"
+#include <linux/io_uring.h>
+#include <vector>
+
+namespace kvstore {
+
+/**
+ * FileWriter backed by io_uring
+ *
+ * Appends are copied into a small set of registered (fixed) buffers and
+ * submitted as IORING_OP_WRITE_FIXED at explicit offsets, so Flush() returns
+ * without waiting for the kernel. Sync() links the last write to a
+ * datasync fsync that drains everything submitted before it. With direct_io
+ * the file is opened O_DIRECT and only block-aligned regions are written;
+ * Close() trims the padding of the final block. A write that completes short
+ * (e.g. at a file size limit) fails the writer like any other error.
+ *
+ * Talks to the kernel through the raw io_uring syscalls, so no liburing is
+ * required. Not thread-safe: callers serialise access (AOF holds its mutex).
+ */
+class UringFileWriter : public FileWriter {
+public:
+    explicit UringFileWriter(bool direct_io);
+    ~UringFileWriter() override;
+
+    UringFileWriter(const UringFileWriter&) = delete;
+    UringFileWriter& operator=(const UringFileWriter&) = delete;
+
+    /**
+     * Set up the ring and register buffers
+     * @return false if io_uring is not available on this kernel
+     */
+    bool Initialize();
+
+    bool Open(const std::string& path, bool append) override;
+    bool Append(const char* data, size_t size) override;
+    bool Flush() override;
+    bool Sync() override;
+    int PrepareSync() override;
+    void Close() override;
+    bool IsOpen() const override { return fd_ >= 0; }
+
+    using FileWriter::Append;
+
+private:
+    static constexpr unsigned kQueueDepth = 64;
+    static constexpr size_t kBufferCount = 8;
+    static constexpr size_t kBufferSize = 256 * 1024;
+    static constexpr size_t kDirectAlignment = 4096;
+    static constexpr uint64_t kFsyncTag = ~0ull;
+
+    struct Buffer {
+        char* data{nullptr};
+        uint64_t file_offset{0};  // File position of data[0]
+        size_t filled{0};         // Bytes appended
+        size_t submitted{0};      // Bytes handed to the kernel
+        unsigned inflight{0};     // Writes from this buffer not yet completed
+    };
+
+    io_uring_sqe* NextSqe();
+    bool SubmitPending(bool sync);
+    bool Submit(unsigned min_complete);
+    void ReapCompletions();
+    bool WaitForBuffer(Buffer& buffer);
+    bool WaitForAll();
+    bool AdvanceBuffer();
+    void ReleaseRing();
+
+    bool direct_io_;
+    int ring_fd_{-1};
+    int fd_{-1};
+    bool failed_{false};
+
+    // Submission queue
+    void* sq_ring_{nullptr};
+    size_t sq_ring_size_{0};
+    unsigned* sq_head_{nullptr};
+    unsigned* sq_tail_{nullptr};
+    unsigned* sq_mask_{nullptr};
+    unsigned* sq_array_{nullptr};
+    io_uring_sqe* sqes_{nullptr};
+    size_t sqes_size_{0};
+    unsigned sq_entries_{0};
+    unsigned to_submit_{0};
+
+    // Completion queue
+    void* cq_ring_{nullptr};
+    size_t cq_ring_size_{0};
+    unsigned* cq_head_{nullptr};
+    unsigned* cq_tail_{nullptr};
+    unsigned* cq_mask_{nullptr};
+    io_uring_cqe* cqes_{nullptr};
+
+    std::vector<Buffer> buffers_;
+    size_t current_{0};
+    unsigned inflight_{0};
+    uint64_t logical_size_{0};  // Bytes of real data written to the file
+};
+
+} // namespace kvstore
+
+#endif // KVSTORE_HAVE_IO_URING
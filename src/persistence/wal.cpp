@@ -0,0 +1,513 @@
+#include "wal.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kvstore {
+
+namespace {
+
+// Records are [length:u32][crc32:u32][serialized ReplicationCommand]
+constexpr size_t kHeaderSize = 8;
+constexpr uint32_t kMaxRecordBytes = 1u << 30;
+
+uint32_t Crc32(const char* data, size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+uint64_t FileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+} // namespace
+
+WriteAheadLog::WriteAheadLog(const std::string& filename, IOBackend backend,
+                             bool fsync_always, uint64_t segment_bytes)
+    : filename_(filename),
+      writer_(filename.empty() ? nullptr : CreateFileWriter(backend)),
+      fsync_always_(fsync_always),
+      segment_bytes_(segment_bytes) {
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    if (writer_ && writer_->IsOpen()) {
+        writer_->Sync();
+        writer_->Close();
+    }
+}
+
+std::string WriteAheadLog::SegmentFilename(int64_t first_sequence) const {
+    std::ostringstream oss;
+    oss << filename_ << "." << std::setw(20) << std::setfill('0') << first_sequence;
+    return oss.str();
+}
+
+void WriteAheadLog::ListSegments() {
+    segments_.clear();
+
+    size_t slash = filename_.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : filename_.substr(0, slash);
+    std::string prefix = (slash == std::string::npos ? filename_ : filename_.substr(slash + 1)) + ".";
+
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) return;
+
+    while (dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.size() != prefix.size() + 20 || name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::string digits = name.substr(prefix.size());
+        if (!std::all_of(digits.begin(), digits.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            continue;
+        }
+        int64_t first_sequence = std::stoll(digits);
+        segments_.push_back({first_sequence, SegmentFilename(first_sequence)});
+    }
+    closedir(handle);
+
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment& a, const Segment& b) { return a.first_sequence < b.first_sequence; });
+}
+
+bool WriteAheadLog::Open(int64_t snapshot_sequence) {
+    if (!IsPersistent()) return true;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ListSegments();
+
+    if (segments_.empty() && FileSize(filename_) > 0 && !ImportLegacyAof(snapshot_sequence)) {
+        return false;
+    }
+
+    if (segments_.empty()) {
+        std::cout << "No WAL segments found: " << filename_ << std::endl;
+        return true;
+    }
+
+    // Only the last segment can end in a torn record
+    Segment& tail = segments_.back();
+    last_sequence_ = std::max(last_sequence_, tail.first_sequence - 1);
+
+    std::ifstream in(tail.path, std::ios::binary);
+    ReplicationCommand command;
+    uint64_t good_offset = 0;
+    while (ReadRecord(in, command)) {
+        last_sequence_ = std::max(last_sequence_, command.sequence_id());
+        good_offset = static_cast<uint64_t>(in.tellg());
+    }
+    in.close();
+
+    if (good_offset < FileSize(tail.path)) {
+        std::cerr << "Discarding torn WAL record at offset " << good_offset << " in " << tail.path << std::endl;
+        if (truncate(tail.path.c_str(), static_cast<off_t>(good_offset)) != 0) {
+            std::cerr << "Failed to truncate WAL segment: " << tail.path << std::endl;
+            return false;
+        }
+    }
+
+    if (!writer_->Open(tail.path, true)) {
+        std::cerr << "Failed to open WAL segment: " << tail.path << std::endl;
+        return false;
+    }
+    segment_size_ = good_offset;
+    synced_sequence_ = last_sequence_;
+
+    std::cout << "WAL opened: " << segments_.size() << " segment(s), last sequence "
+              << last_sequence_ << std::endl;
+    return true;
+}
+
+bool WriteAheadLog::ImportLegacyAof(int64_t snapshot_sequence) {
+    std::ifstream legacy(filename_);
+    if (!legacy.is_open()) return false;
+
+    std::cout << "Converting text AOF to WAL segments: " << filename_ << std::endl;
+
+    std::string line;
+    size_t imported = 0;
+    size_t covered = 0;
+    while (std::getline(legacy, line)) {
+        if (line.empty()) continue;
+
+        // Lines are "[sequence] SET|DELETE|EXPIRE key [value]"
+        std::istringstream iss(line);
+        std::string first, cmd, key;
+        int64_t sequence = 0;
+        iss >> first;
+        if (!first.empty() && std::all_of(first.begin(), first.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            sequence = std::stoll(first);
+            iss >> cmd;
+        } else {
+            cmd = first;
+        }
+        iss >> key;
+
+        // Lines without a sequence were written before the version that
+        // logs them, so a snapshot with a sequence was taken after all of
+        // them and covers them. Replaying one would undo a later write the
+        // snapshot holds.
+        if (sequence == 0 && snapshot_sequence > 0) {
+            covered++;
+            continue;
+        }
+
+        ReplicationCommand command;
+        command.set_key(key);
+        if (cmd == "SET") {
+            std::string value;
+            std::getline(iss, value);
+            if (!value.empty() && value[0] == ' ') {
+                value = value.substr(1);
+            }
+            size_t pos = 0;
+            while ((pos = value.find("\\n", pos)) != std::string::npos) {
+                value.replace(pos, 2, "\n");
+                pos += 1;
+            }
+            command.set_type(ReplicationCommand::SET);
+            command.set_value(value);
+        } else if (cmd == "DELETE") {
+            command.set_type(ReplicationCommand::DELETE);
+        } else if (cmd == "EXPIRE") {
+            int seconds = 0;
+            iss >> seconds;
+            command.set_type(ReplicationCommand::EXPIRE);
+            command.set_seconds(seconds);
+        } else {
+            continue;
+        }
+
+        // Lines written before sequences were logged get the next one
+        command.set_sequence_id(sequence > last_sequence_ ? sequence : last_sequence_ + 1);
+        if (segments_.empty() && !StartSegment(command.sequence_id())) {
+            return false;
+        }
+        if (!WriteRecord(command)) {
+            return false;
+        }
+        last_sequence_ = command.sequence_id();
+        imported++;
+    }
+    legacy.close();
+
+    if (!segments_.empty() && !writer_->Sync()) {
+        return false;
+    }
+    writer_->Close();
+    std::remove(filename_.c_str());
+
+    std::cout << "Converted " << imported << " commands from the text AOF";
+    if (covered > 0) {
+        std::cout << " (dropped " << covered << " unsequenced commands the snapshot covers)";
+    }
+    std::cout << std::endl;
+    return true;
+}
+
+bool WriteAheadLog::StartSegment(int64_t first_sequence) {
+    if (writer_->IsOpen()) {
+        writer_->Sync();
+        writer_->Close();
+    }
+
+    std::string path = SegmentFilename(first_sequence);
+    if (!writer_->Open(path, true)) {
+        std::cerr << "Failed to create WAL segment: " << path << std::endl;
+        return false;
+    }
+
+    segments_.push_back({first_sequence, path});
+    segment_size_ = 0;
+    return true;
+}
+
+bool WriteAheadLog::WriteRecord(const ReplicationCommand& command) {
+    uint32_t length = static_cast<uint32_t>(command.ByteSizeLong());
+
+    record_.resize(kHeaderSize);
+    command.AppendToString(&record_);
+    uint32_t crc = Crc32(record_.data() + kHeaderSize, length);
+    std::memcpy(&record_[0], &length, sizeof(length));
+    std::memcpy(&record_[4], &crc, sizeof(crc));
+
+    if (!writer_->Append(record_) || !writer_->Flush()) {
+        std::cerr << "Failed to append to WAL segment: " << segments_.back().path << std::endl;
+        return false;
+    }
+    segment_size_ += record_.size();
+    return true;
+}
+
+bool WriteAheadLog::ReadRecord(std::istream& in, ReplicationCommand& command) {
+    char header[kHeaderSize];
+    if (!in.read(header, kHeaderSize)) {
+        return false;
+    }
+
+    uint32_t length;
+    uint32_t crc;
+    std::memcpy(&length, header, sizeof(length));
+    std::memcpy(&crc, header + 4, sizeof(crc));
+    if (length > kMaxRecordBytes) {
+        return false;
+    }
+
+    std::string payload(length, '\0');
+    if (length > 0 && !in.read(&payload[0], length)) {
+        return false;
+    }
+    return Crc32(payload.data(), payload.size()) == crc && command.ParseFromString(payload);
+}
+
+int64_t WriteAheadLog::Append(ReplicationCommand& command) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return AppendLocked(command);
+}
+
+int64_t WriteAheadLog::AppendBatch(std::vector<ReplicationCommand>& commands, size_t* written) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t last = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        int64_t sequence = AppendLocked(commands[i]);
+        if (sequence != 0) {
+            last = sequence;
+            count = i + 1;
+        }
+    }
+    if (written) *written = count;
+    return last;
+}
+
+int64_t WriteAheadLog::AppendLocked(ReplicationCommand& command) {
+    if (failed_) {
+        return 0;
+    }
+    if (command.sequence_id() == 0) {
+        command.set_sequence_id(last_sequence_ + 1);
+    } else if (command.sequence_id() <= last_sequence_) {
+        return 0;
+    }
+
+    if (IsPersistent()) {
+        bool roll_over = segments_.empty() || segment_size_ >= segment_bytes_;
+        if ((roll_over && !StartSegment(command.sequence_id())) || !WriteRecord(command)) {
+            // Neither sequenced, published nor acknowledged
+            failed_ = true;
+            std::cerr << "WAL append failed at sequence " << command.sequence_id()
+                      << "; refusing further writes" << std::endl;
+            return 0;
+        }
+    }
+    last_sequence_ = command.sequence_id();
+
+    for (const auto& subscriber : subscribers_) {
+        subscriber(command);
+    }
+    return last_sequence_;
+}
+
+void WriteAheadLog::WaitDurable(int64_t sequence) {
+    if (!fsync_always_ || !IsPersistent()) return;
+
+    // Whoever gets the sync lock first syncs everything appended so far,
+    // which usually covers the callers queued behind it
+    std::lock_guard<std::mutex> sync_lock(sync_mutex_);
+    int64_t target;
+    int fd = -1;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (synced_sequence_ >= sequence || failed_) return;
+        target = last_sequence_;
+        if (writer_->IsOpen()) {
+            int writer_fd = writer_->PrepareSync();
+            // Segments rolled over since were synced when they were closed
+            fd = writer_fd >= 0 ? dup(writer_fd) : -1;
+            if (fd < 0 && !writer_->Sync()) {
+                failed_ = true;
+                std::cerr << "WAL sync failed; refusing further writes" << std::endl;
+                return;
+            }
+        }
+        if (fd < 0) {
+            synced_sequence_ = target;
+            return;
+        }
+    }
+
+    // The fsync itself holds no lock that appends need
+    bool synced = fdatasync(fd) == 0;
+    if (!synced) {
+        std::cerr << "WAL fdatasync failed: " << std::strerror(errno) << "; refusing further writes" << std::endl;
+    }
+    close(fd);
+
+    // After a failed fsync the page cache may have dropped the records, so
+    // nothing from here on counts as durable
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (synced) {
+        synced_sequence_ = std::max(synced_sequence_, target);
+    } else {
+        failed_ = true;
+    }
+}
+
+int64_t WriteAheadLog::LastSequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_sequence_;
+}
+
+bool WriteAheadLog::HasFailed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_;
+}
+
+void WriteAheadLog::AdvanceTo(int64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_sequence_ = std::max(last_sequence_, sequence);
+}
+
+bool WriteAheadLog::Read(int64_t after, ReadCallback callback) {
+    std::vector<Segment> segments;
+    int64_t last_sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (after >= last_sequence_) return true;
+        if (!IsPersistent() || segments_.empty() || segments_.front().first_sequence > after + 1) {
+            return false;
+        }
+        if (writer_->IsOpen()) {
+            writer_->Flush();
+        }
+        segments = segments_;
+        last_sequence = last_sequence_;
+    }
+
+    ReplicationCommand command;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        // Skip segments that end before the requested position
+        if (i + 1 < segments.size() && segments[i + 1].first_sequence <= after + 1) {
+            continue;
+        }
+
+        std::ifstream in(segments[i].path, std::ios::binary);
+        int64_t read_to = segments[i].first_sequence - 1;
+        while (ReadRecord(in, command)) {
+            read_to = command.sequence_id();
+            if (command.sequence_id() <= after) continue;
+            if (!callback(command)) return true;
+        }
+
+        // A corrupt record or a missing segment cuts off what should follow
+        int64_t segment_end = i + 1 < segments.size() ? segments[i + 1].first_sequence - 1 : last_sequence;
+        if (read_to < segment_end) {
+            std::cerr << "WAL segment " << segments[i].path << " ends at sequence " << read_to
+                      << ", expected " << segment_end << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool WriteAheadLog::Truncate(int64_t up_to_sequence) {
+    if (!IsPersistent()) return true;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!retained_.empty()) {
+        up_to_sequence = std::min(up_to_sequence, *retained_.begin());
+    }
+
+    // Roll over a segment that is already fully covered so it can go too
+    if (!segments_.empty() && segment_size_ > 0 && last_sequence_ <= up_to_sequence &&
+        !StartSegment(last_sequence_ + 1)) {
+        // The old segment is closed, so appends have nowhere to go
+        failed_ = true;
+        std::cerr << "WAL rollover failed; refusing further writes" << std::endl;
+        return false;
+    }
+
+    size_t removed = 0;
+    while (segments_.size() > 1 && segments_[1].first_sequence - 1 <= up_to_sequence) {
+        std::remove(segments_.front().path.c_str());
+        segments_.erase(segments_.begin());
+        removed++;
+    }
+
+    std::cout << "WAL truncated at sequence " << up_to_sequence << " (removed " << removed
+              << ", kept " << segments_.size() << " segments)" << std::endl;
+    return true;
+}
+
+void WriteAheadLog::Retain(int64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retained_.insert(sequence);
+}
+
+void WriteAheadLog::Release(int64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = retained_.find(sequence);
+    if (it != retained_.end()) {
+        retained_.erase(it);
+    }
+}
+
+void WriteAheadLog::Reset(int64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (IsPersistent()) {
+        if (writer_->IsOpen()) {
+            writer_->Close();
+        }
+        for (const Segment& segment : segments_) {
+            std::remove(segment.path.c_str());
+        }
+    }
+    segments_.clear();
+    segment_size_ = 0;
+    last_sequence_ = sequence;
+    synced_sequence_ = sequence;
+}
+
+void WriteAheadLog::Subscribe(Subscriber subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.push_back(std::move(subscriber));
+}
+
+uint64_t WriteAheadLog::GetSize() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t size = 0;
+    for (const Segment& segment : segments_) {
+        size += FileSize(segment.path);
+    }
+    return size;
+}
+
+} // namespace kvstore
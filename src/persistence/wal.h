@@ -0,0 +1,163 @@
+#pragma once
+
+#include "file_writer.h"
+#include "kvstore.pb.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <set>
+#include <cstdint>
+
+namespace kvstore {
+
+/**
+ * Write-ahead log: the single source of sequence numbers for mutations
+ *
+ * Each mutation is encoded once as a ReplicationCommand and appended as a
+ * length-prefixed, checksummed record to the current segment file
+ * (<filename>.<first sequence>). Segments roll over at a size limit and are
+ * deleted by Truncate() once a snapshot covers them, so the segments on disk
+ * are exactly the AOF tail. After the write, the command is handed to every
+ * subscriber (replication) in sequence order.
+ *
+ * The last sequence is recovered from the segments on Open(), so sequences
+ * keep increasing across restarts. With an empty filename the log only
+ * assigns sequences and publishes; nothing is written to disk.
+ */
+class WriteAheadLog {
+public:
+    static constexpr uint64_t kDefaultSegmentBytes = 64ull << 20;
+
+    using Subscriber = std::function<void(const ReplicationCommand& command)>;
+    // Return false to stop reading
+    using ReadCallback = std::function<bool(const ReplicationCommand& command)>;
+
+    /**
+     * @param backend I/O backend used for appends
+     * @param fsync_always Make every record durable before the write is acknowledged
+     * @param segment_bytes Size at which a new segment is started
+     */
+    explicit WriteAheadLog(const std::string& filename,
+                           IOBackend backend = IOBackend::STREAM,
+                           bool fsync_always = false,
+                           uint64_t segment_bytes = kDefaultSegmentBytes);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    /**
+     * Find existing segments, drop a torn record at the end of the last one
+     * and recover the last sequence. A text AOF from an older version is
+     * converted into a segment first.
+     * @param snapshot_sequence Sequence of the snapshot being loaded (0 if
+     *        none, or one from before sequences were logged)
+     */
+    bool Open(int64_t snapshot_sequence = 0);
+
+    bool IsPersistent() const { return !filename_.empty(); }
+
+    /**
+     * Append a mutation and publish it to subscribers
+     * If the command's sequence_id is 0 the next sequence is assigned to it;
+     * otherwise (a command replicated from a master) it is kept and must be
+     * greater than the last sequence.
+     * @return Sequence of the record, or 0 if it was not newer than the
+     *         log or could not be written (see HasFailed())
+     */
+    int64_t Append(ReplicationCommand& command);
+
+    /**
+     * Append several commands under one lock, as if by Append() in order
+     * @param written If given, the position after the last command written;
+     *        once one fails the log has failed, so none after it is written
+     * @return Sequence of the last record written, or 0 if none was
+     */
+    int64_t AppendBatch(std::vector<ReplicationCommand>& commands, size_t* written = nullptr);
+
+    /**
+     * With fsync_always, wait until every record up to sequence is durable.
+     * Concurrent callers share one fsync (group commit), which runs outside
+     * the log's lock so appends carry on meanwhile.
+     */
+    void WaitDurable(int64_t sequence);
+
+    int64_t LastSequence() const;
+
+    /**
+     * Whether a record could not be written or synced. Every later append
+     * is refused: a record written after a torn one would be cut off with
+     * it on recovery.
+     */
+    bool HasFailed() const;
+
+    /**
+     * Never assign sequences at or below this one (e.g. a snapshot's
+     * sequence when its segments have been lost)
+     */
+    void AdvanceTo(int64_t sequence);
+
+    /**
+     * Visit the records after a sequence in order, until the callback returns false
+     * @return false if the log no longer holds every record after `after`,
+     *         or one of them could not be read (a corrupt record or a
+     *         missing segment); the records before it were delivered
+     */
+    bool Read(int64_t after, ReadCallback callback);
+
+    /**
+     * Delete segments whose records are all covered by a snapshot taken at up_to_sequence
+     * Records after a retained sequence are kept regardless.
+     * @return false if the segment being appended to could not be rolled
+     *         over; the log has then failed and nothing is deleted
+     */
+    bool Truncate(int64_t up_to_sequence);
+    
+    // Keep the records after `sequence` until the matching Release() (a
+    // full resync in progress that will resume from there)
+    void Retain(int64_t sequence);
+    void Release(int64_t sequence);
+    
+    // Discard every segment and continue from `sequence` (a replica that
+    // has just loaded a full copy of its master's data)
+    void Reset(int64_t sequence);
+
+    void Subscribe(Subscriber subscriber);
+
+    // Total size of the segments on disk
+    uint64_t GetSize() const;
+
+private:
+    struct Segment {
+        int64_t first_sequence;
+        std::string path;
+    };
+
+    std::string SegmentFilename(int64_t first_sequence) const;
+    void ListSegments();
+    bool ImportLegacyAof(int64_t snapshot_sequence);
+    int64_t AppendLocked(ReplicationCommand& command);
+    bool StartSegment(int64_t first_sequence);
+    bool WriteRecord(const ReplicationCommand& command);
+    static bool ReadRecord(std::istream& in, ReplicationCommand& command);
+
+    std::string filename_;
+    std::unique_ptr<FileWriter> writer_;
+    bool fsync_always_;
+    uint64_t segment_bytes_;
+
+    mutable std::mutex mutex_;
+    std::mutex sync_mutex_;          // One fsync at a time; taken before mutex_
+    std::vector<Segment> segments_;  // Oldest first; the last one is being appended to
+    uint64_t segment_size_{0};
+    int64_t last_sequence_{0};
+    int64_t synced_sequence_{0};
+    bool failed_{false};
+    std::string record_;             // Reused encoding buffer
+    std::vector<Subscriber> subscribers_;
+    std::multiset<int64_t> retained_;
+};
+
+} // namespace kvstore
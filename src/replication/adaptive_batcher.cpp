@@ -0,0 +1,24 @@
+#include "adaptive_batcher.h"
+#include <algorithm>
+
+namespace kvstore {
+
+AdaptiveBatcher::AdaptiveBatcher(size_t max_batch_bytes, std::chrono::microseconds max_linger)
+    : max_batch_bytes_(std::max(max_batch_bytes, kMinBatchBytes)),
+      max_linger_(max_linger),
+      batch_bytes_(kMinBatchBytes) {
+}
+
+void AdaptiveBatcher::Update(size_t sent, size_t pending) {
+    if (pending > sent) {
+        // More arrived during the send than it carried: falling behind
+        batch_bytes_ = std::min(batch_bytes_ * 2, max_batch_bytes_);
+        linger_ = std::min(std::max(linger_ * 2, kMinLinger), max_linger_);
+    } else if (pending == 0) {
+        // Caught up: favour latency again
+        batch_bytes_ = std::max(batch_bytes_ / 2, kMinBatchBytes);
+        linger_ = linger_ / 2 < kMinLinger ? std::chrono::microseconds(0) : linger_ / 2;
+    }
+}
+
+} // namespace kvstore
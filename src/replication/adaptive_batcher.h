@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace kvstore {
+
+/**
+ * Sizes the batches a replication sender coalesces commands into
+ *
+ * A replica that keeps up gets small batches sent the moment anything is
+ * pending, so a write reaches it after one round trip. When commands pile up
+ * while a batch is in flight, the replica is falling behind on per-message
+ * overhead: the size limit doubles and the sender lingers before sending a
+ * partial batch, so more commands share each message. Both shrink again once
+ * the replica has caught up.
+ */
+class AdaptiveBatcher {
+public:
+    static constexpr size_t kMinBatchBytes = 16 << 10;
+    static constexpr std::chrono::microseconds kMinLinger{50};
+
+    AdaptiveBatcher(size_t max_batch_bytes, std::chrono::microseconds max_linger);
+
+    /**
+     * Record a sent batch
+     * @param sent Commands in the batch
+     * @param pending Commands waiting for the next one once it was sent
+     */
+    void Update(size_t sent, size_t pending);
+
+    // Stop adding commands once a batch reaches this size
+    size_t BatchBytes() const { return batch_bytes_; }
+    // How long to wait for a partial batch to fill before sending it
+    std::chrono::microseconds Linger() const { return linger_; }
+
+private:
+    size_t max_batch_bytes_;
+    std::chrono::microseconds max_linger_;
+    size_t batch_bytes_;
+    std::chrono::microseconds linger_{0};
+};
+
+} // namespace kvstore
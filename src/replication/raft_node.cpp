@@ -0,0 +1,400 @@
+#include "raft_node.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+namespace kvstore {
+
+namespace {
+
+// Replace a small file so a crash leaves either the old or the new contents
+bool WriteFileAtomically(const std::string& path, const std::string& contents) {
+    std::string temp = path + ".tmp";
+    FILE* file = std::fopen(temp.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    bool ok = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size() &&
+              std::fflush(file) == 0 && ::fsync(fileno(file)) == 0;
+    ok = std::fclose(file) == 0 && ok;
+    return ok && std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+} // namespace
+
+RaftNode::RaftNode(const RaftOptions& options, Callbacks callbacks)
+    : options_(options),
+      callbacks_(std::move(callbacks)),
+      rng_(std::random_device{}()) {
+    for (const std::string& address : options_.peers) {
+        Peer peer;
+        peer.address = address;
+        peer.stub = KeyValueStore::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+        peers_.push_back(std::move(peer));
+    }
+    LoadState();
+}
+
+RaftNode::~RaftNode() {
+    Stop();
+}
+
+void RaftNode::Start() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (thread_.joinable()) return;
+        ResetElectionDeadline();
+    }
+    std::cout << "Consensus mode: " << options_.self << " with " << peers_.size()
+              << " peers, term " << CurrentTerm() << std::endl;
+    thread_ = std::thread(&RaftNode::Run, this);
+}
+
+void RaftNode::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+std::string RaftNode::Leader() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return leader_;
+}
+
+int64_t RaftNode::CurrentTerm() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return current_term_;
+}
+
+void RaftNode::Run() {
+    while (true) {
+        ApplyRole();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopping_) return;
+
+        if (state_ == State::LEADER) {
+            lock.unlock();
+            SendHeartbeats();
+            lock.lock();
+            cv_.wait_for(lock, std::chrono::milliseconds(options_.heartbeat_interval_ms),
+                         [this] { return stopping_ || state_ != State::LEADER; });
+            continue;
+        }
+
+        if (std::chrono::steady_clock::now() >= election_deadline_) {
+            lock.unlock();
+            StartElection();
+            continue;
+        }
+        cv_.wait_until(lock, election_deadline_, [this] {
+            return stopping_ || state_ == State::LEADER || leader_ != applied_leader_;
+        });
+    }
+}
+
+void RaftNode::ApplyRole() {
+    State state;
+    std::string leader;
+    int64_t term;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        state = state_;
+        leader = leader_;
+        term = current_term_;
+    }
+
+    if (state == State::LEADER) {
+        if (applied_state_ == State::LEADER && applied_term_ == term) return;
+        callbacks_.lead(term);
+    } else {
+        // Candidates follow no one until the election is decided
+        if (applied_state_ != State::LEADER && applied_term_ >= 0 && applied_leader_ == leader) return;
+        callbacks_.follow(leader);
+    }
+    applied_state_ = state;
+    applied_leader_ = leader;
+    applied_term_ = term;
+}
+
+void RaftNode::StartElection() {
+    // A node part way through loading or resyncing would win with a log
+    // that claims more than its data holds
+    if (callbacks_.ready && !callbacks_.ready()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ResetElectionDeadline();
+        return;
+    }
+
+    int64_t last_sequence = callbacks_.last_sequence();
+    VoteRequest request;
+    {
+        std::lock_guard<std::mutex> lock(terms_mutex_);
+        request.set_last_log_term(TermAtLocked(last_sequence, last_sequence));
+    }
+    request.set_last_sequence(last_sequence);
+    request.set_candidate(options_.self);
+
+    int64_t term;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) return;
+        state_ = State::CANDIDATE;
+        current_term_++;
+        voted_for_ = options_.self;
+        leader_.clear();
+        SaveState();
+        ResetElectionDeadline();
+        term = current_term_;
+    }
+    request.set_term(term);
+    std::cout << "Standing for election in term " << term << " at sequence " << last_sequence << std::endl;
+
+    auto timeout = std::chrono::milliseconds(2 * options_.heartbeat_interval_ms);
+    std::vector<std::future<std::pair<grpc::Status, VoteResponse>>> calls;
+    for (Peer& peer : peers_) {
+        calls.push_back(std::async(std::launch::async, [&peer, &request, timeout] {
+            grpc::ClientContext context;
+            context.set_deadline(std::chrono::system_clock::now() + timeout);
+            VoteResponse response;
+            grpc::Status status = peer.stub->RequestVote(&context, request, &response);
+            return std::make_pair(status, response);
+        }));
+    }
+
+    int votes = 1;
+    int64_t highest_term = term;
+    for (auto& call : calls) {
+        auto [status, response] = call.get();
+        if (!status.ok()) continue;
+        highest_term = std::max(highest_term, response.term());
+        if (response.granted() && response.term() == term) {
+            votes++;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != State::CANDIDATE || current_term_ != term) {
+        return;
+    }
+    if (highest_term > current_term_) {
+        StepDown(highest_term);
+        return;
+    }
+    if (2 * votes > static_cast<int>(peers_.size()) + 1) {
+        state_ = State::LEADER;
+        leader_ = options_.self;
+        for (Peer& peer : peers_) {
+            peer.last_contact = std::chrono::steady_clock::now();
+        }
+        std::cout << "Elected leader for term " << term << " with " << votes << " votes" << std::endl;
+    }
+}
+
+void RaftNode::SendHeartbeats() {
+    AppendEntriesRequest request;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        request.set_term(current_term_);
+        request.set_leader(options_.self);
+    }
+
+    auto timeout = std::chrono::milliseconds(2 * options_.heartbeat_interval_ms);
+    std::vector<std::future<std::pair<grpc::Status, AppendEntriesResponse>>> calls;
+    for (Peer& peer : peers_) {
+        calls.push_back(std::async(std::launch::async, [&peer, &request, timeout] {
+            grpc::ClientContext context;
+            context.set_deadline(std::chrono::system_clock::now() + timeout);
+            AppendEntriesResponse response;
+            grpc::Status status = peer.stub->AppendEntries(&context, request, &response);
+            return std::make_pair(status, response);
+        }));
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    int64_t highest_term = request.term();
+    for (size_t i = 0; i < calls.size(); ++i) {
+        auto [status, response] = calls[i].get();
+        if (!status.ok()) continue;
+        highest_term = std::max(highest_term, response.term());
+        if (response.success()) {
+            peers_[i].last_contact = now;
+        }
+    }
+
+    // A leader cut off from the majority stops taking writes: they could
+    // not be acknowledged, and another leader may already be elected
+    int reachable = 1;
+    for (const Peer& peer : peers_) {
+        if (now - peer.last_contact < std::chrono::milliseconds(options_.election_timeout_ms)) {
+            reachable++;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != State::LEADER || current_term_ != request.term()) {
+        return;
+    }
+    if (highest_term > current_term_) {
+        std::cout << "Found term " << highest_term << "; stepping down" << std::endl;
+        StepDown(highest_term);
+    } else if (2 * reachable <= static_cast<int>(peers_.size()) + 1) {
+        std::cerr << "Lost contact with a majority of the shard; stepping down" << std::endl;
+        StepDown(current_term_);
+    }
+}
+
+void RaftNode::HandleRequestVote(const VoteRequest& request, VoteResponse* response) {
+    int64_t last_sequence = callbacks_.last_sequence();
+    int64_t last_term;
+    {
+        std::lock_guard<std::mutex> lock(terms_mutex_);
+        last_term = TermAtLocked(last_sequence, last_sequence);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (request.term() > current_term_) {
+        StepDown(request.term());
+    }
+    response->set_term(current_term_);
+    response->set_granted(false);
+    if (request.term() < current_term_) {
+        return;
+    }
+
+    bool up_to_date = request.last_log_term() > last_term ||
+                      (request.last_log_term() == last_term && request.last_sequence() >= last_sequence);
+    if (up_to_date && (voted_for_.empty() || voted_for_ == request.candidate())) {
+        voted_for_ = request.candidate();
+        SaveState();
+        ResetElectionDeadline();
+        response->set_granted(true);
+        std::cout << "Voted for " << request.candidate() << " in term " << current_term_ << std::endl;
+    }
+}
+
+void RaftNode::HandleAppendEntries(const AppendEntriesRequest& request, AppendEntriesResponse* response) {
+    response->set_last_sequence(callbacks_.last_sequence());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (request.term() < current_term_) {
+        response->set_term(current_term_);
+        response->set_success(false);
+        return;
+    }
+    if (request.term() > current_term_ || state_ != State::FOLLOWER) {
+        StepDown(request.term());
+    }
+    if (leader_ != request.leader()) {
+        leader_ = request.leader();
+        std::cout << "Following leader " << leader_ << " in term " << current_term_ << std::endl;
+        cv_.notify_all();
+    }
+    ResetElectionDeadline();
+    response->set_term(current_term_);
+    response->set_success(true);
+}
+
+void RaftNode::StepDown(int64_t term) {
+    if (term > current_term_) {
+        current_term_ = term;
+        voted_for_.clear();
+        leader_.clear();
+        SaveState();
+    }
+    if (state_ == State::LEADER) {
+        leader_.clear();
+    }
+    state_ = State::FOLLOWER;
+    ResetElectionDeadline();
+    cv_.notify_all();
+}
+
+void RaftNode::ResetElectionDeadline() {
+    std::uniform_int_distribution<int> timeout(options_.election_timeout_ms, 2 * options_.election_timeout_ms - 1);
+    election_deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout(rng_));
+}
+
+void RaftNode::NoteLogged(const ReplicationCommand& command) {
+    std::lock_guard<std::mutex> lock(terms_mutex_);
+    int64_t last_term = terms_.empty() ? 0 : terms_.back().first;
+    if (command.term() > last_term) {
+        terms_.emplace_back(command.term(), command.sequence_id());
+        SaveTerms();
+    }
+}
+
+void RaftNode::ResetLog(int64_t term, int64_t sequence) {
+    std::lock_guard<std::mutex> lock(terms_mutex_);
+    terms_.clear();
+    if (term > 0) {
+        terms_.emplace_back(term, sequence);
+    }
+    log_start_ = sequence;
+    SaveTerms();
+}
+
+int64_t RaftNode::TermAt(int64_t sequence) {
+    int64_t last_sequence = callbacks_.last_sequence();
+    std::lock_guard<std::mutex> lock(terms_mutex_);
+    return TermAtLocked(sequence, last_sequence);
+}
+
+int64_t RaftNode::TermAtLocked(int64_t sequence, int64_t last_sequence) const {
+    if (sequence > last_sequence || sequence < log_start_) {
+        return -1;
+    }
+    auto after = std::upper_bound(terms_.begin(), terms_.end(), sequence,
+                                  [](int64_t value, const std::pair<int64_t, int64_t>& entry) {
+                                      return value < entry.second;
+                                  });
+    return after == terms_.begin() ? 0 : std::prev(after)->first;
+}
+
+void RaftNode::SaveState() {
+    std::ostringstream out;
+    out << current_term_ << " " << (voted_for_.empty() ? "-" : voted_for_) << "\n";
+    if (!WriteFileAtomically(options_.state_file, out.str())) {
+        std::cerr << "Failed to save " << options_.state_file << std::endl;
+    }
+}
+
+void RaftNode::SaveTerms() {
+    std::ostringstream out;
+    out << log_start_ << "\n";
+    for (const auto& [term, sequence] : terms_) {
+        out << term << " " << sequence << "\n";
+    }
+    if (!WriteFileAtomically(options_.terms_file, out.str())) {
+        std::cerr << "Failed to save " << options_.terms_file << std::endl;
+    }
+}
+
+void RaftNode::LoadState() {
+    std::ifstream state(options_.state_file);
+    std::string voted_for;
+    if (state >> current_term_ >> voted_for) {
+        voted_for_ = voted_for == "-" ? "" : voted_for;
+    } else {
+        current_term_ = 0;
+    }
+
+    std::ifstream terms(options_.terms_file);
+    int64_t term, sequence;
+    if (terms >> log_start_) {
+        while (terms >> term >> sequence) {
+            terms_.emplace_back(term, sequence);
+        }
+    }
+}
+
+} // namespace kvstore
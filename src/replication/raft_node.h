@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <utility>
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+
+namespace kvstore {
+
+struct RaftOptions {
+    std::string self;                       // Address the other members reach this node at
+    std::vector<std::string> peers;         // The shard's other members
+    // A follower that hears no heartbeat for a random time in [t, 2t)
+    // stands for election
+    int election_timeout_ms = 1000;
+    int heartbeat_interval_ms = 100;
+    int commit_timeout_ms = 2000;           // Longest a write waits for a majority
+    std::string state_file = "raft.state";  // Current term and vote
+    std::string terms_file = "raft.terms";  // Sequence at which each term's commands start
+};
+
+/**
+ * Raft leader election for the members of one shard (consensus mode)
+ *
+ * The log is the write-ahead log and its entries travel over the ordinary
+ * replication stream; this class only adds terms to it:
+ * - Every command is logged with the term of the leader that wrote it, and
+ *   the sequence at which each term starts is kept (and persisted) here
+ * - A candidate wins a term with votes from a majority, each member voting
+ *   once per term and only for a candidate whose log is at least as up to
+ *   date as its own (last term, then last sequence)
+ * - The leader sends heartbeats; a member that sees a higher term steps
+ *   down, and a leader that cannot reach a majority for an election timeout
+ *   stops taking writes
+ * - Writes are acknowledged once a majority has logged them, so every
+ *   acknowledged write is on any node that can win a later election
+ *
+ * Role changes are applied on the node's own thread through Callbacks, so
+ * RPC handlers never wait on the replication stream.
+ */
+class RaftNode {
+public:
+    enum class State {
+        FOLLOWER,
+        CANDIDATE,
+        LEADER
+    };
+
+    struct Callbacks {
+        // Won an election: take writes, logging them under `term`
+        std::function<void(int64_t term)> lead;
+        // Replicate from this leader ("" = none known yet: refuse writes)
+        std::function<void(const std::string& leader)> follow;
+        // Last sequence in the local log
+        std::function<int64_t()> last_sequence;
+        // False while the dataset is incomplete (loading or mid resync);
+        // such a node does not stand for election
+        std::function<bool()> ready;
+    };
+
+    RaftNode(const RaftOptions& options, Callbacks callbacks);
+    ~RaftNode();
+
+    RaftNode(const RaftNode&) = delete;
+    RaftNode& operator=(const RaftNode&) = delete;
+
+    void Start();
+    void Stop();
+
+    void HandleRequestVote(const VoteRequest& request, VoteResponse* response);
+    void HandleAppendEntries(const AppendEntriesRequest& request, AppendEntriesResponse* response);
+
+    // Record the term of a logged command (a log subscriber, in log order)
+    void NoteLogged(const ReplicationCommand& command);
+    // A full resync restarted the log after `sequence`, which was logged in `term`
+    void ResetLog(int64_t term, int64_t sequence);
+    // Term of the logged command at `sequence`, or -1 if the log does not hold it
+    int64_t TermAt(int64_t sequence);
+
+    bool IsLeader() const { return state_ == State::LEADER; }
+    State GetState() const { return state_; }
+    std::string Leader() const;
+    int64_t CurrentTerm() const;
+    // Acknowledgements a write needs besides the leader's own
+    int QuorumReplicas() const { return static_cast<int>((options_.peers.size() + 1) / 2); }
+    int CommitTimeoutMs() const { return options_.commit_timeout_ms; }
+
+private:
+    struct Peer {
+        std::string address;
+        std::unique_ptr<KeyValueStore::Stub> stub;
+        std::chrono::steady_clock::time_point last_contact;  // Last heartbeat it answered
+    };
+
+    void Run();
+    void StartElection();
+    void SendHeartbeats();
+    // Apply the current role through the callbacks if it changed
+    void ApplyRole();
+
+    // Caller holds mutex_
+    void StepDown(int64_t term);
+    void ResetElectionDeadline();
+    void SaveState();
+
+    // Caller holds terms_mutex_
+    int64_t TermAtLocked(int64_t sequence, int64_t last_sequence) const;
+    void SaveTerms();
+
+    void LoadState();
+
+    RaftOptions options_;
+    Callbacks callbacks_;
+    std::vector<Peer> peers_;
+
+    mutable std::mutex mutex_;          // Guards the fields below
+    std::condition_variable cv_;
+    std::atomic<State> state_{State::FOLLOWER};
+    int64_t current_term_{0};
+    std::string voted_for_;
+    std::string leader_;
+    std::chrono::steady_clock::time_point election_deadline_;
+    bool stopping_{false};
+    std::mt19937 rng_;
+
+    // What the callbacks were last told; only touched by the node's thread
+    State applied_state_{State::CANDIDATE};
+    std::string applied_leader_;
+    int64_t applied_term_{-1};
+
+    // Terms of the log: (term, first sequence) in log order. Commands
+    // before log_start_ were replaced by a full resync and are unknown;
+    // commands before the first entry were logged outside consensus (term 0).
+    mutable std::mutex terms_mutex_;    // Taken under the log's lock
+    std::vector<std::pair<int64_t, int64_t>> terms_;
+    int64_t log_start_{0};
+
+    std::thread thread_;
+};
+
+} // namespace kvstore
@@ -0,0 +1,94 @@
+#include "replication_backlog.h"
+#include <algorithm>
+
+namespace kvstore {
+
+ReplicationBacklog::ReplicationBacklog(size_t capacity, size_t max_bytes)
+    : slots_(std::max<size_t>(capacity, 1)),
+      max_bytes_(max_bytes) {
+}
+
+void ReplicationBacklog::Append(const ReplicationCommand& command) {
+    int64_t sequence = command.sequence_id();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (sequence <= last_sequence_) return;
+        
+        if (sequence != last_sequence_ + 1) {
+            // Only contiguous runs can be served; start over from here
+            while (first_sequence_ != 0) {
+                EvictOldest();
+            }
+        }
+        
+        size_t bytes = command.ByteSizeLong();
+        while (first_sequence_ != 0 &&
+               (last_sequence_ - first_sequence_ + 1 >= static_cast<int64_t>(slots_.size()) ||
+                bytes_ + bytes > max_bytes_)) {
+            EvictOldest();
+        }
+        if (first_sequence_ == 0) {
+            first_sequence_ = sequence;
+        }
+        
+        Slot& slot = SlotFor(sequence);
+        slot.command = command;
+        slot.bytes = bytes;
+        bytes_ += bytes;
+        last_sequence_ = sequence;
+    }
+    cv_.notify_all();
+}
+
+void ReplicationBacklog::EvictOldest() {
+    Slot& slot = SlotFor(first_sequence_);
+    bytes_ -= slot.bytes;
+    slot.command.Clear();
+    slot.bytes = 0;
+    
+    if (first_sequence_ == last_sequence_) {
+        first_sequence_ = 0;
+    } else {
+        first_sequence_++;
+    }
+}
+
+ReplicationBacklog::ReadResult ReplicationBacklog::Read(int64_t from, size_t max_bytes,
+                                                        ReplicationBatch& out,
+                                                        std::chrono::microseconds wait) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!cv_.wait_for(lock, wait, [this, from] { return closed_ || last_sequence_ >= from; }) || closed_) {
+        return ReadResult::TIMEOUT;
+    }
+    if (first_sequence_ == 0 || from < first_sequence_) {
+        return ReadResult::TOO_OLD;
+    }
+    
+    size_t bytes = 0;
+    for (int64_t sequence = from; sequence <= last_sequence_ && (bytes == 0 || bytes < max_bytes); ++sequence) {
+        Slot& slot = SlotFor(sequence);
+        *out.add_commands() = slot.command;
+        bytes += slot.bytes;
+    }
+    return ReadResult::OK;
+}
+
+void ReplicationBacklog::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+int64_t ReplicationBacklog::FirstSequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return first_sequence_;
+}
+
+int64_t ReplicationBacklog::LastSequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_sequence_;
+}
+
+} // namespace kvstore
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include "kvstore.pb.h"
+
+namespace kvstore {
+
+/**
+ * In-memory window of the most recent replicated commands
+ *
+ * A fixed ring of slots indexed by sequence id (sequence % capacity), also
+ * bounded by the total encoded size of the commands it holds. Streaming
+ * replicas read from it; a replica that reconnects within the window
+ * resumes without touching the log on disk.
+ */
+class ReplicationBacklog {
+public:
+    enum class ReadResult {
+        OK,        // At least one command copied
+        TOO_OLD,   // The requested sequence has already been evicted
+        TIMEOUT    // Nothing newer arrived in time
+    };
+
+    ReplicationBacklog(size_t capacity, size_t max_bytes);
+
+    // Commands must arrive in sequence order; a gap restarts the window
+    void Append(const ReplicationCommand& command);
+
+    /**
+     * Append the commands from sequence `from` on to `out` until it holds
+     * max_bytes (always at least one), waiting up to `wait` for the first
+     * one to arrive
+     */
+    ReadResult Read(int64_t from, size_t max_bytes, ReplicationBatch& out,
+                    std::chrono::microseconds wait);
+
+    // Wake up blocked readers (shutdown)
+    void Close();
+
+    // Oldest sequence held, 0 when empty
+    int64_t FirstSequence() const;
+    int64_t LastSequence() const;
+
+private:
+    struct Slot {
+        ReplicationCommand command;
+        size_t bytes{0};
+    };
+
+    Slot& SlotFor(int64_t sequence) { return slots_[sequence % slots_.size()]; }
+    void EvictOldest();
+
+    std::vector<Slot> slots_;
+    size_t max_bytes_;
+    size_t bytes_{0};
+    int64_t first_sequence_{0};
+    int64_t last_sequence_{0};
+    bool closed_{false};
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+} // namespace kvstore
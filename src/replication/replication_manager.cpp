@@ -1,13 +1,158 @@
 #include "replication_manager.h"
+#include "../persistence/wal.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include <iostream>
 
 namespace kvstore {
 
-ReplicationManager::ReplicationManager(NodeRole role)
-    : role_(role) {
+namespace {
+
+constexpr std::chrono::milliseconds kStreamPollInterval(100);
+// How often a replica rechecks what it has applied while commands are in flight
+constexpr std::chrono::milliseconds kAckPollInterval(1);
+// A stream silent for longer than this (several missed heartbeats) no
+// longer counts as keeping the replica in sync
+constexpr int64_t kMasterSilenceMs = 1000;
+
+int64_t SteadyNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+constexpr size_t kMaxQueuedChunks = 16;
+
+// Loads full-resync chunks on a few threads while the transfer continues.
+// A partition's chunks always go to the same thread, so they are loaded in
+// order and its completion marker comes last.
+class ChunkLoader {
+public:
+    ChunkLoader(size_t threads, std::function<void(const SnapshotChunk&)> load)
+        : load_(std::move(load)) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+            workers_.back()->thread = std::thread(&ChunkLoader::Run, this, std::ref(*workers_.back()));
+        }
+    }
+    
+    ~ChunkLoader() {
+        Finish();
+    }
+    
+    // Blocks while the partition's thread is too far behind
+    void Add(SnapshotChunk chunk) {
+        Worker& worker = *workers_[static_cast<size_t>(chunk.partition()) % workers_.size()];
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.cv.wait(lock, [&worker] { return worker.queue.size() < kMaxQueuedChunks; });
+        worker.queue.push_back(std::move(chunk));
+        worker.cv.notify_all();
+    }
+    
+    // Load what is queued and stop the threads
+    void Finish() {
+        for (auto& worker : workers_) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->done = true;
+            }
+            worker->cv.notify_all();
+        }
+        for (auto& worker : workers_) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<SnapshotChunk> queue;
+        bool done{false};
+        std::thread thread;
+    };
+    
+    void Run(Worker& worker) {
+        while (true) {
+            SnapshotChunk chunk;
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.cv.wait(lock, [&worker] { return worker.done || !worker.queue.empty(); });
+                if (worker.queue.empty()) return;
+                chunk = std::move(worker.queue.front());
+                worker.queue.pop_front();
+            }
+            worker.cv.notify_all();
+            load_(chunk);
+        }
+    }
+    
+    std::function<void(const SnapshotChunk&)> load_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+} // namespace
+
+ReplicationManager::ReplicationManager(NodeRole role, const ReplicationOptions& options)
+    : role_(role),
+      options_(options),
+      backlog_(options.backlog_capacity, options.backlog_bytes) {
 }
 
 ReplicationManager::~ReplicationManager() {
+    Stop();
+}
+
+void ReplicationManager::Stop() {
+    std::vector<std::unique_ptr<ReplicaConnection>> replicas;
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        stopping_ = true;
+        replicas.swap(replicas_);
+    }
+    backlog_.Close();
+    {
+        std::lock_guard<std::mutex> lock(ack_mutex_);
+    }
+    ack_cv_.notify_all();
+    
+    for (auto& replica : replicas) {
+        StopReplica(*replica);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        if (stream_context_) {
+            stream_context_->TryCancel();
+        }
+        if (sync_context_) {
+            sync_context_->TryCancel();
+        }
+    }
+    stream_cv_.notify_all();
+    if (stream_thread_.joinable()) {
+        stream_thread_.join();
+    }
+}
+
+void ReplicationManager::StopReplica(ReplicaConnection& replica) {
+    {
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        replica.stopping = true;
+        if (replica.sync_context) {
+            replica.sync_context->TryCancel();
+        }
+    }
+    replica.cv.notify_all();
+    
+    if (replica.sender.joinable()) {
+        replica.sender.join();
+    }
+}
+
+void ReplicationManager::AttachLog(WriteAheadLog* log) {
+    log_ = log;
 }
 
 void ReplicationManager::SetRole(NodeRole role) {
@@ -22,11 +167,15 @@ void ReplicationManager::AddReplica(const std::string& replica_address) {
     }
 
     std::lock_guard<std::mutex> lock(replicas_mutex_);
+    if (stopping_) return;
     
     auto replica = std::make_unique<ReplicaConnection>();
     replica->address = replica_address;
     replica->channel = grpc::CreateChannel(replica_address, grpc::InsecureChannelCredentials());
     replica->stub = KeyValueStore::NewStub(replica->channel);
+    replica->metrics = std::make_shared<ReplicaMetrics>(replica_address, "push");
+    metrics_[replica_address] = replica->metrics;
+    replica->sender = std::thread(&ReplicationManager::SenderLoop, this, std::ref(*replica));
     
     replicas_.push_back(std::move(replica));
     
@@ -34,77 +183,809 @@ void ReplicationManager::AddReplica(const std::string& replica_address) {
 }
 
 void ReplicationManager::RemoveReplica(const std::string& replica_address) {
-    std::lock_guard<std::mutex> lock(replicas_mutex_);
-    
-    replicas_.erase(
-        std::remove_if(replicas_.begin(), replicas_.end(),
+    std::vector<std::unique_ptr<ReplicaConnection>> removed;
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        auto it = std::partition(replicas_.begin(), replicas_.end(),
             [&replica_address](const std::unique_ptr<ReplicaConnection>& r) {
-                return r->address == replica_address;
-            }),
-        replicas_.end()
-    );
+                return r->address != replica_address;
+            });
+        std::move(it, replicas_.end(), std::back_inserter(removed));
+        replicas_.erase(it, replicas_.end());
+        metrics_.erase(replica_address);
+    }
+    
+    // Joined outside replicas_mutex_ so Publish is not held up by an RPC in flight
+    for (auto& replica : removed) {
+        StopReplica(*replica);
+    }
     
     std::cout << "Removed replica: " << replica_address << std::endl;
 }
 
-void ReplicationManager::ReplicateSet(const std::string& key, const std::string& value) {
+void ReplicationManager::Publish(const ReplicationCommand& command) {
+    published_sequence_.store(command.sequence_id(), std::memory_order_relaxed);
+    if (!IsMaster() && !serving_streams_) return;
+    
+    backlog_.Append(command);
+    
+    // Pushing to replicas is left to the master
     if (!IsMaster()) return;
     
-    ReplicationCommand command;
-    command.set_type(ReplicationCommand::SET);
-    command.set_key(key);
-    command.set_value(value);
-    command.set_sequence_id(GetNextSequenceId());
+    std::lock_guard<std::mutex> lock(replicas_mutex_);
+    for (const auto& replica : replicas_) {
+        Enqueue(*replica, command);
+    }
+}
+
+void ReplicationManager::Enqueue(ReplicaConnection& replica, const ReplicationCommand& command) {
+    {
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        // A lagging replica reads from the log instead
+        if (replica.stopping || replica.lagging || replica.needs_resync) {
+            return;
+        }
+        
+        size_t size = command.ByteSizeLong();
+        if (replica.buffered_bytes + size > options_.max_buffer_bytes) {
+            replica.buffer.clear();
+            replica.buffered_bytes = 0;
+            replica.lagging = true;
+            std::cerr << "Replica " << replica.address << " is more than " << options_.max_buffer_bytes
+                      << " bytes behind; dropping its buffer, it will catch up from the log" << std::endl;
+        } else {
+            replica.buffer.push_back(command);
+            replica.buffered_bytes += size;
+        }
+    }
+    replica.cv.notify_one();
+}
+
+void ReplicationManager::SenderLoop(ReplicaConnection& replica) {
+    AdaptiveBatcher batcher(options_.max_batch_bytes, std::chrono::microseconds(options_.max_batch_linger_us));
+    ReplicationBatch batch;
+    bool lagging = false;
     
-    ReplicateCommand(command);
+    while (true) {
+        batch.Clear();
+        {
+            std::unique_lock<std::mutex> lock(replica.mutex);
+            replica.cv.wait(lock, [&replica] {
+                return replica.stopping || replica.needs_resync || replica.lagging || !replica.buffer.empty();
+            });
+            // While the replica is behind, give a partial batch a moment to fill
+            if (batcher.Linger().count() > 0) {
+                replica.cv.wait_for(lock, batcher.Linger(), [&replica, &batcher] {
+                    return replica.stopping || replica.needs_resync || replica.lagging ||
+                           replica.buffered_bytes >= batcher.BatchBytes();
+                });
+            }
+            if (replica.stopping) return;
+            lagging = replica.lagging;
+            
+            size_t bytes = 0;
+            while (!replica.buffer.empty() && bytes < batcher.BatchBytes()) {
+                ReplicationCommand& command = replica.buffer.front();
+                size_t size = command.ByteSizeLong();
+                bytes += size;
+                replica.buffered_bytes -= size;
+                // Already delivered while catching up
+                if (command.sequence_id() > replica.acked_sequence) {
+                    *batch.add_commands() = std::move(command);
+                }
+                replica.buffer.pop_front();
+            }
+        }
+        
+        bool ok = true;
+        if (replica.needs_resync) {
+            ok = RequestFullSync(replica);
+        } else if (lagging) {
+            ok = CatchUp(replica, replica.acked_sequence, std::numeric_limits<int64_t>::max());
+            if (ok) {
+                {
+                    std::lock_guard<std::mutex> lock(replica.mutex);
+                    replica.lagging = false;
+                }
+                // Commands logged before the flag was cleared were not buffered
+                WriteAheadLog* log = log_;
+                ok = CatchUp(replica, replica.acked_sequence, log ? log->LastSequence() : 0);
+                if (ok) {
+                    std::cout << "Replica " << replica.address << " caught up to sequence "
+                              << replica.acked_sequence << std::endl;
+                }
+            }
+        } else if (batch.commands_size() > 0) {
+            ok = SendToReplica(replica, batch);
+            if (ok) {
+                size_t pending;
+                {
+                    std::lock_guard<std::mutex> lock(replica.mutex);
+                    pending = replica.buffer.size();
+                }
+                batcher.Update(static_cast<size_t>(batch.commands_size()), pending);
+            }
+        }
+        
+        if (!ok) {
+            if (!lagging && !replica.needs_resync) {
+                std::cerr << "Lost contact with replica " << replica.address << " at sequence "
+                          << replica.acked_sequence << "; it will catch up from the log" << std::endl;
+            }
+            
+            std::unique_lock<std::mutex> lock(replica.mutex);
+            replica.buffer.clear();
+            replica.buffered_bytes = 0;
+            replica.lagging = !replica.needs_resync;
+            replica.cv.wait_for(lock, std::chrono::milliseconds(options_.retry_interval_ms),
+                                [&replica] { return replica.stopping; });
+        }
+    }
 }
 
-void ReplicationManager::ReplicateDelete(const std::string& key) {
-    if (!IsMaster()) return;
+bool ReplicationManager::CallReplicateBatch(ReplicaConnection& replica, const ReplicationBatch& batch,
+                                            ReplicationResponse& response) {
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() +
+                         std::chrono::milliseconds(options_.rpc_timeout_ms));
     
-    ReplicationCommand command;
-    command.set_type(ReplicationCommand::DELETE);
-    command.set_key(key);
-    command.set_sequence_id(GetNextSequenceId());
+    grpc::Status status = replica.stub->ReplicateBatch(&context, batch, &response);
+    ReplicaMetrics& metrics = *replica.metrics;
+    if (!status.ok()) {
+        metrics.connected = false;
+        return false;
+    }
+    if (!metrics.connected.exchange(true) && metrics.batches_sent > 0) {
+        metrics.reconnects++;
+    }
+    metrics.RecordBatch(static_cast<size_t>(batch.commands_size()), batch.ByteSizeLong(),
+                        batch.commands(batch.commands_size() - 1).sequence_id());
+    Acknowledge(replica.acked_sequence, response.last_applied_sequence());
+    metrics.RecordAck(response.last_applied_sequence(), published_sequence_.load(std::memory_order_relaxed));
+    return true;
+}
+
+bool ReplicationManager::SendToReplica(ReplicaConnection& replica, const ReplicationBatch& batch) {
+    ReplicationResponse response;
+    if (!CallReplicateBatch(replica, batch, response)) {
+        return false;
+    }
     
-    ReplicateCommand(command);
+    if (!response.success()) {
+        // The replica is missing earlier commands (it was down, or this is
+        // its first contact); resend them from the log. The replica may
+        // still be applying them, so acked_sequence can stay behind.
+        int64_t last = batch.commands(batch.commands_size() - 1).sequence_id();
+        return CatchUp(replica, response.last_applied_sequence(), last);
+    }
+    return true;
 }
 
-void ReplicationManager::ReplicateExpire(const std::string& key, int seconds) {
-    if (!IsMaster()) return;
+bool ReplicationManager::CatchUp(ReplicaConnection& replica, int64_t after, int64_t up_to) {
+    WriteAheadLog* log = log_;
+    ReplicationBatch batch;
+    size_t bytes = 0;
+    bool ok = true;
     
-    ReplicationCommand command;
-    command.set_type(ReplicationCommand::EXPIRE);
-    command.set_key(key);
-    command.set_seconds(seconds);
-    command.set_sequence_id(GetNextSequenceId());
+    // Catching up is throughput-bound, so batches are always full size
+    auto flush = [&] {
+        if (batch.commands_size() == 0) return true;
+        ReplicationResponse response;
+        bool sent = CallReplicateBatch(replica, batch, response) && response.success();
+        batch.Clear();
+        bytes = 0;
+        return sent;
+    };
+    
+    bool retained = log && log->Read(after, [&](const ReplicationCommand& command) {
+        if (command.sequence_id() > up_to) return false;
+        // The replica may report that it is already further along
+        if (command.sequence_id() <= replica.acked_sequence) return true;
+        
+        *batch.add_commands() = command;
+        bytes += command.ByteSizeLong();
+        if (bytes >= options_.max_batch_bytes && !flush()) {
+            ok = false;
+            return false;
+        }
+        return true;
+    });
     
-    ReplicateCommand(command);
+    if (!retained) {
+        replica.needs_resync = true;
+        std::cerr << "Replica " << replica.address << " needs commands after sequence " << after
+                  << " that are no longer in the log; a full resync is required" << std::endl;
+        return false;
+    }
+    
+    return ok && flush();
 }
 
-void ReplicationManager::ReplicateCommand(const ReplicationCommand& command) {
-    std::lock_guard<std::mutex> lock(replicas_mutex_);
+grpc::Status ReplicationManager::ServeStream(grpc::ServerContext* context,
+                                             grpc::ServerReaderWriter<ReplicationBatch, ReplicationStreamRequest>* stream) {
+    // A replica forwards what it has applied, under the master's sequence
+    // IDs, so sub-replicas resume from it exactly as from the master
+    serving_streams_ = true;
+    
+    ReplicationStreamRequest request;
+    if (!stream->Read(&request)) {
+        return grpc::Status(grpc::StatusCode::CANCELLED, "Replica closed the stream before starting it");
+    }
+    
+    int64_t next = std::max<int64_t>(request.start_sequence(), 1);
+    
+    // Consensus mode: the replica's last command must be the one this log
+    // holds at that sequence. It is not if a deposed leader logged it
+    // without reaching a majority, and the replica then needs a full resync.
+    if (log_terms_.term_at && request.tracks_terms() && log_terms_.term_at(next - 1) != request.last_term()) {
+        std::cout << "Replica " << request.replica_id() << " diverged at sequence " << next - 1
+                  << " (term " << request.last_term() << ")" << std::endl;
+        return grpc::Status(grpc::StatusCode::OUT_OF_RANGE, "Replica's log has diverged from this one");
+    }
+    std::cout << "Replica " << request.replica_id() << " streaming from sequence " << next << std::endl;
+    
+    StreamSession session;
+    session.replica_id = request.replica_id().empty() ? context->peer() : request.replica_id();
+    session.acked_sequence = next - 1;
+    {
+        // A replica keeps its metrics across reconnects
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        sessions_.push_back(&session);
+        auto& metrics = metrics_[session.replica_id];
+        if (metrics) {
+            metrics->reconnects++;
+        } else {
+            metrics = std::make_shared<ReplicaMetrics>(session.replica_id, "stream");
+        }
+        session.metrics = metrics;
+    }
+    ReplicaMetrics& metrics = *session.metrics;
+    metrics.connected = true;
+    metrics.sent_sequence = next - 1;
+    metrics.RecordAck(next - 1, published_sequence_.load(std::memory_order_relaxed));
+    
+    // The replica's acknowledgements are read on a second thread, started
+    // only once something has been sent: until then this handler can still
+    // return an error (OUT_OF_RANGE) without having to cancel the call
+    std::thread acks;
+    auto write = [&](const ReplicationBatch& batch) {
+        if (!acks.joinable()) {
+            acks = std::thread([this, stream, &session] {
+                ReplicationStreamRequest ack;
+                while (stream->Read(&ack)) {
+                    Acknowledge(session.acked_sequence, ack.ack_sequence());
+                    session.metrics->RecordAck(ack.ack_sequence(),
+                                               published_sequence_.load(std::memory_order_relaxed));
+                }
+            });
+        }
+        if (!stream->Write(batch)) {
+            return false;
+        }
+        if (batch.commands_size() > 0) {
+            metrics.RecordBatch(static_cast<size_t>(batch.commands_size()), batch.ByteSizeLong(),
+                                batch.commands(batch.commands_size() - 1).sequence_id());
+        } else {
+            // A heartbeat: a replica that confirmed everything is still caught up
+            if (session.acked_sequence >= published_sequence_.load(std::memory_order_relaxed)) {
+                metrics.caught_up_ms = SteadyNowMs();
+            }
+        }
+        return true;
+    };
     
+    grpc::Status status = StreamCommands(next, context, write);
+    
+    if (acks.joinable()) {
+        // Unblocks the reader; the replica reconnects and learns the outcome then
+        context->TryCancel();
+        acks.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        sessions_.erase(std::find(sessions_.begin(), sessions_.end(), &session));
+    }
+    metrics.connected = false;
+    return status;
+}
+
+grpc::Status ReplicationManager::StreamCommands(int64_t next, grpc::ServerContext* context,
+                                                const BatchWriter& write) {
+    AdaptiveBatcher batcher(options_.max_batch_bytes, std::chrono::microseconds(options_.max_batch_linger_us));
+    ReplicationBatch batch;
+    while (!stopping_ && !context->IsCancelled()) {
+        // Older than the backlog (the replica was away too long, or this
+        // master restarted): partial resync from the log
+        int64_t first = backlog_.FirstSequence();
+        WriteAheadLog* log = log_;
+        if ((first == 0 || next < first) && log && next <= log->LastSequence()) {
+            grpc::Status status = StreamFromLog(next, context, write);
+            if (!status.ok() || context->IsCancelled()) {
+                return status;
+            }
+            continue;
+        }
+        
+        batch.Clear();
+        ReplicationBacklog::ReadResult result = backlog_.Read(next, batcher.BatchBytes(), batch, kStreamPollInterval);
+        if (result == ReplicationBacklog::ReadResult::TOO_OLD) {
+            if (!log) {
+                return grpc::Status(grpc::StatusCode::OUT_OF_RANGE, "Sequence is no longer available");
+            }
+            continue;
+        }
+        if (result != ReplicationBacklog::ReadResult::OK) {
+            // Nothing new: an empty batch tells the replica it is still in
+            // sync, which a replica only vouches for while it is itself
+            batch.Clear();
+            if ((IsMaster() || CheckInSync()) && !write(batch)) {
+                return grpc::Status::OK;
+            }
+            continue;
+        }
+        
+        // While the replica is behind, give a partial batch a moment to fill
+        if (batcher.Linger().count() > 0) {
+            size_t bytes = batch.ByteSizeLong();
+            if (bytes < batcher.BatchBytes()) {
+                std::this_thread::sleep_for(batcher.Linger());
+                backlog_.Read(next + batch.commands_size(), batcher.BatchBytes() - bytes, batch,
+                              std::chrono::microseconds(0));
+            }
+        }
+        
+        if (!write(batch)) {
+            return grpc::Status::OK;
+        }
+        next = batch.commands(batch.commands_size() - 1).sequence_id() + 1;
+        batcher.Update(static_cast<size_t>(batch.commands_size()),
+                       static_cast<size_t>(std::max<int64_t>(backlog_.LastSequence() - next + 1, 0)));
+    }
+    
+    return grpc::Status::OK;
+}
+
+grpc::Status ReplicationManager::StreamFromLog(int64_t& next, grpc::ServerContext* context,
+                                               const BatchWriter& write) {
+    WriteAheadLog* log = log_;
+    ReplicationBatch batch;
+    size_t bytes = 0;
+    bool write_failed = false;
+    
+    auto flush = [&] {
+        if (batch.commands_size() == 0) return true;
+        if (stopping_ || !write(batch)) {
+            write_failed = true;
+            return false;
+        }
+        next = batch.commands(batch.commands_size() - 1).sequence_id() + 1;
+        batch.Clear();
+        bytes = 0;
+        return true;
+    };
+    
+    bool retained = log->Read(next - 1, [&](const ReplicationCommand& command) {
+        *batch.add_commands() = command;
+        bytes += command.ByteSizeLong();
+        if (bytes >= options_.max_batch_bytes && !flush()) {
+            return false;
+        }
+        
+        // Switch back to memory as soon as the backlog covers the rest
+        int64_t first = backlog_.FirstSequence();
+        return first == 0 || command.sequence_id() + 1 < first;
+    });
+    
+    if (!retained) {
+        std::cerr << "Replica requested sequence " << next << ", which is no longer in the log" << std::endl;
+        return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                            "Sequence " + std::to_string(next) + " is no longer available; a full resync is required");
+    }
+    if (!write_failed) {
+        flush();
+    }
+    if (write_failed) {
+        context->TryCancel();
+    }
+    return grpc::Status::OK;
+}
+
+void ReplicationManager::Acknowledge(std::atomic<int64_t>& acked_sequence, int64_t sequence) {
+    {
+        // Under ack_mutex_ so a waiter cannot miss it between counting and sleeping
+        std::lock_guard<std::mutex> lock(ack_mutex_);
+        acked_sequence = sequence;
+    }
+    ack_cv_.notify_all();
+}
+
+int ReplicationManager::CountAcknowledged(int64_t sequence) {
+    std::lock_guard<std::mutex> lock(replicas_mutex_);
+    int count = 0;
     for (const auto& replica : replicas_) {
+        if (replica->acked_sequence >= sequence) ++count;
+    }
+    for (const StreamSession* session : sessions_) {
+        if (session->acked_sequence >= sequence) ++count;
+    }
+    return count;
+}
+
+int ReplicationManager::WaitForReplicas(int64_t sequence, int replicas,
+                                        std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(ack_mutex_);
+    int count = 0;
+    ack_cv_.wait_until(lock, deadline, [&] {
+        count = CountAcknowledged(sequence);
+        return count >= replicas || stopping_;
+    });
+    return count;
+}
+
+void ReplicationManager::NoteReceived(int64_t sequence) {
+    int64_t received = received_sequence_;
+    while (sequence > received && !received_sequence_.compare_exchange_weak(received, sequence)) {
+    }
+    CheckInSync();
+}
+
+bool ReplicationManager::CheckInSync() {
+    if (!handlers_.last_applied) return false;
+    // A pushed replica cannot tell a quiet master from a lost one
+    int64_t last_heard = last_heard_ms_;
+    if (options_.stream_from_master && (last_heard < 0 || SteadyNowMs() - last_heard > kMasterSilenceMs)) {
+        return false;
+    }
+    if (handlers_.last_applied() < received_sequence_) return false;
+    synced_at_ms_ = SteadyNowMs();
+    return true;
+}
+
+int64_t ReplicationManager::ReplicationLagMs() {
+    if (IsMaster() || CheckInSync()) return 0;
+    int64_t synced_at = synced_at_ms_;
+    return synced_at < 0 ? -1 : SteadyNowMs() - synced_at;
+}
+
+std::vector<ReplicaStats> ReplicationManager::GetReplicaStats() {
+    std::vector<std::shared_ptr<ReplicaMetrics>> replicas;
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        for (const auto& [id, metrics] : metrics_) {
+            replicas.push_back(metrics);
+        }
+    }
+    
+    // Commands recovered at startup were never published
+    int64_t last_logged = published_sequence_;
+    WriteAheadLog* log = log_;
+    if (log) {
+        last_logged = std::max(last_logged, log->LastSequence());
+    }
+    
+    std::vector<ReplicaStats> stats;
+    int64_t now = SteadyNowMs();
+    for (const auto& metrics : replicas) {
+        ReplicaStats replica;
+        int64_t acked = metrics->acked_sequence;
+        replica.set_replica_id(metrics->replica_id);
+        replica.set_mode(metrics->mode);
+        replica.set_connected(metrics->connected);
+        replica.set_acked_sequence(acked);
+        replica.set_lag_sequences(std::max<int64_t>(last_logged - acked, 0));
+        if (acked >= last_logged) {
+            // Idle replicas send no acknowledgements; keep this fresh for them
+            metrics->caught_up_ms = now;
+            replica.set_lag_ms(0);
+        } else {
+            int64_t caught_up = metrics->caught_up_ms;
+            replica.set_lag_ms(caught_up < 0 ? -1 : now - caught_up);
+        }
+        replica.set_bytes_per_second(metrics->BytesPerSecond());
+        replica.set_bytes_sent(metrics->bytes_sent);
+        replica.set_commands_sent(metrics->commands_sent);
+        replica.set_batches_sent(metrics->batches_sent);
+        replica.set_reconnects(metrics->reconnects);
+        replica.set_queue_depth(std::max<int64_t>(last_logged - metrics->sent_sequence, 0));
+        for (const auto& count : metrics->batch_sizes) {
+            replica.add_batch_sizes(count);
+        }
+        stats.push_back(std::move(replica));
+    }
+    return stats;
+}
+
+void ReplicationManager::SetReplicaHandlers(const std::string& replica_id, ReplicaHandlers handlers) {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    replica_id_ = replica_id;
+    handlers_ = std::move(handlers);
+}
+
+void ReplicationManager::SetLogTerms(LogTerms terms) {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    log_terms_ = std::move(terms);
+}
+
+void ReplicationManager::StartStreaming() {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    if (stopping_ || stream_thread_.joinable() || master_address_.empty() || !handlers_.apply) {
+        return;
+    }
+    stream_thread_ = std::thread(&ReplicationManager::StreamLoop, this);
+}
+
+void ReplicationManager::StopStreaming() {
+    std::thread stream;
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        stream_stopping_ = true;
+        if (stream_context_) {
+            stream_context_->TryCancel();
+        }
+        if (sync_context_) {
+            sync_context_->TryCancel();
+        }
+        stream = std::move(stream_thread_);
+    }
+    stream_cv_.notify_all();
+    if (stream.joinable()) {
+        stream.join();
+    }
+    stream_stopping_ = false;
+}
+
+void ReplicationManager::StreamLoop() {
+    // The stream stays with this master; a new one restarts streaming
+    const std::string master_address = GetMasterAddress();
+    auto channel = grpc::CreateChannel(master_address, grpc::InsecureChannelCredentials());
+    auto stub = KeyValueStore::NewStub(channel);
+    bool reported = false;
+    
+    while (!StreamStopping()) {
+        // A copy that was cut short left the dataset incomplete
+        if (full_sync_pending_ && !FullSync()) {
+            std::unique_lock<std::mutex> lock(stream_mutex_);
+            stream_cv_.wait_for(lock, std::chrono::milliseconds(options_.retry_interval_ms),
+                                [this] { return StreamStopping(); });
+            continue;
+        }
+        
+        ReplicationStreamRequest request;
+        request.set_start_sequence(handlers_.last_applied() + 1);
+        request.set_replica_id(replica_id_);
+        if (log_terms_.term_at) {
+            request.set_tracks_terms(true);
+            request.set_last_term(log_terms_.term_at(request.start_sequence() - 1));
+        }
+        
         grpc::ClientContext context;
-        ReplicationResponse response;
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            if (StreamStopping()) return;
+            stream_context_ = &context;
+        }
+        
+        auto stream = stub->StreamReplication(&context);
+        stream->Write(request);
         
-        grpc::Status status = replica->stub->ReplicateCommand(&context, command, &response);
+        // Acknowledge what has been applied on the same stream. Applied can
+        // trail received while worker threads are busy, so it is polled
+        // until it catches up.
+        std::mutex ack_mutex;
+        std::condition_variable ack_cv;
+        bool done = false;
+        int64_t last_received = request.start_sequence() - 1;
+        std::thread acker([&] {
+            int64_t acked = last_received;
+            while (true) {
+                int64_t received;
+                {
+                    std::unique_lock<std::mutex> lock(ack_mutex);
+                    ack_cv.wait(lock, [&] { return done || acked < last_received; });
+                    if (done) return;
+                    received = last_received;
+                }
+                int64_t applied = handlers_.last_applied();
+                if (applied >= received) {
+                    CheckInSync();
+                }
+                if (applied > acked) {
+                    ReplicationStreamRequest ack;
+                    ack.set_ack_sequence(applied);
+                    if (!stream->Write(ack)) return;
+                    acked = applied;
+                }
+                if (acked < received) {
+                    std::unique_lock<std::mutex> lock(ack_mutex);
+                    ack_cv.wait_for(lock, kAckPollInterval, [&] { return done; });
+                }
+            }
+        });
+        
+        ReplicationBatch batch;
+        int64_t received = 0;
+        bool gap = false;
+        while (stream->Read(&batch)) {
+            last_heard_ms_ = SteadyNowMs();
+            if (batch.commands_size() == 0) {
+                CheckInSync();
+                continue;
+            }
+            if (received++ == 0) {
+                std::cout << "Streaming from master " << master_address << " at sequence "
+                          << batch.commands(0).sequence_id() << std::endl;
+                reported = false;
+            }
+            if (!handlers_.apply(batch)) {
+                // Reconnect from what was actually applied
+                gap = true;
+                context.TryCancel();
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(ack_mutex);
+                last_received = batch.commands(batch.commands_size() - 1).sequence_id();
+            }
+            ack_cv.notify_one();
+            NoteReceived(last_received);
+        }
+        // Until it reconnects, the replica's data ages from its last sync
+        CheckInSync();
+        last_heard_ms_ = -1;
+        {
+            std::lock_guard<std::mutex> lock(ack_mutex);
+            done = true;
+        }
+        ack_cv.notify_one();
+        acker.join();
+        stream->WritesDone();
+        grpc::Status status = stream->Finish();
+        
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            stream_context_ = nullptr;
+        }
+        if (StreamStopping()) return;
+        
+        bool retry_now = gap;
+        if (status.error_code() == grpc::StatusCode::OUT_OF_RANGE) {
+            std::cerr << "Master " << master_address << " cannot resume from sequence "
+                      << request.start_sequence() << " (" << status.error_message()
+                      << "); starting a full resync" << std::endl;
+            retry_now = FullSync();
+        } else if (!gap && !reported) {
+            std::cerr << "Replication stream from " << master_address << " ended: "
+                      << (status.ok() ? "closed by master" : status.error_message())
+                      << "; reconnecting" << std::endl;
+            reported = true;
+        }
+        
+        std::unique_lock<std::mutex> lock(stream_mutex_);
+        stream_cv_.wait_for(lock, std::chrono::milliseconds(retry_now ? 0 : options_.retry_interval_ms),
+                            [this] { return StreamStopping(); });
+    }
+}
+
+bool ReplicationManager::FullSync() {
+    std::lock_guard<std::mutex> sync_lock(full_sync_mutex_);
+    const std::string master_address = GetMasterAddress();
+    if (StreamStopping() || !handlers_.begin_full_sync || master_address.empty()) {
+        return false;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    auto channel = grpc::CreateChannel(master_address, grpc::InsecureChannelCredentials());
+    auto stub = KeyValueStore::NewStub(channel);
+    
+    grpc::ClientContext context;
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        if (StreamStopping()) return false;
+        sync_context_ = &context;
+    }
+    
+    std::cout << "Full resync from master " << master_address << " started" << std::endl;
+    handlers_.begin_full_sync();
+    full_sync_pending_ = true;
+    
+    FullSyncRequest request;
+    request.set_replica_id(replica_id_);
+    auto reader = stub->FullSync(&context, request);
+    
+    int64_t sequence = -1;
+    int64_t term = 0;
+    size_t keys = 0;
+    {
+        size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 2, 8);
+        ChunkLoader loader(threads, handlers_.load_chunk);
         
-        if (!status.ok()) {
-            std::cerr << "Failed to replicate to " << replica->address 
-                      << ": " << status.error_message() << std::endl;
+        SnapshotChunk chunk;
+        while (reader->Read(&chunk)) {
+            sequence = chunk.sequence();
+            term = chunk.term();
+            keys += chunk.entries_size();
+            loader.Add(std::move(chunk));
+            chunk.Clear();
         }
     }
+    grpc::Status status = reader->Finish();
+    
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        sync_context_ = nullptr;
+    }
+    
+    if (!status.ok() || sequence < 0) {
+        std::cerr << "Full resync from " << master_address << " failed: "
+                  << (status.ok() ? "no data received" : status.error_message()) << std::endl;
+        return false;
+    }
+    
+    handlers_.finish_full_sync(sequence);
+    if (log_terms_.reset) {
+        log_terms_.reset(term, sequence);
+    }
+    full_sync_pending_ = false;
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Full resync complete: " << keys << " keys at sequence " << sequence
+              << " in " << elapsed.count() << " ms" << std::endl;
+    return true;
 }
 
-int64_t ReplicationManager::GetNextSequenceId() {
-    return sequence_counter_.fetch_add(1);
+bool ReplicationManager::RequestFullSync(ReplicaConnection& replica) {
+    ReplicationCommand command;
+    command.set_type(ReplicationCommand::FULL_SYNC);
+    
+    // The replica answers once it has loaded the whole copy, so the
+    // deadline is generous; StopReplica() cancels the call sooner
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() +
+                         std::chrono::milliseconds(options_.full_sync_timeout_ms));
+    {
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        if (replica.stopping) return false;
+        replica.sync_context = &context;
+    }
+    
+    ReplicationResponse response;
+    grpc::Status status = replica.stub->ReplicateCommand(&context, command, &response);
+    {
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        replica.sync_context = nullptr;
+    }
+    if (!status.ok() || !response.success()) {
+        if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+            std::cerr << "Replica " << replica.address << " did not load a full copy within "
+                      << options_.full_sync_timeout_ms << " ms" << std::endl;
+        }
+        return false;
+    }
+    
+    Acknowledge(replica.acked_sequence, response.last_applied_sequence());
+    replica.metrics->RecordAck(response.last_applied_sequence(), published_sequence_.load(std::memory_order_relaxed));
+    replica.needs_resync = false;
+    {
+        // Resume with the commands after the copy's sequence
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        replica.lagging = true;
+    }
+    std::cout << "Replica " << replica.address << " loaded a full copy at sequence "
+              << replica.acked_sequence << std::endl;
+    return true;
 }
 
 void ReplicationManager::SetMasterAddress(const std::string& master_address) {
-    master_address_ = master_address;
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        master_address_ = master_address;
+    }
     std::cout << "Master address set to: " << master_address << std::endl;
 }
 
+std::string ReplicationManager::GetMasterAddress() const {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    return master_address_;
+}
+
 } // namespace kvstore
@@ -5,8 +5,17 @@
 #include <memory>
 #include <mutex>
 #include <atomic>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <map>
 #include <grpcpp/grpcpp.h>
 #include "kvstore.grpc.pb.h"
+#include "replication_backlog.h"
+#include "adaptive_batcher.h"
+#include "replication_metrics.h"
 
 namespace kvstore {
 
@@ -15,41 +24,241 @@ enum class NodeRole {
     REPLICA
 };
 
+struct ReplicationOptions {
+    // Commands buffered per replica before it is disconnected and has to
+    // catch up from the log
+    size_t max_buffer_bytes = 64ull << 20;
+    int rpc_timeout_ms = 5000;
+    // How long a pushed-to replica may take to fetch and load a full copy
+    int full_sync_timeout_ms = 10 * 60 * 1000;
+    // Wait before retrying an unreachable replica or master
+    int retry_interval_ms = 1000;
+    // Upper bounds for adaptive batching: commands per message (by encoded
+    // size) and how long a sender may wait for a partial batch to fill
+    size_t max_batch_bytes = 1 << 20;
+    int max_batch_linger_us = 2000;
+    // Recent commands kept in memory for streaming replicas
+    size_t backlog_capacity = 1 << 20;
+    size_t backlog_bytes = 64ull << 20;
+    // Replicas pull from the master over StreamReplication; when false they
+    // wait for the master to push to them (--replicas on the master)
+    bool stream_from_master = true;
+};
+
+class WriteAheadLog;
+
 class ReplicationManager {
 public:
-    explicit ReplicationManager(NodeRole role);
+    // How a replica applies what it receives from its master
+    struct ReplicaHandlers {
+        // Apply consecutive commands; false if earlier ones are missing
+        std::function<bool(const ReplicationBatch& batch)> apply;
+        std::function<int64_t()> last_applied;
+        
+        // Full resync: discard the dataset, load the master's chunks (called
+        // from several threads, each partition's chunks in order on one of
+        // them), then continue from the copy's sequence
+        std::function<void()> begin_full_sync;
+        std::function<void(const SnapshotChunk& chunk)> load_chunk;
+        std::function<void(int64_t sequence)> finish_full_sync;
+    };
+    
+    // Consensus mode: the terms of logged commands, so that a replica whose
+    // log has diverged from its new master's is resynced rather than resumed
+    struct LogTerms {
+        // Term of the logged command at `sequence`; -1 if the log does not hold it
+        std::function<int64_t(int64_t sequence)> term_at;
+        // A full resync restarted the log after `sequence`, logged in `term`
+        std::function<void(int64_t term, int64_t sequence)> reset;
+    };
+
+    explicit ReplicationManager(NodeRole role, const ReplicationOptions& options = ReplicationOptions());
     ~ReplicationManager();
 
     void SetRole(NodeRole role);
     NodeRole GetRole() const { return role_; }
     bool IsMaster() const { return role_ == NodeRole::MASTER; }
     bool IsReplica() const { return role_ == NodeRole::REPLICA; }
+    
+    // Log that published commands come from; replicas that fall behind are
+    // caught up by reading it
+    void AttachLog(WriteAheadLog* log);
+    
+    // Buffer a logged command for every replica and streaming sub-replica.
+    // Called by the log in sequence order, so it never blocks on the network.
+    void Publish(const ReplicationCommand& command);
+    
+    // Stop the sender threads and end replication streams; buffered
+    // commands are dropped
+    void Stop();
+    
+    /**
+     * Upstream side of StreamReplication, on a master or on a replica
+     * chaining to sub-replicas: after the replica's first message, send
+     * every command from its start_sequence() on, then keep the stream open
+     * and send new ones as they are logged, batched adaptively. Commands
+     * still in the backlog are sent from memory; older ones are read from
+     * the log. The replica's later messages acknowledge what it has applied.
+     * @return OUT_OF_RANGE if the log no longer holds the start sequence, or
+     *         (consensus mode) holds it under a different term
+     */
+    grpc::Status ServeStream(grpc::ServerContext* context,
+                             grpc::ServerReaderWriter<ReplicationBatch, ReplicationStreamRequest>* stream);
+    
+    /**
+     * Master side: block until `replicas` replicas have acknowledged every
+     * command up to `sequence`, or until the deadline
+     * @return Replicas that have acknowledged it
+     */
+    int WaitForReplicas(int64_t sequence, int replicas, std::chrono::steady_clock::time_point deadline);
+    
+    /**
+     * Replica side: record that commands up to `sequence` were received
+     * from the master (push mode; streamed batches are recorded internally)
+     */
+    void NoteReceived(int64_t sequence);
+    
+    /**
+     * How stale this node's data may be: 0 on a master, or on a replica
+     * that has applied everything received over a live stream; otherwise
+     * the milliseconds since that was last true, or -1 if it never was
+     */
+    int64_t ReplicationLagMs();
+    
+    /**
+     * Progress of every replica this node has replicated to: pushed-to
+     * replicas and streaming (sub-)replicas, including disconnected ones,
+     * read without taking any lock a write takes
+     */
+    std::vector<ReplicaStats> GetReplicaStats();
+    
+    // Replica side: how commands and full copies from the master are applied
+    void SetReplicaHandlers(const std::string& replica_id, ReplicaHandlers handlers);
+    void SetLogTerms(LogTerms terms);
+    
+    /**
+     * Replica side: keep a stream open to the master address, applying each
+     * command and acknowledging last_applied() as it advances, and reconnect
+     * from last_applied() + 1 when it drops. If the
+     * master no longer has that sequence, a full resync is run first.
+     */
+    void StartStreaming();
+    
+    /**
+     * Replica side: close the stream to the master, cancelling a full
+     * resync in progress (it is rerun when streaming starts again), and
+     * wait for the stream thread to exit
+     */
+    void StopStreaming();
+    
+    /**
+     * Replica side: replace the dataset with a copy of the master's, loading
+     * chunks on several threads while the transfer runs
+     * @return false if the transfer failed; the dataset is then incomplete
+     *         and a retry is needed
+     */
+    bool FullSync();
 
     void AddReplica(const std::string& replica_address);
     void RemoveReplica(const std::string& replica_address);
     
-    void ReplicateSet(const std::string& key, const std::string& value);
-    void ReplicateDelete(const std::string& key);
-    void ReplicateExpire(const std::string& key, int seconds);
-
     void SetMasterAddress(const std::string& master_address);
-    std::string GetMasterAddress() const { return master_address_; }
+    std::string GetMasterAddress() const;
 
 private:
+    /**
+     * One replica and its sender thread
+     * Published commands are buffered here and drained by the sender in
+     * adaptively sized batches, so a slow replica only delays itself. If the buffer outgrows
+     * max_buffer_bytes, or an RPC fails, the buffer is dropped and the
+     * replica is marked lagging: the sender then resends from the log,
+     * starting after acked_sequence.
+     */
     struct ReplicaConnection {
         std::string address;
         std::shared_ptr<grpc::Channel> channel;
         std::unique_ptr<KeyValueStore::Stub> stub;
+        
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<ReplicationCommand> buffer;
+        size_t buffered_bytes{0};
+        bool lagging{false};
+        bool stopping{false};
+        grpc::ClientContext* sync_context{nullptr};  // Full resync request in flight, cancelled on stop
+        
+        std::atomic<int64_t> acked_sequence{0};  // Last sequence the replica confirmed
+        std::atomic<bool> needs_resync{false};   // Missing commands the log no longer holds
+        std::shared_ptr<ReplicaMetrics> metrics;
+        std::thread sender;
     };
 
-    void ReplicateCommand(const ReplicationCommand& command);
-    int64_t GetNextSequenceId();
+    // A replica connected over StreamReplication
+    struct StreamSession {
+        std::string replica_id;
+        std::atomic<int64_t> acked_sequence{0};
+        std::shared_ptr<ReplicaMetrics> metrics;
+    };
+    
+    using BatchWriter = std::function<bool(const ReplicationBatch& batch)>;
+    
+    void StreamLoop();
+    bool StreamStopping() const { return stopping_ || stream_stopping_; }
+    // Send from `next` on until the stream ends
+    grpc::Status StreamCommands(int64_t next, grpc::ServerContext* context, const BatchWriter& write);
+    // Stream the records from `next` on from the log until they reach the backlog
+    grpc::Status StreamFromLog(int64_t& next, grpc::ServerContext* context, const BatchWriter& write);
+    // Record a replica's acknowledgement and wake WaitForReplicas()
+    void Acknowledge(std::atomic<int64_t>& acked_sequence, int64_t sequence);
+    int CountAcknowledged(int64_t sequence);
+    // Replica: refresh synced_at_ms_ if everything received has been applied
+    bool CheckInSync();
+    void Enqueue(ReplicaConnection& replica, const ReplicationCommand& command);
+    void SenderLoop(ReplicaConnection& replica);
+    // Send a batch, catching the replica up from the log if it reports a gap
+    bool SendToReplica(ReplicaConnection& replica, const ReplicationBatch& batch);
+    // One ReplicateBatch call; false if the RPC itself failed
+    bool CallReplicateBatch(ReplicaConnection& replica, const ReplicationBatch& batch,
+                            ReplicationResponse& response);
+    bool CatchUp(ReplicaConnection& replica, int64_t after, int64_t up_to);
+    // Push mode: have the replica fetch a full copy, then resume after it
+    bool RequestFullSync(ReplicaConnection& replica);
+    static void StopReplica(ReplicaConnection& replica);
 
-    NodeRole role_;
-    std::string master_address_;
+    std::atomic<NodeRole> role_;
+    ReplicationOptions options_;
+    std::string master_address_;       // Guarded by stream_mutex_
     std::vector<std::unique_ptr<ReplicaConnection>> replicas_;
-    std::mutex replicas_mutex_;
-    std::atomic<int64_t> sequence_counter_{0};
+    std::vector<StreamSession*> sessions_;
+    // By replica address (push) or ID (stream); kept after a disconnect
+    std::map<std::string, std::shared_ptr<ReplicaMetrics>> metrics_;
+    std::mutex replicas_mutex_;         // Guards replicas_, sessions_ and metrics_
+    std::mutex ack_mutex_;
+    std::condition_variable ack_cv_;
+    std::atomic<WriteAheadLog*> log_{nullptr};
+    std::atomic<bool> stopping_{false};
+    std::atomic<int64_t> published_sequence_{0};  // Last command published
+    
+    ReplicationBacklog backlog_;
+    // A replica fills the backlog only once a sub-replica has connected
+    std::atomic<bool> serving_streams_{false};
+    
+    // Replica's stream from the master
+    std::string replica_id_;
+    ReplicaHandlers handlers_;
+    LogTerms log_terms_;
+    std::thread stream_thread_;
+    std::atomic<bool> stream_stopping_{false};
+    std::atomic<bool> full_sync_pending_{false};  // A full resync began and has not completed
+    mutable std::mutex stream_mutex_;
+    std::condition_variable stream_cv_;
+    grpc::ClientContext* stream_context_{nullptr};
+    grpc::ClientContext* sync_context_{nullptr};
+    // Replica's replication lag
+    std::atomic<int64_t> last_heard_ms_{-1};  // Last batch or heartbeat on the stream; -1 = not connected
+    std::atomic<int64_t> received_sequence_{0};
+    std::atomic<int64_t> synced_at_ms_{-1};  // Steady clock; -1 = never in sync
+    std::mutex full_sync_mutex_;        // One full resync at a time
 };
 
 } // namespace kvstore
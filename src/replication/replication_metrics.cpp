@@ -0,0 +1,59 @@
+#include "replication_metrics.h"
+#include <chrono>
+
+namespace kvstore {
+
+namespace {
+
+int64_t SteadyNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+size_t ReplicaMetrics::BatchSizeBucket(size_t commands) {
+    size_t bucket = 0;
+    while (bucket + 1 < kBatchSizeBuckets && (size_t{1} << bucket) < commands) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+void ReplicaMetrics::RecordBatch(size_t commands, size_t bytes, int64_t last_sequence) {
+    sent_sequence.store(last_sequence, std::memory_order_relaxed);
+    bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+    commands_sent.fetch_add(commands, std::memory_order_relaxed);
+    batches_sent.fetch_add(1, std::memory_order_relaxed);
+    batch_sizes[BatchSizeBucket(commands)].fetch_add(1, std::memory_order_relaxed);
+    
+    // One sending thread per replica, so the window needs no lock
+    int64_t now = SteadyNowMs();
+    int64_t start = window_start_ms_.load(std::memory_order_relaxed);
+    uint64_t window = window_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (start < 0) {
+        window_start_ms_.store(now, std::memory_order_relaxed);
+    } else if (now - start >= kRateWindowMs) {
+        bytes_per_second_.store(window * 1000 / static_cast<uint64_t>(now - start), std::memory_order_relaxed);
+        window_bytes_.store(0, std::memory_order_relaxed);
+        window_start_ms_.store(now, std::memory_order_relaxed);
+    }
+}
+
+void ReplicaMetrics::RecordAck(int64_t sequence, int64_t last_logged) {
+    acked_sequence.store(sequence, std::memory_order_relaxed);
+    if (sequence >= last_logged) {
+        caught_up_ms.store(SteadyNowMs(), std::memory_order_relaxed);
+    }
+}
+
+uint64_t ReplicaMetrics::BytesPerSecond() const {
+    // Nothing sent for a whole window since the last rate was taken
+    int64_t start = window_start_ms_.load(std::memory_order_relaxed);
+    if (start < 0 || SteadyNowMs() - start >= 2 * kRateWindowMs) {
+        return 0;
+    }
+    return bytes_per_second_.load(std::memory_order_relaxed);
+}
+
+} // namespace kvstore
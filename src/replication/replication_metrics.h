@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+namespace kvstore {
+
+/**
+ * Counters for one replica, as its master (or chaining replica) sees it
+ *
+ * Written only by the threads that talk to that replica: the sender (push
+ * mode) or the stream handler and its acknowledgement reader (stream mode).
+ * Every field is atomic, so stats are read without a lock and nothing is
+ * added to the path a write takes through the log.
+ */
+struct ReplicaMetrics {
+    // Batches of up to 1, 2, 4, ... 1024 commands, then larger ones
+    static constexpr size_t kBatchSizeBuckets = 12;
+    // Throughput is averaged over windows of this length
+    static constexpr int64_t kRateWindowMs = 1000;
+
+    ReplicaMetrics(std::string replica_id, std::string mode)
+        : replica_id(std::move(replica_id)), mode(std::move(mode)) {}
+
+    // Record a batch the replica was sent, ending at `last_sequence`
+    void RecordBatch(size_t commands, size_t bytes, int64_t last_sequence);
+    // Record an acknowledgement; `last_logged` is the log's last sequence then
+    void RecordAck(int64_t sequence, int64_t last_logged);
+    // Bytes sent per second over the last complete window (0 once idle)
+    uint64_t BytesPerSecond() const;
+
+    static size_t BatchSizeBucket(size_t commands);
+
+    const std::string replica_id;
+    const std::string mode;                  // "stream" or "push"
+    std::atomic<bool> connected{false};
+    std::atomic<int64_t> sent_sequence{0};   // Last sequence sent
+    std::atomic<int64_t> acked_sequence{0};  // Last sequence the replica confirmed
+    std::atomic<int64_t> caught_up_ms{-1};   // Steady clock; last ack of everything logged, -1 = never
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> commands_sent{0};
+    std::atomic<uint64_t> batches_sent{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::array<std::atomic<uint64_t>, kBatchSizeBuckets> batch_sizes{};
+
+private:
+    std::atomic<int64_t> window_start_ms_{-1};
+    std::atomic<uint64_t> window_bytes_{0};
+    std::atomic<uint64_t> bytes_per_second_{0};
+};
+
+} // namespace kvstore
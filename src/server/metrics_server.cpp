@@ -0,0 +1,193 @@
+#include "metrics_server.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+namespace kvstore {
+
+namespace {
+
+constexpr int kAcceptPollMs = 100;
+constexpr int kReadTimeoutMs = 1000;
+constexpr size_t kMaxRequestBytes = 8 << 10;
+
+void WriteAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        written += static_cast<size_t>(n);
+    }
+}
+
+std::string Response(const std::string& status, const std::string& body) {
+    return "HTTP/1.1 " + status + "\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+           "Connection: close\r\n\r\n" + body;
+}
+
+// Quote a label value
+std::string Label(const std::string& value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '\\' || c == '"') quoted += '\\';
+        if (c == '\n') {
+            quoted += "\\n";
+            continue;
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+} // namespace
+
+MetricsServer::MetricsServer(int port, std::function<std::string()> render)
+    : port_(port), render_(std::move(render)) {
+}
+
+MetricsServer::~MetricsServer() {
+    Stop();
+}
+
+bool MetricsServer::Start() {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+        std::cerr << "Metrics endpoint: socket failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(port_));
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(listen_fd_, 16) < 0) {
+        std::cerr << "Metrics endpoint: cannot listen on port " << port_ << ": "
+                  << std::strerror(errno) << std::endl;
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    
+    thread_ = std::thread(&MetricsServer::Run, this);
+    std::cout << "Metrics endpoint on port " << port_ << " (/metrics)" << std::endl;
+    return true;
+}
+
+void MetricsServer::Stop() {
+    stopping_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+}
+
+void MetricsServer::Run() {
+    while (!stopping_) {
+        pollfd listener{listen_fd_, POLLIN, 0};
+        if (poll(&listener, 1, kAcceptPollMs) <= 0) continue;
+        int connection = accept(listen_fd_, nullptr, nullptr);
+        if (connection < 0) continue;
+        Serve(connection);
+        close(connection);
+    }
+}
+
+void MetricsServer::Serve(int connection) {
+    // Only the request line matters; read until the end of the headers
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < kMaxRequestBytes) {
+        pollfd readable{connection, POLLIN, 0};
+        if (poll(&readable, 1, kReadTimeoutMs) <= 0) return;
+        ssize_t n = recv(connection, buffer, sizeof(buffer), 0);
+        if (n <= 0) break;
+        request.append(buffer, static_cast<size_t>(n));
+    }
+    
+    std::istringstream line(request.substr(0, request.find("\r\n")));
+    std::string method, path;
+    line >> method >> path;
+    if (method != "GET") {
+        WriteAll(connection, Response("405 Method Not Allowed", "Only GET is supported\n"));
+    } else if (path != "/metrics" && path != "/") {
+        WriteAll(connection, Response("404 Not Found", "Metrics are served at /metrics\n"));
+    } else {
+        WriteAll(connection, Response("200 OK", render_()));
+    }
+}
+
+std::string FormatMetrics(const StatsResponse& stats) {
+    std::ostringstream out;
+    auto gauge = [&out](const char* name, const char* help, int64_t value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " gauge\n"
+            << name << " " << value << "\n";
+    };
+    gauge("kvstore_keys", "Keys stored on this node.", stats.key_count());
+    gauge("kvstore_is_master", "1 if this node takes writes.", stats.role() == "master" ? 1 : 0);
+    gauge("kvstore_last_sequence", "Last sequence in this node's log.", stats.last_sequence());
+    if (stats.replicas_size() == 0) {
+        return out.str();
+    }
+    
+    // One family at a time, with a sample per replica
+    auto family = [&](const char* name, const char* type, const char* help, auto value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " " << type << "\n";
+        for (const ReplicaStats& replica : stats.replicas()) {
+            out << name << "{replica=" << Label(replica.replica_id()) << ",mode=" << Label(replica.mode())
+                << "} " << value(replica) << "\n";
+        }
+    };
+    family("kvstore_replica_connected", "gauge", "1 while the replica is connected.",
+           [](const ReplicaStats& r) { return r.connected() ? 1 : 0; });
+    family("kvstore_replica_acked_sequence", "gauge", "Last sequence the replica confirmed.",
+           [](const ReplicaStats& r) { return r.acked_sequence(); });
+    family("kvstore_replica_lag_sequences", "gauge", "Logged commands the replica has not confirmed.",
+           [](const ReplicaStats& r) { return r.lag_sequences(); });
+    family("kvstore_replica_lag_milliseconds", "gauge",
+           "Milliseconds since the replica last confirmed everything logged (-1 = never).",
+           [](const ReplicaStats& r) { return r.lag_ms(); });
+    family("kvstore_replica_send_bytes_per_second", "gauge", "Replication data sent to the replica per second.",
+           [](const ReplicaStats& r) { return r.bytes_per_second(); });
+    family("kvstore_replica_queue_depth", "gauge", "Logged commands not yet sent to the replica.",
+           [](const ReplicaStats& r) { return r.queue_depth(); });
+    family("kvstore_replica_sent_bytes_total", "counter", "Replication data sent to the replica.",
+           [](const ReplicaStats& r) { return r.bytes_sent(); });
+    family("kvstore_replica_sent_commands_total", "counter", "Commands sent to the replica.",
+           [](const ReplicaStats& r) { return r.commands_sent(); });
+    family("kvstore_replica_reconnects_total", "counter", "Times the replica reconnected.",
+           [](const ReplicaStats& r) { return r.reconnects(); });
+    
+    const char* histogram = "kvstore_replica_batch_size";
+    out << "# HELP " << histogram << " Commands per batch sent to the replica.\n"
+        << "# TYPE " << histogram << " histogram\n";
+    for (const ReplicaStats& replica : stats.replicas()) {
+        std::string labels = "replica=" + Label(replica.replica_id()) + ",mode=" + Label(replica.mode());
+        uint64_t cumulative = 0;
+        for (int i = 0; i < replica.batch_sizes_size(); ++i) {
+            cumulative += replica.batch_sizes(i);
+            std::string bound = i + 1 < replica.batch_sizes_size() ? std::to_string(1ull << i) : "+Inf";
+            out << histogram << "_bucket{" << labels << ",le=\"" << bound << "\"} " << cumulative << "\n";
+        }
+        out << histogram << "_sum{" << labels << "} " << replica.commands_sent() << "\n"
+            << histogram << "_count{" << labels << "} " << replica.batches_sent() << "\n";
+    }
+    return out.str();
+}
+
+} // namespace kvstore
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include "kvstore.pb.h"
+
+namespace kvstore {
+
+/**
+ * Minimal HTTP endpoint for scrapers: GET /metrics answers with the text
+ * `render` returns, one connection at a time on its own thread
+ */
+class MetricsServer {
+public:
+    MetricsServer(int port, std::function<std::string()> render);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    // @return false if the port could not be bound
+    bool Start();
+    void Stop();
+
+private:
+    void Run();
+    void Serve(int connection);
+
+    int port_;
+    std::function<std::string()> render_;
+    int listen_fd_{-1};
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+/**
+ * Node stats in the Prometheus text format: the node's own gauges, then one
+ * series per replica it replicates to, labelled with the replica's ID
+ */
+std::string FormatMetrics(const StatsResponse& stats);
+
+} // namespace kvstore
@@ -1,21 +1,23 @@
 #include "server.h"
-#include "../storage/storage.h"
 #include "../service/kvstore_service.h"
-#include "../replication/replication_manager.h"
 #include <iostream>
+#include <thread>
+#include <chrono>
 
 namespace kvstore {
 
-Server::Server(const std::string& address, bool is_master)
+Server::Server(const std::string& address, bool is_master, const StorageOptions& storage_options,
+               const ReplicationOptions& replication_options)
     : server_address_(address),
       is_master_(is_master),
-      storage_(std::make_shared<Storage>("kvstore.rdb", "kvstore.aof")),
+      storage_(std::make_shared<Storage>("kvstore.rdb", "kvstore.aof", storage_options)),
       replication_manager_(std::make_shared<ReplicationManager>(
-          is_master ? NodeRole::MASTER : NodeRole::REPLICA)),
-      service_(std::make_unique<KeyValueStoreServiceImpl>(storage_)) {
+          is_master ? NodeRole::MASTER : NodeRole::REPLICA, replication_options)),
+      service_(std::make_unique<KeyValueStoreServiceImpl>(storage_, replication_manager_)),
+      stream_from_master_(replication_options.stream_from_master) {
     
     storage_->SetReplicationManager(replication_manager_);
-    storage_->StartBackgroundSnapshot(60);
+    storage_->StartBackgroundSnapshot(storage_options.snapshot_interval_seconds);
     
     std::cout << "Server initialized as " << (is_master ? "MASTER" : "REPLICA") << std::endl;
 }
@@ -30,7 +32,11 @@ void Server::Run() {
     builder.AddListeningPort(server_address_, grpc::InsecureServerCredentials());
     builder.RegisterService(service_.get());
     
-    grpc_server_ = builder.BuildAndStart();
+    {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        if (shutting_down_) return;
+        grpc_server_ = builder.BuildAndStart();
+    }
     
     if (grpc_server_) {
         std::cout << "Server listening on " << server_address_ << std::endl;
@@ -41,6 +47,19 @@ void Server::Run() {
 }
 
 void Server::Shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        shutting_down_ = true;
+    }
+    // Elections would otherwise restart the replication stream
+    if (raft_) {
+        raft_->Stop();
+    }
+    if (metrics_server_) {
+        metrics_server_->Stop();
+    }
+    // Ends replication streams, which would otherwise keep Shutdown() waiting
+    replication_manager_->Stop();
     if (grpc_server_) {
         grpc_server_->Shutdown();
     }
@@ -60,6 +79,90 @@ void Server::SetMaster(const std::string& master_address) {
         return;
     }
     replication_manager_->SetMasterAddress(master_address);
+    InstallReplicaHandlers();
+    
+    if (stream_from_master_) {
+        replication_manager_->StartStreaming();
+    }
+}
+
+void Server::EnableConsensus(const RaftOptions& options) {
+    InstallReplicaHandlers();
+    
+    // Both callbacks run on the election thread, one at a time
+    RaftNode::Callbacks callbacks;
+    callbacks.lead = [this](int64_t term) {
+        replication_manager_->StopStreaming();
+        storage_->ResetReplicationPosition();
+        storage_->SetWriteTerm(term);
+        replication_manager_->SetRole(NodeRole::MASTER);
+    };
+    callbacks.follow = [this](const std::string& leader) {
+        // Refuse writes before anything else
+        replication_manager_->SetRole(NodeRole::REPLICA);
+        storage_->SetWriteTerm(0);
+        replication_manager_->StopStreaming();
+        storage_->ResetReplicationPosition();
+        if (!leader.empty()) {
+            replication_manager_->SetMasterAddress(leader);
+            replication_manager_->StartStreaming();
+        }
+    };
+    std::shared_ptr<Storage> storage = storage_;
+    callbacks.last_sequence = [storage] { return storage->LastSequence(); };
+    callbacks.ready = [storage] { return !storage->GetLoadProgress().loading; };
+    raft_ = std::make_shared<RaftNode>(options, std::move(callbacks));
+    
+    std::weak_ptr<RaftNode> node = raft_;
+    storage_->SubscribeToLog([node](const ReplicationCommand& command) {
+        if (auto raft = node.lock()) {
+            raft->NoteLogged(command);
+        }
+    });
+    ReplicationManager::LogTerms terms;
+    terms.term_at = [node](int64_t sequence) {
+        auto raft = node.lock();
+        return raft ? raft->TermAt(sequence) : -1;
+    };
+    terms.reset = [node](int64_t term, int64_t sequence) {
+        if (auto raft = node.lock()) {
+            raft->ResetLog(term, sequence);
+        }
+    };
+    replication_manager_->SetLogTerms(std::move(terms));
+    service_->SetRaftNode(raft_);
+    
+    raft_->Start();
+}
+
+void Server::EnableMetrics(int port) {
+    // The same figures GetStats reports
+    metrics_server_ = std::make_unique<MetricsServer>(port, [this] {
+        StatsRequest request;
+        StatsResponse stats;
+        service_->GetStats(nullptr, &request, &stats);
+        return FormatMetrics(stats);
+    });
+    if (!metrics_server_->Start()) {
+        metrics_server_.reset();
+    }
+}
+
+void Server::InstallReplicaHandlers() {
+    std::shared_ptr<Storage> storage = storage_;
+    ReplicationManager::ReplicaHandlers handlers;
+    handlers.apply = [storage](const ReplicationBatch& batch) {
+        // Wait for a lazy load to reach the batch's keys
+        while (!storage->CanApplyReplicated(batch)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return storage->ApplyReplicated(batch) != Storage::ReplicationResult::GAP;
+    };
+    handlers.last_applied = [storage] { return storage->LastSequence(); };
+    handlers.begin_full_sync = [storage] { storage->BeginFullSync(); };
+    handlers.load_chunk = [storage](const SnapshotChunk& chunk) { storage->LoadSyncChunk(chunk); };
+    handlers.finish_full_sync = [storage](int64_t sequence) { storage->FinishFullSync(sequence); };
+    replication_manager_->SetReplicaHandlers(server_address_, std::move(handlers));
 }
 
 } // namespace kvstore
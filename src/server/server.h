@@ -4,31 +4,54 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include "../storage/storage.h"
+#include "../replication/replication_manager.h"
+#include "../replication/raft_node.h"
+#include "metrics_server.h"
 
 namespace kvstore {
 
 class KeyValueStoreServiceImpl;
-class Storage;
-class ReplicationManager;
 
 class Server {
 public:
-    explicit Server(const std::string& address, bool is_master = true);
+    explicit Server(const std::string& address, bool is_master = true,
+                    const StorageOptions& storage_options = StorageOptions(),
+                    const ReplicationOptions& replication_options = ReplicationOptions());
     ~Server();
 
+    // Serve until Shutdown(); returns at once if it was already called
     void Run();
     void Shutdown();
     
     void AddReplica(const std::string& replica_address);
     void SetMaster(const std::string& master_address);
+    
+    /**
+     * Consensus mode: elect the shard's master with the other members
+     * instead of fixing it at startup. The node starts as a replica, and
+     * its role and master follow the elections from then on.
+     */
+    void EnableConsensus(const RaftOptions& options);
+    
+    // Serve GetStats, replica metrics included, over HTTP for scrapers
+    void EnableMetrics(int port);
 
 private:
+    // How this node applies what it streams from a master
+    void InstallReplicaHandlers();
+    
     std::string server_address_;
     bool is_master_;
     std::shared_ptr<Storage> storage_;
     std::shared_ptr<ReplicationManager> replication_manager_;
+    std::shared_ptr<RaftNode> raft_;
     std::unique_ptr<KeyValueStoreServiceImpl> service_;
     std::unique_ptr<grpc::Server> grpc_server_;
+    std::unique_ptr<MetricsServer> metrics_server_;
+    std::mutex run_mutex_;              // Orders Run() against Shutdown()
+    bool shutting_down_{false};
+    bool stream_from_master_;
 };
 
 } // namespace kvstore
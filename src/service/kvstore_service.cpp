@@ -1,9 +1,79 @@
 #include "kvstore_service.h"
+#include "../sharding/shard_info.h"
+#include "../sharding/placement_strategy.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
 
 namespace kvstore {
 
-KeyValueStoreServiceImpl::KeyValueStoreServiceImpl(std::shared_ptr<Storage> storage)
-    : storage_(storage) {
+namespace {
+
+// Returned while the node is still loading the data a request depends on
+grpc::Status NotLoaded() {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Key not loaded yet, retry later");
+}
+
+// Returned for writes once the log has failed to write or sync a record
+grpc::Status LogFailed() {
+    return grpc::Status(grpc::StatusCode::INTERNAL, "Write could not be logged; this node refuses writes until restarted");
+}
+
+constexpr size_t kChunkBytes = 1 << 20;
+
+// How often a Wait checks whether its caller has gone away
+constexpr std::chrono::milliseconds kWaitSlice(100);
+
+// Whether a ring hash falls in (start, end], which wraps when start >= end
+bool InRange(uint32_t hash, const HashRange& range) {
+    if (range.start() < range.end()) {
+        return hash > range.start() && hash <= range.end();
+    }
+    return hash > range.start() || hash <= range.end();
+}
+
+} // namespace
+
+KeyValueStoreServiceImpl::KeyValueStoreServiceImpl(std::shared_ptr<Storage> storage,
+                                                   std::shared_ptr<ReplicationManager> replication_manager)
+    : storage_(storage),
+      replication_manager_(replication_manager) {
+}
+
+bool KeyValueStoreServiceImpl::RefusesWrites() const {
+    // The role flips on the election thread shortly after a step-down
+    return storage_->IsReadOnly() || (raft_ && !raft_->IsLeader());
+}
+
+grpc::Status KeyValueStoreServiceImpl::NotMaster(grpc::ServerContext* context) const {
+    std::string master;
+    if (raft_) {
+        master = raft_->IsLeader() ? "" : raft_->Leader();
+    } else if (replication_manager_) {
+        master = replication_manager_->GetMasterAddress();
+    }
+    if (!master.empty()) {
+        context->AddTrailingMetadata(kLeaderMetadataKey, master);
+        return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                            "Replicas are read-only; send writes to the master at " + master);
+    }
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Replicas are read-only; send writes to the master");
+}
+
+grpc::Status KeyValueStoreServiceImpl::Commit(int64_t sequence) {
+    if (storage_->LogFailed()) {
+        return LogFailed();
+    }
+    if (!raft_ || !replication_manager_) {
+        return grpc::Status::OK;
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(raft_->CommitTimeoutMs());
+    int needed = raft_->QuorumReplicas();
+    if (replication_manager_->WaitForReplicas(sequence, needed, deadline) < needed) {
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            "Write not acknowledged by a majority of the shard; it may be lost in a failover");
+    }
+    return grpc::Status::OK;
 }
 
 grpc::Status KeyValueStoreServiceImpl::Get(grpc::ServerContext* context,
@@ -13,6 +83,14 @@ grpc::Status KeyValueStoreServiceImpl::Get(grpc::ServerContext* context,
         return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
     }
 
+    if (!storage_->IsLoaded(request->key())) {
+        return NotLoaded();
+    }
+
+    // Read before the value, so the value is at least this fresh
+    response->set_applied_sequence(storage_->LastSequence());
+    response->set_lag_ms(replication_manager_ ? replication_manager_->ReplicationLagMs() : 0);
+    
     auto value = storage_->Get(request->key());
     if (value.has_value()) {
         response->set_found(true);
@@ -31,10 +109,20 @@ grpc::Status KeyValueStoreServiceImpl::Set(grpc::ServerContext* context,
         return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
     }
 
-    storage_->Set(request->key(), request->value());
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+
+    if (!storage_->IsWritable()) {
+        return NotLoaded();
+    }
+
+    int64_t sequence = 0;
+    storage_->Set(request->key(), request->value(), &sequence);
     response->set_success(true);
+    response->set_sequence(sequence);
     
-    return grpc::Status::OK;
+    return Commit(sequence);
 }
 
 grpc::Status KeyValueStoreServiceImpl::Contains(grpc::ServerContext* context,
@@ -44,6 +132,10 @@ grpc::Status KeyValueStoreServiceImpl::Contains(grpc::ServerContext* context,
         return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
     }
 
+    if (!storage_->IsLoaded(request->key())) {
+        return NotLoaded();
+    }
+
     bool exists = storage_->Contains(request->key());
     response->set_exists(exists);
     
@@ -57,11 +149,21 @@ grpc::Status KeyValueStoreServiceImpl::Delete(grpc::ServerContext* context,
         return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
     }
 
-    bool found = storage_->Delete(request->key());
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+
+    if (!storage_->IsLoaded(request->key())) {
+        return NotLoaded();
+    }
+
+    int64_t sequence = 0;
+    bool found = storage_->Delete(request->key(), &sequence);
     response->set_success(true);
     response->set_found(found);
+    response->set_sequence(sequence);
     
-    return grpc::Status::OK;
+    return Commit(sequence);
 }
 
 grpc::Status KeyValueStoreServiceImpl::Expire(grpc::ServerContext* context,
@@ -75,10 +177,20 @@ grpc::Status KeyValueStoreServiceImpl::Expire(grpc::ServerContext* context,
         return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Seconds must be positive");
     }
 
-    bool success = storage_->Expire(request->key(), request->seconds());
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+
+    if (!storage_->IsLoaded(request->key())) {
+        return NotLoaded();
+    }
+
+    int64_t sequence = 0;
+    bool success = storage_->Expire(request->key(), request->seconds(), &sequence);
     response->set_success(success);
+    response->set_sequence(sequence);
     
-    return grpc::Status::OK;
+    return Commit(sequence);
 }
 
 grpc::Status KeyValueStoreServiceImpl::TTL(grpc::ServerContext* context,
@@ -88,42 +200,421 @@ grpc::Status KeyValueStoreServiceImpl::TTL(grpc::ServerContext* context,
         return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
     }
 
+    if (!storage_->IsLoaded(request->key())) {
+        return NotLoaded();
+    }
+
     int ttl = storage_->TTL(request->key());
     response->set_seconds(ttl);
     
     return grpc::Status::OK;
 }
 
+grpc::Status KeyValueStoreServiceImpl::MultiGet(grpc::ServerContext* context,
+                                                const KeysRequest* request,
+                                                MultiGetResponse* response) {
+    for (const std::string& key : request->keys()) {
+        if (key.empty()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
+        }
+        if (!storage_->IsLoaded(key)) {
+            return NotLoaded();
+        }
+    }
+    
+    response->set_applied_sequence(storage_->LastSequence());
+    for (const std::string& key : request->keys()) {
+        auto value = storage_->Get(key);
+        response->add_found(value.has_value());
+        response->add_values(value.value_or(""));
+    }
+    
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::MultiSet(grpc::ServerContext* context,
+                                                const MultiSetRequest* request,
+                                                MultiSetResponse* response) {
+    std::vector<std::pair<std::string, std::string>> entries;
+    entries.reserve(request->entries_size());
+    for (const SetRequest& entry : request->entries()) {
+        if (entry.key().empty()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
+        }
+        entries.emplace_back(entry.key(), entry.value());
+    }
+    
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+    
+    if (!storage_->IsWritable()) {
+        return NotLoaded();
+    }
+    
+    int64_t sequence = 0;
+    storage_->MultiSet(entries, &sequence);
+    response->set_sequence(sequence);
+    
+    return Commit(sequence);
+}
+
+grpc::Status KeyValueStoreServiceImpl::MultiDelete(grpc::ServerContext* context,
+                                                   const KeysRequest* request,
+                                                   MultiDeleteResponse* response) {
+    for (const std::string& key : request->keys()) {
+        if (key.empty()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
+        }
+    }
+    
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+    
+    for (const std::string& key : request->keys()) {
+        if (!storage_->IsLoaded(key)) {
+            return NotLoaded();
+        }
+    }
+    
+    std::vector<std::string> keys(request->keys().begin(), request->keys().end());
+    std::vector<bool> found;
+    int64_t sequence = 0;
+    storage_->MultiDelete(keys, &found, &sequence);
+    for (bool existed : found) {
+        response->add_found(existed);
+    }
+    response->set_sequence(sequence);
+    
+    return Commit(sequence);
+}
+
+grpc::Status KeyValueStoreServiceImpl::GetStats(grpc::ServerContext* context,
+                                                const StatsRequest* request,
+                                                StatsResponse* response) {
+    Storage::LoadProgress progress = storage_->GetLoadProgress();
+    response->set_key_count(storage_->Size());
+    response->set_loading(progress.loading);
+    response->set_load_bytes_loaded(progress.bytes_loaded);
+    response->set_load_bytes_total(progress.bytes_total);
+    response->set_partitions_loaded(static_cast<int32_t>(progress.partitions_loaded));
+    response->set_partitions_total(static_cast<int32_t>(progress.partitions_total));
+    response->set_role(RefusesWrites() ? "replica" : "master");
+    response->set_last_sequence(storage_->LastSequence());
+    if (raft_) {
+        response->set_leader(raft_->Leader());
+        response->set_term(raft_->CurrentTerm());
+    }
+    if (replication_manager_) {
+        for (ReplicaStats& replica : replication_manager_->GetReplicaStats()) {
+            *response->add_replicas() = std::move(replica);
+        }
+    }
+    
+    return grpc::Status::OK;
+}
+
 grpc::Status KeyValueStoreServiceImpl::ReplicateCommand(grpc::ServerContext* context,
                                                         const ReplicationCommand* request,
                                                         ReplicationResponse* response) {
-    switch (request->type()) {
-        case ReplicationCommand::SET:
-            storage_->SetFromReplication(request->key(), request->value());
-            break;
-        
-        case ReplicationCommand::DELETE:
-            storage_->DeleteFromReplication(request->key());
-            break;
-        
-        case ReplicationCommand::EXPIRE:
-            storage_->ExpireFromReplication(request->key(), request->seconds());
-            break;
-        
-        default:
-            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Unknown command type");
+    if (!ReplicationCommand::CommandType_IsValid(request->type())) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Unknown command type");
     }
     
-    response->set_success(true);
-    response->set_last_applied_sequence(request->sequence_id());
+    // The master cannot catch this replica up from its log; fetch a full
+    // copy before answering so the master resumes after it
+    if (request->type() == ReplicationCommand::FULL_SYNC) {
+        if (!replication_manager_ || !replication_manager_->FullSync()) {
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Full resync failed");
+        }
+        response->set_success(true);
+        response->set_last_applied_sequence(storage_->LastSequence());
+        return grpc::Status::OK;
+    }
+    
+    if (storage_->LogFailed()) {
+        return LogFailed();
+    }
+    if (!storage_->CanApplyReplicated(*request)) {
+        return NotLoaded();
+    }
+    
+    // On a gap the master resends from last_applied_sequence onwards
+    Storage::ReplicationResult result = storage_->ApplyReplicated(*request);
+    if (storage_->LogFailed()) {
+        return LogFailed();
+    }
+    response->set_success(result != Storage::ReplicationResult::GAP);
+    response->set_last_applied_sequence(storage_->LastSequence());
+    
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::ReplicateBatch(grpc::ServerContext* context,
+                                                      const ReplicationBatch* request,
+                                                      ReplicationResponse* response) {
+    for (const ReplicationCommand& command : request->commands()) {
+        if (!ReplicationCommand::CommandType_IsValid(command.type()) ||
+            command.type() == ReplicationCommand::FULL_SYNC) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Batches may only hold SET, DELETE and EXPIRE");
+        }
+    }
+    
+    if (storage_->LogFailed()) {
+        return LogFailed();
+    }
+    if (!storage_->CanApplyReplicated(*request)) {
+        return NotLoaded();
+    }
+    
+    Storage::ReplicationResult result = storage_->ApplyReplicated(*request);
+    if (storage_->LogFailed()) {
+        return LogFailed();
+    }
+    response->set_success(result != Storage::ReplicationResult::GAP);
+    response->set_last_applied_sequence(storage_->LastSequence());
+    if (replication_manager_ && result != Storage::ReplicationResult::GAP && request->commands_size() > 0) {
+        replication_manager_->NoteReceived(request->commands(request->commands_size() - 1).sequence_id());
+    }
+    
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::Wait(grpc::ServerContext* context,
+                                            const WaitRequest* request,
+                                            WaitResponse* response) {
+    if (RefusesWrites()) {
+        return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Wait is served by the master");
+    }
+    
+    int64_t sequence = request->sequence() > 0 ? request->sequence() : storage_->LastSequence();
+    response->set_sequence(sequence);
+    if (!replication_manager_) {
+        response->set_replicas(0);
+        return grpc::Status::OK;
+    }
+    
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (request->timeout_ms() > 0) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(request->timeout_ms());
+    }
+    
+    // Waited out in slices so a caller that gives up (or whose deadline
+    // passes) does not hold a server thread until the timeout
+    int replicas = 0;
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        auto until = deadline - now > kWaitSlice ? now + kWaitSlice : deadline;
+        replicas = replication_manager_->WaitForReplicas(sequence, request->replicas(), until);
+        if (replicas >= request->replicas() || until == deadline || context->IsCancelled()) {
+            break;
+        }
+    }
+    response->set_replicas(replicas);
     
     return grpc::Status::OK;
 }
 
 grpc::Status KeyValueStoreServiceImpl::StreamReplication(grpc::ServerContext* context,
-                                                         const ReplicationStreamRequest* request,
-                                                         grpc::ServerWriter<ReplicationCommand>* writer) {
-    return grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "Streaming replication not yet implemented");
+                                                         grpc::ServerReaderWriter<ReplicationBatch, ReplicationStreamRequest>* stream) {
+    if (!replication_manager_) {
+        return grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "Replication is not configured on this node");
+    }
+    
+    return replication_manager_->ServeStream(context, stream);
+}
+
+grpc::Status KeyValueStoreServiceImpl::FullSync(grpc::ServerContext* context,
+                                                const FullSyncRequest* request,
+                                                grpc::ServerWriter<SnapshotChunk>* writer) {
+    // Replicas serve full resyncs to their sub-replicas too, except while
+    // loading one themselves
+    if (storage_->GetLoadProgress().loading) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Dataset still loading, retry later");
+    }
+    
+    std::cout << "Full resync for replica " << request->replica_id() << " started" << std::endl;
+    auto term_at = [this](int64_t sequence) { return raft_ ? raft_->TermAt(sequence) : 0; };
+    
+    // Each partition is sent as chunks of about kChunkBytes, the last one
+    // flagged complete (an empty partition is a single empty chunk)
+    bool complete = storage_->ExportPartitions(
+        [&](int64_t sequence, size_t partition, const std::vector<Storage::SnapshotEntry>& entries) {
+            SnapshotChunk chunk;
+            size_t bytes = 0;
+            for (const Storage::SnapshotEntry& entry : entries) {
+                SnapshotEntry* out = chunk.add_entries();
+                out->set_key(entry.key);
+                out->set_value(*entry.value);
+                out->set_ttl_seconds(entry.ttl_seconds);
+                bytes += entry.key.size() + entry.value->size();
+                
+                if (bytes >= kChunkBytes) {
+                    chunk.set_sequence(sequence);
+                    chunk.set_term(term_at(sequence));
+                    chunk.set_partition(static_cast<int32_t>(partition));
+                    if (!writer->Write(chunk)) return false;
+                    chunk.Clear();
+                    bytes = 0;
+                }
+            }
+            
+            chunk.set_sequence(sequence);
+            chunk.set_term(term_at(sequence));
+            chunk.set_partition(static_cast<int32_t>(partition));
+            chunk.set_partition_complete(true);
+            return writer->Write(chunk) && !context->IsCancelled();
+        });
+    
+    if (!complete) {
+        if (!context->IsCancelled()) {
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Dataset replaced during the full resync, retry later");
+        }
+        return grpc::Status(grpc::StatusCode::CANCELLED, "Replica went away during the full resync");
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::RequestVote(grpc::ServerContext* context,
+                                                   const VoteRequest* request,
+                                                   VoteResponse* response) {
+    if (!raft_) {
+        return grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "Consensus mode is not enabled on this node");
+    }
+    raft_->HandleRequestVote(*request, response);
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::AppendEntries(grpc::ServerContext* context,
+                                                     const AppendEntriesRequest* request,
+                                                     AppendEntriesResponse* response) {
+    if (!raft_) {
+        return grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "Consensus mode is not enabled on this node");
+    }
+    raft_->HandleAppendEntries(*request, response);
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::ScanRange(grpc::ServerContext* context,
+                                                 const ScanRangeRequest* request,
+                                                 grpc::ServerWriter<SnapshotChunk>* writer) {
+    if (storage_->GetLoadProgress().loading) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Dataset still loading, retry later");
+    }
+    
+    if (request->hash_version() > static_cast<uint32_t>(RingHashVersion::FNV1A_FINALIZED)) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Unknown ring hash version");
+    }
+    auto version = static_cast<RingHashVersion>(request->hash_version());
+    auto match = [request, version](const std::string& key) {
+        if (request->ranges_size() == 0) {
+            return true;
+        }
+        uint32_t hash = RingHash(request->hash_tags() ? HashTag(key) : std::string_view(key), version);
+        return std::any_of(request->ranges().begin(), request->ranges().end(),
+                           [hash](const HashRange& range) { return InRange(hash, range); });
+    };
+    
+    // Chunks of about kChunkBytes; the caller's pace holds up the scan,
+    // but no partition stays locked while it waits
+    bool complete = storage_->ScanKeys(match, [&](const std::vector<Storage::SnapshotEntry>& entries) {
+        SnapshotChunk chunk;
+        size_t bytes = 0;
+        for (const Storage::SnapshotEntry& entry : entries) {
+            SnapshotEntry* out = chunk.add_entries();
+            out->set_key(entry.key);
+            out->set_value(*entry.value);
+            out->set_ttl_seconds(entry.ttl_seconds);
+            bytes += entry.key.size() + entry.value->size();
+            
+            if (bytes >= kChunkBytes) {
+                if (!writer->Write(chunk)) return false;
+                chunk.Clear();
+                bytes = 0;
+            }
+        }
+        return (chunk.entries_size() == 0 || writer->Write(chunk)) && !context->IsCancelled();
+    });
+    
+    if (!complete) {
+        return grpc::Status(grpc::StatusCode::CANCELLED, "Scan abandoned by the caller");
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::ExportKeys(grpc::ServerContext* context,
+                                                  const KeysRequest* request,
+                                                  Entries* response) {
+    for (const std::string& key : request->keys()) {
+        if (!storage_->IsLoaded(key)) {
+            return NotLoaded();
+        }
+        // The TTL first: a key expiring in between is then left out
+        int ttl = storage_->TTL(key);
+        auto value = storage_->Get(key);
+        if (!value || ttl == -2) continue;
+        
+        SnapshotEntry* entry = response->add_entries();
+        entry->set_key(key);
+        entry->set_value(*value);
+        entry->set_ttl_seconds(ttl);
+    }
+    
+    return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreServiceImpl::Import(grpc::ServerContext* context,
+                                              const Entries* request,
+                                              ImportResponse* response) {
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+    
+    // Whether a key is already here is only known once it is loaded
+    if (storage_->GetLoadProgress().loading) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Dataset still loading, retry later");
+    }
+    
+    int32_t imported = 0;
+    int64_t sequence = storage_->LastSequence();
+    for (const SnapshotEntry& entry : request->entries()) {
+        if (entry.key().empty()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Key cannot be empty");
+        }
+        if (storage_->Import({entry.key(), entry.value(), entry.ttl_seconds()}, &sequence)) {
+            imported++;
+        }
+    }
+    response->set_imported(imported);
+    response->set_sequence(sequence);
+    
+    return Commit(sequence);
+}
+
+grpc::Status KeyValueStoreServiceImpl::DropKeys(grpc::ServerContext* context,
+                                                const KeysRequest* request,
+                                                DropKeysResponse* response) {
+    if (RefusesWrites()) {
+        return NotMaster(context);
+    }
+    
+    int32_t dropped = 0;
+    int64_t sequence = storage_->LastSequence();
+    for (const std::string& key : request->keys()) {
+        if (!storage_->IsLoaded(key)) {
+            return NotLoaded();
+        }
+        int64_t deleted_at = 0;
+        if (storage_->Delete(key, &deleted_at)) {
+            dropped++;
+        }
+        sequence = std::max(sequence, deleted_at);
+    }
+    response->set_dropped(dropped);
+    response->set_sequence(sequence);
+    
+    return Commit(sequence);
 }
 
 } // namespace kvstore
@@ -3,6 +3,8 @@
 #include <grpcpp/grpcpp.h>
 #include "kvstore.grpc.pb.h"
 #include "../storage/storage.h"
+#include "../replication/replication_manager.h"
+#include "../replication/raft_node.h"
 #include <memory>
 
 namespace kvstore {
@@ -12,7 +14,11 @@ namespace kvstore {
  */
 class KeyValueStoreServiceImpl final : public KeyValueStore::Service {
 public:
-    explicit KeyValueStoreServiceImpl(std::shared_ptr<Storage> storage);
+    explicit KeyValueStoreServiceImpl(std::shared_ptr<Storage> storage,
+                                      std::shared_ptr<ReplicationManager> replication_manager = nullptr);
+    
+    // Consensus mode; set before the server starts
+    void SetRaftNode(std::shared_ptr<RaftNode> raft) { raft_ = std::move(raft); }
 
     grpc::Status Get(grpc::ServerContext* context,
                     const GetRequest* request,
@@ -38,16 +44,76 @@ public:
                     const TTLRequest* request,
                     TTLResponse* response) override;
 
+    grpc::Status MultiGet(grpc::ServerContext* context,
+                          const KeysRequest* request,
+                          MultiGetResponse* response) override;
+
+    grpc::Status MultiSet(grpc::ServerContext* context,
+                          const MultiSetRequest* request,
+                          MultiSetResponse* response) override;
+
+    grpc::Status MultiDelete(grpc::ServerContext* context,
+                             const KeysRequest* request,
+                             MultiDeleteResponse* response) override;
+
+    grpc::Status GetStats(grpc::ServerContext* context,
+                         const StatsRequest* request,
+                         StatsResponse* response) override;
+
     grpc::Status ReplicateCommand(grpc::ServerContext* context,
                                  const ReplicationCommand* request,
                                  ReplicationResponse* response) override;
 
+    grpc::Status ReplicateBatch(grpc::ServerContext* context,
+                                const ReplicationBatch* request,
+                                ReplicationResponse* response) override;
+
+    grpc::Status Wait(grpc::ServerContext* context,
+                     const WaitRequest* request,
+                     WaitResponse* response) override;
+
     grpc::Status StreamReplication(grpc::ServerContext* context,
-                                   const ReplicationStreamRequest* request,
-                                   grpc::ServerWriter<ReplicationCommand>* writer) override;
+                                   grpc::ServerReaderWriter<ReplicationBatch, ReplicationStreamRequest>* stream) override;
+
+    grpc::Status FullSync(grpc::ServerContext* context,
+                          const FullSyncRequest* request,
+                          grpc::ServerWriter<SnapshotChunk>* writer) override;
+
+    grpc::Status RequestVote(grpc::ServerContext* context,
+                             const VoteRequest* request,
+                             VoteResponse* response) override;
+
+    grpc::Status AppendEntries(grpc::ServerContext* context,
+                               const AppendEntriesRequest* request,
+                               AppendEntriesResponse* response) override;
+
+    grpc::Status ScanRange(grpc::ServerContext* context,
+                           const ScanRangeRequest* request,
+                           grpc::ServerWriter<SnapshotChunk>* writer) override;
+
+    grpc::Status ExportKeys(grpc::ServerContext* context,
+                            const KeysRequest* request,
+                            Entries* response) override;
+
+    grpc::Status Import(grpc::ServerContext* context,
+                        const Entries* request,
+                        ImportResponse* response) override;
+
+    grpc::Status DropKeys(grpc::ServerContext* context,
+                          const KeysRequest* request,
+                          DropKeysResponse* response) override;
 
 private:
+    // Client writes go to the master (the elected leader in consensus mode)
+    bool RefusesWrites() const;
+    // Refuse a write, naming the node that takes them in trailing metadata
+    grpc::Status NotMaster(grpc::ServerContext* context) const;
+    // Consensus mode: wait until a majority of the shard has logged the write
+    grpc::Status Commit(int64_t sequence);
+    
     std::shared_ptr<Storage> storage_;
+    std::shared_ptr<ReplicationManager> replication_manager_;
+    std::shared_ptr<RaftNode> raft_;
 };
 
 } // namespace kvstore
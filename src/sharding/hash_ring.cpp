@@ -1,17 +1,49 @@
 #include "hash_ring.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 namespace kvstore {
 
-HashRing::HashRing(int virtual_nodes_per_shard)
-    : virtual_nodes_per_shard_(virtual_nodes_per_shard) {
+namespace {
+
+// This thread's reader stripe, assigned round-robin on first use
+size_t ReaderStripeIndex(size_t stripes) {
+    static std::atomic<size_t> next{0};
+    thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed);
+    return stripe % stripes;
+}
+
+} // namespace
+
+class HashRing::ReadSection {
+public:
+    explicit ReadSection(const HashRing& ring)
+        : readers_(ring.reader_stripes_[ReaderStripeIndex(kReaderStripes)]
+                       .readers[ring.epoch_.load() & 1]) {
+        readers_++;
+    }
+    ~ReadSection() { readers_--; }
+
+private:
+    std::atomic<int64_t>& readers_;
+};
+
+HashRing::HashRing(int virtual_nodes_per_shard, std::shared_ptr<const PlacementStrategy> strategy,
+                   bool hash_tags)
+    : virtual_nodes_per_shard_(virtual_nodes_per_shard),
+      hash_tags_(hash_tags),
+      strategy_(strategy ? std::move(strategy) : std::make_shared<RingStrategy>()) {
     if (virtual_nodes_per_shard_ <= 0) {
         virtual_nodes_per_shard_ = 150; // Default
     }
+    PublishPlacement();
 }
 
-bool HashRing::AddShard(const std::string& shard_id, const std::string& address) {
+bool HashRing::AddShard(const std::string& shard_id, const std::string& address,
+                        const std::vector<std::string>& replica_addresses, double weight) {
     std::lock_guard<std::mutex> lock(mutex_);
     
     // Check if shard already exists
@@ -19,20 +51,25 @@ bool HashRing::AddShard(const std::string& shard_id, const std::string& address)
         std::cerr << "Shard already exists: " << shard_id << std::endl;
         return false;
     }
+    if (!(weight > 0)) {
+        std::cerr << "Shard weight must be positive: " << shard_id << std::endl;
+        return false;
+    }
     
     // Create shard info
     ShardInfo shard_info(shard_id, address);
+    shard_info.replica_addresses = replica_addresses;
+    shard_info.weight = weight;
+    shard_info.virtual_nodes = VirtualNodesFor(weight);
     shards_[shard_id] = shard_info;
+    shard_order_.push_back(shard_id);
     
     // Add virtual nodes to the ring
-    for (int i = 0; i < virtual_nodes_per_shard_; ++i) {
-        std::string vnode_key = GetVirtualNodeKey(shard_id, i);
-        uint32_t hash = ComputeHash(vnode_key);
-        ring_[hash] = shard_id;
-    }
+    AddVirtualNodes(shard_id, 0, shard_info.virtual_nodes);
+    PublishPlacement();
     
     std::cout << "Added shard '" << shard_id << "' to hash ring with " 
-              << virtual_nodes_per_shard_ << " virtual nodes" << std::endl;
+              << shard_info.virtual_nodes << " virtual nodes" << std::endl;
     
     return true;
 }
@@ -41,45 +78,91 @@ bool HashRing::RemoveShard(const std::string& shard_id) {
     std::lock_guard<std::mutex> lock(mutex_);
     
     // Check if shard exists
-    if (shards_.find(shard_id) == shards_.end()) {
+    auto it = shards_.find(shard_id);
+    if (it == shards_.end()) {
         std::cerr << "Shard not found: " << shard_id << std::endl;
         return false;
     }
     
     // Remove virtual nodes from the ring
-    for (int i = 0; i < virtual_nodes_per_shard_; ++i) {
-        std::string vnode_key = GetVirtualNodeKey(shard_id, i);
-        uint32_t hash = ComputeHash(vnode_key);
-        ring_.erase(hash);
-    }
+    RemoveVirtualNodes(shard_id, 0, it->second.virtual_nodes);
     
     // Remove shard info
     shards_.erase(shard_id);
+    auto position = std::find(shard_order_.begin(), shard_order_.end(), shard_id);
+    *position = shard_order_.back();
+    shard_order_.pop_back();
+    PublishPlacement();
     
     std::cout << "Removed shard '" << shard_id << "' from hash ring" << std::endl;
     
     return true;
 }
 
-std::string HashRing::GetShardForKey(const std::string& key) const {
+const std::string& HashRing::GetShardForKey(const std::string& key) const {
+    // The placement is loaded after the lookup is counted, so a change
+    // either waits for it or has already swapped in its new placement
+    ReadSection read(*this);
+    return placement_.load()->ShardFor(PlacementKey(key));
+}
+
+bool HashRing::SetWeight(const std::string& shard_id, double weight) {
     std::lock_guard<std::mutex> lock(mutex_);
     
-    if (ring_.empty()) {
-        return "";
+    auto it = shards_.find(shard_id);
+    if (it == shards_.end()) {
+        std::cerr << "Shard not found: " << shard_id << std::endl;
+        return false;
+    }
+    if (!(weight > 0)) {
+        std::cerr << "Shard weight must be positive: " << shard_id << std::endl;
+        return false;
     }
     
-    // Compute hash of the key
-    uint32_t hash = ComputeHash(key);
+    ShardInfo& shard = it->second;
+    int virtual_nodes = VirtualNodesFor(weight);
+    if (virtual_nodes > shard.virtual_nodes) {
+        AddVirtualNodes(shard_id, shard.virtual_nodes, virtual_nodes);
+    } else {
+        RemoveVirtualNodes(shard_id, virtual_nodes, shard.virtual_nodes);
+    }
+    shard.weight = weight;
+    shard.virtual_nodes = virtual_nodes;
+    PublishPlacement();
     
-    // Find the first node on the ring >= hash (clockwise search)
-    auto it = ring_.lower_bound(hash);
+    std::cout << "Shard '" << shard_id << "' now has weight " << weight << " ("
+              << virtual_nodes << " virtual nodes)" << std::endl;
+    return true;
+}
+
+bool HashRing::SetPrimary(const std::string& shard_id, const std::string& address) {
+    std::lock_guard<std::mutex> lock(mutex_);
     
-    // If we're past the end, wrap around to the beginning
-    if (it == ring_.end()) {
-        it = ring_.begin();
+    auto it = shards_.find(shard_id);
+    if (it == shards_.end()) {
+        return false;
+    }
+    ShardInfo& shard = it->second;
+    if (shard.address == address) {
+        return true;
     }
     
-    return it->second;
+    auto& replicas = shard.replica_addresses;
+    replicas.erase(std::remove(replicas.begin(), replicas.end(), address), replicas.end());
+    replicas.push_back(shard.address);
+    shard.address = address;
+    return true;
+}
+
+bool HashRing::SetAvailable(const std::string& shard_id, bool available) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    auto it = shards_.find(shard_id);
+    if (it == shards_.end()) {
+        return false;
+    }
+    it->second.is_available = available;
+    return true;
 }
 
 const ShardInfo* HashRing::GetShard(const std::string& shard_id) const {
@@ -115,17 +198,97 @@ bool HashRing::IsEmpty() const {
     return shards_.empty();
 }
 
-uint32_t HashRing::ComputeHash(const std::string& data) const {
-    // Simple but effective hash function (FNV-1a)
-    // Good distribution for consistent hashing
-    uint32_t hash = 2166136261u;
+std::unique_ptr<HashRing> HashRing::Clone() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    auto copy = std::make_unique<HashRing>(virtual_nodes_per_shard_, strategy_, hash_tags_);
+    copy->ring_ = ring_;
+    copy->shards_ = shards_;
+    copy->shard_order_ = shard_order_;
+    copy->PublishPlacement();
+    return copy;
+}
+
+bool HashRing::MovedRanges(const HashRing& target, std::vector<MovedRange>* ranges) const {
+    // Owners can only change at a virtual node of one ring or the other
+    std::vector<uint32_t> boundaries;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [hash, shard_id] : ring_) {
+            boundaries.push_back(hash);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(target.mutex_);
+        for (const auto& [hash, shard_id] : target.ring_) {
+            boundaries.push_back(hash);
+        }
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
     
-    for (char c : data) {
-        hash ^= static_cast<uint32_t>(c);
-        hash *= 16777619u;
+    // Read without the locks, which a change holds while it waits for us
+    ReadSection read_before(*this);
+    ReadSection read_after(target);
+    const Placement* before = placement_.load();
+    const Placement* after = target.placement_.load();
+    ranges->clear();
+    for (size_t i = 0; i < boundaries.size(); ++i) {
+        // Every key in the range goes where its end does
+        const std::string* from = before->ShardForHash(boundaries[i]);
+        const std::string* to = after->ShardForHash(boundaries[i]);
+        if (!from || !to) {
+            ranges->clear();
+            return false;
+        }
+        if (*from == *to) continue;
+        
+        uint32_t start = boundaries[i == 0 ? boundaries.size() - 1 : i - 1];
+        if (!ranges->empty() && ranges->back().end == start && ranges->back().from == *from &&
+            ranges->back().to == *to) {
+            ranges->back().end = boundaries[i];
+        } else {
+            ranges->push_back({start, boundaries[i], *from, *to});
+        }
+    }
+    return true;
+}
+
+uint32_t HashRing::ComputeHash(const std::string& data) const {
+    // As keys are hashed for lookups
+    return RingHash(data, strategy_->HashVersion());
+}
+
+void HashRing::PublishPlacement() {
+    std::vector<double> weights;
+    weights.reserve(shard_order_.size());
+    for (const auto& shard_id : shard_order_) {
+        weights.push_back(shards_.at(shard_id).weight);
     }
+    for (const auto& shard_id : shard_order_) {
+        names_.insert(shard_id);
+    }
+    std::unique_ptr<Placement> replaced = std::move(current_);
+    current_ = strategy_->Build(PlacementInput{ring_, shard_order_, weights, names_});
+    placement_.store(current_.get());
     
-    return hash;
+    // Lookups counted from here on find the new placement. One counted
+    // before may still read the old one: new lookups are moved to the
+    // other parity, and each parity's earlier ones are waited out in turn.
+    for (int turn = 0; turn < 2; ++turn) {
+        uint64_t earlier = epoch_++;
+        while (Readers(earlier) > 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+int64_t HashRing::Readers(uint64_t epoch) const {
+    int64_t readers = 0;
+    for (const auto& stripe : reader_stripes_) {
+        readers += stripe.readers[epoch & 1].load();
+    }
+    return readers;
 }
 
 std::string HashRing::GetVirtualNodeKey(const std::string& shard_id, int virtual_index) const {
@@ -134,4 +297,28 @@ std::string HashRing::GetVirtualNodeKey(const std::string& shard_id, int virtual
     return oss.str();
 }
 
+int HashRing::VirtualNodesFor(double weight) const {
+    return std::max(1, static_cast<int>(std::lround(virtual_nodes_per_shard_ * weight)));
+}
+
+void HashRing::AddVirtualNodes(const std::string& shard_id, int from, int to) {
+    for (int i = from; i < to; ++i) {
+        std::string vnode_key = GetVirtualNodeKey(shard_id, i);
+        uint32_t hash = ComputeHash(vnode_key);
+        ring_[hash] = shard_id;
+    }
+}
+
+void HashRing::RemoveVirtualNodes(const std::string& shard_id, int from, int to) {
+    for (int i = from; i < to; ++i) {
+        std::string vnode_key = GetVirtualNodeKey(shard_id, i);
+        uint32_t hash = ComputeHash(vnode_key);
+        // A colliding virtual node may have been taken by another shard
+        auto it = ring_.find(hash);
+        if (it != ring_.end() && it->second == shard_id) {
+            ring_.erase(it);
+        }
+    }
+}
+
 } // namespace kvstore
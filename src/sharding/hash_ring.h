@@ -1,11 +1,17 @@
 #pragma once
 
 #include "shard_info.h"
+#include "placement_strategy.h"
 #include <string>
+#include <string_view>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <array>
+#include <memory>
 #include <mutex>
+#include <atomic>
 #include <functional>
 #include <cstdint>
 
@@ -14,22 +20,47 @@ namespace kvstore {
 /**
  * Consistent hash ring for distributing keys across shards
  * Uses virtual nodes to ensure uniform distribution
+ *
+ * Which shard owns a key is decided by a PlacementStrategy: the virtual
+ * node ring by default, or jump, rendezvous or bounded-load hashing.
+ * Changes to the ring are made under a mutex and compiled by the strategy
+ * into a new Placement, which is published with an atomic pointer swap.
+ * Key lookups read the current placement without locking or allocating.
+ * Each counts itself in the current epoch while it reads, and a change
+ * frees the placement it replaced once the lookups of earlier epochs
+ * have finished. Shard ids are kept for the ring's lifetime, so the
+ * references lookups return outlive the placement that gave them.
+ *
+ * With hash tags on, a key containing "{...}" is placed by the part
+ * between the braces alone (see HashTag), so keys sharing a tag always
+ * share a shard and can be written or read together in one request.
  */
 class HashRing {
 public:
     /**
      * Create a hash ring with specified number of virtual nodes per physical node
      * @param virtual_nodes_per_shard Number of virtual nodes (default: 150)
+     * @param strategy Key placement (default: RingStrategy)
+     * @param hash_tags Place keys by their "{...}" tag. Fixed for the
+     *        ring's lifetime: switching it would move keys without
+     *        migrating them
      */
-    explicit HashRing(int virtual_nodes_per_shard = 150);
+    explicit HashRing(int virtual_nodes_per_shard = 150,
+                      std::shared_ptr<const PlacementStrategy> strategy = nullptr,
+                      bool hash_tags = false);
     
     /**
      * Add a shard to the hash ring
      * @param shard_id Unique identifier for the shard
      * @param address Network address of the shard (host:port)
+     * @param replica_addresses Addresses of the shard's replicas, which
+     *        may serve reads
+     * @param weight Relative capacity: the shard gets weight times the
+     *        usual number of virtual nodes (at least one)
      * @return true if added successfully
      */
-    bool AddShard(const std::string& shard_id, const std::string& address);
+    bool AddShard(const std::string& shard_id, const std::string& address,
+                  const std::vector<std::string>& replica_addresses = {}, double weight = 1.0);
     
     /**
      * Remove a shard from the hash ring
@@ -38,12 +69,49 @@ public:
      */
     bool RemoveShard(const std::string& shard_id);
     
+    /**
+     * Change a shard's weight. Virtual nodes are added or removed from the
+     * end of its numbering and the rest stay put, so only keys moving onto
+     * or off that shard change owner.
+     * @return false if the shard is unknown or the weight is not positive
+     */
+    bool SetWeight(const std::string& shard_id, double weight);
+    
+    /**
+     * Make `address` the shard's primary, after a failover. It leaves the
+     * replica list if it was there, and the old primary joins it.
+     * @return false if the shard is unknown
+     */
+    bool SetPrimary(const std::string& shard_id, const std::string& address);
+    
+    /**
+     * Mark a shard available or not, as its router finds it. Keys stay
+     * placed on an unavailable shard; this only reports its health.
+     * @return false if the shard is unknown
+     */
+    bool SetAvailable(const std::string& shard_id, bool available);
+    
     /**
      * Find which shard owns a given key
      * @param key The key to look up
-     * @return Shard ID that owns this key, or empty string if no shards
+     * @return Shard ID that owns this key, or empty string if no shards.
+     *         The reference stays valid for the ring's lifetime.
+     */
+    const std::string& GetShardForKey(const std::string& key) const;
+    
+    /**
+     * Whether keys are placed by their hash tags
+     */
+    bool HashTags() const { return hash_tags_; }
+    
+    /**
+     * The string a key is placed by: its hash tag when tags are on, else
+     * the key. Ring positions are RingHash of this, with the strategy's
+     * HashVersion.
      */
-    std::string GetShardForKey(const std::string& key) const;
+    std::string_view PlacementKey(const std::string& key) const {
+        return hash_tags_ ? HashTag(key) : std::string_view(key);
+    }
     
     /**
      * Get information about a specific shard
@@ -68,6 +136,38 @@ public:
      */
     bool IsEmpty() const;
     
+    /**
+     * The strategy placing keys
+     */
+    const PlacementStrategy& GetStrategy() const { return *strategy_; }
+    
+    /**
+     * A copy of the ring (shards, weights, their order, the strategy and
+     * hash tag setting),
+     * to stage a topology change on before making it here
+     */
+    std::unique_ptr<HashRing> Clone() const;
+    
+    /**
+     * A stretch of the ring whose keys change owner: the ring hashes in
+     * (start, end], wrapping past the top when start >= end
+     */
+    struct MovedRange {
+        uint32_t start;
+        uint32_t end;
+        std::string from;   // "" when the ring had no shards
+        std::string to;     // "" when it has none left
+    };
+    
+    /**
+     * The ranges owned by a different shard in `target`, found by
+     * comparing the two placements between every virtual node of either
+     * ring. Neighbouring ranges moving between the same shards are merged.
+     * @return false if a placement does not go by ring position (jump and
+     *         rendezvous hashing): any key may have moved
+     */
+    bool MovedRanges(const HashRing& target, std::vector<MovedRange>* ranges) const;
+    
 private:
     /**
      * Compute hash value for a string
@@ -80,9 +180,31 @@ private:
      */
     std::string GetVirtualNodeKey(const std::string& shard_id, int virtual_index) const;
     
-    // Number of virtual nodes per physical shard
+    // Virtual nodes for a shard of this weight
+    int VirtualNodesFor(double weight) const;
+    
+    // Put a shard's virtual nodes [from, to) on the ring, or take them off
+    void AddVirtualNodes(const std::string& shard_id, int from, int to);
+    void RemoveVirtualNodes(const std::string& shard_id, int from, int to);
+    
+    /**
+     * Build a new placement from ring_ and shard_order_ and make it
+     * current, then free the one it replaced once no lookup may be
+     * reading it. Called with mutex_ held.
+     */
+    void PublishPlacement();
+    
+    // Counts a lookup in the epoch it started in, while it reads a placement
+    class ReadSection;
+    
+    // Lookups in progress that started in an epoch of this parity
+    int64_t Readers(uint64_t epoch) const;
+    
+    // Number of virtual nodes per physical shard of weight 1
     int virtual_nodes_per_shard_;
     
+    bool hash_tags_;
+    
     // Hash ring: hash value -> shard_id
     // Ordered map for efficient range queries
     std::map<uint32_t, std::string> ring_;
@@ -90,6 +212,29 @@ private:
     // Shard metadata: shard_id -> ShardInfo
     std::unordered_map<std::string, ShardInfo> shards_;
     
+    // Shards in a stable order for placements that number them; a removed
+    // shard's place goes to the last one
+    std::vector<std::string> shard_order_;
+    
+    std::shared_ptr<const PlacementStrategy> strategy_;
+    
+    // Every shard id the ring has had, which placements refer to; kept
+    // for the ring's lifetime. Guarded by mutex_.
+    std::unordered_set<std::string> names_;
+    
+    // The placement lookups use, and its owner (guarded by mutex_)
+    std::atomic<const Placement*> placement_{nullptr};
+    std::unique_ptr<Placement> current_;
+    
+    // Lookups in progress by epoch parity, striped over cache lines so
+    // threads looking up keys rarely write the same one
+    static constexpr size_t kReaderStripes = 8;
+    struct alignas(64) ReaderStripe {
+        std::array<std::atomic<int64_t>, 2> readers{};
+    };
+    std::atomic<uint64_t> epoch_{0};
+    mutable std::array<ReaderStripe, kReaderStripes> reader_stripes_;
+    
     // Thread safety
     mutable std::mutex mutex_;
 };
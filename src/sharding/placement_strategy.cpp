@@ -0,0 +1,257 @@
+#include "placement_strategy.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+
+namespace kvstore {
+
+namespace {
+
+const std::string kNoShard;
+
+// 64-bit FNV-1a, for strategies that need more than the ring's 32 bits
+uint64_t Fnv1aHash64(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : data) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// splitmix64's finalizer: FNV's low bits are weak on short, similar keys
+uint64_t Mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// The ring's copy of a shard id, which outlives the placement
+const std::string* Name(const PlacementInput& input, const std::string& shard_id) {
+    return &*input.names.find(shard_id);
+}
+
+std::vector<const std::string*> Names(const PlacementInput& input, const std::vector<std::string>& shard_ids) {
+    std::vector<const std::string*> names;
+    names.reserve(shard_ids.size());
+    for (const auto& shard_id : shard_ids) {
+        names.push_back(Name(input, shard_id));
+    }
+    return names;
+}
+
+// A compiled ring, as HashRing has always routed
+class RingPlacement final : public Placement {
+public:
+    RingPlacement(const std::map<uint32_t, std::string>& ring, const PlacementInput& input, RingHashVersion hash)
+        : table_(ring), names_(Names(input, table_.ShardIds())), hash_(hash) {}
+
+    const std::string& ShardFor(std::string_view key) const override {
+        return *ShardForHash(RingHash(key, hash_));
+    }
+
+    const std::string* ShardForHash(uint32_t hash) const override {
+        if (table_.Empty()) {
+            return &kNoShard;
+        }
+        return names_[table_.Lookup(hash)];
+    }
+
+private:
+    RoutingTable table_;
+    std::vector<const std::string*> names_;   // By the table's shard index
+    RingHashVersion hash_;
+};
+
+class JumpPlacement : public Placement {
+public:
+    explicit JumpPlacement(std::vector<const std::string*> shard_ids) : shard_ids_(std::move(shard_ids)) {}
+
+    const std::string& ShardFor(std::string_view key) const override {
+        if (shard_ids_.empty()) {
+            return kNoShard;
+        }
+        // Follow the key's jumps until the next would land past the end
+        uint64_t state = Mix(Fnv1aHash64(key));
+        int64_t bucket = -1;
+        int64_t next = 0;
+        const int64_t buckets = static_cast<int64_t>(shard_ids_.size());
+        while (next < buckets) {
+            bucket = next;
+            state = state * 2862933555777941757ull + 1;
+            next = static_cast<int64_t>((bucket + 1) * (static_cast<double>(1ll << 31) /
+                                                         static_cast<double>((state >> 33) + 1)));
+        }
+        return *shard_ids_[bucket];
+    }
+
+private:
+    std::vector<const std::string*> shard_ids_;
+};
+
+class RendezvousPlacement : public Placement {
+public:
+    RendezvousPlacement(std::vector<const std::string*> shard_ids, std::vector<double> weights)
+        : shard_ids_(std::move(shard_ids)), weights_(std::move(weights)) {
+        // A shard's seed is fixed by its id, so its scores do not change
+        // as other shards come and go
+        for (const std::string* shard_id : shard_ids_) {
+            seeds_.push_back(Mix(Fnv1aHash64(*shard_id)));
+        }
+        weighted_ = std::adjacent_find(weights_.begin(), weights_.end(), std::not_equal_to<double>()) !=
+                    weights_.end();
+    }
+
+    const std::string& ShardFor(std::string_view key) const override {
+        if (shard_ids_.empty()) {
+            return kNoShard;
+        }
+        uint64_t key_hash = Fnv1aHash64(key);
+        return *shard_ids_[weighted_ ? WeightedBest(key_hash) : Best(key_hash)];
+    }
+
+private:
+    // Equal weights: the highest hash wins
+    size_t Best(uint64_t key_hash) const {
+        size_t best = 0;
+        uint64_t best_score = Mix(key_hash ^ seeds_[0]);
+        for (size_t i = 1; i < seeds_.size(); ++i) {
+            uint64_t score = Mix(key_hash ^ seeds_[i]);
+            if (score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        return best;
+    }
+
+    size_t WeightedBest(uint64_t key_hash) const {
+        size_t best = 0;
+        double best_score = -std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < seeds_.size(); ++i) {
+            // 53 bits of the hash as a uniform in (0, 1)
+            double u = (static_cast<double>(Mix(key_hash ^ seeds_[i]) >> 11) + 0.5) * 0x1.0p-53;
+            double score = -weights_[i] / std::log(u);
+            if (score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        return best;
+    }
+
+    std::vector<const std::string*> shard_ids_;
+    std::vector<double> weights_;
+    std::vector<uint64_t> seeds_;
+    bool weighted_;
+};
+
+} // namespace
+
+uint32_t RingHash(std::string_view data, RingHashVersion version) {
+    uint32_t hash = 2166136261u;
+    for (char c : data) {
+        hash ^= static_cast<uint32_t>(c);
+        hash *= 16777619u;
+    }
+    if (version == RingHashVersion::FNV1A) {
+        return hash;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+std::string_view HashTag(std::string_view key) {
+    size_t open = key.find('{');
+    if (open == std::string_view::npos) {
+        return key;
+    }
+    size_t close = key.find('}', open + 1);
+    if (close == std::string_view::npos || close == open + 1) {
+        return key;
+    }
+    return key.substr(open + 1, close - open - 1);
+}
+
+std::unique_ptr<Placement> RingStrategy::Build(const PlacementInput& input) const {
+    return std::make_unique<RingPlacement>(input.ring, input, hash_);
+}
+
+std::unique_ptr<Placement> JumpHashStrategy::Build(const PlacementInput& input) const {
+    return std::make_unique<JumpPlacement>(Names(input, input.shard_ids));
+}
+
+std::unique_ptr<Placement> RendezvousStrategy::Build(const PlacementInput& input) const {
+    return std::make_unique<RendezvousPlacement>(Names(input, input.shard_ids), input.weights);
+}
+
+std::unique_ptr<Placement> BoundedLoadStrategy::Build(const PlacementInput& input) const {
+    const auto& ring = input.ring;
+    if (ring.empty() || input.shard_ids.empty()) {
+        return std::make_unique<RingPlacement>(ring, input, hash_);
+    }
+
+    // Arc i runs from the previous virtual node (exclusive) to node i; the
+    // first wraps round from the last
+    std::vector<uint32_t> hashes;
+    std::vector<std::string> owners;
+    for (const auto& [hash, shard_id] : ring) {
+        hashes.push_back(hash);
+        owners.push_back(shard_id);
+    }
+    const size_t nodes = hashes.size();
+    auto arc = [&](size_t i) -> uint64_t {
+        if (i == 0) {
+            return (uint64_t{1} << 32) - hashes[nodes - 1] + hashes[0];
+        }
+        return static_cast<uint64_t>(hashes[i]) - hashes[i - 1];
+    };
+
+    // Each shard may own up to (1 + epsilon) times its weight's share
+    double total_weight = 0;
+    for (double weight : input.weights) {
+        total_weight += weight;
+    }
+    std::unordered_map<std::string, double> capacity;
+    for (size_t i = 0; i < input.shard_ids.size(); ++i) {
+        capacity[input.shard_ids[i]] = (1.0 + epsilon_) * static_cast<double>(uint64_t{1} << 32) *
+                                       input.weights[i] / total_weight;
+    }
+    std::unordered_map<std::string, uint64_t> load;
+    std::map<uint32_t, std::string> bounded;
+    for (size_t i = 0; i < nodes; ++i) {
+        uint64_t length = arc(i);
+        const std::string* owner = nullptr;
+        // The node's own shard, else the next one clockwise with room
+        for (size_t step = 0; step < nodes && !owner; ++step) {
+            const std::string& candidate = owners[(i + step) % nodes];
+            if (load[candidate] + length <= capacity[candidate]) {
+                owner = &candidate;
+            }
+        }
+        if (!owner) {
+            // An arc no shard has room for: the least loaded for its
+            // capacity takes it
+            owner = &input.shard_ids.front();
+            for (const auto& shard_id : input.shard_ids) {
+                if (load[shard_id] / capacity[shard_id] < load[*owner] / capacity[*owner]) {
+                    owner = &shard_id;
+                }
+            }
+        }
+        load[*owner] += length;
+        bounded[hashes[i]] = *owner;
+    }
+    return std::make_unique<RingPlacement>(bounded, input, hash_);
+}
+
+} // namespace kvstore
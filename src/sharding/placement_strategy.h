@@ -0,0 +1,164 @@
+#pragma once
+
+#include "routing_table.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace kvstore {
+
+/**
+ * The hash that puts keys and virtual nodes on the ring. Switching a
+ * ring's hash moves most of its keys, so it is fixed by the strategy.
+ */
+enum class RingHashVersion {
+    FNV1A = 0,              // FNV-1a: the default, as rings have always placed keys
+    FNV1A_FINALIZED = 1,    // FNV-1a, then murmur3's 32-bit finalizer: spreads
+                            // virtual nodes evenly, so shares follow weights
+};
+
+/**
+ * The shards a placement is built from
+ */
+struct PlacementInput {
+    // Virtual node hash -> shard_id, for strategies built on the ring
+    const std::map<uint32_t, std::string>& ring;
+    // Every shard, in a stable order: a shard keeps its position until it
+    // is removed, when the last one takes its place
+    const std::vector<std::string>& shard_ids;
+    // Each shard's weight, in the same order
+    const std::vector<double>& weights;
+    // The shard ids again, kept by the ring for its lifetime: ShardFor
+    // returns references to these, so they outlive the placement
+    const std::unordered_set<std::string>& names;
+};
+
+/**
+ * A key -> shard mapping, fixed when built
+ *
+ * HashRing builds one per topology change and swaps it in atomically, so
+ * ShardFor is called without locks and must not allocate. A replaced
+ * placement is freed once no lookup is reading it.
+ */
+class Placement {
+public:
+    virtual ~Placement() = default;
+
+    /**
+     * The shard that owns a key, or "" if there are no shards. The
+     * reference is to one of PlacementInput::names, or to a static "".
+     */
+    virtual const std::string& ShardFor(std::string_view key) const = 0;
+
+    /**
+     * The shard owning a ring position, for placements that go by one
+     * (keys at RingHash(key) with the strategy's HashVersion); nullptr for
+     * those that do not
+     */
+    virtual const std::string* ShardForHash(uint32_t /*hash*/) const { return nullptr; }
+};
+
+/**
+ * How keys are spread over shards
+ */
+class PlacementStrategy {
+public:
+    virtual ~PlacementStrategy() = default;
+
+    virtual const char* Name() const = 0;
+    virtual std::unique_ptr<Placement> Build(const PlacementInput& input) const = 0;
+    
+    // The hash for ring positions, for strategies that go by them
+    virtual RingHashVersion HashVersion() const { return RingHashVersion::FNV1A; }
+};
+
+/**
+ * Consistent hashing on the virtual node ring: a key belongs to the first
+ * virtual node at or after its hash. The default. Weights are applied by
+ * HashRing, which gives shards virtual nodes in proportion to them; they
+ * are only followed closely with RingHashVersion::FNV1A_FINALIZED.
+ */
+class RingStrategy : public PlacementStrategy {
+public:
+    explicit RingStrategy(RingHashVersion hash = RingHashVersion::FNV1A) : hash_(hash) {}
+
+    const char* Name() const override { return hash_ == RingHashVersion::FNV1A ? "ring" : "ring-finalized"; }
+    std::unique_ptr<Placement> Build(const PlacementInput& input) const override;
+    RingHashVersion HashVersion() const override { return hash_; }
+
+private:
+    RingHashVersion hash_;
+};
+
+/**
+ * Jump consistent hash (Lamping & Veach): no ring and no memory beyond
+ * the shard list, near-perfect balance, O(log n) per lookup. Adding a
+ * shard moves the minimum; removing one moves its keys and the last
+ * shard's, since the last shard takes its position. Buckets are equal, so
+ * weights are ignored.
+ */
+class JumpHashStrategy : public PlacementStrategy {
+public:
+    const char* Name() const override { return "jump"; }
+    std::unique_ptr<Placement> Build(const PlacementInput& input) const override;
+};
+
+/**
+ * Rendezvous (highest random weight) hashing: a key belongs to the shard
+ * scoring highest for it. Adding or removing a shard moves only the keys
+ * it gains or loses, but a lookup scores every shard. With unequal
+ * weights the score is -weight / ln(u) for a uniform u, which gives each
+ * shard its weight's share and still moves only the changed shard's keys.
+ */
+class RendezvousStrategy : public PlacementStrategy {
+public:
+    const char* Name() const override { return "rendezvous"; }
+    std::unique_ptr<Placement> Build(const PlacementInput& input) const override;
+};
+
+/**
+ * Consistent hashing with bounded loads (Mirrokni, Thorup & Zadimoghaddam),
+ * applied to key space: no shard owns more than (1 + epsilon) times its
+ * fair share of the ring, shares being in proportion to weight. Going
+ * round the ring in hash order, an arc whose virtual node's shard is full
+ * passes to the next shard clockwise with room for it. Placement stays a
+ * pure function of the topology, so keys are found where they were
+ * written.
+ */
+class BoundedLoadStrategy : public PlacementStrategy {
+public:
+    explicit BoundedLoadStrategy(double epsilon = 0.25, RingHashVersion hash = RingHashVersion::FNV1A)
+        : epsilon_(epsilon), hash_(hash) {}
+
+    const char* Name() const override {
+        return hash_ == RingHashVersion::FNV1A ? "bounded-load" : "bounded-load-finalized";
+    }
+    std::unique_ptr<Placement> Build(const PlacementInput& input) const override;
+    RingHashVersion HashVersion() const override { return hash_; }
+
+private:
+    double epsilon_;
+    RingHashVersion hash_;
+};
+
+/**
+ * The ring's hash for keys and virtual nodes: FNV-1a, and with
+ * FNV1A_FINALIZED murmur3's 32-bit finalizer after it. FNV-1a alone
+ * leaves strings that differ only at the end ("shard-1:0", "shard-1:1",
+ * ...) clustered on the ring.
+ */
+uint32_t RingHash(std::string_view data, RingHashVersion version = RingHashVersion::FNV1A);
+
+/**
+ * The part of a key that is hashed when hash tags are on: what is between
+ * the first '{' and the first '}' after it, if that is not empty, else the
+ * whole key (Redis Cluster's rule). "user:{42}:profile" and
+ * "user:{42}:cart" both hash as "42"; "{}x" and "x{" hash whole.
+ */
+std::string_view HashTag(std::string_view key);
+
+} // namespace kvstore
@@ -0,0 +1,215 @@
+#include "router_metrics.h"
+#include <algorithm>
+#include <cmath>
+
+namespace kvstore {
+
+const char* RouterOpName(RouterOp op) {
+    switch (op) {
+        case RouterOp::GET: return "get";
+        case RouterOp::SET: return "set";
+        case RouterOp::DELETE: return "delete";
+        case RouterOp::CONTAINS: return "contains";
+        case RouterOp::EXPIRE: return "expire";
+        case RouterOp::TTL: return "ttl";
+        case RouterOp::MULTI_GET: return "multi_get";
+        case RouterOp::MULTI_SET: return "multi_set";
+        case RouterOp::MULTI_DELETE: return "multi_delete";
+    }
+    return "unknown";
+}
+
+uint64_t LatencySnapshot::Percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * static_cast<double>(count))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return LatencyHistogram::BucketUpperBound(i, precision_bits);
+        }
+    }
+    return Max();
+}
+
+uint64_t LatencySnapshot::Max() const {
+    for (size_t i = counts.size(); i > 0; --i) {
+        if (counts[i - 1] > 0) {
+            return LatencyHistogram::BucketUpperBound(i - 1, precision_bits);
+        }
+    }
+    return 0;
+}
+
+double LatencySnapshot::Mean() const {
+    if (count == 0) {
+        return 0;
+    }
+    // Each sample at the middle of its bucket
+    double sum = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] == 0) continue;
+        uint64_t upper = LatencyHistogram::BucketUpperBound(i, precision_bits);
+        uint64_t lower = i == 0 ? 0 : LatencyHistogram::BucketUpperBound(i - 1, precision_bits) + 1;
+        sum += static_cast<double>(counts[i]) * (static_cast<double>(lower) + static_cast<double>(upper)) / 2;
+    }
+    return sum / static_cast<double>(count);
+}
+
+void LatencySnapshot::Merge(const LatencySnapshot& other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (count == 0) {
+        *this = other;
+        return;
+    }
+    for (size_t i = 0; i < counts.size() && i < other.counts.size(); ++i) {
+        counts[i] += other.counts[i];
+    }
+    count += other.count;
+}
+
+LatencyHistogram::LatencyHistogram(int precision_bits)
+    : precision_bits_(std::clamp(precision_bits, 1, kMaxPrecisionBits)),
+      size_(BucketCount(precision_bits_)),
+      buckets_(new std::atomic<uint64_t>[size_]) {
+    Reset();
+}
+
+size_t LatencyHistogram::BucketCount(int precision_bits) {
+    // [0, 2^(p+1)) one per value, then 2^p per power of two up to the range
+    return static_cast<size_t>(kRangeBits - precision_bits + 1) << precision_bits;
+}
+
+size_t LatencyHistogram::BucketFor(uint64_t micros, int precision_bits) {
+    const uint64_t sub_buckets = uint64_t{1} << precision_bits;
+    micros = std::min(micros, (uint64_t{1} << kRangeBits) - 1);
+    if (micros < 2 * sub_buckets) {
+        return static_cast<size_t>(micros);
+    }
+    int top_bit = 63 - __builtin_clzll(micros);
+    int shift = top_bit - precision_bits;
+    return static_cast<size_t>((shift + 1) * sub_buckets + ((micros >> shift) - sub_buckets));
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(size_t bucket, int precision_bits) {
+    const uint64_t sub_buckets = uint64_t{1} << precision_bits;
+    if (bucket < 2 * sub_buckets) {
+        return bucket;
+    }
+    uint64_t shift = bucket / sub_buckets - 1;
+    uint64_t lower = (sub_buckets + bucket % sub_buckets) << shift;
+    return lower + (uint64_t{1} << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t micros) {
+    buckets_[BucketFor(micros, precision_bits_)].fetch_add(1, std::memory_order_relaxed);
+}
+
+LatencySnapshot LatencyHistogram::Snapshot() const {
+    LatencySnapshot snapshot;
+    snapshot.precision_bits = precision_bits_;
+    snapshot.counts.resize(size_);
+    for (size_t i = 0; i < size_; ++i) {
+        snapshot.counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.counts[i];
+    }
+    if (snapshot.count == 0) {
+        snapshot.counts.clear();
+    }
+    return snapshot;
+}
+
+void LatencyHistogram::Reset() {
+    for (size_t i = 0; i < size_; ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+ShardMetrics::ShardMetrics(int precision_bits) {
+    for (auto& histogram : latency_) {
+        histogram = std::make_unique<LatencyHistogram>(precision_bits);
+    }
+}
+
+size_t ShardMetrics::StripeIndex() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return stripe;
+}
+
+int64_t ShardMetrics::Sum(ShardCounter counter) const {
+    int64_t sum = 0;
+    for (const auto& stripe : stripes_) {
+        sum += stripe.counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+void ShardMetrics::RecordLatency(RouterOp op, std::chrono::steady_clock::time_point start,
+                                 std::chrono::steady_clock::time_point end) {
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    latency_[static_cast<size_t>(op)]->Record(static_cast<uint64_t>(std::max<int64_t>(micros, 0)));
+}
+
+void ShardMetrics::Reset() {
+    for (auto& stripe : stripes_) {
+        for (size_t i = 0; i < kShardCounters; ++i) {
+            if (i != static_cast<size_t>(ShardCounter::IN_FLIGHT)) {
+                stripe.counters[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+    for (auto& histogram : latency_) {
+        histogram->Reset();
+    }
+}
+
+RouterMetrics::RouterMetrics(int precision_bits) : precision_bits_(precision_bits) {
+    indexes_.push_back(std::make_unique<Index>());
+    index_.store(indexes_.back().get(), std::memory_order_release);
+    ForShard("");
+}
+
+ShardMetrics& RouterMetrics::ForShard(const std::string& shard_id) {
+    const Index* index = index_.load(std::memory_order_acquire);
+    auto it = index->find(shard_id);
+    if (it != index->end()) {
+        return *it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    index = index_.load(std::memory_order_acquire);
+    it = index->find(shard_id);
+    if (it != index->end()) {
+        return *it->second;
+    }
+    shard_ids_.push_back(shard_id);
+    shards_.push_back(std::make_unique<ShardMetrics>(precision_bits_));
+    auto next = std::make_unique<Index>(*index);
+    (*next)[shard_id] = shards_.back().get();
+    indexes_.push_back(std::move(next));
+    index_.store(indexes_.back().get(), std::memory_order_release);
+    return *shards_.back();
+}
+
+std::vector<std::pair<std::string, const ShardMetrics*>> RouterMetrics::All() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<std::string, const ShardMetrics*>> all;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        all.emplace_back(shard_ids_[i], shards_[i].get());
+    }
+    return all;
+}
+
+void RouterMetrics::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& shard : shards_) {
+        shard->Reset();
+    }
+}
+
+} // namespace kvstore
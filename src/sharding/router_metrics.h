@@ -0,0 +1,191 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace kvstore {
+
+/**
+ * The router operations timed separately
+ */
+enum class RouterOp {
+    GET,
+    SET,
+    DELETE,
+    CONTAINS,
+    EXPIRE,
+    TTL,
+    MULTI_GET,
+    MULTI_SET,
+    MULTI_DELETE,
+};
+
+constexpr size_t kRouterOps = 9;
+
+const char* RouterOpName(RouterOp op);
+
+/**
+ * A latency distribution copied out of a LatencyHistogram, in microseconds
+ */
+struct LatencySnapshot {
+    int precision_bits{0};
+    std::vector<uint64_t> counts;   // Per bucket; empty if nothing was recorded
+    uint64_t count{0};
+
+    /**
+     * The latency a fraction p of the samples are at or below (the upper
+     * bound of the bucket holding it); 0 if there are none
+     */
+    uint64_t Percentile(double p) const;
+    uint64_t Max() const;
+    double Mean() const;
+
+    // Add in a snapshot of the same precision
+    void Merge(const LatencySnapshot& other);
+};
+
+/**
+ * Latency histogram in the style of HdrHistogram: log-linear buckets,
+ * exact up to 2^(precision_bits + 1) microseconds and then 2^precision_bits
+ * buckets per power of two, so each value is kept to within
+ * 2^-precision_bits of itself (about 3% at the default of 5). Values past
+ * 2^kRangeBits microseconds (about 67 s) go in the top bucket.
+ *
+ * Recording is one relaxed atomic increment on the value's bucket, with
+ * no lock and no count or sum that every thread would write; those are
+ * worked out from the buckets when read.
+ */
+class LatencyHistogram {
+public:
+    static constexpr int kDefaultPrecisionBits = 5;
+    static constexpr int kMaxPrecisionBits = 10;
+    static constexpr int kRangeBits = 26;
+
+    explicit LatencyHistogram(int precision_bits = kDefaultPrecisionBits);
+
+    void Record(uint64_t micros);
+    LatencySnapshot Snapshot() const;
+    void Reset();
+
+    // Bucket layout for a precision
+    static size_t BucketCount(int precision_bits);
+    static size_t BucketFor(uint64_t micros, int precision_bits);
+    static uint64_t BucketUpperBound(size_t bucket, int precision_bits);
+
+private:
+    int precision_bits_;
+    size_t size_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+};
+
+/**
+ * The counts kept per shard
+ */
+enum class ShardCounter {
+    REQUESTS,
+    SUCCESSES,
+    FAILURES,
+    REPLICA_READS,        // Reads answered by a replica
+    REPLICA_FALLBACKS,    // Replica reads redone on the primary
+    LEADER_CHANGES,
+    MIGRATION_READS,      // Moving keys found on their old owner
+    CROSS_SHARD_CALLS,    // Multi-key calls to more than one shard (router-wide slot)
+    SHED,                 // Calls refused while the shard's circuit was open
+    RETRIES,              // Calls sent again after failing
+    CIRCUIT_OPENS,        // Times the shard's circuit opened
+    IN_FLIGHT,            // Requests started and not yet counted
+};
+
+constexpr size_t kShardCounters = 12;
+
+/**
+ * One shard's statistics, written without locks
+ *
+ * Counters are split into stripes, each on its own cache lines, and a
+ * thread always adds to the same stripe: threads on different stripes
+ * never write the same line, and a read sums the stripes. The in-flight
+ * gauge is a counter like the rest (an asynchronous request may finish
+ * on another stripe than it started on; the sum is still right).
+ */
+class ShardMetrics {
+public:
+    static constexpr size_t kStripes = 8;
+
+    explicit ShardMetrics(int precision_bits);
+
+    void Add(ShardCounter counter, int64_t delta = 1) {
+        stripes_[StripeIndex()].counters[static_cast<size_t>(counter)].fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    int64_t Sum(ShardCounter counter) const;
+
+    // A request's latency, from `start` to `end`
+    void RecordLatency(RouterOp op, std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end);
+
+    LatencySnapshot Latency(RouterOp op) const { return latency_[static_cast<size_t>(op)]->Snapshot(); }
+
+    // Zero the counts and histograms, except the in-flight gauge
+    void Reset();
+
+private:
+    struct alignas(64) Stripe {
+        std::array<std::atomic<int64_t>, kShardCounters> counters{};
+    };
+
+    // This thread's stripe, assigned round-robin on first use
+    static size_t StripeIndex();
+
+    std::array<Stripe, kStripes> stripes_;
+    std::array<std::unique_ptr<LatencyHistogram>, kRouterOps> latency_;
+};
+
+/**
+ * Every shard's ShardMetrics, found by shard id without a lock
+ *
+ * Shards are numbered as first seen. The id -> number index is immutable
+ * once published: a new shard is added to a copy, under a mutex, and the
+ * copy swapped in. Replaced indexes are kept until the metrics are
+ * destroyed, so a lookup never reads a freed one; there is one per shard
+ * ever seen, so they stay few. The shard id "" holds requests that had no shard and the
+ * router-wide counts.
+ */
+class RouterMetrics {
+public:
+    explicit RouterMetrics(int precision_bits = LatencyHistogram::kDefaultPrecisionBits);
+
+    RouterMetrics(const RouterMetrics&) = delete;
+    RouterMetrics& operator=(const RouterMetrics&) = delete;
+
+    /**
+     * A shard's metrics, created on first use. The reference stays valid
+     * for the metrics' lifetime, after the shard leaves too.
+     */
+    ShardMetrics& ForShard(const std::string& shard_id);
+
+    // Every shard's metrics, by number ("" first)
+    std::vector<std::pair<std::string, const ShardMetrics*>> All() const;
+
+    void Reset();
+
+private:
+    using Index = std::unordered_map<std::string, ShardMetrics*>;
+
+    int precision_bits_;
+    std::atomic<const Index*> index_{nullptr};
+
+    mutable std::mutex mutex_;          // Guards adding shards
+    std::vector<std::string> shard_ids_;
+    std::vector<std::unique_ptr<ShardMetrics>> shards_;
+    std::vector<std::unique_ptr<Index>> indexes_;   // Every one published (current last)
+};
+
+} // namespace kvstore
@@ -0,0 +1,40 @@
+#include "routing_table.h"
+#include <unordered_map>
+
+namespace kvstore {
+
+RoutingTable::RoutingTable(const std::map<uint32_t, std::string>& ring) {
+    // Number the shards, and list the virtual nodes in hash order
+    std::unordered_map<std::string, uint32_t> indices;
+    std::vector<std::pair<uint32_t, uint32_t>> sorted;
+    sorted.reserve(ring.size());
+    for (const auto& [hash, shard_id] : ring) {
+        auto [it, added] = indices.emplace(shard_id, static_cast<uint32_t>(shard_ids_.size()));
+        if (added) {
+            shard_ids_.push_back(shard_id);
+        }
+        sorted.emplace_back(hash, it->second);
+    }
+
+    hashes_.resize(sorted.size() + 1);
+    owners_.resize(sorted.size() + 1);
+    size_t next = 0;
+    Layout(sorted, next, 1);
+    if (!sorted.empty()) {
+        owners_[0] = sorted.front().second;
+    }
+}
+
+void RoutingTable::Layout(const std::vector<std::pair<uint32_t, uint32_t>>& sorted, size_t& next, size_t k) {
+    // In-order walk of the implicit tree hands out the sorted entries
+    if (k > sorted.size()) {
+        return;
+    }
+    Layout(sorted, next, 2 * k);
+    hashes_[k] = sorted[next].first;
+    owners_[k] = sorted[next].second;
+    next++;
+    Layout(sorted, next, 2 * k + 1);
+}
+
+} // namespace kvstore
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace kvstore {
+
+/**
+ * A hash ring compiled for lookups
+ *
+ * The ring's virtual node hashes are laid out as an implicit binary tree
+ * in breadth-first (Eytzinger) order: the node at k has children at 2k
+ * and 2k+1. A search descends with one comparison per level and no
+ * data-dependent branch, and the next levels it will touch are adjacent
+ * in memory, so they can be prefetched.
+ *
+ * A table never changes once built. HashRing builds a new one on every
+ * topology change and swaps it in, so lookups need no lock.
+ */
+class RoutingTable {
+public:
+    /**
+     * Compile a ring of virtual node hash -> shard_id
+     */
+    explicit RoutingTable(const std::map<uint32_t, std::string>& ring);
+
+    /**
+     * The shard owning a hash: the first virtual node at or after it,
+     * wrapping past the top of the ring
+     * @return Index into ShardIds(); the table must not be empty
+     */
+    size_t Lookup(uint32_t hash) const {
+        const size_t n = hashes_.size() - 1;
+        const uint32_t* hashes = hashes_.data();
+        size_t k = 1;
+        while (k <= n) {
+            // 16 hashes to a cache line: four levels down (clamped, as a
+            // pointer past the end of the table is undefined even unread)
+            __builtin_prefetch(hashes + std::min(16 * k, n));
+            k = 2 * k + (hashes[k] < hash);
+        }
+        // Undo the right turns taken after the last left one: k is then the
+        // smallest hash >= the key, or 0 if there is none (owners_[0] is
+        // the lowest virtual node's shard, where the ring wraps)
+        k >>= __builtin_ffsll(~static_cast<long long>(k));
+        return owners_[k];
+    }
+
+    const std::string& ShardId(size_t index) const { return shard_ids_[index]; }
+    const std::vector<std::string>& ShardIds() const { return shard_ids_; }
+    bool Empty() const { return shard_ids_.empty(); }
+
+private:
+    // Fill hashes_ and owners_ from slot k on, in order from `sorted`
+    void Layout(const std::vector<std::pair<uint32_t, uint32_t>>& sorted, size_t& next, size_t k);
+
+    std::vector<uint32_t> hashes_;          // Eytzinger order from slot 1; slot 0 unused
+    std::vector<uint32_t> owners_;          // Shard index of each slot
+    std::vector<std::string> shard_ids_;
+};
+
+} // namespace kvstore
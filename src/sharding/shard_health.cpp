@@ -0,0 +1,156 @@
+#include "shard_health.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace kvstore {
+
+namespace {
+
+int64_t SteadyNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+int64_t HealthOptions::DeadlineMs(RouterOp op) const {
+    switch (op) {
+        case RouterOp::GET:
+        case RouterOp::CONTAINS:
+        case RouterOp::TTL:
+            return read_deadline_ms;
+        case RouterOp::SET:
+        case RouterOp::DELETE:
+        case RouterOp::EXPIRE:
+            return write_deadline_ms;
+        case RouterOp::MULTI_GET:
+        case RouterOp::MULTI_SET:
+        case RouterOp::MULTI_DELETE:
+            return multi_key_deadline_ms;
+    }
+    return 0;
+}
+
+bool HealthOptions::Idempotent(RouterOp op) {
+    // Writes are left alone: a retried DELETE would report the key gone,
+    // and a retried SET could land after a newer one
+    return op == RouterOp::GET || op == RouterOp::CONTAINS || op == RouterOp::TTL || op == RouterOp::MULTI_GET;
+}
+
+CircuitBreaker::CircuitBreaker(const HealthOptions& options)
+    : consecutive_limit_(std::max(options.consecutive_failures, 1)),
+      probe_limit_(std::max(options.unhealthy_probes, 1)),
+      open_ms_(std::max<int64_t>(options.open_ms, 1)) {
+}
+
+bool CircuitBreaker::Allow() {
+    if (State() == CircuitState::CLOSED) {
+        return true;
+    }
+    // The call that moves the retry time on is the trial
+    int64_t now = SteadyNowMs();
+    int64_t retry_at = retry_at_ms_.load();
+    if (now < retry_at || !retry_at_ms_.compare_exchange_strong(retry_at, now + open_ms_)) {
+        return false;
+    }
+    int open = static_cast<int>(CircuitState::OPEN);
+    state_.compare_exchange_strong(open, static_cast<int>(CircuitState::HALF_OPEN));
+    return true;
+}
+
+CircuitChange CircuitBreaker::RecordSuccess() {
+    if (failures_.load(std::memory_order_relaxed) != 0) {
+        failures_.store(0, std::memory_order_relaxed);
+    }
+    return State() == CircuitState::CLOSED ? CircuitChange::NONE : Close();
+}
+
+CircuitChange CircuitBreaker::RecordFailure() {
+    int failures = failures_.fetch_add(1, std::memory_order_relaxed) + 1;
+    int half_open = static_cast<int>(CircuitState::HALF_OPEN);
+    if (State() == CircuitState::HALF_OPEN) {
+        // The trial failed: wait again
+        retry_at_ms_ = SteadyNowMs() + open_ms_;
+        state_.compare_exchange_strong(half_open, static_cast<int>(CircuitState::OPEN));
+        return CircuitChange::NONE;
+    }
+    return failures >= consecutive_limit_ ? Open() : CircuitChange::NONE;
+}
+
+CircuitChange CircuitBreaker::RecordProbe(bool healthy) {
+    if (healthy) {
+        failed_probes_.store(0, std::memory_order_relaxed);
+        return Close();
+    }
+    return failed_probes_.fetch_add(1, std::memory_order_relaxed) + 1 >= probe_limit_ ? Open()
+                                                                                     : CircuitChange::NONE;
+}
+
+CircuitChange CircuitBreaker::Trip() {
+    return Open();
+}
+
+CircuitChange CircuitBreaker::Open() {
+    if (State() != CircuitState::CLOSED) {
+        return CircuitChange::NONE;
+    }
+    // Set before the state, so a call that sees the circuit open waits
+    retry_at_ms_ = SteadyNowMs() + open_ms_;
+    int closed = static_cast<int>(CircuitState::CLOSED);
+    if (state_.compare_exchange_strong(closed, static_cast<int>(CircuitState::OPEN))) {
+        return CircuitChange::OPENED;
+    }
+    return CircuitChange::NONE;
+}
+
+CircuitChange CircuitBreaker::Close() {
+    failures_.store(0, std::memory_order_relaxed);
+    int state = state_.load();
+    while (state != static_cast<int>(CircuitState::CLOSED)) {
+        if (state_.compare_exchange_weak(state, static_cast<int>(CircuitState::CLOSED))) {
+            return CircuitChange::CLOSED;
+        }
+    }
+    return CircuitChange::NONE;
+}
+
+RetryBudget::RetryBudget(const HealthOptions& options)
+    : max_(std::max(options.retry_tokens, 1) * int64_t{1000}),
+      ratio_(static_cast<int64_t>(std::max(options.retry_token_ratio, 0.0) * 1000)),
+      tokens_(max_) {
+}
+
+void RetryBudget::RecordSuccess() {
+    // A full budget, the usual case, is left unwritten
+    int64_t tokens = tokens_.load(std::memory_order_relaxed);
+    while (tokens < max_ &&
+           !tokens_.compare_exchange_weak(tokens, std::min(max_, tokens + ratio_), std::memory_order_relaxed)) {
+    }
+}
+
+void RetryBudget::RecordFailure() {
+    int64_t tokens = tokens_.load(std::memory_order_relaxed);
+    while (tokens > 0 &&
+           !tokens_.compare_exchange_weak(tokens, std::max<int64_t>(0, tokens - 1000), std::memory_order_relaxed)) {
+    }
+}
+
+bool RetryBudget::AllowRetry() const {
+    return tokens_.load(std::memory_order_relaxed) > max_ / 2;
+}
+
+int64_t RetryBackoffMs(int retry, int64_t base_ms, int64_t max_ms) {
+    int64_t cap = std::max<int64_t>(base_ms, 0);
+    for (int i = 0; i < retry && cap < max_ms; ++i) {
+        cap *= 2;
+    }
+    cap = std::min(cap, std::max<int64_t>(max_ms, 0));
+    if (cap <= 0) {
+        return 0;
+    }
+    thread_local std::minstd_rand rng(std::random_device{}());
+    return std::uniform_int_distribution<int64_t>(0, cap)(rng);
+}
+
+} // namespace kvstore
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "router_metrics.h"
+#include <atomic>
+#include <cstdint>
+
+namespace kvstore {
+
+/**
+ * How a router bounds requests to a shard and reacts when one stops
+ * answering: deadlines, health probes, circuit breaking and retries
+ */
+struct HealthOptions {
+    // How long a call to a shard may take, leader redirects and retries
+    // included; 0 = no deadline
+    int64_t read_deadline_ms = 5000;        // GET, CONTAINS, TTL
+    int64_t write_deadline_ms = 5000;       // SET, DELETE, EXPIRE
+    int64_t multi_key_deadline_ms = 10000;  // Each shard's request in a multi-key call
+
+    // Each shard's primary is asked for its stats this often; 0 = no
+    // probes (and no failure-rate checks, which run with them)
+    int64_t probe_interval_ms = 1000;
+    int64_t probe_timeout_ms = 500;
+    // Failed probes in a row that open a shard's circuit
+    int unhealthy_probes = 2;
+
+    // Outlier detection: failed calls in a row that open the circuit...
+    int consecutive_failures = 5;
+    // ...or the share of requests failing over a probe interval, once
+    // there are at least min_requests of them; 0 = off
+    double failure_rate = 0.5;
+    int64_t min_requests = 20;
+    // How long an open circuit refuses calls before letting one through
+    // as a trial
+    int64_t open_ms = 1000;
+    // While a shard's circuit is open, its reads are served by a replica
+    // (as ReadConsistency::ANY) rather than refused
+    bool replica_reads_when_open = true;
+
+    // Reads (GET, CONTAINS, TTL, MULTI_GET) that failed with UNAVAILABLE
+    // are retried up to this many times, after a random wait of up to
+    // retry_backoff_ms, doubled each retry up to retry_backoff_max_ms
+    int max_retries = 2;
+    int64_t retry_backoff_ms = 20;
+    int64_t retry_backoff_max_ms = 200;
+    // Retry budget per shard, as gRPC throttles retries: a failure takes
+    // a token and a success gives back retry_token_ratio of one, and
+    // retries stop while half or fewer of retry_tokens are left
+    int retry_tokens = 10;
+    double retry_token_ratio = 0.1;
+
+    // The deadline for an operation, in milliseconds (0 = none)
+    int64_t DeadlineMs(RouterOp op) const;
+    // Whether an operation may be sent again after a failure
+    static bool Idempotent(RouterOp op);
+};
+
+enum class CircuitState {
+    CLOSED,     // Calls go through
+    OPEN,       // Calls are refused
+    HALF_OPEN   // One trial call is through; its outcome closes or reopens the circuit
+};
+
+// A change of state worth reporting
+enum class CircuitChange {
+    NONE,
+    OPENED,
+    CLOSED
+};
+
+/**
+ * A shard primary's circuit breaker
+ *
+ * Opened by failures in a row, failed probes, or a failure rate found by
+ * the router's probe round; closed by a successful trial or probe. The
+ * state is held in atomics, and a call to a healthy shard only reads
+ * them: a success writes nothing unless failures had been counted.
+ */
+class CircuitBreaker {
+public:
+    explicit CircuitBreaker(const HealthOptions& options);
+
+    /**
+     * Whether a call may go to the shard now. Once an open circuit has
+     * waited open_ms, one call is let through as a trial, then another
+     * open_ms later if that one never reports.
+     */
+    bool Allow();
+
+    // The outcome of a call Allow() let through
+    CircuitChange RecordSuccess();
+    CircuitChange RecordFailure();
+
+    // The outcome of a health probe
+    CircuitChange RecordProbe(bool healthy);
+
+    // Open the circuit (a failure rate too high), if closed
+    CircuitChange Trip();
+
+    // Close the circuit, if open
+    CircuitChange Close();
+
+    CircuitState State() const { return static_cast<CircuitState>(state_.load(std::memory_order_acquire)); }
+
+private:
+    CircuitChange Open();
+
+    int consecutive_limit_;
+    int probe_limit_;
+    int64_t open_ms_;
+    std::atomic<int> state_{static_cast<int>(CircuitState::CLOSED)};
+    std::atomic<int64_t> retry_at_ms_{0};       // When an open circuit next lets a trial through
+    std::atomic<int> failures_{0};              // Failed calls in a row
+    std::atomic<int> failed_probes_{0};         // Failed probes in a row
+};
+
+/**
+ * A shard's retry budget: retries are allowed while more than half of the
+ * tokens are left. Failures spend a token and successes earn back a
+ * fraction of one, so a shard that keeps failing gets retried at most
+ * about token_ratio times per success, and not at all once the budget
+ * runs down. Tokens are kept in thousandths.
+ */
+class RetryBudget {
+public:
+    explicit RetryBudget(const HealthOptions& options);
+
+    void RecordSuccess();
+    void RecordFailure();
+    bool AllowRetry() const;
+
+private:
+    int64_t max_;
+    int64_t ratio_;
+    std::atomic<int64_t> tokens_;
+};
+
+/**
+ * The wait before a retry: random between 0 and base doubled for each
+ * retry before it, capped ("full jitter"), so clients retrying together
+ * spread out
+ */
+int64_t RetryBackoffMs(int retry, int64_t base_ms, int64_t max_ms);
+
+} // namespace kvstore
@@ -6,6 +6,10 @@
 
 namespace kvstore {
 
+// Trailing metadata on a write refused by a replica: the address of the
+// node that takes the shard's writes, when the replica knows it
+inline constexpr char kLeaderMetadataKey[] = "kvstore-leader";
+
 /**
  * Information about a shard in the cluster
  */
@@ -15,12 +19,14 @@ struct ShardInfo {
     std::vector<std::string> replica_addresses; // Replica addresses
     bool is_available;                          // Health status
     uint64_t key_count;                         // Approximate number of keys
+    double weight;                              // Relative capacity; 1 = a standard shard
+    int virtual_nodes;                          // On the hash ring, in proportion to weight
     
     ShardInfo() 
-        : is_available(true), key_count(0) {}
+        : is_available(true), key_count(0), weight(1.0), virtual_nodes(0) {}
     
     ShardInfo(const std::string& id, const std::string& addr)
-        : shard_id(id), address(addr), is_available(true), key_count(0) {}
+        : shard_id(id), address(addr), is_available(true), key_count(0), weight(1.0), virtual_nodes(0) {}
 };
 
 } // namespace kvstore
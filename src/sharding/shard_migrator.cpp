@@ -0,0 +1,285 @@
+#include "shard_migrator.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+using grpc::ClientContext;
+using grpc::Status;
+
+namespace kvstore {
+
+namespace {
+
+// Import calls also stop at this size, whatever options.batch_keys says
+constexpr size_t kBatchBytes = 1 << 20;
+constexpr int64_t kRetryBackoffMs = 200;
+
+} // namespace
+
+ShardMigrator::ShardMigrator(const HashRing& current, std::unique_ptr<HashRing> target,
+                             const MigrationOptions& options)
+    : target_(std::move(target)), options_(options) {
+    options_.batch_keys = std::max<size_t>(options_.batch_keys, 1);
+
+    // Connections to every shard of either ring
+    for (const HashRing* ring : {&current, static_cast<const HashRing*>(target_.get())}) {
+        for (const ShardInfo& shard : ring->GetAllShards()) {
+            if (stubs_.count(shard.shard_id) == 0) {
+                stubs_[shard.shard_id] = KeyValueStore::NewStub(
+                    grpc::CreateChannel(shard.address, grpc::InsecureChannelCredentials()));
+            }
+        }
+    }
+
+    std::vector<HashRing::MovedRange> moved;
+    if (current.MovedRanges(*target_, &moved)) {
+        // Ranges grouped by old owner, each scanned in one pass. A range
+        // with no old owner holds nothing; one with no new owner is lost
+        // (only when the last shard goes, which the router refuses).
+        std::unordered_map<std::string, size_t> index;
+        for (const auto& range : moved) {
+            if (range.from.empty() || range.to.empty()) continue;
+            auto [it, added] = index.emplace(range.from, sources_.size());
+            if (added) {
+                sources_.push_back({range.from, {}});
+            }
+            HashRange scanned;
+            scanned.set_start(range.start);
+            scanned.set_end(range.end);
+            sources_[it->second].ranges.push_back(scanned);
+        }
+        stats_.ranges = moved.size();
+    } else {
+        // Keys move between any two shards: scan them all
+        for (const ShardInfo& shard : current.GetAllShards()) {
+            sources_.push_back({shard.shard_id, {}});
+        }
+    }
+}
+
+KeyValueStore::Stub* ShardMigrator::Stub(const std::string& shard_id) {
+    auto it = stubs_.find(shard_id);
+    return it != stubs_.end() ? it->second.get() : nullptr;
+}
+
+void ShardMigrator::RecordDelete(const std::string& key) {
+    std::unique_lock<std::mutex> lock(import_mutex_);
+    deleted_.insert(key);
+    // A copy being written could land after the delete
+    import_cv_.wait(lock, [this, &key] { return importing_.count(key) == 0; });
+}
+
+bool ShardMigrator::CopyKey(const std::string& key, const std::string& from, const std::string& to) {
+    KeyValueStore::Stub* source = Stub(from);
+    if (!source) {
+        return false;
+    }
+
+    KeysRequest request;
+    request.add_keys(key);
+    Entries entries;
+    ClientContext context;
+    if (!source->ExportKeys(&context, request, &entries).ok()) {
+        return false;
+    }
+    if (entries.entries_size() == 0) {
+        // Not on the old owner either: nothing to copy
+        return true;
+    }
+    return Flush(from, to, entries);
+}
+
+bool ShardMigrator::Copy() {
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        started_ = std::chrono::steady_clock::now();
+        throttle_base_ = stats_.keys_scanned;
+    }
+
+    bool copied = true;
+    for (const Source& source : sources_) {
+        int attempt = 0;
+        while (!CopyFrom(source)) {
+            if (++attempt > options_.max_retries) {
+                std::cerr << "Migration could not copy keys from shard '" << source.shard_id << "'" << std::endl;
+                copied = false;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(kRetryBackoffMs * attempt));
+        }
+        if (!copied) break;
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.copy_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+    return copied;
+}
+
+bool ShardMigrator::CopyFrom(const Source& source) {
+    KeyValueStore::Stub* stub = Stub(source.shard_id);
+    if (!stub) {
+        return false;
+    }
+
+    ScanRangeRequest request;
+    request.set_hash_tags(target_->HashTags());
+    request.set_hash_version(static_cast<uint32_t>(target_->GetStrategy().HashVersion()));
+    for (const HashRange& range : source.ranges) {
+        *request.add_ranges() = range;
+    }
+    ClientContext context;
+    auto reader = stub->ScanRange(&context, request);
+
+    // A batch per new owner, sent when full
+    std::unordered_map<std::string, Entries> batches;
+    std::unordered_map<std::string, size_t> batch_bytes;
+    SnapshotChunk chunk;
+    bool flushed = true;
+    while (flushed && reader->Read(&chunk)) {
+        for (SnapshotEntry& entry : *chunk.mutable_entries()) {
+            const std::string& to = target_->GetShardForKey(entry.key());
+            if (to == source.shard_id || to.empty()) continue;
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                stats_.keys_scanned++;
+            }
+
+            size_t& bytes = batch_bytes[to];
+            bytes += entry.key().size() + entry.value().size();
+            Entries& batch = batches[to];
+            *batch.add_entries() = std::move(entry);
+            if (static_cast<size_t>(batch.entries_size()) >= options_.batch_keys || bytes >= kBatchBytes) {
+                flushed = Flush(source.shard_id, to, batch);
+                batch.Clear();
+                bytes = 0;
+                if (!flushed) break;
+                Throttle();
+            }
+        }
+    }
+    for (auto& [to, batch] : batches) {
+        if (!flushed) break;
+        if (batch.entries_size() > 0) {
+            flushed = Flush(source.shard_id, to, batch);
+        }
+    }
+
+    if (!flushed) {
+        context.TryCancel();
+    }
+    Status status = reader->Finish();
+    if (!status.ok() && flushed) {
+        std::cerr << "Scan of shard '" << source.shard_id << "' failed: " << status.error_message() << std::endl;
+    }
+    return flushed && status.ok();
+}
+
+bool ShardMigrator::Flush(const std::string& from, const std::string& to, Entries& batch) {
+    KeyValueStore::Stub* stub = Stub(to);
+    if (!stub) {
+        return false;
+    }
+
+    const int batched = batch.entries_size();
+    auto* entries = batch.mutable_entries();
+    uint64_t bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(import_mutex_);
+        entries->erase(std::remove_if(entries->begin(), entries->end(), [this](const SnapshotEntry& entry) {
+            return deleted_.count(entry.key()) > 0;
+        }), entries->end());
+        
+        std::vector<std::string>& moved = moved_[from];
+        for (const SnapshotEntry& entry : *entries) {
+            moved.push_back(entry.key());
+            importing_.insert(entry.key());
+            bytes += entry.key().size() + entry.value().size();
+        }
+    }
+
+    // No lock across the calls and their backoff: client deletes of other
+    // keys carry on meanwhile
+    ImportResponse response;
+    Status status;
+    for (int attempt = 0; !entries->empty(); ++attempt) {
+        ClientContext context;
+        status = stub->Import(&context, batch, &response);
+        if (status.ok() || attempt >= options_.max_retries) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(kRetryBackoffMs * (attempt + 1)));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(import_mutex_);
+        for (const SnapshotEntry& entry : *entries) {
+            importing_.erase(importing_.find(entry.key()));
+        }
+    }
+    import_cv_.notify_all();
+    if (!status.ok()) {
+        std::cerr << "Import into shard '" << to << "' failed: " << status.error_message() << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+    stats_.keys_copied += response.imported();
+    stats_.keys_skipped += batched - response.imported();
+    stats_.bytes_copied += bytes;
+    return true;
+}
+
+void ShardMigrator::Throttle() {
+    if (options_.max_keys_per_second <= 0) {
+        return;
+    }
+    std::chrono::steady_clock::time_point due;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        due = started_ + std::chrono::microseconds(static_cast<int64_t>(
+            1e6 * (stats_.keys_scanned - throttle_base_) / options_.max_keys_per_second));
+    }
+    std::this_thread::sleep_until(due);
+}
+
+bool ShardMigrator::DropMoved() {
+    std::unordered_map<std::string, std::vector<std::string>> moved;
+    {
+        std::lock_guard<std::mutex> lock(import_mutex_);
+        moved.swap(moved_);
+        deleted_.clear();
+    }
+
+    bool dropped_all = true;
+    for (const auto& [from, keys] : moved) {
+        // A shard that left the ring is being retired with its data
+        if (!target_->GetShard(from)) continue;
+        KeyValueStore::Stub* stub = Stub(from);
+        for (size_t i = 0; i < keys.size() && stub; i += options_.batch_keys) {
+            KeysRequest request;
+            for (size_t j = i; j < std::min(keys.size(), i + options_.batch_keys); ++j) {
+                request.add_keys(keys[j]);
+            }
+            DropKeysResponse response;
+            ClientContext context;
+            Status status = stub->DropKeys(&context, request, &response);
+            if (!status.ok()) {
+                std::cerr << "Dropping moved keys from shard '" << from << "' failed: "
+                          << status.error_message() << std::endl;
+                dropped_all = false;
+                break;
+            }
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            stats_.keys_dropped += response.dropped();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.complete = true;
+    return dropped_all;
+}
+
+MigrationStats ShardMigrator::GetStats() const {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_;
+}
+
+} // namespace kvstore
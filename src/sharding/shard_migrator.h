@@ -0,0 +1,150 @@
+#pragma once
+
+#include "hash_ring.h"
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace kvstore {
+
+/**
+ * How a resharding copies keys
+ */
+struct MigrationOptions {
+    // Keys per Import call to a new owner
+    size_t batch_keys = 500;
+    // Copy at most this many keys a second, leaving the shards room for
+    // foreground requests; 0 = as fast as they go
+    int64_t max_keys_per_second = 50000;
+    // Times a failed scan or batch is retried before the migration stops
+    int max_retries = 3;
+};
+
+/**
+ * Progress of a resharding
+ */
+struct MigrationStats {
+    size_t ranges{0};              // Ring ranges changing owner (0 when whole shards are scanned)
+    uint64_t keys_scanned{0};      // Moving keys read from their old owners
+    uint64_t keys_copied{0};       // Written to their new owners
+    uint64_t keys_skipped{0};      // Already there (written since), or deleted meanwhile
+    uint64_t bytes_copied{0};
+    uint64_t keys_dropped{0};      // Deleted from their old owners after the cutover
+    double copy_seconds{0};
+    bool complete{false};          // Cut over and cleaned up
+};
+
+/**
+ * Moves the keys that change owner when a ring's topology changes
+ *
+ * The target ring is a copy of the current one with the change made. The
+ * keys to move are found by ring range (MovedRanges) and streamed from
+ * each old owner with ScanRange; strategies that do not place keys by
+ * ring position (jump, rendezvous) have every shard scanned instead, and
+ * the keys filtered here. They are written to their new owners in
+ * throttled batches with Import, which keeps a key the new owner already
+ * holds: while the migration runs the router sends writes for moving
+ * keys to the new owner, so anything there is newer than the copy.
+ *
+ * A delete of a moving key removes it from both owners and is recorded,
+ * so a copy in flight cannot bring it back: batches are filtered against
+ * the record, and a delete of a key in a batch being imported waits for
+ * that import to finish.
+ *
+ * The migrator talks to the shards' primaries as of its creation, on
+ * connections of its own, so the copy does not queue in front of the
+ * router's requests.
+ */
+class ShardMigrator {
+public:
+    ShardMigrator(const HashRing& current, std::unique_ptr<HashRing> target, const MigrationOptions& options);
+
+    ShardMigrator(const ShardMigrator&) = delete;
+    ShardMigrator& operator=(const ShardMigrator&) = delete;
+
+    const HashRing& Target() const { return *target_; }
+
+    /**
+     * The key's owner in the target ring if that is not `owner`, its
+     * current one; nullptr if it stays put
+     */
+    const std::string* NewOwner(const std::string& key, const std::string& owner) const {
+        const std::string& to = target_->GetShardForKey(key);
+        return to == owner ? nullptr : &to;
+    }
+
+    /**
+     * A moving key is being deleted from both owners; do not copy it from
+     * now on. Waits only if the key is in a batch being imported.
+     */
+    void RecordDelete(const std::string& key);
+
+    /**
+     * Copy one key now, ahead of the scan (for an EXPIRE, which must find
+     * the key on its new owner)
+     * @return false if a shard could not be reached
+     */
+    bool CopyKey(const std::string& key, const std::string& from, const std::string& to);
+
+    /**
+     * Copy every moving key to its new owner. May be called again after a
+     * failure: keys already copied are skipped.
+     * @return false if a shard could not be reached after the retries
+     */
+    bool Copy();
+
+    /**
+     * After the cutover: delete the copied keys from their old owners
+     * (except shards that have left the ring), and forget them
+     */
+    bool DropMoved();
+
+    MigrationStats GetStats() const;
+
+private:
+    struct Source {
+        std::string shard_id;
+        std::vector<HashRange> ranges;   // None: scan every key
+    };
+
+    KeyValueStore::Stub* Stub(const std::string& shard_id);
+
+    // Stream one old owner's moving keys to their new owners
+    bool CopyFrom(const Source& source);
+
+    // Import a batch into `to`, leaving out keys deleted meanwhile
+    bool Flush(const std::string& from, const std::string& to, Entries& batch);
+
+    // Hold the copy to options_.max_keys_per_second
+    void Throttle();
+
+    std::unique_ptr<HashRing> target_;
+    MigrationOptions options_;
+    std::vector<Source> sources_;
+    std::unordered_map<std::string, std::unique_ptr<KeyValueStore::Stub>> stubs_;
+
+    // Guards deleted_ and importing_. A batch's keys are marked while its
+    // Import runs, unlocked, and a delete of one waits for it, so the
+    // delete cannot fall between the filtering of a batch and its write.
+    std::mutex import_mutex_;
+    std::condition_variable import_cv_;
+    std::unordered_set<std::string> deleted_;
+    std::unordered_multiset<std::string> importing_;
+
+    // Keys read from each old owner, to drop after the cutover
+    std::unordered_map<std::string, std::vector<std::string>> moved_;
+
+    mutable std::mutex stats_mutex_;
+    MigrationStats stats_;
+    std::chrono::steady_clock::time_point started_;
+    uint64_t throttle_base_{0};          // keys_scanned when Copy() began
+};
+
+} // namespace kvstore
@@ -1,5 +1,10 @@
 #include "shard_router.h"
+#include <grpcpp/alarm.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <random>
+#include <thread>
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -7,103 +12,463 @@ using grpc::Status;
 
 namespace kvstore {
 
-ShardRouter::ShardRouter(std::shared_ptr<HashRing> hash_ring)
-    : hash_ring_(hash_ring) {
-    stats_.total_requests = 0;
-    stats_.successful_requests = 0;
-    stats_.failed_requests = 0;
+namespace {
+
+// How long a replica that failed a read is left out of replica selection
+constexpr int64_t kReplicaRetryMs = 1000;
+// How long a replica's reported position rules it out; after that it is
+// tried again in case it has caught up
+constexpr int64_t kReplicaReportTtlMs = 100;
+// Times a call on a shard's primary is redone on a newly learned leader
+constexpr int kMaxLeaderRedirects = 3;
+constexpr int64_t kLeaderQueryTimeoutMs = 500;
+
+int64_t SteadyNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The future form of an asynchronous operation: `start` issues it with a
+// callback that fulfils the future
+template <typename T, typename Start>
+std::future<T> ToFuture(Start start) {
+    auto promise = std::make_shared<std::promise<T>>();
+    std::future<T> future = promise->get_future();
+    start([promise](T result) { promise->set_value(std::move(result)); });
+    return future;
+}
+
+// The batch a multi-key call's key at `position` joins: its shard's
+// latest, or a new one when there is none or it is full
+template <typename Batch>
+Batch& BatchFor(std::vector<Batch>& batches, std::unordered_map<std::string, size_t>& latest,
+                const std::string& shard_id, size_t position) {
+    auto it = latest.find(shard_id);
+    if (it == latest.end() || batches[it->second].positions.size() >= ShardRouter::kMaxBatchKeys) {
+        latest[shard_id] = batches.size();
+        batches.emplace_back();
+        batches.back().shard_id = shard_id;
+    }
+    Batch& batch = batches[latest[shard_id]];
+    batch.positions.push_back(position);
+    return batch;
+}
+
+} // namespace
+
+/**
+ * CallPrimary on the async stubs. Each attempt gets a fresh context, with
+ * the deadline set when the call was made; a failed one is redone on the
+ * shard's new leader as CallPrimary does, with its members asked on the
+ * completion queue too. A retry waits out its backoff on an alarm on the
+ * completion queue, holding no thread.
+ */
+template <typename Request, typename Response>
+class ShardRouter::AsyncPrimaryCall final : public AsyncCall {
+public:
+    using Prepare = std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*)(
+        ClientContext*, const Request&, grpc::CompletionQueue*);
+    using Done = std::function<void(const Status&, const Response&)>;
+    
+    AsyncPrimaryCall(ShardRouter* router, std::string shard_id, RouterOp op, Request request, Prepare prepare,
+                     Done done)
+        : router_(router),
+          shard_id_(std::move(shard_id)),
+          op_(op),
+          deadline_(router->DeadlineFor(op)),
+          request_(std::move(request)),
+          prepare_(prepare),
+          done_(std::move(done)) {
+    }
+    
+    void Start() {
+        // The reader lives in the previous attempt's call
+        reader_.reset();
+        response_.Clear();
+        
+        channel_ = router_->GetShardChannel(shard_id_);
+        if (!channel_) {
+            Finish(Status(grpc::StatusCode::UNAVAILABLE, "No connection to shard '" + shard_id_ + "'"));
+            return;
+        }
+        if (!router_->AllowCall(shard_id_, *channel_->pool)) {
+            Finish(ShedStatus(shard_id_));
+            return;
+        }
+        grpc::CompletionQueue* queue = router_->BeginAsync(this);
+        if (!queue) {
+            Finish(Status(grpc::StatusCode::CANCELLED, "Router is shutting down"));
+            return;
+        }
+        context->set_deadline(deadline_);
+        channel_->outstanding++;
+        reader_ = ((*channel_->stub).*prepare_)(context.get(), request_, queue);
+        reader_->StartCall();
+        reader_->Finish(&response_, &status_, this);
+    }
+    
+    void Complete() override {
+        if (backing_off_) {
+            backing_off_ = false;
+            Start();
+            return;
+        }
+        channel_->outstanding--;
+        router_->RecordOutcome(shard_id_, *channel_->pool, status_);
+        if (redirects_ < kMaxLeaderRedirects) {
+            if (Redirect(LeaderNamed(status_, *context))) {
+                return;
+            }
+            if (router_->ShouldDiscoverLeader(shard_id_, status_, deadline_)) {
+                // The call carries on once the members have answered
+                router_->DiscoverLeaderAsync(shard_id_, deadline_, [this](std::string leader) {
+                    if (!Redirect(leader)) {
+                        RetryOrFinish();
+                    }
+                });
+                return;
+            }
+        }
+        RetryOrFinish();
+    }
+
+private:
+    // Redo the call on a newly learned leader, if there is one
+    bool Redirect(const std::string& leader) {
+        if (leader.empty() || !router_->FollowLeader(shard_id_, leader, channel_->pool->address)) {
+            return false;
+        }
+        redirects_++;
+        Start();
+        return true;
+    }
+    
+    // Retry the call after its backoff if RetryBackoff allows, or finish it
+    void RetryOrFinish() {
+        int64_t backoff_ms = router_->RetryBackoff(shard_id_, op_, status_, retries_, *channel_->pool, deadline_);
+        if (backoff_ms >= 0) {
+            reader_.reset();
+            grpc::CompletionQueue* queue = router_->BeginAsync(this);
+            if (queue) {
+                // Shutdown waits for the alarm, which is never long
+                retries_++;
+                backing_off_ = true;
+                alarm_.Set(queue, std::chrono::system_clock::now() + std::chrono::milliseconds(backoff_ms), this);
+                return;
+            }
+        }
+        Finish(status_);
+    }
     
+    void Finish(const Status& status) {
+        done_(status, response_);
+        router_->EndAsync(this);
+        delete this;
+    }
+    
+    ShardRouter* router_;
+    std::string shard_id_;
+    RouterOp op_;
+    std::chrono::system_clock::time_point deadline_;
+    Request request_;
+    Prepare prepare_;
+    Done done_;
+    int redirects_{0};
+    int retries_{0};
+    bool backing_off_{false};
+    grpc::Alarm alarm_;
+    std::shared_ptr<PooledChannel> channel_;
+    Response response_;
+    Status status_;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader_;
+};
+
+/**
+ * A GetAsync tried on a replica first: the same checks as Get, with the
+ * primary asked instead when the replica is too stale or fails
+ */
+class ShardRouter::AsyncReplicaGet final : public AsyncCall {
+public:
+    AsyncReplicaGet(ShardRouter* router, const RequestStart& started, std::string shard_id,
+                    std::shared_ptr<ShardReplicas> replicas, ReplicaEndpoint* replica, const std::string& key,
+                    const ReadOptions& options, std::function<void(std::optional<std::string>)> done)
+        : router_(router),
+          started_(started),
+          shard_id_(std::move(shard_id)),
+          replicas_(std::move(replicas)),
+          replica_(replica),
+          options_(options),
+          done_(std::move(done)) {
+        request_.set_key(key);
+    }
+    
+    void Start() {
+        grpc::CompletionQueue* queue = router_->BeginAsync(this);
+        if (!queue) {
+            router_->CountRequest(started_, RouterOp::GET, false);
+            done_(std::nullopt);
+            router_->EndAsync(this);
+            delete this;
+            return;
+        }
+        context->set_deadline(router_->DeadlineFor(RouterOp::GET));
+        replica_->outstanding++;
+        reader_ = replica_->stub->PrepareAsyncGet(context.get(), request_, queue);
+        reader_->StartCall();
+        reader_->Finish(&response_, &status_, this);
+    }
+    
+    void Complete() override {
+        replica_->outstanding--;
+        if (status_.ok()) {
+            replica_->applied_sequence = response_.applied_sequence();
+            replica_->lag_ms = response_.lag_ms();
+            replica_->reported_at_ms = SteadyNowMs();
+        } else {
+            replica_->retry_after_ms = SteadyNowMs() + kReplicaRetryMs;
+        }
+        
+        bool fresh = status_.ok() &&
+                     WithinBounds(*replicas_, response_.applied_sequence(), response_.lag_ms(), options_);
+        if (fresh) {
+            started_.shard->Add(ShardCounter::REPLICA_READS);
+            router_->CountRequest(started_, RouterOp::GET, true);
+            done_(response_.found() ? std::optional<std::string>(response_.value()) : std::nullopt);
+        } else {
+            // Too far behind, or unavailable: the primary answers instead
+            started_.shard->Add(ShardCounter::REPLICA_FALLBACKS);
+            router_->GetFromPrimaryAsync(KeyRoute{&shard_id_}, request_.key(), started_, std::move(done_));
+        }
+        router_->EndAsync(this);
+        delete this;
+    }
+
+private:
+    ShardRouter* router_;
+    RequestStart started_;
+    std::string shard_id_;
+    std::shared_ptr<ShardReplicas> replicas_;
+    ReplicaEndpoint* replica_;
+    ReadOptions options_;
+    std::function<void(std::optional<std::string>)> done_;
+    GetRequest request_;
+    GetResponse response_;
+    Status status_;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<GetResponse>> reader_;
+};
+
+/**
+ * A GetStats to one member of a shard, asking who leads it. `owner` keeps
+ * the member's stub alive until the call completes.
+ */
+class ShardRouter::AsyncStats final : public AsyncCall {
+public:
+    using Done = std::function<void(const Status&, const StatsResponse&)>;
+    
+    AsyncStats(ShardRouter* router, std::shared_ptr<void> owner, KeyValueStore::Stub* stub, Done done)
+        : router_(router), owner_(std::move(owner)), stub_(stub), done_(std::move(done)) {
+    }
+    
+    void Start(std::chrono::system_clock::time_point deadline) {
+        grpc::CompletionQueue* queue = router_->BeginAsync(this);
+        if (!queue) {
+            status_ = Status(grpc::StatusCode::CANCELLED, "Router is shutting down");
+            Complete();
+            return;
+        }
+        context->set_deadline(deadline);
+        reader_ = stub_->PrepareAsyncGetStats(context.get(), request_, queue);
+        reader_->StartCall();
+        reader_->Finish(&response_, &status_, this);
+    }
+    
+    void Complete() override {
+        done_(status_, response_);
+        router_->EndAsync(this);
+        delete this;
+    }
+
+private:
+    ShardRouter* router_;
+    std::shared_ptr<void> owner_;
+    KeyValueStore::Stub* stub_;
+    Done done_;
+    StatsRequest request_;
+    StatsResponse response_;
+    Status status_;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<StatsResponse>> reader_;
+};
+
+class ShardRouter::WriteInFlight {
+public:
+    explicit WriteInFlight(ShardRouter& router) : router_(router), epoch_(router.BeginWrite()) {}
+    ~WriteInFlight() { router_.EndWrite(epoch_); }
+
+private:
+    ShardRouter& router_;
+    uint64_t epoch_;
+};
+
+ShardRouter::ShardRouter(std::shared_ptr<HashRing> hash_ring, size_t completion_threads,
+                         const ChannelPoolOptions& pool, int latency_precision_bits,
+                         const HealthOptions& health)
+    : hash_ring_(hash_ring),
+      pool_options_(pool),
+      metrics_(latency_precision_bits),
+      health_options_(health),
+      completion_threads_(std::max<size_t>(completion_threads, 1)) {
     // Create connections to all existing shards
     auto shards = hash_ring_->GetAllShards();
+    pool_options_.channels_per_shard = std::max<size_t>(pool_options_.channels_per_shard, 1);
     for (const auto& shard : shards) {
-        CreateShardConnection(shard.shard_id, shard.address);
+        CreateShardConnection(shard);
+    }
+    if (pool_options_.warm_up_timeout_ms > 0) {
+        WarmUpConnections();
+    }
+    if (health_options_.probe_interval_ms > 0) {
+        prober_ = std::thread(&ShardRouter::RunProber, this);
     }
     
     std::cout << "ShardRouter initialized with " << shards.size() << " shards" << std::endl;
 }
 
 ShardRouter::~ShardRouter() {
-    std::lock_guard<std::mutex> lock(connection_mutex_);
-    shard_stubs_.clear();
+    if (prober_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(prober_mutex_);
+            prober_stopping_ = true;
+        }
+        prober_cv_.notify_all();
+        prober_.join();
+    }
+    
+    // Cancel asynchronous calls and let them complete before the queues
+    // they complete on go away
+    {
+        std::unique_lock<std::mutex> lock(async_mutex_);
+        async_stopping_ = true;
+        for (AsyncCall* call : async_calls_) {
+            call->context->TryCancel();
+        }
+        worker_cv_.notify_all();
+        async_cv_.wait(lock, [this] { return async_calls_.empty() && worker_pending_ == 0; });
+    }
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+    for (auto& queue : completion_queues_) {
+        queue->Shutdown();
+    }
+    for (auto& poller : pollers_) {
+        poller.join();
+    }
+    
+    std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+    shard_pools_.clear();
+    shard_replicas_.clear();
 }
 
 bool ShardRouter::Set(const std::string& key, const std::string& value) {
+    WriteInFlight write(*this);
+    
     // Step 1: Determine which shard owns this key using the hash ring
-    std::string shard_id = hash_ring_->GetShardForKey(key);
+    // (the one it is moving to, during a migration)
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
     
     if (shard_id.empty()) {
         std::cerr << "No shard available for key: " << key << std::endl;
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
-        return false;
-    }
-    
-    // Step 2: Get the gRPC stub for this shard (creates connection if needed)
-    auto& stub = GetShardStub(shard_id);
-    if (!stub) {
-        std::cerr << "Failed to get stub for shard: " << shard_id << std::endl;
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
+        CountRequest(started, RouterOp::SET, false);
         return false;
     }
     
-    // Step 3: Build the gRPC request
+    // Step 2: Build the gRPC request
     SetRequest request;
     request.set_key(key);
     request.set_value(value);
     
     SetResponse response;
-    ClientContext context;
     
-    // Step 4: Make the RPC call to the shard
-    Status status = stub->Set(&context, request, &response);
+    // Step 3: Make the RPC call on the shard's primary (connecting if
+    // needed, and following it if it has moved)
+    Status status = CallPrimary(shard_id, RouterOp::SET, [&](KeyValueStore::Stub& stub, ClientContext& context) {
+        return stub.Set(&context, request, &response);
+    });
+    if (status.ok()) {
+        RecordPrimarySequence(shard_id, response.sequence());
+    }
     
-    // Step 5: Update statistics
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex_);
-        stats_.total_requests++;
-        stats_.per_shard_requests[shard_id]++;
-        
-        if (status.ok() && response.success()) {
-            stats_.successful_requests++;
-            return true;
-        } else {
-            stats_.failed_requests++;
-            if (!status.ok()) {
-                std::cerr << "RPC failed for key '" << key << "' on shard '" 
-                          << shard_id << "': " << status.error_message() << std::endl;
-            }
-            return false;
-        }
+    // Step 4: Update statistics
+    bool success = status.ok() && response.success();
+    CountRequest(started, RouterOp::SET, success);
+    if (!status.ok()) {
+        std::cerr << "RPC failed for key '" << key << "' on shard '" 
+                  << shard_id << "': " << status.error_message() << std::endl;
     }
+    return success;
 }
 
 std::optional<std::string> ShardRouter::Get(const std::string& key) {
-    // Similar pattern: hash ring lookup → get stub → make RPC call
-    std::string shard_id = hash_ring_->GetShardForKey(key);
+    return Get(key, ReadOptions());
+}
+
+std::optional<std::string> ShardRouter::Get(const std::string& key, const ReadOptions& options) {
+    // Similar pattern: hash ring lookup → RPC call on the shard
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
     
-    if (shard_id.empty()) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
+    // Try a replica first when the consistency level allows one, or the
+    // primary's circuit is open
+    ReadOptions read = options;
+    if (read.consistency == ReadConsistency::PRIMARY && health_options_.replica_reads_when_open &&
+        !shard_id.empty() && PrimaryOpen(shard_id)) {
+        read.consistency = ReadConsistency::ANY;
+    }
+    std::shared_ptr<ShardReplicas> replicas;
+    ReplicaEndpoint* replica = nullptr;
+    if (read.consistency != ReadConsistency::PRIMARY && !shard_id.empty() && !route.moving_to) {
+        replicas = GetShardReplicas(shard_id);
+        replica = replicas ? PickReplica(*replicas, read) : nullptr;
+    }
+    if (replica) {
+        GetRequest request;
+        request.set_key(key);
+        
+        GetResponse response;
+        ClientContext context;
+        context.set_deadline(DeadlineFor(RouterOp::GET));
+        
+        replica->outstanding++;
+        Status status = replica->stub->Get(&context, request, &response);
+        replica->outstanding--;
+        
+        if (status.ok()) {
+            replica->applied_sequence = response.applied_sequence();
+            replica->lag_ms = response.lag_ms();
+            replica->reported_at_ms = SteadyNowMs();
+        } else {
+            replica->retry_after_ms = SteadyNowMs() + kReplicaRetryMs;
         }
-        return std::nullopt;
+        
+        bool fresh = status.ok() &&
+                     WithinBounds(*replicas, response.applied_sequence(), response.lag_ms(), read);
+        if (fresh) {
+            started.shard->Add(ShardCounter::REPLICA_READS);
+            CountRequest(started, RouterOp::GET, true);
+            if (response.found()) {
+                return response.value();
+            }
+            return std::nullopt;
+        }
+        // Too far behind, or unavailable: the primary answers instead
+        started.shard->Add(ShardCounter::REPLICA_FALLBACKS);
     }
     
-    auto& stub = GetShardStub(shard_id);
-    if (!stub) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
+    if (shard_id.empty()) {
+        CountRequest(started, RouterOp::GET, false);
         return std::nullopt;
     }
     
@@ -111,94 +476,72 @@ std::optional<std::string> ShardRouter::Get(const std::string& key) {
     request.set_key(key);
     
     GetResponse response;
-    ClientContext context;
-    
-    Status status = stub->Get(&context, request, &response);
+    Status status = CallKey(route, RouterOp::GET, [&](KeyValueStore::Stub& stub, ClientContext& context) {
+        return stub.Get(&context, request, &response);
+    }, [&] { return response.found(); });
+    if (status.ok() && !route.moving_to) {
+        RecordPrimarySequence(shard_id, response.applied_sequence());
+    }
     
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex_);
-        stats_.total_requests++;
-        stats_.per_shard_requests[shard_id]++;
-        
-        if (status.ok()) {
-            stats_.successful_requests++;
-            if (response.found()) {
-                return response.value();
-            }
-            return std::nullopt;
-        } else {
-            stats_.failed_requests++;
-            std::cerr << "RPC failed for key '" << key << "': " 
-                      << status.error_message() << std::endl;
-            return std::nullopt;
-        }
+    CountRequest(started, RouterOp::GET, status.ok());
+    if (!status.ok()) {
+        std::cerr << "RPC failed for key '" << key << "': " 
+                  << status.error_message() << std::endl;
+        return std::nullopt;
     }
+    if (response.found()) {
+        return response.value();
+    }
+    return std::nullopt;
 }
 
 bool ShardRouter::Delete(const std::string& key) {
-    std::string shard_id = hash_ring_->GetShardForKey(key);
+    WriteInFlight write(*this);
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
     
     if (shard_id.empty()) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
+        CountRequest(started, RouterOp::DELETE, false);
         return false;
     }
     
-    auto& stub = GetShardStub(shard_id);
-    if (!stub) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
-        return false;
+    if (route.moving_to) {
+        // Copies made from now on leave it out
+        route.migration->RecordDelete(key);
     }
     
     DeleteRequest request;
     request.set_key(key);
     
     DeleteResponse response;
-    ClientContext context;
-    
-    Status status = stub->Delete(&context, request, &response);
-    
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex_);
-        stats_.total_requests++;
-        stats_.per_shard_requests[shard_id]++;
-        
-        if (status.ok()) {
-            stats_.successful_requests++;
-            return response.found();
-        } else {
-            stats_.failed_requests++;
-            return false;
-        }
+    Status status = CallPrimary(shard_id, RouterOp::DELETE, [&](KeyValueStore::Stub& stub, ClientContext& context) {
+        return stub.Delete(&context, request, &response);
+    });
+    if (status.ok()) {
+        RecordPrimarySequence(shard_id, response.sequence());
     }
+    bool found = status.ok() && response.found();
+    if (route.moving_to && status.ok()) {
+        // And from the old owner, which reads fall back to
+        DeleteResponse old_response;
+        status = CallPrimary(*route.shard_id, RouterOp::DELETE, [&](KeyValueStore::Stub& stub, ClientContext& context) {
+            return stub.Delete(&context, request, &old_response);
+        });
+        found = found || (status.ok() && old_response.found());
+    }
+    
+    CountRequest(started, RouterOp::DELETE, status.ok());
+    return status.ok() ? found : false;
 }
 
 bool ShardRouter::Contains(const std::string& key) {
-    std::string shard_id = hash_ring_->GetShardForKey(key);
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
     
     if (shard_id.empty()) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
-        return false;
-    }
-    
-    auto& stub = GetShardStub(shard_id);
-    if (!stub) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
+        CountRequest(started, RouterOp::CONTAINS, false);
         return false;
     }
     
@@ -206,44 +549,22 @@ bool ShardRouter::Contains(const std::string& key) {
     request.set_key(key);
     
     ContainsResponse response;
-    ClientContext context;
-    
-    Status status = stub->Contains(&context, request, &response);
+    Status status = CallKey(route, RouterOp::CONTAINS, [&](KeyValueStore::Stub& stub, ClientContext& context) {
+        return stub.Contains(&context, request, &response);
+    }, [&] { return response.exists(); });
     
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex_);
-        stats_.total_requests++;
-        stats_.per_shard_requests[shard_id]++;
-        
-        if (status.ok()) {
-            stats_.successful_requests++;
-            return response.exists();
-        } else {
-            stats_.failed_requests++;
-            return false;
-        }
-    }
+    CountRequest(started, RouterOp::CONTAINS, status.ok());
+    return status.ok() ? response.exists() : false;
 }
 
 bool ShardRouter::Expire(const std::string& key, int seconds) {
-    std::string shard_id = hash_ring_->GetShardForKey(key);
+    WriteInFlight write(*this);
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
     
     if (shard_id.empty()) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
-        return false;
-    }
-    
-    auto& stub = GetShardStub(shard_id);
-    if (!stub) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
+        CountRequest(started, RouterOp::EXPIRE, false);
         return false;
     }
     
@@ -252,44 +573,30 @@ bool ShardRouter::Expire(const std::string& key, int seconds) {
     request.set_seconds(seconds);
     
     ExpireResponse response;
-    ClientContext context;
-    
-    Status status = stub->Expire(&context, request, &response);
-    
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex_);
-        stats_.total_requests++;
-        stats_.per_shard_requests[shard_id]++;
-        
-        if (status.ok()) {
-            stats_.successful_requests++;
-            return response.success();
-        } else {
-            stats_.failed_requests++;
-            return false;
-        }
+    auto expire = [&](KeyValueStore::Stub& stub, ClientContext& context) {
+        return stub.Expire(&context, request, &response);
+    };
+    Status status = CallPrimary(shard_id, RouterOp::EXPIRE, expire);
+    if (route.moving_to && status.ok() && !response.success() &&
+        route.migration->CopyKey(key, *route.shard_id, shard_id)) {
+        // Not copied yet: copy it now and expire the copy
+        status = CallPrimary(shard_id, RouterOp::EXPIRE, expire);
     }
+    if (status.ok()) {
+        RecordPrimarySequence(shard_id, response.sequence());
+    }
+    
+    CountRequest(started, RouterOp::EXPIRE, status.ok());
+    return status.ok() ? response.success() : false;
 }
 
 int ShardRouter::TTL(const std::string& key) {
-    std::string shard_id = hash_ring_->GetShardForKey(key);
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
     
     if (shard_id.empty()) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
-        return -2;
-    }
-    
-    auto& stub = GetShardStub(shard_id);
-    if (!stub) {
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex_);
-            stats_.total_requests++;
-            stats_.failed_requests++;
-        }
+        CountRequest(started, RouterOp::TTL, false);
         return -2;
     }
     
@@ -297,75 +604,1403 @@ int ShardRouter::TTL(const std::string& key) {
     request.set_key(key);
     
     TTLResponse response;
-    ClientContext context;
-    
-    Status status = stub->TTL(&context, request, &response);
+    Status status = CallKey(route, RouterOp::TTL, [&](KeyValueStore::Stub& stub, ClientContext& context) {
+        return stub.TTL(&context, request, &response);
+    }, [&] { return response.seconds() != -2; });
     
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex_);
-        stats_.total_requests++;
-        stats_.per_shard_requests[shard_id]++;
+    CountRequest(started, RouterOp::TTL, status.ok());
+    return status.ok() ? response.seconds() : -2;
+}
+
+Status ShardRouter::CallPrimary(const std::string& shard_id, RouterOp op, const PrimaryCall& call) {
+    auto deadline = DeadlineFor(op);
+    Status status(grpc::StatusCode::UNAVAILABLE, "No connection to shard '" + shard_id + "'");
+    int redirects = 0;
+    int retries = 0;
+    while (true) {
+        auto channel = GetShardChannel(shard_id);
+        if (!channel) {
+            return status;
+        }
+        if (!AllowCall(shard_id, *channel->pool)) {
+            return ShedStatus(shard_id);
+        }
         
-        if (status.ok()) {
-            stats_.successful_requests++;
-            return response.seconds();
-        } else {
-            stats_.failed_requests++;
-            return -2;
+        ClientContext context;
+        context.set_deadline(deadline);
+        channel->outstanding++;
+        status = call(*channel->stub, context);
+        channel->outstanding--;
+        RecordOutcome(shard_id, *channel->pool, status);
+        
+        if (redirects < kMaxLeaderRedirects) {
+            std::string leader = LeaderAfter(shard_id, status, context, deadline);
+            if (!leader.empty() && FollowLeader(shard_id, leader, channel->pool->address)) {
+                redirects++;
+                continue;
+            }
+        }
+        int64_t backoff_ms = RetryBackoff(shard_id, op, status, retries, *channel->pool, deadline);
+        if (backoff_ms < 0) {
+            break;
         }
+        retries++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
     }
+    return status;
 }
 
-std::unique_ptr<KeyValueStore::Stub>& ShardRouter::GetShardStub(const std::string& shard_id) {
-    std::lock_guard<std::mutex> lock(connection_mutex_);
-    
-    // Check if we already have a connection to this shard
-    auto it = shard_stubs_.find(shard_id);
-    if (it != shard_stubs_.end()) {
-        return it->second;
+ShardRouter::KeyRoute ShardRouter::RouteKey(const std::string& key) const {
+    KeyRoute route{&hash_ring_->GetShardForKey(key)};
+    if (!migrating_.load()) {
+        return route;
     }
-    
-    // Connection doesn't exist, create it
-    const ShardInfo* shard = hash_ring_->GetShard(shard_id);
-    if (!shard) {
-        static std::unique_ptr<KeyValueStore::Stub> null_stub;
-        return null_stub;
+    {
+        std::lock_guard<std::mutex> lock(migration_mutex_);
+        route.migration = migration_;
     }
-    
-    CreateShardConnection(shard_id, shard->address);
-    return shard_stubs_[shard_id];
+    if (route.migration) {
+        const std::string* to = route.migration->NewOwner(key, *route.shard_id);
+        if (to && route.shard_id->empty()) {
+            // Shards coming into an empty ring: nothing to fall back to
+            route.shard_id = to;
+        } else if (to) {
+            route.moving_to = to;
+        }
+    }
+    return route;
 }
 
-void ShardRouter::CreateShardConnection(const std::string& shard_id, const std::string& address) {
-    // Create a gRPC channel to the shard
-    // Using InsecureChannelCredentials for simplicity (use SSL in production!)
-    auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+Status ShardRouter::CallKey(const KeyRoute& route, RouterOp op, const PrimaryCall& call,
+                            const std::function<bool()>& found) {
+    Status status = CallPrimary(route.Target(), op, call);
+    if (route.moving_to && found && status.ok() && !found()) {
+        // Not copied yet: the old owner still has it
+        status = CallPrimary(*route.shard_id, op, call);
+        if (status.ok() && found()) {
+            metrics_.ForShard(*route.shard_id).Add(ShardCounter::MIGRATION_READS);
+        }
+    }
+    return status;
+}
+
+std::string ShardRouter::LeaderAfter(const std::string& shard_id, const Status& status,
+                                     const ClientContext& context, std::chrono::system_clock::time_point deadline) {
+    std::string leader = LeaderNamed(status, context);
+    if (leader.empty() && ShouldDiscoverLeader(shard_id, status, deadline)) {
+        leader = DiscoverLeader(shard_id, deadline);
+    }
+    return leader;
+}
+
+std::string ShardRouter::LeaderNamed(const Status& status, const ClientContext& context) {
+    // A replica names the node that takes writes
+    if (status.error_code() != grpc::StatusCode::FAILED_PRECONDITION) {
+        return "";
+    }
+    const auto& trailers = context.GetServerTrailingMetadata();
+    auto hint = trailers.find(kLeaderMetadataKey);
+    return hint == trailers.end() ? "" : std::string(hint->second.data(), hint->second.size());
+}
+
+bool ShardRouter::ShouldDiscoverLeader(const std::string& shard_id, const Status& status,
+                                       std::chrono::system_clock::time_point deadline) {
+    // A primary that cannot be reached may have been replaced by an election
+    if (status.error_code() != grpc::StatusCode::UNAVAILABLE || std::chrono::system_clock::now() >= deadline) {
+        return false;
+    }
+    auto replicas = GetShardReplicas(shard_id);
+    return replicas && MayElectLeader(*replicas);
+}
+
+void ShardRouter::SetAsync(const std::string& key, const std::string& value, std::function<void(bool)> done) {
+    uint64_t epoch = BeginWrite();
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
+    if (shard_id.empty()) {
+        std::cerr << "No shard available for key: " << key << std::endl;
+        EndWrite(epoch);
+        CountRequest(started, RouterOp::SET, false);
+        done(false);
+        return;
+    }
     
-    // Create a stub (client) for the KeyValueStore service
-    auto stub = KeyValueStore::NewStub(channel);
+    SetRequest request;
+    request.set_key(key);
+    request.set_value(value);
+    StartPrimaryCall<SetRequest, SetResponse>(shard_id, RouterOp::SET, std::move(request),
+                                              &KeyValueStore::Stub::PrepareAsyncSet,
+        [this, shard_id, started, epoch, done = std::move(done)](const Status& status, const SetResponse& response) {
+            EndWrite(epoch);
+            if (status.ok()) {
+                RecordPrimarySequence(shard_id, response.sequence());
+            } else if (status.error_code() != grpc::StatusCode::CANCELLED) {
+                std::cerr << "RPC failed on shard '" << shard_id << "': " << status.error_message() << std::endl;
+            }
+            bool success = status.ok() && response.success();
+            CountRequest(started, RouterOp::SET, success);
+            done(success);
+        });
+}
+
+void ShardRouter::GetAsync(const std::string& key, std::function<void(std::optional<std::string>)> done) {
+    GetAsync(key, ReadOptions(), std::move(done));
+}
+
+void ShardRouter::GetAsync(const std::string& key, const ReadOptions& options,
+                           std::function<void(std::optional<std::string>)> done) {
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
+    if (shard_id.empty()) {
+        CountRequest(started, RouterOp::GET, false);
+        done(std::nullopt);
+        return;
+    }
     
-    shard_stubs_[shard_id] = std::move(stub);
+    // A replica first, as Get tries one
+    ReadOptions read = options;
+    if (read.consistency == ReadConsistency::PRIMARY && health_options_.replica_reads_when_open &&
+        PrimaryOpen(shard_id)) {
+        read.consistency = ReadConsistency::ANY;
+    }
+    if (read.consistency != ReadConsistency::PRIMARY && !route.moving_to) {
+        std::shared_ptr<ShardReplicas> replicas = GetShardReplicas(shard_id);
+        ReplicaEndpoint* replica = replicas ? PickReplica(*replicas, read) : nullptr;
+        if (replica) {
+            (new AsyncReplicaGet(this, started, shard_id, std::move(replicas), replica, key, read,
+                                 std::move(done)))->Start();
+            return;
+        }
+    }
+    GetFromPrimaryAsync(route, key, started, std::move(done));
+}
+
+void ShardRouter::GetFromPrimaryAsync(const KeyRoute& route, const std::string& key, const RequestStart& started,
+                                      std::function<void(std::optional<std::string>)> done) {
+    GetRequest request;
+    request.set_key(key);
+    StartKeyCall<GetRequest, GetResponse>(route, RouterOp::GET, std::move(request), &KeyValueStore::Stub::PrepareAsyncGet,
+        [](const GetResponse& response) { return response.found(); },
+        [this, shard_id = route.Target(), started, moving = route.moving_to != nullptr, done = std::move(done)](
+            const Status& status, const GetResponse& response) {
+            if (status.ok()) {
+                if (!moving) {
+                    RecordPrimarySequence(shard_id, response.applied_sequence());
+                }
+            } else if (status.error_code() != grpc::StatusCode::CANCELLED) {
+                std::cerr << "RPC failed on shard '" << shard_id << "': " << status.error_message() << std::endl;
+            }
+            CountRequest(started, RouterOp::GET, status.ok());
+            done(status.ok() && response.found() ? std::optional<std::string>(response.value()) : std::nullopt);
+        });
+}
+
+void ShardRouter::DeleteAsync(const std::string& key, std::function<void(bool)> done) {
+    uint64_t epoch = BeginWrite();
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
+    if (shard_id.empty()) {
+        EndWrite(epoch);
+        CountRequest(started, RouterOp::DELETE, false);
+        done(false);
+        return;
+    }
     
-    std::cout << "Created connection to shard '" << shard_id << "' at " << address << std::endl;
+    // A moving key goes from both owners, as Delete does
+    std::string old_owner;
+    if (route.moving_to) {
+        route.migration->RecordDelete(key);
+        old_owner = *route.shard_id;
+    }
+    DeleteRequest request;
+    request.set_key(key);
+    auto finish = [this, started, epoch, done = std::move(done)](bool success, bool found) {
+        EndWrite(epoch);
+        CountRequest(started, RouterOp::DELETE, success);
+        done(success && found);
+    };
+    StartPrimaryCall<DeleteRequest, DeleteResponse>(shard_id, RouterOp::DELETE, request,
+                                                    &KeyValueStore::Stub::PrepareAsyncDelete,
+        [this, shard_id, old_owner, request, finish = std::move(finish)](const Status& status,
+                                                                         const DeleteResponse& response) {
+            if (status.ok()) {
+                RecordPrimarySequence(shard_id, response.sequence());
+            }
+            if (!status.ok() || old_owner.empty()) {
+                finish(status.ok(), response.found());
+                return;
+            }
+            StartPrimaryCall<DeleteRequest, DeleteResponse>(old_owner, RouterOp::DELETE, request,
+                                                            &KeyValueStore::Stub::PrepareAsyncDelete,
+                [finish, found = response.found()](const Status& status, const DeleteResponse& response) {
+                    finish(status.ok(), found || response.found());
+                });
+        });
 }
 
-void ShardRouter::RemoveShardConnection(const std::string& shard_id) {
-    std::lock_guard<std::mutex> lock(connection_mutex_);
-    shard_stubs_.erase(shard_id);
-    std::cout << "Removed connection to shard '" << shard_id << "'" << std::endl;
+void ShardRouter::ContainsAsync(const std::string& key, std::function<void(bool)> done) {
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
+    if (shard_id.empty()) {
+        CountRequest(started, RouterOp::CONTAINS, false);
+        done(false);
+        return;
+    }
+    
+    ContainsRequest request;
+    request.set_key(key);
+    StartKeyCall<ContainsRequest, ContainsResponse>(route, RouterOp::CONTAINS, std::move(request),
+        &KeyValueStore::Stub::PrepareAsyncContains,
+        [](const ContainsResponse& response) { return response.exists(); },
+        [this, started, done = std::move(done)](const Status& status, const ContainsResponse& response) {
+            CountRequest(started, RouterOp::CONTAINS, status.ok());
+            done(status.ok() && response.exists());
+        });
 }
 
-ShardRouter::RoutingStats ShardRouter::GetStats() const {
-    std::lock_guard<std::mutex> lock(stats_mutex_);
-    return stats_;
+void ShardRouter::ExpireAsync(const std::string& key, int seconds, std::function<void(bool)> done) {
+    uint64_t epoch = BeginWrite();
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
+    if (shard_id.empty()) {
+        EndWrite(epoch);
+        CountRequest(started, RouterOp::EXPIRE, false);
+        done(false);
+        return;
+    }
+    
+    ExpireRequest request;
+    request.set_key(key);
+    request.set_seconds(seconds);
+    auto finish = [this, shard_id, started, epoch, done = std::move(done)](const Status& status,
+                                                                            const ExpireResponse& response) {
+        EndWrite(epoch);
+        if (status.ok()) {
+            RecordPrimarySequence(shard_id, response.sequence());
+        }
+        CountRequest(started, RouterOp::EXPIRE, status.ok());
+        done(status.ok() && response.success());
+    };
+    if (!route.moving_to) {
+        StartPrimaryCall<ExpireRequest, ExpireResponse>(shard_id, RouterOp::EXPIRE, std::move(request),
+            &KeyValueStore::Stub::PrepareAsyncExpire, std::move(finish));
+        return;
+    }
+    
+    // A moving key not copied yet is copied (on the worker, as that
+    // blocks) and its copy expired, as Expire does
+    StartPrimaryCall<ExpireRequest, ExpireResponse>(shard_id, RouterOp::EXPIRE, request,
+                                                    &KeyValueStore::Stub::PrepareAsyncExpire,
+        [this, migration = route.migration, old_owner = *route.shard_id, shard_id, request,
+         finish = std::move(finish)](const Status& status, const ExpireResponse& response) {
+            if (!status.ok() || response.success()) {
+                finish(status, response);
+                return;
+            }
+            bool queued = RunBlocking([this, migration, old_owner, shard_id, request, finish, status, response] {
+                if (!migration->CopyKey(request.key(), old_owner, shard_id)) {
+                    finish(status, response);
+                    return;
+                }
+                StartPrimaryCall<ExpireRequest, ExpireResponse>(shard_id, RouterOp::EXPIRE, request,
+                    &KeyValueStore::Stub::PrepareAsyncExpire, finish);
+            });
+            if (!queued) {
+                finish(Status(grpc::StatusCode::CANCELLED, "Router is shutting down"), response);
+            }
+        });
+}
+
+void ShardRouter::TTLAsync(const std::string& key, std::function<void(int)> done) {
+    KeyRoute route = RouteKey(key);
+    const std::string& shard_id = route.Target();
+    RequestStart started = BeginRequest(shard_id);
+    if (shard_id.empty()) {
+        CountRequest(started, RouterOp::TTL, false);
+        done(-2);
+        return;
+    }
+    
+    TTLRequest request;
+    request.set_key(key);
+    StartKeyCall<TTLRequest, TTLResponse>(route, RouterOp::TTL, std::move(request), &KeyValueStore::Stub::PrepareAsyncTTL,
+        [](const TTLResponse& response) { return response.seconds() != -2; },
+        [this, started, done = std::move(done)](const Status& status, const TTLResponse& response) {
+            CountRequest(started, RouterOp::TTL, status.ok());
+            done(status.ok() ? response.seconds() : -2);
+        });
+}
+
+std::future<bool> ShardRouter::SetAsync(const std::string& key, const std::string& value) {
+    return ToFuture<bool>([&](auto done) { SetAsync(key, value, std::move(done)); });
+}
+
+std::future<std::optional<std::string>> ShardRouter::GetAsync(const std::string& key, const ReadOptions& options) {
+    return ToFuture<std::optional<std::string>>([&](auto done) { GetAsync(key, options, std::move(done)); });
+}
+
+std::future<bool> ShardRouter::DeleteAsync(const std::string& key) {
+    return ToFuture<bool>([&](auto done) { DeleteAsync(key, std::move(done)); });
+}
+
+std::future<bool> ShardRouter::ContainsAsync(const std::string& key) {
+    return ToFuture<bool>([&](auto done) { ContainsAsync(key, std::move(done)); });
+}
+
+std::future<bool> ShardRouter::ExpireAsync(const std::string& key, int seconds) {
+    return ToFuture<bool>([&](auto done) { ExpireAsync(key, seconds, std::move(done)); });
+}
+
+std::future<int> ShardRouter::TTLAsync(const std::string& key) {
+    return ToFuture<int>([&](auto done) { TTLAsync(key, std::move(done)); });
+}
+
+std::vector<ShardRouter::KeyResult> ShardRouter::MultiGet(const std::vector<std::string>& keys) {
+    using Batch = ShardBatch<KeysRequest, MultiGetResponse>;
+    std::vector<KeyResult> results(keys.size());
+    std::vector<KeyRoute> routes;
+    routes.reserve(keys.size());
+    
+    std::vector<Batch> batches;
+    std::unordered_map<std::string, size_t> latest;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        routes.push_back(RouteKey(keys[i]));
+        const std::string& shard_id = routes[i].Target();
+        if (shard_id.empty()) {
+            CountRequest(BeginRequest(shard_id), RouterOp::MULTI_GET, false);
+            continue;
+        }
+        BatchFor(batches, latest, shard_id, i).request.add_keys(keys[i]);
+    }
+    CountShardsCalled(latest.size());
+    CallShards(batches, RouterOp::MULTI_GET, &KeyValueStore::Stub::PrepareAsyncMultiGet);
+    
+    // Moving keys not copied yet are asked of their old owners
+    std::vector<Batch> fallbacks;
+    latest.clear();
+    for (const Batch& batch : batches) {
+        bool ok = batch.status.ok() && batch.response.found_size() == static_cast<int>(batch.positions.size());
+        if (ok) {
+            RecordPrimarySequence(batch.shard_id, batch.response.applied_sequence());
+        } else if (batch.status.error_code() != grpc::StatusCode::CANCELLED) {
+            std::cerr << "MultiGet failed on shard '" << batch.shard_id << "': "
+                      << batch.status.error_message() << std::endl;
+        }
+        CountRequest(batch.started, RouterOp::MULTI_GET, ok, batch.finished);
+        
+        for (size_t j = 0; ok && j < batch.positions.size(); ++j) {
+            size_t i = batch.positions[j];
+            results[i].ok = true;
+            if (batch.response.found(j)) {
+                results[i].found = true;
+                results[i].value = batch.response.values(j);
+            } else if (routes[i].moving_to) {
+                BatchFor(fallbacks, latest, *routes[i].shard_id, i).request.add_keys(keys[i]);
+            }
+        }
+    }
+    if (fallbacks.empty()) {
+        return results;
+    }
+    
+    CallShards(fallbacks, RouterOp::MULTI_GET, &KeyValueStore::Stub::PrepareAsyncMultiGet);
+    for (const Batch& batch : fallbacks) {
+        bool ok = batch.status.ok() && batch.response.found_size() == static_cast<int>(batch.positions.size());
+        CountRequest(batch.started, RouterOp::MULTI_GET, ok, batch.finished);
+        for (size_t j = 0; j < batch.positions.size(); ++j) {
+            KeyResult& result = results[batch.positions[j]];
+            result.ok = ok;
+            if (ok && batch.response.found(j)) {
+                result.found = true;
+                result.value = batch.response.values(j);
+                batch.started.shard->Add(ShardCounter::MIGRATION_READS);
+            }
+        }
+    }
+    return results;
+}
+
+std::vector<ShardRouter::KeyResult> ShardRouter::MultiSet(
+    const std::vector<std::pair<std::string, std::string>>& entries) {
+    WriteInFlight write(*this);
+    std::vector<KeyResult> results(entries.size());
+    
+    std::vector<ShardBatch<MultiSetRequest, MultiSetResponse>> batches;
+    std::unordered_map<std::string, size_t> latest;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        // Moving keys are written to their new owner
+        KeyRoute route = RouteKey(entries[i].first);
+        const std::string& shard_id = route.Target();
+        if (shard_id.empty()) {
+            CountRequest(BeginRequest(shard_id), RouterOp::MULTI_SET, false);
+            continue;
+        }
+        SetRequest* entry = BatchFor(batches, latest, shard_id, i).request.add_entries();
+        entry->set_key(entries[i].first);
+        entry->set_value(entries[i].second);
+    }
+    CountShardsCalled(latest.size());
+    CallShards(batches, RouterOp::MULTI_SET, &KeyValueStore::Stub::PrepareAsyncMultiSet);
+    
+    for (const auto& batch : batches) {
+        if (batch.status.ok()) {
+            RecordPrimarySequence(batch.shard_id, batch.response.sequence());
+        } else if (batch.status.error_code() != grpc::StatusCode::CANCELLED) {
+            std::cerr << "MultiSet failed on shard '" << batch.shard_id << "': "
+                      << batch.status.error_message() << std::endl;
+        }
+        CountRequest(batch.started, RouterOp::MULTI_SET, batch.status.ok(), batch.finished);
+        for (size_t i : batch.positions) {
+            results[i].ok = batch.status.ok();
+        }
+    }
+    return results;
+}
+
+std::vector<ShardRouter::KeyResult> ShardRouter::MultiDelete(const std::vector<std::string>& keys) {
+    WriteInFlight write(*this);
+    std::vector<KeyResult> results(keys.size());
+    std::vector<bool> routed(keys.size(), false);
+    
+    std::vector<ShardBatch<KeysRequest, MultiDeleteResponse>> batches;
+    std::unordered_map<std::string, size_t> latest;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        KeyRoute route = RouteKey(keys[i]);
+        const std::string& shard_id = route.Target();
+        if (shard_id.empty()) {
+            CountRequest(BeginRequest(shard_id), RouterOp::MULTI_DELETE, false);
+            continue;
+        }
+        routed[i] = true;
+        BatchFor(batches, latest, shard_id, i).request.add_keys(keys[i]);
+        if (route.moving_to) {
+            // From both owners, as Delete does; copies made from now on
+            // leave it out
+            route.migration->RecordDelete(keys[i]);
+            BatchFor(batches, latest, *route.shard_id, i).request.add_keys(keys[i]);
+        }
+    }
+    CountShardsCalled(latest.size());
+    CallShards(batches, RouterOp::MULTI_DELETE, &KeyValueStore::Stub::PrepareAsyncMultiDelete);
+    
+    // A key succeeds if every request it was in did, and was found if
+    // any of them found it
+    for (size_t i = 0; i < keys.size(); ++i) {
+        results[i].ok = routed[i];
+    }
+    for (const auto& batch : batches) {
+        bool ok = batch.status.ok() && batch.response.found_size() == static_cast<int>(batch.positions.size());
+        if (ok) {
+            RecordPrimarySequence(batch.shard_id, batch.response.sequence());
+        } else if (batch.status.error_code() != grpc::StatusCode::CANCELLED) {
+            std::cerr << "MultiDelete failed on shard '" << batch.shard_id << "': "
+                      << batch.status.error_message() << std::endl;
+        }
+        CountRequest(batch.started, RouterOp::MULTI_DELETE, ok, batch.finished);
+        for (size_t j = 0; j < batch.positions.size(); ++j) {
+            KeyResult& result = results[batch.positions[j]];
+            result.ok = result.ok && ok;
+            result.found = result.found || (ok && batch.response.found(j));
+        }
+    }
+    for (KeyResult& result : results) {
+        result.found = result.found && result.ok;
+    }
+    return results;
+}
+
+bool ShardRouter::CrossesShards(const std::vector<std::string>& keys) const {
+    const std::string* first = nullptr;
+    for (const auto& key : keys) {
+        // Where its writes would go; a key sharing a tag moves with the rest
+        KeyRoute route = RouteKey(key);
+        if (first && route.Target() != *first) {
+            return true;
+        }
+        first = &route.Target();
+    }
+    return false;
+}
+
+void ShardRouter::CountShardsCalled(size_t shards) {
+    if (shards > 1) {
+        metrics_.ForShard("").Add(ShardCounter::CROSS_SHARD_CALLS);
+    }
+}
+
+template <typename Request, typename Response>
+void ShardRouter::CallShards(std::vector<ShardBatch<Request, Response>>& batches, RouterOp op,
+                             std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*prepare)(
+                                 ClientContext*, const Request&, grpc::CompletionQueue*)) {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending = batches.size();
+    
+    // Each callback fills in its own batch, on a polling thread
+    for (auto& batch : batches) {
+        batch.started = BeginRequest(batch.shard_id);
+        StartPrimaryCall<Request, Response>(batch.shard_id, op, batch.request, prepare,
+            [&batch, &mutex, &done, &pending](const Status& status, const Response& response) {
+                batch.finished = std::chrono::steady_clock::now();
+                batch.status = status;
+                batch.response = response;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending == 0) {
+                    done.notify_one();
+                }
+            });
+    }
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&pending] { return pending == 0; });
+}
+
+template <typename Request, typename Response>
+void ShardRouter::StartPrimaryCall(const std::string& shard_id, RouterOp op, Request request,
+                                   std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*prepare)(
+                                       ClientContext*, const Request&, grpc::CompletionQueue*),
+                                   std::function<void(const Status&, const Response&)> done) {
+    // Deletes itself once `done` has run
+    (new AsyncPrimaryCall<Request, Response>(this, shard_id, op, std::move(request), prepare, std::move(done)))->Start();
+}
+
+template <typename Request, typename Response>
+void ShardRouter::StartKeyCall(const KeyRoute& route, RouterOp op, Request request,
+                               std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*prepare)(
+                                   ClientContext*, const Request&, grpc::CompletionQueue*),
+                               std::function<bool(const Response&)> found,
+                               std::function<void(const Status&, const Response&)> done) {
+    if (!route.moving_to) {
+        StartPrimaryCall<Request, Response>(*route.shard_id, op, std::move(request), prepare, std::move(done));
+        return;
+    }
+    
+    StartPrimaryCall<Request, Response>(*route.moving_to, op, request, prepare,
+        [this, old_owner = *route.shard_id, op, request, prepare, found = std::move(found), done = std::move(done)](
+            const Status& status, const Response& response) {
+            if (!status.ok() || found(response)) {
+                done(status, response);
+                return;
+            }
+            // Not copied yet: the old owner still has it
+            StartPrimaryCall<Request, Response>(old_owner, op, request, prepare,
+                [this, old_owner, found, done](const Status& status, const Response& response) {
+                    if (status.ok() && found(response)) {
+                        metrics_.ForShard(old_owner).Add(ShardCounter::MIGRATION_READS);
+                    }
+                    done(status, response);
+                });
+        });
+}
+
+grpc::CompletionQueue* ShardRouter::BeginAsync(AsyncCall* call) {
+    std::call_once(completion_started_, [this] { StartCompletionThreads(); });
+    
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (async_stopping_) {
+        return nullptr;
+    }
+    call->context = std::make_unique<ClientContext>();
+    async_calls_.insert(call);
+    return completion_queues_[next_queue_++ % completion_queues_.size()].get();
+}
+
+void ShardRouter::EndAsync(AsyncCall* call) {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    async_calls_.erase(call);
+    if (async_calls_.empty() && worker_pending_ == 0) {
+        async_cv_.notify_all();
+    }
+}
+
+bool ShardRouter::RunBlocking(std::function<void()> task) {
+    std::call_once(worker_started_, [this] { worker_ = std::thread(&ShardRouter::RunWorker, this); });
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        if (async_stopping_) {
+            return false;
+        }
+        worker_tasks_.push_back(std::move(task));
+        worker_pending_++;
+    }
+    worker_cv_.notify_one();
+    return true;
+}
+
+void ShardRouter::RunWorker() {
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    while (true) {
+        worker_cv_.wait(lock, [this] { return async_stopping_ || !worker_tasks_.empty(); });
+        if (worker_tasks_.empty()) {
+            return;
+        }
+        std::function<void()> task = std::move(worker_tasks_.front());
+        worker_tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        if (--worker_pending_ == 0 && async_calls_.empty()) {
+            async_cv_.notify_all();
+        }
+    }
+}
+
+void ShardRouter::StartCompletionThreads() {
+    for (size_t i = 0; i < completion_threads_; ++i) {
+        completion_queues_.push_back(std::make_unique<grpc::CompletionQueue>());
+    }
+    for (auto& queue : completion_queues_) {
+        pollers_.emplace_back(&ShardRouter::PollCompletions, this, std::ref(*queue));
+    }
+}
+
+void ShardRouter::PollCompletions(grpc::CompletionQueue& queue) {
+    void* tag;
+    bool ok;
+    // Every call is tagged only on Finish, which always completes (ok is
+    // true), and on a retry's alarm, which fires; its status says how it
+    // went
+    while (queue.Next(&tag, &ok)) {
+        static_cast<AsyncCall*>(tag)->Complete();
+    }
+}
+
+ShardRouter::RequestStart ShardRouter::BeginRequest(const std::string& shard_id) {
+    RequestStart request{&metrics_.ForShard(shard_id), std::chrono::steady_clock::now()};
+    request.shard->Add(ShardCounter::IN_FLIGHT);
+    return request;
+}
+
+void ShardRouter::CountRequest(const RequestStart& request, RouterOp op, bool success,
+                               std::chrono::steady_clock::time_point finished) {
+    ShardMetrics& shard = *request.shard;
+    shard.Add(ShardCounter::IN_FLIGHT, -1);
+    shard.Add(ShardCounter::REQUESTS);
+    shard.Add(success ? ShardCounter::SUCCESSES : ShardCounter::FAILURES);
+    shard.RecordLatency(op, request.at, finished);
+}
+
+std::chrono::system_clock::time_point ShardRouter::DeadlineFor(RouterOp op) const {
+    int64_t deadline_ms = health_options_.DeadlineMs(op);
+    if (deadline_ms <= 0) {
+        return std::chrono::system_clock::time_point::max();
+    }
+    return std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_ms);
+}
+
+bool ShardRouter::AllowCall(const std::string& shard_id, ChannelPool& pool) {
+    if (pool.breaker.Allow()) {
+        return true;
+    }
+    metrics_.ForShard(shard_id).Add(ShardCounter::SHED);
+    return false;
+}
+
+Status ShardRouter::ShedStatus(const std::string& shard_id) {
+    return Status(grpc::StatusCode::UNAVAILABLE, "Circuit open for shard '" + shard_id + "'");
+}
+
+void ShardRouter::RecordOutcome(const std::string& shard_id, ChannelPool& pool, const Status& status) {
+    switch (status.error_code()) {
+        case grpc::StatusCode::UNAVAILABLE:
+        case grpc::StatusCode::DEADLINE_EXCEEDED:
+        case grpc::StatusCode::UNKNOWN:
+        case grpc::StatusCode::INTERNAL:
+            pool.retry_budget.RecordFailure();
+            CircuitChanged(shard_id, pool, pool.breaker.RecordFailure());
+            break;
+        case grpc::StatusCode::CANCELLED:
+            // The router shutting down, not the shard
+            break;
+        default:
+            // The shard answered, even if only to refuse
+            pool.retry_budget.RecordSuccess();
+            CircuitChanged(shard_id, pool, pool.breaker.RecordSuccess());
+            break;
+    }
+}
+
+int64_t ShardRouter::RetryBackoff(const std::string& shard_id, RouterOp op, const Status& status, int retries,
+                                  ChannelPool& pool, std::chrono::system_clock::time_point deadline) {
+    if (status.error_code() != grpc::StatusCode::UNAVAILABLE || !HealthOptions::Idempotent(op) ||
+        retries >= health_options_.max_retries || !pool.retry_budget.AllowRetry()) {
+        return -1;
+    }
+    int64_t backoff_ms = RetryBackoffMs(retries, health_options_.retry_backoff_ms,
+                                        health_options_.retry_backoff_max_ms);
+    if (deadline != std::chrono::system_clock::time_point::max() &&
+        std::chrono::system_clock::now() + std::chrono::milliseconds(backoff_ms) >= deadline) {
+        return -1;
+    }
+    metrics_.ForShard(shard_id).Add(ShardCounter::RETRIES);
+    return backoff_ms;
+}
+
+void ShardRouter::CircuitChanged(const std::string& shard_id, ChannelPool& pool, CircuitChange change) {
+    if (change == CircuitChange::NONE) {
+        return;
+    }
+    if (change == CircuitChange::OPENED) {
+        metrics_.ForShard(shard_id).Add(ShardCounter::CIRCUIT_OPENS);
+    }
+    
+    // The state is read again under the lock, so racing changes settle
+    // on the last one
+    std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+    auto it = shard_pools_.find(shard_id);
+    if (it == shard_pools_.end() || it->second.get() != &pool) {
+        return;
+    }
+    bool open = pool.breaker.State() != CircuitState::CLOSED;
+    if (open == pool.counted_open) {
+        return;
+    }
+    pool.counted_open = open;
+    open_circuits_ += open ? 1 : -1;
+    hash_ring_->SetAvailable(shard_id, !open);
+    if (open) {
+        std::cerr << "Shard '" << shard_id << "' is unavailable: its calls are refused for "
+                  << health_options_.open_ms << " ms at a time" << std::endl;
+    } else {
+        std::cout << "Shard '" << shard_id << "' is available again" << std::endl;
+    }
+}
+
+bool ShardRouter::PrimaryOpen(const std::string& shard_id) {
+    if (open_circuits_ == 0) {
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> lock(connection_mutex_);
+    auto it = shard_pools_.find(shard_id);
+    return it != shard_pools_.end() && it->second->breaker.State() != CircuitState::CLOSED;
+}
+
+void ShardRouter::RetirePool(const std::string& shard_id) {
+    auto it = shard_pools_.find(shard_id);
+    if (it != shard_pools_.end() && it->second->counted_open) {
+        it->second->counted_open = false;
+        open_circuits_--;
+        hash_ring_->SetAvailable(shard_id, true);
+    }
+}
+
+CircuitState ShardRouter::GetCircuitState(const std::string& shard_id) {
+    std::shared_lock<std::shared_mutex> lock(connection_mutex_);
+    auto it = shard_pools_.find(shard_id);
+    return it == shard_pools_.end() ? CircuitState::CLOSED : it->second->breaker.State();
+}
+
+void ShardRouter::RunProber() {
+    auto interval = std::chrono::milliseconds(health_options_.probe_interval_ms);
+    std::unique_lock<std::mutex> lock(prober_mutex_);
+    while (!prober_cv_.wait_for(lock, interval, [this] { return prober_stopping_; })) {
+        lock.unlock();
+        ProbeShards();
+        lock.lock();
+    }
+}
+
+void ShardRouter::ProbeShards() {
+    std::vector<std::pair<std::string, std::shared_ptr<ChannelPool>>> pools;
+    {
+        std::shared_lock<std::shared_mutex> lock(connection_mutex_);
+        pools.assign(shard_pools_.begin(), shard_pools_.end());
+    }
+    
+    // Every primary is probed at once, so one that hangs holds up none of
+    // the others; each callback fills in its own answer, on a polling thread
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending = pools.size();
+    std::vector<std::optional<int64_t>> terms(pools.size());   // Set if answered
+    auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(health_options_.probe_timeout_ms);
+    for (size_t i = 0; i < pools.size(); ++i) {
+        ChannelPool& pool = *pools[i].second;
+        (new AsyncStats(this, pools[i].second, SelectChannel(pool)->stub.get(),
+            [&terms, &mutex, &done, &pending, i](const Status& status, const StatsResponse& response) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (status.ok()) {
+                    terms[i] = response.term();
+                }
+                if (--pending == 0) {
+                    done.notify_one();
+                }
+            }))->Start(deadline);
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&pending] { return pending == 0; });
+    }
+    
+    std::vector<size_t> lost;
+    for (size_t i = 0; i < pools.size(); ++i) {
+        const auto& [shard_id, pool] = pools[i];
+        bool healthy = terms[i].has_value();
+        CircuitChanged(shard_id, *pool, pool->breaker.RecordProbe(healthy));
+        auto replicas = GetShardReplicas(shard_id);
+        if (healthy) {
+            if (replicas) {
+                replicas->reported_term = *terms[i];
+            }
+            CheckFailureRate(shard_id, *pool);
+        } else if (pool->breaker.State() != CircuitState::CLOSED && replicas && MayElectLeader(*replicas)) {
+            // A primary that stopped answering may have lost an election
+            lost.push_back(i);
+        }
+    }
+    
+    // Their members are asked together too
+    std::vector<std::string> leaders(lost.size());
+    pending = lost.size();
+    for (size_t j = 0; j < lost.size(); ++j) {
+        DiscoverLeaderAsync(pools[lost[j]].first, std::chrono::system_clock::time_point::max(),
+            [&leaders, &mutex, &done, &pending, j](std::string leader) {
+                std::lock_guard<std::mutex> lock(mutex);
+                leaders[j] = std::move(leader);
+                if (--pending == 0) {
+                    done.notify_one();
+                }
+            });
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&pending] { return pending == 0; });
+    }
+    for (size_t j = 0; j < lost.size(); ++j) {
+        if (!leaders[j].empty()) {
+            FollowLeader(pools[lost[j]].first, leaders[j], pools[lost[j]].second->address);
+        }
+    }
+}
+
+void ShardRouter::CheckFailureRate(const std::string& shard_id, ChannelPool& pool) {
+    ShardMetrics& metrics = metrics_.ForShard(shard_id);
+    int64_t shed = metrics.Sum(ShardCounter::SHED);
+    std::pair<int64_t, int64_t> counts(metrics.Sum(ShardCounter::REQUESTS) - shed,
+                                       metrics.Sum(ShardCounter::FAILURES) - shed);
+    auto& checked = checked_counts_[shard_id];
+    int64_t requests = counts.first - checked.first;
+    int64_t failures = counts.second - checked.second;
+    checked = counts;
+    
+    // Negative after a ResetStats: skipped this once
+    if (health_options_.failure_rate <= 0 || requests < std::max<int64_t>(health_options_.min_requests, 1) ||
+        failures < 0) {
+        return;
+    }
+    if (static_cast<double>(failures) >= health_options_.failure_rate * static_cast<double>(requests)) {
+        std::cerr << "Shard '" << shard_id << "' failed " << failures << " of " << requests
+                  << " requests in the last probe interval" << std::endl;
+        CircuitChanged(shard_id, pool, pool.breaker.Trip());
+    }
+}
+
+std::string ShardRouter::DiscoverLeader(const std::string& shard_id, std::chrono::system_clock::time_point deadline) {
+    return ToFuture<std::string>([&](std::function<void(std::string)> done) {
+        DiscoverLeaderAsync(shard_id, deadline, std::move(done));
+    }).get();
+}
+
+void ShardRouter::DiscoverLeaderAsync(const std::string& shard_id, std::chrono::system_clock::time_point deadline,
+                                      std::function<void(std::string)> done) {
+    auto primary = GetShardChannel(shard_id);
+    auto replicas = GetShardReplicas(shard_id);
+    if (!primary || !replicas) {
+        done("");
+        return;
+    }
+    deadline = std::min(deadline, std::chrono::system_clock::now() + std::chrono::milliseconds(kLeaderQueryTimeoutMs));
+    
+    // Members that lost touch with the leader may still name it; the one
+    // reporting the highest term knows best
+    struct Discovery {
+        std::mutex mutex;
+        size_t waiting;
+        std::string leader;
+        int64_t leader_term = -1;
+        int64_t highest_term = -1;
+        std::shared_ptr<ShardReplicas> replicas;
+        std::function<void(std::string)> done;
+    };
+    auto discovery = std::make_shared<Discovery>();
+    discovery->waiting = replicas->endpoints.size() + 1;
+    discovery->replicas = replicas;
+    discovery->done = std::move(done);
+    auto answered = [discovery](const Status& status, const StatsResponse& response) {
+        {
+            std::lock_guard<std::mutex> lock(discovery->mutex);
+            if (status.ok()) {
+                discovery->highest_term = std::max(discovery->highest_term, response.term());
+                if (!response.leader().empty() && response.term() > discovery->leader_term) {
+                    discovery->leader = response.leader();
+                    discovery->leader_term = response.term();
+                }
+            }
+            if (--discovery->waiting > 0) {
+                return;
+            }
+        }
+        if (discovery->highest_term >= 0) {
+            discovery->replicas->reported_term = discovery->highest_term;
+        }
+        discovery->done(discovery->leader);
+    };
+    
+    // Each deletes itself once it has answered
+    (new AsyncStats(this, primary, primary->stub.get(), answered))->Start(deadline);
+    for (const auto& endpoint : replicas->endpoints) {
+        (new AsyncStats(this, replicas, endpoint->stub.get(), answered))->Start(deadline);
+    }
+}
+
+bool ShardRouter::MayElectLeader(const ShardReplicas& replicas) {
+    return !replicas.endpoints.empty() && replicas.reported_term != 0;
+}
+
+bool ShardRouter::FollowLeader(const std::string& shard_id, const std::string& leader,
+                               const std::string& tried) {
+    if (leader == tried) {
+        // Still leading as far as its members know: nothing new to try
+        return false;
+    }
+    std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+    
+    const ShardInfo* shard = hash_ring_->GetShard(shard_id);
+    if (!shard) {
+        return false;
+    }
+    if (shard->address == leader) {
+        // Already followed by another request
+        return true;
+    }
+    hash_ring_->SetPrimary(shard_id, leader);
+    
+    // Connections in use stay alive until their calls finish
+    int64_t primary_sequence = 0;
+    int64_t reported_term = -1;
+    auto it = shard_replicas_.find(shard_id);
+    if (it != shard_replicas_.end()) {
+        primary_sequence = it->second->primary_sequence;
+        reported_term = it->second->reported_term;
+    }
+    CreateShardConnection(*shard);
+    shard_replicas_[shard_id]->primary_sequence = primary_sequence;
+    shard_replicas_[shard_id]->reported_term = reported_term;
+    
+    metrics_.ForShard(shard_id).Add(ShardCounter::LEADER_CHANGES);
+    std::cout << "Shard '" << shard_id << "' is now led by " << leader << std::endl;
+    return true;
+}
+
+std::shared_ptr<ShardRouter::PooledChannel> ShardRouter::GetShardChannel(const std::string& shard_id) {
+    std::shared_ptr<ChannelPool> pool;
+    {
+        // Check if we already have a connection to this shard; readers
+        // share the lock, so requests do not queue on each other here
+        std::shared_lock<std::shared_mutex> lock(connection_mutex_);
+        auto it = shard_pools_.find(shard_id);
+        if (it != shard_pools_.end()) {
+            pool = it->second;
+        }
+    }
+    if (!pool) {
+        std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+        
+        auto it = shard_pools_.find(shard_id);
+        if (it != shard_pools_.end()) {
+            pool = it->second;
+        } else {
+            // Connection doesn't exist, create it
+            const ShardInfo* shard = hash_ring_->GetShard(shard_id);
+            if (!shard) {
+                return nullptr;
+            }
+            CreateShardConnection(*shard);
+            pool = shard_pools_[shard_id];
+        }
+    }
+    
+    // Shares the pool's ownership, so a pool replaced by a leader change
+    // outlives the calls still using it
+    return std::shared_ptr<PooledChannel>(pool, SelectChannel(*pool));
+}
+
+ShardRouter::PooledChannel* ShardRouter::SelectChannel(ChannelPool& pool) {
+    const auto& channels = pool.channels;
+    size_t start = pool.next++ % channels.size();
+    if (pool_options_.selection == ChannelSelection::ROUND_ROBIN || channels.size() == 1) {
+        return channels[start].get();
+    }
+    
+    // Scan from a rotating start, so ties are spread rather than all
+    // landing on the first channel
+    PooledChannel* best = channels[start].get();
+    for (size_t i = 1; i < channels.size() && best->outstanding > 0; ++i) {
+        PooledChannel* candidate = channels[(start + i) % channels.size()].get();
+        if (candidate->outstanding < best->outstanding) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+size_t ShardRouter::ReadyChannels(const std::string& shard_id) {
+    std::shared_ptr<ChannelPool> pool;
+    {
+        std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+        auto it = shard_pools_.find(shard_id);
+        if (it == shard_pools_.end()) {
+            return 0;
+        }
+        pool = it->second;
+    }
+    size_t ready = 0;
+    for (const auto& pooled : pool->channels) {
+        if (pooled->channel->GetState(false) == GRPC_CHANNEL_READY) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+std::shared_ptr<ShardRouter::ShardReplicas> ShardRouter::GetShardReplicas(const std::string& shard_id) {
+    {
+        std::shared_lock<std::shared_mutex> lock(connection_mutex_);
+        auto it = shard_replicas_.find(shard_id);
+        if (it != shard_replicas_.end()) {
+            return it->second;
+        }
+    }
+    
+    std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+    auto it = shard_replicas_.find(shard_id);
+    if (it != shard_replicas_.end()) {
+        return it->second;
+    }
+    
+    const ShardInfo* shard = hash_ring_->GetShard(shard_id);
+    if (!shard) {
+        return nullptr;
+    }
+    
+    CreateShardConnection(*shard);
+    return shard_replicas_[shard_id];
+}
+
+void ShardRouter::CreateShardConnection(const ShardInfo& shard) {
+    // Create the gRPC channels to the shard. Channels with the same target
+    // and arguments would share one connection from gRPC's global
+    // subchannel pool; a local pool apiece keeps them apart.
+    // Using InsecureChannelCredentials for simplicity (use SSL in production!)
+    auto pool = std::make_shared<ChannelPool>(health_options_);
+    pool->address = shard.address;
+    for (size_t i = 0; i < pool_options_.channels_per_shard; ++i) {
+        grpc::ChannelArguments args;
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        
+        auto pooled = std::make_unique<PooledChannel>();
+        pooled->channel = grpc::CreateCustomChannel(shard.address, grpc::InsecureChannelCredentials(), args);
+        // Create a stub (client) for the KeyValueStore service
+        pooled->stub = KeyValueStore::NewStub(pooled->channel);
+        pooled->pool = pool.get();
+        pool->channels.push_back(std::move(pooled));
+    }
+    RetirePool(shard.shard_id);
+    shard_pools_[shard.shard_id] = std::move(pool);
+    
+    // Replicas get their own channels, used only for reads
+    auto replicas = std::make_shared<ShardReplicas>();
+    for (const std::string& address : shard.replica_addresses) {
+        auto endpoint = std::make_unique<ReplicaEndpoint>();
+        endpoint->address = address;
+        endpoint->stub = KeyValueStore::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+        replicas->endpoints.push_back(std::move(endpoint));
+    }
+    shard_replicas_[shard.shard_id] = std::move(replicas);
+    
+    std::cout << "Created connection to shard '" << shard.shard_id << "' at " << shard.address;
+    if (pool_options_.channels_per_shard > 1) {
+        std::cout << " (" << pool_options_.channels_per_shard << " channels)";
+    }
+    if (!shard.replica_addresses.empty()) {
+        std::cout << " with " << shard.replica_addresses.size() << " replicas";
+    }
+    std::cout << std::endl;
+}
+
+void ShardRouter::WarmUpConnections() {
+    std::vector<std::shared_ptr<grpc::Channel>> channels;
+    {
+        std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+        for (const auto& [shard_id, pool] : shard_pools_) {
+            for (const auto& pooled : pool->channels) {
+                channels.push_back(pooled->channel);
+            }
+        }
+    }
+    
+    // Start every connection before waiting on any, so they come up
+    // together rather than one timeout after another
+    for (const auto& channel : channels) {
+        channel->GetState(true);
+    }
+    auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(pool_options_.warm_up_timeout_ms);
+    size_t ready = 0;
+    for (const auto& channel : channels) {
+        if (channel->WaitForConnected(deadline)) {
+            ready++;
+        }
+    }
+    if (ready < channels.size()) {
+        std::cerr << "Warm-up connected " << ready << " of " << channels.size()
+                  << " shard channels; the rest connect on first use" << std::endl;
+    }
+}
+
+ShardRouter::ReplicaEndpoint* ShardRouter::PickReplica(ShardReplicas& replicas, const ReadOptions& options) {
+    // Replicas without a recent report are tried; their response is
+    // checked anyway
+    int64_t now = SteadyNowMs();
+    std::vector<ReplicaEndpoint*> eligible;
+    for (const auto& endpoint : replicas.endpoints) {
+        if (endpoint->retry_after_ms > now) continue;
+        if (now - endpoint->reported_at_ms < kReplicaReportTtlMs &&
+            !WithinBounds(replicas, endpoint->applied_sequence, endpoint->lag_ms, options)) {
+            continue;
+        }
+        eligible.push_back(endpoint.get());
+    }
+    
+    if (eligible.empty()) {
+        return nullptr;
+    }
+    if (eligible.size() == 1) {
+        return eligible[0];
+    }
+    
+    // Two random choices, then the less loaded: nearly as good as scanning
+    // for the least loaded, without herding every router onto it
+    thread_local std::minstd_rand rng(std::random_device{}());
+    std::uniform_int_distribution<size_t> pick(0, eligible.size() - 1);
+    size_t first = pick(rng);
+    size_t second = pick(rng);
+    if (second == first) {
+        second = (first + 1) % eligible.size();
+    }
+    return eligible[second]->outstanding < eligible[first]->outstanding ? eligible[second] : eligible[first];
+}
+
+bool ShardRouter::WithinBounds(const ShardReplicas& replicas, int64_t applied_sequence,
+                               int64_t lag_ms, const ReadOptions& options) {
+    if (options.consistency != ReadConsistency::BOUNDED) {
+        return true;
+    }
+    if (options.max_lag_sequences >= 0 &&
+        applied_sequence < replicas.primary_sequence - options.max_lag_sequences) {
+        return false;
+    }
+    if (options.max_lag_ms >= 0 && (lag_ms < 0 || lag_ms > options.max_lag_ms)) {
+        return false;
+    }
+    return true;
+}
+
+void ShardRouter::RecordPrimarySequence(const std::string& shard_id, int64_t sequence) {
+    auto replicas = GetShardReplicas(shard_id);
+    if (!replicas) {
+        return;
+    }
+    int64_t known = replicas->primary_sequence;
+    while (sequence > known && !replicas->primary_sequence.compare_exchange_weak(known, sequence)) {
+    }
+}
+
+void ShardRouter::RemoveShardConnection(const std::string& shard_id) {
+    std::lock_guard<std::shared_mutex> lock(connection_mutex_);
+    RetirePool(shard_id);
+    shard_pools_.erase(shard_id);
+    shard_replicas_.erase(shard_id);
+    std::cout << "Removed connection to shard '" << shard_id << "'" << std::endl;
+}
+
+bool ShardRouter::AddShard(const std::string& shard_id, const std::string& address,
+                           const std::vector<std::string>& replica_addresses, double weight,
+                           const MigrationOptions& options) {
+    return Reshard([=](HashRing& ring) { return ring.AddShard(shard_id, address, replica_addresses, weight); },
+                   options);
+}
+
+bool ShardRouter::RemoveShard(const std::string& shard_id, const MigrationOptions& options) {
+    return Reshard([=](HashRing& ring) { return ring.RemoveShard(shard_id); }, options);
+}
+
+bool ShardRouter::ResumeMigration() {
+    std::lock_guard<std::mutex> lock(reshard_mutex_);
+    if (!migrating_) {
+        std::cerr << "No migration to resume" << std::endl;
+        return false;
+    }
+    return CompleteMigration();
+}
+
+MigrationStats ShardRouter::GetMigrationStats() const {
+    std::lock_guard<std::mutex> lock(migration_mutex_);
+    return migration_ ? migration_->GetStats() : last_migration_stats_;
+}
+
+bool ShardRouter::Reshard(std::function<bool(HashRing&)> change, const MigrationOptions& options) {
+    std::lock_guard<std::mutex> lock(reshard_mutex_);
+    if (migrating_) {
+        std::cerr << "A migration is still in progress; resume it first" << std::endl;
+        return false;
+    }
+    
+    std::unique_ptr<HashRing> target = hash_ring_->Clone();
+    if (!change(*target)) {
+        return false;
+    }
+    // Checked on the copy, under the lock: removals racing each other
+    // cannot empty the ring between them
+    if (target->GetShardCount() == 0) {
+        std::cerr << "Cannot remove the last shard: its keys have nowhere to go" << std::endl;
+        return false;
+    }
+    
+    // Moving keys are sent to their new owners before the ring knows them
+    {
+        std::lock_guard<std::shared_mutex> connection_lock(connection_mutex_);
+        for (const ShardInfo& shard : target->GetAllShards()) {
+            if (shard_pools_.count(shard.shard_id) == 0) {
+                CreateShardConnection(shard);
+            }
+        }
+    }
+    
+    auto migration = std::make_shared<ShardMigrator>(*hash_ring_, std::move(target), options);
+    pending_change_ = std::move(change);
+    {
+        std::lock_guard<std::mutex> migration_lock(migration_mutex_);
+        migration_ = migration;
+    }
+    migrating_ = true;
+    WaitForEarlierWrites();
+    
+    std::cout << "Migration started: " << migration->GetStats().ranges << " ring ranges change owner"
+              << std::endl;
+    return CompleteMigration();
+}
+
+bool ShardRouter::CompleteMigration() {
+    std::shared_ptr<ShardMigrator> migration;
+    {
+        std::lock_guard<std::mutex> lock(migration_mutex_);
+        migration = migration_;
+    }
+    if (!migration->Copy()) {
+        std::cerr << "Migration incomplete; requests keep following it until it is resumed" << std::endl;
+        return false;
+    }
+    
+    // Cut over. Requests that find no migration from here on find the
+    // ring switched over; those that found it route the same either way,
+    // and keep it alive until they are done.
+    pending_change_(*hash_ring_);
+    pending_change_ = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(migration_mutex_);
+        migration_.reset();
+        last_migration_stats_ = migration->GetStats();
+    }
+    migrating_ = false;
+    
+    migration->DropMoved();
+    MigrationStats stats = migration->GetStats();
+    {
+        std::lock_guard<std::mutex> lock(migration_mutex_);
+        last_migration_stats_ = stats;
+    }
+    std::cout << "Migration done: " << stats.keys_copied << " keys copied (" << stats.keys_skipped
+              << " already moved or deleted) in " << stats.copy_seconds << " s, "
+              << stats.keys_dropped << " dropped from their old owners" << std::endl;
+    
+    // Shards that left the ring, now that nothing is sent to them
+    std::vector<std::string> retired;
+    {
+        std::shared_lock<std::shared_mutex> lock(connection_mutex_);
+        for (const auto& [shard_id, pool] : shard_pools_) {
+            if (!hash_ring_->GetShard(shard_id)) {
+                retired.push_back(shard_id);
+            }
+        }
+    }
+    for (const std::string& shard_id : retired) {
+        RemoveShardConnection(shard_id);
+    }
+    return true;
+}
+
+uint64_t ShardRouter::BeginWrite() {
+    uint64_t epoch = write_epoch_.load();
+    writes_in_flight_[epoch & 1]++;
+    return epoch;
+}
+
+void ShardRouter::EndWrite(uint64_t epoch) {
+    writes_in_flight_[epoch & 1]--;
+}
+
+void ShardRouter::WaitForEarlierWrites() {
+    // A write counted after this looks for the migration after counting,
+    // so it finds it
+    uint64_t earlier = write_epoch_++;
+    while (writes_in_flight_[earlier & 1] > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+ShardRouter::RoutingStats ShardRouter::GetStats() const {
+    RoutingStats stats{};
+    for (const auto& [shard_id, metrics] : metrics_.All()) {
+        auto requests = static_cast<uint64_t>(metrics->Sum(ShardCounter::REQUESTS));
+        stats.total_requests += requests;
+        stats.successful_requests += metrics->Sum(ShardCounter::SUCCESSES);
+        stats.failed_requests += metrics->Sum(ShardCounter::FAILURES);
+        stats.replica_reads += metrics->Sum(ShardCounter::REPLICA_READS);
+        stats.replica_fallbacks += metrics->Sum(ShardCounter::REPLICA_FALLBACKS);
+        stats.leader_changes += metrics->Sum(ShardCounter::LEADER_CHANGES);
+        stats.migration_reads += metrics->Sum(ShardCounter::MIGRATION_READS);
+        stats.cross_shard_calls += metrics->Sum(ShardCounter::CROSS_SHARD_CALLS);
+        stats.shed_requests += metrics->Sum(ShardCounter::SHED);
+        stats.retries += metrics->Sum(ShardCounter::RETRIES);
+        stats.circuit_opens += metrics->Sum(ShardCounter::CIRCUIT_OPENS);
+        stats.in_flight += metrics->Sum(ShardCounter::IN_FLIGHT);
+        
+        ShardStats shard;
+        shard.requests = requests;
+        shard.failures = metrics->Sum(ShardCounter::FAILURES);
+        shard.in_flight = metrics->Sum(ShardCounter::IN_FLIGHT);
+        for (size_t op = 0; op < kRouterOps; ++op) {
+            shard.latency[op] = metrics->Latency(static_cast<RouterOp>(op));
+            stats.latency[op].Merge(shard.latency[op]);
+        }
+        // Requests that found no shard count in the totals only
+        if (!shard_id.empty() && requests > 0) {
+            stats.per_shard_requests[shard_id] = requests;
+        }
+        if (!shard_id.empty() && (requests > 0 || shard.in_flight > 0)) {
+            stats.per_shard[shard_id] = std::move(shard);
+        }
+    }
+    return stats;
 }
 
 void ShardRouter::ResetStats() {
-    std::lock_guard<std::mutex> lock(stats_mutex_);
-    stats_.total_requests = 0;
-    stats_.successful_requests = 0;
-    stats_.failed_requests = 0;
-    stats_.per_shard_requests.clear();
+    metrics_.Reset();
 }
 
 } // namespace kvstore
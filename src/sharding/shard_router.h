@@ -1,6 +1,9 @@
 #pragma once
 
 #include "hash_ring.h"
+#include "shard_migrator.h"
+#include "router_metrics.h"
+#include "shard_health.h"
 #include "../storage/storage.h"
 #include <grpcpp/grpcpp.h>
 #include "kvstore.grpc.pb.h"
@@ -8,25 +11,122 @@
 #include <string>
 #include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
 #include <optional>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <future>
+#include <condition_variable>
+#include <thread>
+#include <unordered_set>
+#include <array>
+#include <chrono>
+#include <deque>
 
 namespace kvstore {
 
+/**
+ * Where a routed read may be served from
+ */
+enum class ReadConsistency {
+    PRIMARY,  // The shard's primary only
+    ANY,      // Any replica, however far behind
+    BOUNDED   // A replica within ReadOptions' staleness bounds
+};
+
+/**
+ * Per-request read options. Reads that allow replicas fall back to the
+ * primary when the shard has none, none is within the bounds, or the
+ * replica fails.
+ */
+struct ReadOptions {
+    ReadConsistency consistency = ReadConsistency::PRIMARY;
+    // BOUNDED: how many sequences a replica may trail the highest primary
+    // sequence this router has seen (0 = read your own writes); -1 = no limit
+    int64_t max_lag_sequences = -1;
+    // BOUNDED: how long ago the replica was last in sync; -1 = no limit
+    int64_t max_lag_ms = -1;
+};
+
+/**
+ * How a request picks one of a shard's pooled channels
+ */
+enum class ChannelSelection {
+    ROUND_ROBIN,   // Each channel in turn
+    LEAST_LOADED   // The channel with the fewest requests in flight
+};
+
+/**
+ * The connections a router keeps to each shard's primary. Every channel
+ * gets its own subchannel pool, so each is a separate HTTP/2 connection
+ * rather than a share of one.
+ */
+struct ChannelPoolOptions {
+    // Past one, requests in flight stop queueing behind each other on a
+    // single connection (benchmarks/channel_pool_bench sweeps this)
+    size_t channels_per_shard = 4;
+    ChannelSelection selection = ChannelSelection::ROUND_ROBIN;
+    // Connect every channel when the router is created, waiting up to this
+    // long for them; 0 = connect on first use
+    int64_t warm_up_timeout_ms = 1000;
+};
+
 /**
  * Routes requests to appropriate shards based on consistent hashing
  * 
  * The ShardRouter maintains:
  * 1. A hash ring to determine which shard owns each key
  * 2. gRPC client connections to all shards
- * 3. Connection pooling for efficient communication
+ * 3. Connection pooling for efficient communication: a pool of channels
+ *    per shard primary, spread by ChannelPoolOptions
+ *
+ * Every operation comes in a blocking form and an asynchronous one. The
+ * asynchronous forms (GetAsync, SetAsync, ...) are made on gRPC's async
+ * stubs and completed by a few polling threads, so requests in flight do
+ * not each hold a thread. Each takes a callback, which runs on a polling
+ * thread and must not block, or returns a future.
+ *
+ * Shards added or removed through the router (AddShard, RemoveShard) are
+ * resharded online: the keys changing owner are copied by a
+ * ShardMigrator while requests carry on, then the ring switches over.
+ * Until it does, requests for a moving key go to its new owner, and reads
+ * that find nothing there ask the old owner. Deletes go to both. An
+ * EXPIRE of a key not copied yet copies it first, blocking the calling
+ * thread (for ExpireAsync, a worker thread of the router's).
+ * Moving keys are read from primaries whatever the ReadOptions.
+ *
+ * Every call to a shard has a deadline, and each shard primary has a
+ * circuit breaker (see HealthOptions). Calls that fail in a row, a
+ * failure rate found each probe interval, or health probes that go
+ * unanswered open the circuit: the shard is marked unavailable in the
+ * ring and its calls are refused at once rather than left to time out,
+ * except for reads, which its replicas serve. A trial call after a
+ * while, or a probe that is answered, closes it again. Reads that fail
+ * with UNAVAILABLE are retried after a jittered backoff, within a
+ * per-shard retry budget.
  */
 class ShardRouter {
 public:
+    static constexpr size_t kDefaultCompletionThreads = 2;
+    // Keys per request to one shard in a multi-key call
+    static constexpr size_t kMaxBatchKeys = 1000;
+    
     /**
      * Create a router with an existing hash ring
      * @param hash_ring Shared pointer to the hash ring
+     * @param completion_threads Threads completing asynchronous calls,
+     *        started with the first one
+     * @param pool Channels per shard and how requests pick one
+     * @param latency_precision_bits Resolution of the latency histograms:
+     *        each latency is kept to within 2^-bits of itself (1 to 10)
+     * @param health Deadlines, health probes, circuit breaking and retries
      */
-    explicit ShardRouter(std::shared_ptr<HashRing> hash_ring);
+    explicit ShardRouter(std::shared_ptr<HashRing> hash_ring,
+                         size_t completion_threads = kDefaultCompletionThreads,
+                         const ChannelPoolOptions& pool = ChannelPoolOptions(),
+                         int latency_precision_bits = LatencyHistogram::kDefaultPrecisionBits,
+                         const HealthOptions& health = HealthOptions());
     
     ~ShardRouter();
     
@@ -43,12 +143,23 @@ public:
     bool Set(const std::string& key, const std::string& value);
     
     /**
-     * Route a GET operation to the appropriate shard
+     * Route a GET operation to the appropriate shard's primary
      * @param key The key to retrieve
      * @return The value if found, std::nullopt otherwise
      */
     std::optional<std::string> Get(const std::string& key);
     
+    /**
+     * Route a GET operation to the appropriate shard, spreading it across
+     * the shard's replicas when the options allow. Of two replicas picked
+     * at random, the one with fewer requests in flight is used, and the
+     * staleness it reports in its response is checked against the bounds.
+     * @param key The key to retrieve
+     * @param options Consistency level
+     * @return The value if found, std::nullopt otherwise
+     */
+    std::optional<std::string> Get(const std::string& key, const ReadOptions& options);
+    
     /**
      * Route a DELETE operation to the appropriate shard
      * @param key The key to delete
@@ -78,6 +189,102 @@ public:
      */
     int TTL(const std::string& key);
     
+    /**
+     * Asynchronous forms of the operations above, with the same results.
+     * Calls still in flight when the router is destroyed are cancelled and
+     * complete as failures.
+     */
+    void SetAsync(const std::string& key, const std::string& value, std::function<void(bool)> done);
+    void GetAsync(const std::string& key, std::function<void(std::optional<std::string>)> done);
+    void GetAsync(const std::string& key, const ReadOptions& options,
+                  std::function<void(std::optional<std::string>)> done);
+    void DeleteAsync(const std::string& key, std::function<void(bool)> done);
+    void ContainsAsync(const std::string& key, std::function<void(bool)> done);
+    void ExpireAsync(const std::string& key, int seconds, std::function<void(bool)> done);
+    void TTLAsync(const std::string& key, std::function<void(int)> done);
+    
+    std::future<bool> SetAsync(const std::string& key, const std::string& value);
+    std::future<std::optional<std::string>> GetAsync(const std::string& key,
+                                                     const ReadOptions& options = ReadOptions());
+    std::future<bool> DeleteAsync(const std::string& key);
+    std::future<bool> ContainsAsync(const std::string& key);
+    std::future<bool> ExpireAsync(const std::string& key, int seconds);
+    std::future<int> TTLAsync(const std::string& key);
+    
+    /**
+     * One key's outcome in a multi-key call
+     */
+    struct KeyResult {
+        bool ok{false};        // False if its shard's request failed; other shards' keys are unaffected
+        bool found{false};     // MultiGet, MultiDelete: the key existed
+        std::string value;     // MultiGet: its value, if found
+    };
+    
+    /**
+     * Multi-key operations. The keys are grouped by shard, and each shard
+     * gets one request per kMaxBatchKeys of them; the requests are all
+     * sent at once on the async stubs, so a call takes about as long as
+     * its slowest shard rather than the sum of them. Results are in the
+     * order of the keys given. Keys moving in a migration are handled as
+     * the single-key calls handle them.
+     */
+    std::vector<KeyResult> MultiGet(const std::vector<std::string>& keys);
+    std::vector<KeyResult> MultiSet(const std::vector<std::pair<std::string, std::string>>& entries);
+    std::vector<KeyResult> MultiDelete(const std::vector<std::string>& keys);
+    
+    /**
+     * Whether a multi-key call on these keys would go to more than one
+     * shard, and so not be atomic. Keys sharing a hash tag, on a ring
+     * with hash tags on, never do.
+     */
+    bool CrossesShards(const std::vector<std::string>& keys) const;
+    
+    /**
+     * Add a shard to the live cluster, moving the keys it takes over to it
+     * from their current owners. Blocks until the copy is done and the
+     * ring has switched over; the copies are then dropped from the old
+     * owners. Requests may be made meanwhile, but other ring changes must
+     * not.
+     * @param options Batching and throttling of the copy
+     * @return false if the shard exists, another migration is unfinished,
+     *         or the copy failed. A failed migration stays in progress,
+     *         and requests keep following it, until ResumeMigration()
+     *         completes it.
+     */
+    bool AddShard(const std::string& shard_id, const std::string& address,
+                  const std::vector<std::string>& replica_addresses = {}, double weight = 1.0,
+                  const MigrationOptions& options = MigrationOptions());
+    
+    /**
+     * Remove a shard from the live cluster, moving its keys to the shards
+     * taking them over first. The shard's own data is left in place.
+     * @return false as for AddShard, or if it is the last shard
+     */
+    bool RemoveShard(const std::string& shard_id, const MigrationOptions& options = MigrationOptions());
+    
+    /**
+     * Retry a migration that failed to copy its keys
+     * @return false if there is none, or it failed again
+     */
+    bool ResumeMigration();
+    
+    /**
+     * Progress of the current migration, or the last one
+     */
+    MigrationStats GetMigrationStats() const;
+    
+    /**
+     * One shard's statistics. Latencies run from the router call's start
+     * to its end (a multi-key call's from its request to the shard), in
+     * microseconds, per RouterOp.
+     */
+    struct ShardStats {
+        uint64_t requests{0};
+        uint64_t failures{0};
+        int64_t in_flight{0};          // Requests started and not finished
+        std::array<LatencySnapshot, kRouterOps> latency;
+    };
+    
     /**
      * Get routing statistics
      */
@@ -85,23 +292,367 @@ public:
         uint64_t total_requests;
         uint64_t successful_requests;
         uint64_t failed_requests;
+        uint64_t replica_reads;        // Reads answered by a replica
+        uint64_t replica_fallbacks;    // Replica reads redone on the primary (too stale or failed)
+        uint64_t leader_changes;       // Primaries replaced by a shard's newly elected leader
+        uint64_t migration_reads;      // Reads of a moving key answered by its old owner (not copied yet)
+        uint64_t cross_shard_calls;    // Multi-key calls sent to more than one shard
+        uint64_t shed_requests;        // Calls refused while a shard's circuit was open
+        uint64_t retries;              // Reads sent again after failing
+        uint64_t circuit_opens;        // Times a shard's circuit opened
+        int64_t in_flight;             // Requests started and not finished, all shards
         std::unordered_map<std::string, uint64_t> per_shard_requests;
+        std::unordered_map<std::string, ShardStats> per_shard;
+        std::array<LatencySnapshot, kRouterOps> latency;   // Per operation, all shards
     };
     
+    /**
+     * Statistics are kept per shard in lock-free counters and histograms
+     * (see RouterMetrics) and added up here. Requests finishing during a
+     * ResetStats may be counted either side of it.
+     */
     RoutingStats GetStats() const;
     void ResetStats();
     
+    /**
+     * How many of a shard primary's pooled channels are connected
+     */
+    size_t ReadyChannels(const std::string& shard_id);
+    
+    /**
+     * The state of a shard primary's circuit (CLOSED if it is unknown)
+     */
+    CircuitState GetCircuitState(const std::string& shard_id);
+    
 private:
+    struct ChannelPool;
+    
+    // One connection to a shard's primary
+    struct PooledChannel {
+        std::shared_ptr<grpc::Channel> channel;
+        std::unique_ptr<KeyValueStore::Stub> stub;
+        std::atomic<int> outstanding{0};              // Requests in flight
+        ChannelPool* pool{nullptr};                   // Its pool, which outlives it
+    };
+    
+    // The channels to a shard's primary, and how that primary is doing.
+    // A leader change replaces the pool, and so starts its health afresh.
+    struct ChannelPool {
+        explicit ChannelPool(const HealthOptions& options) : breaker(options), retry_budget(options) {}
+        
+        std::string address;                          // The primary's
+        std::vector<std::unique_ptr<PooledChannel>> channels;
+        std::atomic<size_t> next{0};                  // Round-robin position
+        CircuitBreaker breaker;
+        RetryBudget retry_budget;
+        bool counted_open{false};                     // In open_circuits_; guarded by connection_mutex_
+    };
+    
+
+    // A replica of a shard, for reads that allow one
+    struct ReplicaEndpoint {
+        std::string address;
+        std::unique_ptr<KeyValueStore::Stub> stub;
+        std::atomic<int> outstanding{0};              // Requests in flight
+        std::atomic<int64_t> applied_sequence{-1};    // As of its last response; -1 = not yet known
+        std::atomic<int64_t> lag_ms{-1};
+        std::atomic<int64_t> reported_at_ms{0};       // When applied_sequence and lag_ms arrived
+        std::atomic<int64_t> retry_after_ms{0};       // Skipped until then after a failure
+    };
+    
+    struct ShardReplicas {
+        std::vector<std::unique_ptr<ReplicaEndpoint>> endpoints;
+        std::atomic<int64_t> primary_sequence{0};     // Highest primary sequence seen
+        // The highest term its members last reported: 0 if they elect no
+        // leader (no consensus), -1 if not yet known
+        std::atomic<int64_t> reported_term{-1};
+    };
+    
+    using PrimaryCall = std::function<grpc::Status(KeyValueStore::Stub& stub, grpc::ClientContext& context)>;
+    
+    // Where a key's requests go
+    struct KeyRoute {
+        const std::string* shard_id;              // Its owner in the ring
+        const std::string* moving_to = nullptr;   // Set while the key is moving to this shard
+        // The migration consulted, kept alive while the route names shards
+        // of its target ring
+        std::shared_ptr<ShardMigrator> migration;
+        
+        // The shard that takes the key's writes
+        const std::string& Target() const { return moving_to ? *moving_to : *shard_id; }
+    };
+    
+    // A request to a shard, in its in-flight gauge until counted
+    struct RequestStart {
+        ShardMetrics* shard{nullptr};
+        std::chrono::steady_clock::time_point at;
+    };
+    
+    // Counts a blocking write in flight for the migration barrier
+    class WriteInFlight;
+    
+    // An asynchronous call in flight; its address is the completion queue tag
+    struct AsyncCall {
+        virtual ~AsyncCall() = default;
+        // The RPC finished, successfully or not, or a retry's backoff ended
+        virtual void Complete() = 0;
+        // Replaced for each attempt, under async_mutex_
+        std::unique_ptr<grpc::ClientContext> context;
+    };
+    template <typename Request, typename Response> class AsyncPrimaryCall;
+    class AsyncReplicaGet;
+    class AsyncStats;
+    
+    // One request of a multi-key call: the shard, the positions of its
+    // keys in the call, and the reply once CallShards returns
+    template <typename Request, typename Response>
+    struct ShardBatch {
+        std::string shard_id;
+        std::vector<size_t> positions;
+        Request request;
+        RequestStart started;
+        std::chrono::steady_clock::time_point finished;
+        grpc::Status status;
+        Response response;
+    };
+    
+    /**
+     * Get or create a connection to a shard's primary, picked from its
+     * pool. The pool stays alive while the result is held.
+     */
+    std::shared_ptr<PooledChannel> GetShardChannel(const std::string& shard_id);
+    
+    // Pick a channel from a pool by pool_options_.selection
+    PooledChannel* SelectChannel(ChannelPool& pool);
+    
+    /**
+     * Get or create the connections to a shard's replicas
+     */
+    std::shared_ptr<ShardReplicas> GetShardReplicas(const std::string& shard_id);
+    
+    /**
+     * Route a key. The migration is looked up before the ring, so a
+     * request that misses a migration ending finds the ring already
+     * switched over.
+     */
+    KeyRoute RouteKey(const std::string& key) const;
+    
+    /**
+     * CallPrimary on the key's shard. For a moving key, if `found` says
+     * the call found nothing on the new owner, it is redone on the old one.
+     */
+    grpc::Status CallKey(const KeyRoute& route, RouterOp op, const PrimaryCall& call,
+                         const std::function<bool()>& found = nullptr);
+    
+    /**
+     * StartPrimaryCall on the key's shard, redone on a moving key's old
+     * owner as CallKey does
+     */
+    template <typename Request, typename Response>
+    void StartKeyCall(const KeyRoute& route, RouterOp op, Request request,
+                      std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*prepare)(
+                          grpc::ClientContext*, const Request&, grpc::CompletionQueue*),
+                      std::function<bool(const Response&)> found,
+                      std::function<void(const grpc::Status&, const Response&)> done);
+    
+    /**
+     * Writes are counted while in flight, by the parity of the epoch they
+     * were routed in. A migration moves to the next epoch once it is
+     * published and waits out the writes routed before, which may not
+     * have seen it, so none lands on an old owner after the copy read it.
+     */
+    uint64_t BeginWrite();
+    void EndWrite(uint64_t epoch);
+    void WaitForEarlierWrites();
+    
+    /**
+     * Make a topology change with a migration: `change` is made to a copy
+     * of the ring, the moving keys are copied, then it is made to the ring
+     */
+    bool Reshard(std::function<bool(HashRing&)> change, const MigrationOptions& options);
+    
+    // Copy the migration's keys, switch over and clean up. Called with
+    // reshard_mutex_ held.
+    bool CompleteMigration();
+    
+    /**
+     * Make a call on a shard's primary, within the operation's deadline.
+     * When the shard elects its master (consensus mode) and it has moved,
+     * the call is redone on the new leader: a replica's refusal names it,
+     * and if the primary cannot be reached the shard's members are asked.
+     * An open circuit refuses the call; an idempotent one that fails is
+     * retried as RetryBackoff allows.
+     */
+    grpc::Status CallPrimary(const std::string& shard_id, RouterOp op, const PrimaryCall& call);
+    
+    /**
+     * After a failed call on a shard's primary, the leader to redo it on:
+     * the one a replica's refusal names, or (if the primary could not be
+     * reached) the one its members report. "" if there is none to follow.
+     * Members are only asked for a shard with replicas that may elect one,
+     * and not past the call's deadline.
+     */
+    std::string LeaderAfter(const std::string& shard_id, const grpc::Status& status,
+                            const grpc::ClientContext& context, std::chrono::system_clock::time_point deadline);
+    
+    // The leader a replica's refusal names, or ""
+    static std::string LeaderNamed(const grpc::Status& status, const grpc::ClientContext& context);
+    
+    // Whether LeaderAfter asks the shard's members: the primary could not
+    // be reached, the shard may elect a leader and the call has time left
+    bool ShouldDiscoverLeader(const std::string& shard_id, const grpc::Status& status,
+                              std::chrono::system_clock::time_point deadline);
+    
+    /**
+     * CallPrimary on the async stubs: issue the call, following leader
+     * changes, and pass its final status and response to `done`
+     */
+    template <typename Request, typename Response>
+    void StartPrimaryCall(const std::string& shard_id, RouterOp op, Request request,
+                          std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*prepare)(
+                              grpc::ClientContext*, const Request&, grpc::CompletionQueue*),
+                          std::function<void(const grpc::Status&, const Response&)> done);
+    
+    // Count a multi-key call that went to more than one shard
+    void CountShardsCalled(size_t shards);
+    
+    /**
+     * StartPrimaryCall every batch at once, and wait until all have
+     * completed
+     */
+    template <typename Request, typename Response>
+    void CallShards(std::vector<ShardBatch<Request, Response>>& batches, RouterOp op,
+                    std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (KeyValueStore::Stub::*prepare)(
+                        grpc::ClientContext*, const Request&, grpc::CompletionQueue*));
+    
+    // The primary half of GetAsync
+    void GetFromPrimaryAsync(const KeyRoute& route, const std::string& key, const RequestStart& started,
+                             std::function<void(std::optional<std::string>)> done);
+    
+    /**
+     * Track a call about to issue an RPC: give it a fresh context and pick
+     * its completion queue
+     * @return nullptr if the router is shutting down
+     */
+    grpc::CompletionQueue* BeginAsync(AsyncCall* call);
+    // The call is done and about to be deleted
+    void EndAsync(AsyncCall* call);
+    void StartCompletionThreads();
+    void PollCompletions(grpc::CompletionQueue& queue);
+    
+    /**
+     * Run a step of an asynchronous call that blocks (ExpireAsync copying
+     * a key) on the router's worker thread, off the polling threads
+     * @return false if the router is shutting down; the task is not run
+     */
+    bool RunBlocking(std::function<void()> task);
+    void RunWorker();
+    
+    // When a call made now for the operation must finish by
+    std::chrono::system_clock::time_point DeadlineFor(RouterOp op) const;
+    
+    // Whether the shard's circuit lets a call through; counted as shed if not
+    bool AllowCall(const std::string& shard_id, ChannelPool& pool);
+    
+    // What a call refused by an open circuit fails with
+    static grpc::Status ShedStatus(const std::string& shard_id);
+    
+    // Feed a call's status to the shard's circuit and retry budget
+    void RecordOutcome(const std::string& shard_id, ChannelPool& pool, const grpc::Status& status);
+    
     /**
-     * Get or create a gRPC stub for a shard
-     * Uses connection pooling to reuse connections
+     * How long to wait before retrying a failed call, counting the retry
+     * @param retries Retries made so far
+     * @return -1 if it is not retried: not idempotent, not UNAVAILABLE,
+     *         out of retries or budget, or past its deadline by then
      */
-    std::unique_ptr<KeyValueStore::Stub>& GetShardStub(const std::string& shard_id);
+    int64_t RetryBackoff(const std::string& shard_id, RouterOp op, const grpc::Status& status, int retries,
+                         ChannelPool& pool, std::chrono::system_clock::time_point deadline);
+    
+    /**
+     * Act on a circuit's change of state: log it, and keep the ring's
+     * availability and open_circuits_ in step with the shard's current
+     * pool (a replaced pool's changes are ignored)
+     */
+    void CircuitChanged(const std::string& shard_id, ChannelPool& pool, CircuitChange change);
+    
+    // Whether the shard's primary has its circuit open
+    bool PrimaryOpen(const std::string& shard_id);
+    
+    // Stop counting a pool's open circuit, as it is replaced or removed.
+    // Called with connection_mutex_ held.
+    void RetirePool(const std::string& shard_id);
+    
+    /**
+     * Probe every shard's primary each probe interval, all at once on the
+     * async stubs, and check its failure rate over the interval. An
+     * unanswered probe on a shard with replicas also asks them who leads
+     * it, in case it was replaced.
+     */
+    void RunProber();
+    void ProbeShards();
+    void CheckFailureRate(const std::string& shard_id, ChannelPool& pool);
+    
+    // Start a request to a shard: it joins the shard's in-flight gauge
+    RequestStart BeginRequest(const std::string& shard_id);
+    
+    // Count a finished request in the statistics, with its latency
+    void CountRequest(const RequestStart& request, RouterOp op, bool success,
+                      std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now());
+    
+    /**
+     * Ask a shard's members who leads it, all at once, for up to
+     * kLeaderQueryTimeoutMs but not past `deadline`. Their terms are kept
+     * in the shard's reported_term. Waits on the polling threads, so is
+     * never called on one.
+     * @return The leader reported with the highest term, or "" if none is known
+     */
+    std::string DiscoverLeader(const std::string& shard_id, std::chrono::system_clock::time_point deadline);
+    
+    // DiscoverLeader on the async stubs: `done` gets the leader once every
+    // member has answered or failed, on a polling thread
+    void DiscoverLeaderAsync(const std::string& shard_id, std::chrono::system_clock::time_point deadline,
+                             std::function<void(std::string)> done);
+    
+    // Whether asking a shard's members who leads it could find a leader:
+    // it has replicas, and they have not reported that none is elected
+    static bool MayElectLeader(const ShardReplicas& replicas);
     
     /**
-     * Create a new gRPC channel and stub for a shard
+     * Make `leader` the shard's primary; the old primary becomes a replica
+     * @param tried The primary the failed call went to
+     * @return Whether the call should be redone: false if the shard is
+     *         unknown or `leader` is the primary it already tried
      */
-    void CreateShardConnection(const std::string& shard_id, const std::string& address);
+    bool FollowLeader(const std::string& shard_id, const std::string& leader, const std::string& tried);
+    
+    /**
+     * Create new gRPC channels and stubs for a shard and its replicas
+     */
+    void CreateShardConnection(const ShardInfo& shard);
+    
+    /**
+     * Connect every channel to every shard, waiting up to
+     * pool_options_.warm_up_timeout_ms for them
+     */
+    void WarmUpConnections();
+    
+    /**
+     * Power of two choices among the replicas that look eligible
+     * @return nullptr if none does
+     */
+    ReplicaEndpoint* PickReplica(ShardReplicas& replicas, const ReadOptions& options);
+    
+    /**
+     * Whether a replica's reported position satisfies the options
+     */
+    static bool WithinBounds(const ShardReplicas& replicas, int64_t applied_sequence,
+                             int64_t lag_ms, const ReadOptions& options);
+    
+    /**
+     * Remember the primary's sequence after a write or primary read
+     */
+    void RecordPrimarySequence(const std::string& shard_id, int64_t sequence);
     
     /**
      * Remove a shard connection (when shard is removed)
@@ -111,15 +662,58 @@ private:
     // Hash ring for determining shard ownership
     std::shared_ptr<HashRing> hash_ring_;
     
-    // Connection pool: shard_id -> gRPC stub
-    std::unordered_map<std::string, std::unique_ptr<KeyValueStore::Stub>> shard_stubs_;
+    // Connection pool: shard_id -> channels to its primary
+    ChannelPoolOptions pool_options_;
+    std::unordered_map<std::string, std::shared_ptr<ChannelPool>> shard_pools_;
+    
+    // Replica connections and read routing state: shard_id -> replicas
+    std::unordered_map<std::string, std::shared_ptr<ShardReplicas>> shard_replicas_;
     
     // Statistics
-    mutable std::mutex stats_mutex_;
-    RoutingStats stats_;
+    RouterMetrics metrics_;
+    
+    // Shard health: circuits are kept in the channel pools
+    HealthOptions health_options_;
+    std::atomic<int> open_circuits_{0};     // Pools with their circuit open, so reads check for one only then
+    std::thread prober_;
+    std::mutex prober_mutex_;               // Guards prober_stopping_
+    std::condition_variable prober_cv_;
+    bool prober_stopping_{false};
+    // Prober thread only: each shard's requests and failures (shed calls
+    // left out) at the last check
+    std::unordered_map<std::string, std::pair<int64_t, int64_t>> checked_counts_;
+    
+    // Connection mutex: shared for lookups, exclusive to add or replace
+    std::shared_mutex connection_mutex_;
+    
+    // Asynchronous calls: one completion queue per polling thread
+    size_t completion_threads_;
+    std::once_flag completion_started_;
+    std::vector<std::unique_ptr<grpc::CompletionQueue>> completion_queues_;
+    std::vector<std::thread> pollers_;
+    std::atomic<size_t> next_queue_{0};
+    std::mutex async_mutex_;            // Guards async_calls_, async_stopping_ and the worker's tasks
+    std::condition_variable async_cv_;
+    std::unordered_set<AsyncCall*> async_calls_;
+    bool async_stopping_{false};
+    
+    // Blocking steps of asynchronous calls, run by one worker thread
+    std::once_flag worker_started_;
+    std::thread worker_;
+    std::condition_variable worker_cv_;
+    std::deque<std::function<void()>> worker_tasks_;
+    size_t worker_pending_{0};          // Tasks queued or running
     
-    // Connection mutex
-    std::mutex connection_mutex_;
+    // Resharding. A migration is freed once it is done and the last
+    // request routed by it has let go; only its stats are kept.
+    std::mutex reshard_mutex_;          // One topology change at a time
+    std::atomic<bool> migrating_{false};            // migration_ is set; checked before locking
+    mutable std::mutex migration_mutex_;            // Guards migration_ and last_migration_stats_
+    std::shared_ptr<ShardMigrator> migration_;      // In progress
+    MigrationStats last_migration_stats_;           // Of the last one done
+    std::function<bool(HashRing&)> pending_change_;
+    std::atomic<uint64_t> write_epoch_{0};
+    std::array<std::atomic<int64_t>, 2> writes_in_flight_{};
 };
 
 } // namespace kvstore
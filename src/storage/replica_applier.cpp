@@ -0,0 +1,127 @@
+#include "replica_applier.h"
+#include <algorithm>
+
+namespace kvstore {
+
+namespace {
+
+// Commands received but not yet logged before Submit() waits
+constexpr size_t kMaxInFlight = 1 << 16;
+
+} // namespace
+
+ReplicaApplier::ReplicaApplier(size_t threads, int64_t last_sequence, RouteFunction route,
+                               ApplyFunction apply, LogFunction log)
+    : route_(std::move(route)),
+      apply_(std::move(apply)),
+      log_(std::move(log)),
+      received_(last_sequence) {
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+        workers_.back()->thread = std::thread(&ReplicaApplier::Run, this, std::ref(*workers_.back()));
+    }
+}
+
+ReplicaApplier::~ReplicaApplier() {
+    Drain();
+    for (auto& worker : workers_) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->stopping = true;
+        }
+        worker->cv.notify_all();
+        worker->thread.join();
+    }
+}
+
+ReplicaApplier::SubmitResult ReplicaApplier::Submit(const ReplicationBatch& batch) {
+    std::vector<std::vector<Pending*>> assigned(workers_.size());
+    bool accepted = false;
+    bool gap = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return window_.size() < kMaxInFlight; });
+
+        for (const ReplicationCommand& command : batch.commands()) {
+            if (command.sequence_id() <= received_) continue;
+            if (command.sequence_id() != received_ + 1) {
+                gap = true;
+                break;
+            }
+            // Deque elements stay put as others are added and removed
+            window_.push_back({command, false});
+            received_ = command.sequence_id();
+            accepted = true;
+            assigned[route_(command.key()) % workers_.size()].push_back(&window_.back());
+        }
+    }
+
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        if (assigned[i].empty()) continue;
+        Worker& worker = *workers_[i];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.queue.insert(worker.queue.end(), assigned[i].begin(), assigned[i].end());
+        }
+        worker.cv.notify_one();
+    }
+
+    if (gap) return SubmitResult::GAP;
+    return accepted ? SubmitResult::ACCEPTED : SubmitResult::DUPLICATE;
+}
+
+void ReplicaApplier::Run(Worker& worker) {
+    std::vector<Pending*> work;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.cv.wait(lock, [&worker] { return worker.stopping || !worker.queue.empty(); });
+            if (worker.queue.empty()) return;
+            work.swap(worker.queue);
+        }
+
+        for (Pending* pending : work) {
+            apply_(pending->command);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (Pending* pending : work) {
+                pending->applied = true;
+            }
+        }
+        work.clear();
+        Commit();
+    }
+}
+
+void ReplicaApplier::Commit() {
+    std::lock_guard<std::mutex> commit_lock(commit_mutex_);
+    std::vector<ReplicationCommand> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!window_.empty() && window_.front().applied) {
+            ready.push_back(std::move(window_.front().command));
+            window_.pop_front();
+        }
+    }
+    if (ready.empty()) return;
+
+    log_(ready);
+    cv_.notify_all();
+}
+
+void ReplicaApplier::Drain() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return window_.empty(); });
+    }
+    // The last commands may have left the window but still be being logged
+    std::lock_guard<std::mutex> commit_lock(commit_mutex_);
+}
+
+void ReplicaApplier::Reset(int64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    received_ = sequence;
+}
+
+} // namespace kvstore
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdint>
+#include "kvstore.pb.h"
+
+namespace kvstore {
+
+/**
+ * Applies a replica's incoming commands on several worker threads
+ *
+ * Each command goes to the worker that owns its key's storage partition, so
+ * the commands on a key are applied one at a time in sequence order while
+ * other partitions proceed in parallel, and workers never wait on each
+ * other's partition locks. Once a command and every command before it have
+ * been applied they are logged, in sequence order: the log's last sequence
+ * is a low watermark below which everything has been applied.
+ */
+class ReplicaApplier {
+public:
+    // Apply one command to the dataset without logging it
+    using ApplyFunction = std::function<void(const ReplicationCommand& command)>;
+    // Log applied commands, oldest first
+    using LogFunction = std::function<void(std::vector<ReplicationCommand>& commands)>;
+    // Storage partition of a key
+    using RouteFunction = std::function<size_t(const std::string& key)>;
+
+    enum class SubmitResult {
+        ACCEPTED,
+        DUPLICATE,  // Everything in the batch was received before
+        GAP         // The batch skips a sequence; only the commands before it were queued
+    };
+
+    /**
+     * @param last_sequence Last sequence already applied and logged
+     */
+    ReplicaApplier(size_t threads, int64_t last_sequence, RouteFunction route,
+                   ApplyFunction apply, LogFunction log);
+    ~ReplicaApplier();
+
+    ReplicaApplier(const ReplicaApplier&) = delete;
+    ReplicaApplier& operator=(const ReplicaApplier&) = delete;
+
+    // Queue the commands after the last one received; blocks while too
+    // many are in flight
+    SubmitResult Submit(const ReplicationBatch& batch);
+
+    // Wait until everything queued has been applied and logged
+    void Drain();
+
+    // Continue after `sequence` (a full resync); only valid once drained
+    void Reset(int64_t sequence);
+
+private:
+    struct Pending {
+        ReplicationCommand command;
+        bool applied{false};
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<Pending*> queue;
+        bool stopping{false};
+        std::thread thread;
+    };
+
+    void Run(Worker& worker);
+    // Log the applied prefix of the window
+    void Commit();
+
+    RouteFunction route_;
+    ApplyFunction apply_;
+    LogFunction log_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::mutex mutex_;               // Guards window_ and received_
+    std::condition_variable cv_;
+    std::deque<Pending> window_;     // Received but not yet logged, oldest first
+    int64_t received_;
+    std::mutex commit_mutex_;        // Keeps log appends in sequence order
+};
+
+} // namespace kvstore
@@ -1,179 +1,620 @@
 #include "storage.h"
-#include "../persistence/aof_persistence.h"
+#include "../persistence/wal.h"
 #include "../persistence/rdb_persistence.h"
+#include "replica_applier.h"
 #include "../replication/replication_manager.h"
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <vector>
 
 namespace kvstore {
 
 using namespace std::chrono;
 
-Storage::Storage(const std::string& rdb_filename, const std::string& aof_filename) {
+namespace {
+
+constexpr size_t kLoadBatchSize = 1024;
+
+// Seconds left before expiry, -1 for keys without one
+int RemainingSeconds(const std::unordered_map<std::string, steady_clock::time_point>& expiration,
+                     const std::string& key, steady_clock::time_point now) {
+    auto it = expiration.find(key);
+    if (it == expiration.end()) {
+        return -1;
+    }
+    return static_cast<int>(duration_cast<seconds>(it->second - now).count());
+}
+
+} // namespace
+
+Storage::Storage(const std::string& rdb_filename, const std::string& aof_filename,
+                 const StorageOptions& options)
+    : replica_apply_threads_(options.replica_apply_threads),
+      max_delta_snapshots_(options.max_delta_snapshots) {
     if (!rdb_filename.empty()) {
-        rdb_ = std::make_unique<RDBPersistence>(rdb_filename);
-        rdb_->LoadSnapshot(data_, expiration_);
+        rdb_ = std::make_unique<RDBPersistence>(rdb_filename, options.io_backend);
+        track_dirty_ = true;
     }
     
-    if (!aof_filename.empty()) {
-        aof_ = std::make_unique<AOFPersistence>(aof_filename);
-        
-        aof_->Replay([this](const std::string& cmd, const std::string& key, const std::string& value) {
-            if (cmd == "SET") {
-                data_[key] = value;
-            } else if (cmd == "DELETE") {
-                data_.erase(key);
-                expiration_.erase(key);
-            } else if (cmd == "EXPIRE") {
-                int seconds = std::stoi(value);
-                auto expiry_time = steady_clock::now() + std::chrono::seconds(seconds);
-                expiration_[key] = expiry_time;
-            }
-        });
-        
-        aof_->Enable();
+    // Without a filename the log only sequences and publishes mutations
+    wal_ = std::make_unique<WriteAheadLog>(aof_filename, options.io_backend,
+                                           options.aof_fsync_always, options.wal_segment_bytes);
+    
+    if (options.lazy_load) {
+        load_thread_ = std::make_unique<std::thread>(&Storage::LoadDataset, this);
+    } else {
+        LoadDataset();
     }
 }
 
 Storage::~Storage() {
+    // Replication reads from the log, so it has to stop first
+    if (replication_manager_) {
+        replication_manager_->Stop();
+    }
+    
+    load_cancelled_ = true;
+    if (load_thread_ && load_thread_->joinable()) {
+        load_thread_->join();
+    }
     StopBackgroundSnapshot();
 }
 
-void Storage::Set(const std::string& key, const std::string& value) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    data_[key] = value;
-    lock.unlock();
+void Storage::LoadDataset() {
+    auto start = steady_clock::now();
+    int64_t snapshot_sequence = 0;
+    bool have_snapshot = rdb_ && rdb_->OpenForLoad(kPartitionCount, snapshot_sequence);
+    bool partitioned = !have_snapshot || rdb_->IsPartitioned();
+    if (have_snapshot) {
+        load_bytes_total_ += rdb_->GetSnapshotBytes();
+    }
+    
+    // Only the log tail written after the snapshot needs replaying. It is not
+    // grouped by partition, so it is read up front and applied to each
+    // partition after that partition's snapshot entries.
+    std::vector<std::vector<ReplicationCommand>> tail(kPartitionCount);
+    if (wal_->IsPersistent()) {
+        wal_->Open(snapshot_sequence);
+        uint64_t wal_bytes = wal_->GetSize();
+        load_bytes_total_ += wal_bytes;
+        
+        size_t replayed = 0;
+        bool complete = wal_->Read(snapshot_sequence, [&](const ReplicationCommand& command) {
+            tail[PartitionIndex(command.key())].push_back(command);
+            replayed++;
+            return true;
+        });
+        if (!complete) {
+            std::cerr << "WAL does not reach back to snapshot sequence " << snapshot_sequence
+                      << "; writes between them are lost" << std::endl;
+        }
+        std::cout << "Replayed " << replayed << " commands from WAL" << std::endl;
+        
+        wal_bytes_loaded_ = wal_bytes;
+    }
+    
+    // New writes can be sequenced and logged from here on
+    wal_->AdvanceTo(snapshot_sequence);
+    writable_ = true;
     
-    if (aof_ && aof_->IsEnabled()) {
-        aof_->LogSet(key, value);
+    std::vector<SnapshotEntry> batch;
+    RDBPersistence::LoadCallback collect = [this, &batch](const std::string& key, const std::string* value,
+                                                          int ttl_seconds) {
+        batch.push_back({key, value ? std::optional<std::string>(*value) : std::nullopt, ttl_seconds});
+        if (batch.size() >= kLoadBatchSize) {
+            ApplyLoaded(batch);
+            batch.clear();
+        }
+    };
+    
+    for (size_t index = 0; index < kPartitionCount && !load_cancelled_; ++index) {
+        // Snapshots without partition markers are read in full on the first
+        // pass, before any partition can be declared complete
+        if (have_snapshot) {
+            rdb_->LoadPartition(partitioned ? index : RDBPersistence::kAllPartitions, collect);
+            ApplyLoaded(batch);
+            batch.clear();
+        }
+        
+        Partition& partition = partitions_[index];
+        std::unique_lock<std::shared_mutex> lock(partition.mutex);
+        
+        // Tail keys are not in any snapshot file yet, so they start out dirty
+        for (const ReplicationCommand& command : tail[index]) {
+            if (partition.written_during_load.count(command.key())) continue;
+            
+            if (ApplyCommand(partition, command)) {
+                MarkDirty(partition, command.key());
+            }
+        }
+        tail[index].clear();
+        tail[index].shrink_to_fit();
+        
+        partition.loaded = true;
+        partition.written_during_load.clear();
+        partitions_loaded_++;
     }
     
-    if (replication_manager_ && replication_manager_->IsMaster()) {
-        replication_manager_->ReplicateSet(key, value);
+    if (have_snapshot) {
+        rdb_->FinishLoad();
+    }
+    if (load_cancelled_) return;
+    
+    loading_ = false;
+    initial_load_done_ = true;
+    
+    if (rdb_ || wal_->IsPersistent()) {
+        auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+        std::cout << "Dataset loaded: " << Size() << " keys in " << elapsed.count() << " ms" << std::endl;
     }
 }
 
-void Storage::SetFromReplication(const std::string& key, const std::string& value) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    data_[key] = value;
-    lock.unlock();
+void Storage::ApplyLoaded(const std::vector<SnapshotEntry>& entries) {
+    auto now = steady_clock::now();
+    Partition* locked = nullptr;
+    std::unique_lock<std::shared_mutex> lock;
     
-    if (aof_ && aof_->IsEnabled()) {
-        aof_->LogSet(key, value);
+    for (const SnapshotEntry& entry : entries) {
+        Partition& partition = PartitionFor(entry.key);
+        if (&partition != locked) {
+            if (lock.owns_lock()) lock.unlock();
+            lock = std::unique_lock<std::shared_mutex>(partition.mutex);
+            locked = &partition;
+        }
+        
+        if (partition.written_during_load.count(entry.key)) continue;
+        
+        if (!entry.value) {
+            partition.data.erase(entry.key);
+            partition.expiration.erase(entry.key);
+            continue;
+        }
+        
+        partition.data[entry.key] = *entry.value;
+        if (entry.ttl_seconds >= 0) {
+            partition.expiration[entry.key] = now + std::chrono::seconds(entry.ttl_seconds);
+        } else {
+            partition.expiration.erase(entry.key);
+        }
     }
 }
 
-std::optional<std::string> Storage::Get(const std::string& key) const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
+bool Storage::IsLoaded(const std::string& key) const {
+    if (!loading_) return true;
     
-    if (IsExpired(key)) {
-        lock.unlock();
-        RemoveExpired(key);
-        return std::nullopt;
+    Partition& partition = PartitionFor(key);
+    std::shared_lock<std::shared_mutex> lock(partition.mutex);
+    return partition.loaded || partition.written_during_load.count(key) > 0;
+}
+
+Storage::LoadProgress Storage::GetLoadProgress() const {
+    LoadProgress progress;
+    progress.loading = loading_;
+    progress.bytes_total = load_bytes_total_;
+    progress.bytes_loaded = progress.loading
+        ? wal_bytes_loaded_ + (rdb_ ? rdb_->GetBytesLoaded() : 0)
+        : progress.bytes_total;
+    progress.partitions_loaded = partitions_loaded_;
+    progress.partitions_total = kPartitionCount;
+    return progress;
+}
+
+size_t Storage::PartitionIndex(const std::string& key) {
+    // FNV-1a: stable across builds, since snapshots are grouped by partition
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash % kPartitionCount;
+}
+
+Storage::Partition& Storage::PartitionFor(const std::string& key) const {
+    return partitions_[PartitionIndex(key)];
+}
+
+void Storage::MarkDirty(Partition& partition, const std::string& key) const {
+    if (track_dirty_ && partition.dirty.insert(key).second) {
+        dirty_count_.fetch_add(1, std::memory_order_relaxed);
     }
+}
+
+bool Storage::ApplyCommand(Partition& partition, const ReplicationCommand& command) {
+    const std::string& key = command.key();
     
-    auto it = data_.find(key);
-    if (it != data_.end()) {
-        return it->second;
+    switch (command.type()) {
+        case ReplicationCommand::SET:
+            partition.data[key] = command.value();
+            return true;
+        
+        case ReplicationCommand::DELETE:
+            partition.expiration.erase(key);
+            return partition.data.erase(key) > 0;
+        
+        case ReplicationCommand::EXPIRE:
+            if (partition.data.find(key) == partition.data.end()) {
+                return false;
+            }
+            partition.expiration[key] = steady_clock::now() + std::chrono::seconds(command.seconds());
+            return true;
+        
+        default:
+            return false;
     }
-    return std::nullopt;
 }
 
-bool Storage::Contains(const std::string& key) const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
+Storage::KeyState Storage::TakeKeyState(Partition& partition, const ReplicationCommand& command) {
+    const std::string& key = command.key();
+    KeyState state;
     
-    if (IsExpired(key)) {
-        lock.unlock();
-        RemoveExpired(key);
-        return false;
+    if (command.type() == ReplicationCommand::SET || command.type() == ReplicationCommand::DELETE) {
+        auto it = partition.data.find(key);
+        if (it != partition.data.end()) {
+            state.has_value = true;
+            state.value = std::move(it->second);
+        }
     }
+    auto expires = partition.expiration.find(key);
+    if (expires != partition.expiration.end()) {
+        state.expiration = expires->second;
+    }
+    return state;
+}
+
+void Storage::RestoreKey(Partition& partition, const ReplicationCommand& command, KeyState& state) {
+    const std::string& key = command.key();
     
-    return data_.find(key) != data_.end();
+    if (command.type() == ReplicationCommand::SET || command.type() == ReplicationCommand::DELETE) {
+        if (state.has_value) {
+            partition.data[key] = std::move(state.value);
+        } else {
+            partition.data.erase(key);
+        }
+    }
+    if (state.expiration) {
+        partition.expiration[key] = *state.expiration;
+    } else {
+        partition.expiration.erase(key);
+    }
 }
 
-bool Storage::Delete(const std::string& key) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    expiration_.erase(key);
-    bool found = data_.erase(key) > 0;
-    lock.unlock();
+int64_t Storage::Apply(ReplicationCommand& command, bool replicated) {
+    Partition& partition = PartitionFor(command.key());
+    std::unique_lock<std::shared_mutex> lock(partition.mutex);
+    if (wal_->HasFailed()) {
+        return 0;
+    }
+    
+    KeyState previous = TakeKeyState(partition, command);
+    bool changed = ApplyCommand(partition, command);
     
-    if (found && aof_ && aof_->IsEnabled()) {
-        aof_->LogDelete(key);
+    // Replicated commands are always logged so the sequence keeps pace with the master
+    if (!changed && !replicated) {
+        // Still shields a key not loaded yet, so a delete is not undone by the loader
+        if (!partition.loaded) partition.written_during_load.insert(command.key());
+        return 0;
     }
     
-    if (found && replication_manager_ && replication_manager_->IsMaster()) {
-        replication_manager_->ReplicateDelete(key);
+    // Logging under the partition lock keeps log order consistent with the
+    // order writes to a key were applied
+    int64_t sequence = wal_->Append(command);
+    if (sequence == 0) {
+        // Neither logged nor replicated, so no reader may see it
+        RestoreKey(partition, command, previous);
+        return 0;
     }
+    if (changed) MarkDirty(partition, command.key());
+    if (!partition.loaded) partition.written_during_load.insert(command.key());
+    lock.unlock();
     
-    return found;
+    wal_->WaitDurable(sequence);
+    return sequence;
 }
 
-bool Storage::DeleteFromReplication(const std::string& key) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    expiration_.erase(key);
-    bool found = data_.erase(key) > 0;
-    lock.unlock();
+bool Storage::Write(ReplicationCommand& command, int64_t* sequence) {
+    if (int64_t term = write_term_) {
+        command.set_term(term);
+    }
+    int64_t logged = Apply(command, false);
+    if (sequence) {
+        *sequence = logged != 0 ? logged : wal_->LastSequence();
+    }
+    return logged != 0;
+}
+
+void Storage::WriteBatch(std::vector<ReplicationCommand>& commands, std::vector<bool>* changed,
+                         int64_t* sequence) {
+    std::vector<size_t> indexes;
+    indexes.reserve(commands.size());
+    for (const ReplicationCommand& command : commands) {
+        indexes.push_back(PartitionIndex(command.key()));
+    }
+    auto locks = LockPartitions(indexes);
+    if (wal_->HasFailed()) {
+        if (changed) changed->assign(commands.size(), false);
+        if (sequence) *sequence = wal_->LastSequence();
+        return;
+    }
+    
+    // Only commands that changed something are logged, as with Write()
+    std::vector<ReplicationCommand> logged;
+    std::vector<KeyState> previous;
+    std::vector<size_t> logged_indexes;    // Partition of each logged command
+    std::vector<size_t> logged_positions;  // and its position in `commands`
+    int64_t term = write_term_;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        Partition& partition = partitions_[indexes[i]];
+        KeyState state = TakeKeyState(partition, commands[i]);
+        bool applied = ApplyCommand(partition, commands[i]);
+        if (changed) changed->push_back(applied);
+        if (!applied) {
+            if (!partition.loaded) partition.written_during_load.insert(commands[i].key());
+            continue;
+        }
+        if (term) commands[i].set_term(term);
+        logged.push_back(std::move(commands[i]));
+        previous.push_back(std::move(state));
+        logged_indexes.push_back(indexes[i]);
+        logged_positions.push_back(i);
+    }
     
-    if (found && aof_ && aof_->IsEnabled()) {
-        aof_->LogDelete(key);
+    size_t written = 0;
+    int64_t last = logged.empty() ? 0 : wal_->AppendBatch(logged, &written);
+    CommitLogged(logged, logged_indexes, previous, written);
+    for (size_t i = written; changed && i < logged.size(); ++i) {
+        (*changed)[logged_positions[i]] = false;
     }
+    locks.clear();
     
-    return found;
+    if (last != 0) {
+        wal_->WaitDurable(last);
+    }
+    if (sequence) {
+        *sequence = last != 0 ? last : wal_->LastSequence();
+    }
 }
 
-size_t Storage::Size() const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
-    return data_.size();
+void Storage::CommitLogged(const std::vector<ReplicationCommand>& commands, const std::vector<size_t>& indexes,
+                           std::vector<KeyState>& previous, size_t written) {
+    for (size_t i = 0; i < written; ++i) {
+        Partition& partition = partitions_[indexes[i]];
+        MarkDirty(partition, commands[i].key());
+        if (!partition.loaded) partition.written_during_load.insert(commands[i].key());
+    }
+    // Newest first, so a key written twice gets back its value from before both
+    for (size_t i = commands.size(); i > written; --i) {
+        RestoreKey(partitions_[indexes[i - 1]], commands[i - 1], previous[i - 1]);
+    }
+}
+
+void Storage::Set(const std::string& key, const std::string& value, int64_t* sequence) {
+    ReplicationCommand command;
+    command.set_type(ReplicationCommand::SET);
+    command.set_key(key);
+    command.set_value(value);
+    Write(command, sequence);
 }
 
-bool Storage::Expire(const std::string& key, int seconds) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
+Storage::ReplicationResult Storage::ApplyReplicated(const ReplicationCommand& command) {
+    if (Applier()) {
+        ReplicationBatch batch;
+        *batch.add_commands() = command;
+        return ApplyReplicated(batch);
+    }
     
-    if (data_.find(key) == data_.end()) {
-        return false;
+    // Commands arrive one at a time from a single master, in sequence order
+    int64_t last_sequence = wal_->LastSequence();
+    if (command.sequence_id() <= last_sequence) {
+        return ReplicationResult::DUPLICATE;
+    }
+    if (command.sequence_id() > last_sequence + 1) {
+        return ReplicationResult::GAP;
     }
     
-    auto expiry_time = steady_clock::now() + std::chrono::seconds(seconds);
-    expiration_[key] = expiry_time;
-    lock.unlock();
+    ReplicationCommand logged = command;
+    Apply(logged, true);
+    return ReplicationResult::APPLIED;
+}
+
+Storage::ReplicationResult Storage::ApplyReplicated(const ReplicationBatch& batch) {
+    if (ReplicaApplier* applier = Applier()) {
+        switch (applier->Submit(batch)) {
+            case ReplicaApplier::SubmitResult::ACCEPTED: return ReplicationResult::APPLIED;
+            case ReplicaApplier::SubmitResult::DUPLICATE: return ReplicationResult::DUPLICATE;
+            case ReplicaApplier::SubmitResult::GAP: return ReplicationResult::GAP;
+        }
+    }
+    
+    // Skip what was already applied, then take the run of consecutive
+    // commands that follows the last applied sequence
+    int64_t last_sequence = wal_->LastSequence();
+    std::vector<ReplicationCommand> commands;
+    bool gap = false;
+    for (const ReplicationCommand& command : batch.commands()) {
+        if (command.sequence_id() <= last_sequence) continue;
+        if (command.sequence_id() != last_sequence + 1) {
+            gap = true;
+            break;
+        }
+        commands.push_back(command);
+        last_sequence = command.sequence_id();
+    }
+    if (commands.empty()) {
+        return gap ? ReplicationResult::GAP : ReplicationResult::DUPLICATE;
+    }
     
-    if (aof_ && aof_->IsEnabled()) {
-        aof_->LogExpire(key, seconds);
+    // Lock every partition the batch touches once, in index order
+    std::vector<size_t> indexes;
+    indexes.reserve(commands.size());
+    for (const ReplicationCommand& command : commands) {
+        indexes.push_back(PartitionIndex(command.key()));
     }
+    auto locks = LockPartitions(indexes);
     
-    if (replication_manager_ && replication_manager_->IsMaster()) {
-        replication_manager_->ReplicateExpire(key, seconds);
+    std::vector<KeyState> previous;
+    previous.reserve(commands.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        Partition& partition = partitions_[indexes[i]];
+        previous.push_back(TakeKeyState(partition, commands[i]));
+        ApplyCommand(partition, commands[i]);
     }
     
+    size_t written = 0;
+    int64_t sequence = wal_->AppendBatch(commands, &written);
+    CommitLogged(commands, indexes, previous, written);
+    locks.clear();
+    
+    wal_->WaitDurable(sequence);
+    return gap ? ReplicationResult::GAP : ReplicationResult::APPLIED;
+}
+
+std::vector<std::unique_lock<std::shared_mutex>> Storage::LockPartitions(std::vector<size_t> indexes) {
+    std::sort(indexes.begin(), indexes.end());
+    indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+    
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    locks.reserve(indexes.size());
+    for (size_t index : indexes) {
+        locks.emplace_back(partitions_[index].mutex);
+    }
+    return locks;
+}
+
+void Storage::ApplyUnlogged(const ReplicationCommand& command) {
+    Partition& partition = PartitionFor(command.key());
+    std::unique_lock<std::shared_mutex> lock(partition.mutex);
+    if (ApplyCommand(partition, command)) MarkDirty(partition, command.key());
+    if (!partition.loaded) partition.written_during_load.insert(command.key());
+}
+
+ReplicaApplier* Storage::Applier() {
+    if (replica_apply_threads_ == 0) return nullptr;
+    
+    // Logged only once applied, so the log stays a low watermark and a
+    // snapshot taken at its last sequence contains everything up to it
+    std::call_once(applier_once_, [this] {
+        applier_ = std::make_unique<ReplicaApplier>(
+            replica_apply_threads_, wal_->LastSequence(),
+            [](const std::string& key) { return PartitionIndex(key); },
+            [this](const ReplicationCommand& command) { ApplyUnlogged(command); },
+            [this](std::vector<ReplicationCommand>& commands) {
+                wal_->WaitDurable(wal_->AppendBatch(commands));
+            });
+    });
+    return applier_.get();
+}
+
+int64_t Storage::LastSequence() const {
+    return wal_->LastSequence();
+}
+
+bool Storage::LogFailed() const {
+    return wal_->HasFailed();
+}
+
+bool Storage::IsReadOnly() const {
+    return replication_manager_ && replication_manager_->IsReplica();
+}
+
+bool Storage::CanApplyReplicated(const ReplicationCommand& command) const {
+    // Sets and deletes shield not-yet-loaded keys from the loader; an
+    // expire needs the current value
+    return command.type() == ReplicationCommand::EXPIRE
+        ? IsLoaded(command.key())
+        : IsWritable();
+}
+
+bool Storage::CanApplyReplicated(const ReplicationBatch& batch) const {
+    for (const ReplicationCommand& command : batch.commands()) {
+        if (!CanApplyReplicated(command)) return false;
+    }
     return true;
 }
 
-bool Storage::ExpireFromReplication(const std::string& key, int seconds) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
+std::optional<std::string> Storage::Get(const std::string& key) const {
+    Partition& partition = PartitionFor(key);
+    std::shared_lock<std::shared_mutex> lock(partition.mutex);
     
-    if (data_.find(key) == data_.end()) {
-        return false;
+    if (IsExpired(partition, key)) {
+        lock.unlock();
+        RemoveExpired(key);
+        return std::nullopt;
     }
     
-    auto expiry_time = steady_clock::now() + std::chrono::seconds(seconds);
-    expiration_[key] = expiry_time;
-    lock.unlock();
+    auto it = partition.data.find(key);
+    if (it != partition.data.end()) {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+bool Storage::Contains(const std::string& key) const {
+    Partition& partition = PartitionFor(key);
+    std::shared_lock<std::shared_mutex> lock(partition.mutex);
     
-    if (aof_ && aof_->IsEnabled()) {
-        aof_->LogExpire(key, seconds);
+    if (IsExpired(partition, key)) {
+        lock.unlock();
+        RemoveExpired(key);
+        return false;
     }
     
-    return true;
+    return partition.data.find(key) != partition.data.end();
+}
+
+bool Storage::Delete(const std::string& key, int64_t* sequence) {
+    ReplicationCommand command;
+    command.set_type(ReplicationCommand::DELETE);
+    command.set_key(key);
+    return Write(command, sequence);
+}
+
+void Storage::MultiSet(const std::vector<std::pair<std::string, std::string>>& entries, int64_t* sequence) {
+    std::vector<ReplicationCommand> commands(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        commands[i].set_type(ReplicationCommand::SET);
+        commands[i].set_key(entries[i].first);
+        commands[i].set_value(entries[i].second);
+    }
+    WriteBatch(commands, nullptr, sequence);
+}
+
+void Storage::MultiDelete(const std::vector<std::string>& keys, std::vector<bool>* found, int64_t* sequence) {
+    std::vector<ReplicationCommand> commands(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        commands[i].set_type(ReplicationCommand::DELETE);
+        commands[i].set_key(keys[i]);
+    }
+    WriteBatch(commands, found, sequence);
+}
+
+size_t Storage::Size() const {
+    size_t size = 0;
+    for (const Partition& partition : partitions_) {
+        std::shared_lock<std::shared_mutex> lock(partition.mutex);
+        size += partition.data.size();
+    }
+    return size;
+}
+
+bool Storage::Expire(const std::string& key, int seconds, int64_t* sequence) {
+    ReplicationCommand command;
+    command.set_type(ReplicationCommand::EXPIRE);
+    command.set_key(key);
+    command.set_seconds(seconds);
+    return Write(command, sequence);
 }
 
 int Storage::TTL(const std::string& key) const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
+    Partition& partition = PartitionFor(key);
+    std::shared_lock<std::shared_mutex> lock(partition.mutex);
     
-    if (data_.find(key) == data_.end()) {
+    if (partition.data.find(key) == partition.data.end()) {
         return -2;
     }
     
-    auto it = expiration_.find(key);
-    if (it == expiration_.end()) {
+    auto it = partition.expiration.find(key);
+    if (it == partition.expiration.end()) {
         return -1;
     }
     
@@ -186,9 +627,9 @@ int Storage::TTL(const std::string& key) const {
     return static_cast<int>(remaining.count());
 }
 
-bool Storage::IsExpired(const std::string& key) const {
-    auto it = expiration_.find(key);
-    if (it == expiration_.end()) {
+bool Storage::IsExpired(const Partition& partition, const std::string& key) const {
+    auto it = partition.expiration.find(key);
+    if (it == partition.expiration.end()) {
         return false;
     }
     
@@ -196,23 +637,119 @@ bool Storage::IsExpired(const std::string& key) const {
 }
 
 void Storage::RemoveExpired(const std::string& key) const {
-    std::shared_lock<std::shared_mutex> shared_lock(mutex_);
-    shared_lock.unlock();
+    Partition& partition = PartitionFor(key);
+    std::unique_lock<std::shared_mutex> lock(partition.mutex);
     
-    std::unique_lock<std::shared_mutex> unique_lock(mutex_);
-    
-    auto exp_it = expiration_.find(key);
-    if (exp_it != expiration_.end() && exp_it->second <= steady_clock::now()) {
-        const_cast<std::unordered_map<std::string, TimePoint>&>(expiration_).erase(key);
-        const_cast<std::unordered_map<std::string, std::string>&>(data_).erase(key);
+    auto exp_it = partition.expiration.find(key);
+    if (exp_it != partition.expiration.end() && exp_it->second <= steady_clock::now()) {
+        partition.expiration.erase(exp_it);
+        partition.data.erase(key);
+        MarkDirty(partition, key);
     }
 }
 
 void Storage::SaveSnapshot() {
-    if (!rdb_) return;
+    // A snapshot of a partially loaded dataset would let the AOF be truncated
+    if (!rdb_ || loading_) return;
+    
+    std::lock_guard<std::mutex> guard(snapshot_mutex_);
+    // A full resync may have started while waiting
+    if (loading_) return;
+    int64_t sequence = wal_->LastSequence();
+    
+    // Everything up to the snapshot's sequence is now on disk, so the log
+    // only has to keep the tail written after it
+    if (WriteFullSnapshot(sequence)) {
+        wal_->Truncate(sequence);
+    }
+}
+
+void Storage::SaveDeltaSnapshot() {
+    if (!rdb_ || loading_) return;
+    
+    std::lock_guard<std::mutex> guard(snapshot_mutex_);
+    if (loading_) return;
+    int64_t sequence = wal_->LastSequence();
+    
+    bool saved = (!rdb_->HasBaseSnapshot() || force_full_snapshot_)
+                     ? WriteFullSnapshot(sequence)
+                     : WriteDeltaSnapshot(sequence);
+    if (saved) {
+        wal_->Truncate(sequence);
+    }
+}
+
+bool Storage::WriteFullSnapshot(int64_t sequence) {
+    if (!rdb_->BeginSnapshot(RDBPersistence::SnapshotType::FULL, sequence, kPartitionCount)) {
+        return false;
+    }
+    
+    // Partitions are locked one at a time, so writers only ever wait on the
+    // slice being serialised. Anything changed after its dirty set is
+    // cleared is picked up by the next delta.
+    auto now = steady_clock::now();
+    for (size_t index = 0; index < kPartitionCount; ++index) {
+        Partition& partition = partitions_[index];
+        {
+            std::unique_lock<std::shared_mutex> lock(partition.mutex);
+            dirty_count_.fetch_sub(partition.dirty.size(), std::memory_order_relaxed);
+            partition.dirty.clear();
+        }
+        
+        std::shared_lock<std::shared_mutex> lock(partition.mutex);
+        rdb_->BeginPartition(index);
+        for (const auto& [key, value] : partition.data) {
+            if (IsExpired(partition, key)) continue;
+            rdb_->WriteEntry(key, value, RemainingSeconds(partition.expiration, key, now));
+        }
+    }
+    
+    // The dirty sets were already cleared, so a failed base can only be
+    // repaired by another full snapshot
+    force_full_snapshot_ = !rdb_->CommitSnapshot();
+    return !force_full_snapshot_;
+}
+
+bool Storage::WriteDeltaSnapshot(int64_t sequence) {
+    if (!rdb_->BeginSnapshot(RDBPersistence::SnapshotType::DELTA, sequence, kPartitionCount)) {
+        return false;
+    }
+    
+    // Copy each partition's changed keys under its lock, then serialise them
+    // without holding it
+    std::vector<SnapshotEntry> changes;
+    for (size_t index = 0; index < kPartitionCount; ++index) {
+        Partition& partition = partitions_[index];
+        changes.clear();
+        {
+            std::unique_lock<std::shared_mutex> lock(partition.mutex);
+            if (partition.dirty.empty()) continue;
+            
+            auto now = steady_clock::now();
+            for (const std::string& key : partition.dirty) {
+                auto it = partition.data.find(key);
+                if (it == partition.data.end() || IsExpired(partition, key)) {
+                    changes.push_back({key, std::nullopt, -1});
+                } else {
+                    changes.push_back({key, it->second, RemainingSeconds(partition.expiration, key, now)});
+                }
+            }
+            dirty_count_.fetch_sub(partition.dirty.size(), std::memory_order_relaxed);
+            partition.dirty.clear();
+        }
+        
+        rdb_->BeginPartition(index);
+        for (const SnapshotEntry& change : changes) {
+            if (change.value) {
+                rdb_->WriteEntry(change.key, *change.value, change.ttl_seconds);
+            } else {
+                rdb_->WriteDeletion(change.key);
+            }
+        }
+    }
     
-    std::shared_lock<std::shared_mutex> lock(mutex_);
-    rdb_->SaveSnapshot(data_, expiration_);
+    force_full_snapshot_ = !rdb_->CommitSnapshot();
+    return !force_full_snapshot_;
 }
 
 void Storage::StartBackgroundSnapshot(int interval_seconds) {
@@ -224,7 +761,11 @@ void Storage::StartBackgroundSnapshot(int interval_seconds) {
 }
 
 void Storage::StopBackgroundSnapshot() {
-    snapshot_running_ = false;
+    {
+        std::lock_guard<std::mutex> lock(snapshot_wait_mutex_);
+        snapshot_running_ = false;
+    }
+    snapshot_cv_.notify_all();
     if (snapshot_thread_ && snapshot_thread_->joinable()) {
         snapshot_thread_->join();
     }
@@ -232,15 +773,221 @@ void Storage::StopBackgroundSnapshot() {
 
 void Storage::SnapshotLoop() {
     while (snapshot_running_) {
-        std::this_thread::sleep_for(std::chrono::seconds(snapshot_interval_));
-        if (snapshot_running_) {
+        {
+            std::unique_lock<std::mutex> lock(snapshot_wait_mutex_);
+            snapshot_cv_.wait_for(lock, std::chrono::seconds(snapshot_interval_),
+                                  [this] { return !snapshot_running_; });
+        }
+        if (!snapshot_running_) break;
+        if (loading_) continue;
+        
+        size_t dirty = dirty_count_.load(std::memory_order_relaxed);
+        bool merge;
+        {
+            std::lock_guard<std::mutex> guard(snapshot_mutex_);
+            if (dirty == 0 && rdb_->HasBaseSnapshot()) {
+                continue;
+            }
+            merge = rdb_->GetDeltaCount() >= max_delta_snapshots_;
+        }
+        
+        // Merge the delta chain into a new base once it gets long, or once
+        // so much has changed that a delta would be nearly a full copy
+        if (merge || dirty * 2 > Size()) {
             SaveSnapshot();
+        } else {
+            SaveDeltaSnapshot();
+        }
+    }
+}
+
+bool Storage::ExportPartitions(const ExportCallback& visit) {
+    // Writes log their command under the partition lock after applying it,
+    // so every command up to this sequence is already in the partitions.
+    // Later ones may or may not be; replaying them on top of the copy is
+    // harmless, except that a replayed EXPIRE restarts its countdown.
+    uint64_t generation = full_syncs_;
+    int64_t sequence = wal_->LastSequence();
+    wal_->Retain(sequence);
+    
+    std::vector<SnapshotEntry> entries;
+    bool complete = true;
+    for (size_t index = 0; index < kPartitionCount && complete; ++index) {
+        Partition& partition = partitions_[index];
+        entries.clear();
+        {
+            std::shared_lock<std::shared_mutex> lock(partition.mutex);
+            auto now = steady_clock::now();
+            entries.reserve(partition.data.size());
+            for (const auto& [key, value] : partition.data) {
+                if (IsExpired(partition, key)) continue;
+                entries.push_back({key, value, RemainingSeconds(partition.expiration, key, now)});
+            }
+        }
+        // A copy mixing the old and new datasets is useless
+        complete = full_syncs_ == generation && visit(sequence, index, entries);
+    }
+    
+    wal_->Release(sequence);
+    return complete;
+}
+
+void Storage::BeginFullSync() {
+    // The persisted dataset is about to be replaced; let its loader finish first
+    while (!initial_load_done_ && !load_cancelled_) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (ReplicaApplier* applier = Applier()) {
+        applier->Drain();
+    }
+    
+    // Holding the snapshot lock keeps a snapshot of the half-loaded copy
+    // from replacing the one on disk
+    std::lock_guard<std::mutex> guard(snapshot_mutex_);
+    full_syncs_++;
+    loading_ = true;
+    partitions_loaded_ = 0;
+    for (Partition& partition : partitions_) {
+        std::unique_lock<std::shared_mutex> lock(partition.mutex);
+        dirty_count_.fetch_sub(partition.dirty.size(), std::memory_order_relaxed);
+        partition.data.clear();
+        partition.expiration.clear();
+        partition.dirty.clear();
+        partition.written_during_load.clear();
+        partition.loaded = false;
+    }
+}
+
+void Storage::LoadSyncChunk(const SnapshotChunk& chunk) {
+    std::vector<SnapshotEntry> entries;
+    entries.reserve(chunk.entries_size());
+    for (const auto& entry : chunk.entries()) {
+        entries.push_back({entry.key(), entry.value(), entry.ttl_seconds()});
+    }
+    ApplyLoaded(entries);
+    
+    if (chunk.partition_complete() && chunk.partition() >= 0 &&
+        static_cast<size_t>(chunk.partition()) < kPartitionCount) {
+        Partition& partition = partitions_[chunk.partition()];
+        std::unique_lock<std::shared_mutex> lock(partition.mutex);
+        if (!partition.loaded) {
+            partition.loaded = true;
+            partitions_loaded_++;
         }
     }
 }
 
+void Storage::FinishFullSync(int64_t sequence) {
+    {
+        std::lock_guard<std::mutex> guard(snapshot_mutex_);
+        // The old log describes data that is gone
+        wal_->Reset(sequence);
+        if (ReplicaApplier* applier = Applier()) {
+            applier->Reset(sequence);
+        }
+        for (Partition& partition : partitions_) {
+            std::unique_lock<std::shared_mutex> lock(partition.mutex);
+            partition.loaded = true;
+        }
+        partitions_loaded_ = kPartitionCount;
+        // Nothing is marked dirty, so a delta would miss the copied keys
+        force_full_snapshot_ = true;
+        loading_ = false;
+    }
+    
+    SaveSnapshot();
+}
+
+bool Storage::ScanKeys(const std::function<bool(const std::string& key)>& match, const ScanCallback& visit) const {
+    std::vector<SnapshotEntry> entries;
+    for (const Partition& partition : partitions_) {
+        entries.clear();
+        {
+            std::shared_lock<std::shared_mutex> lock(partition.mutex);
+            auto now = steady_clock::now();
+            for (const auto& [key, value] : partition.data) {
+                if (IsExpired(partition, key) || !match(key)) continue;
+                entries.push_back({key, value, RemainingSeconds(partition.expiration, key, now)});
+            }
+        }
+        if (!entries.empty() && !visit(entries)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Storage::Import(const SnapshotEntry& entry, int64_t* sequence) {
+    Partition& partition = PartitionFor(entry.key);
+    std::unique_lock<std::shared_mutex> lock(partition.mutex);
+    
+    bool present = partition.data.find(entry.key) != partition.data.end();
+    if (!entry.value || (present && !IsExpired(partition, entry.key)) || wal_->HasFailed()) {
+        lock.unlock();
+        if (sequence) *sequence = wal_->LastSequence();
+        return false;
+    }
+    
+    // An expired leftover goes first, so its expiration is not the copy's
+    std::vector<ReplicationCommand> commands;
+    if (present) {
+        commands.emplace_back();
+        commands.back().set_type(ReplicationCommand::DELETE);
+    }
+    commands.emplace_back();
+    commands.back().set_type(ReplicationCommand::SET);
+    commands.back().set_value(*entry.value);
+    if (entry.ttl_seconds >= 0) {
+        // Seconds are rounded down; one about to expire still gets a moment
+        commands.emplace_back();
+        commands.back().set_type(ReplicationCommand::EXPIRE);
+        commands.back().set_seconds(std::max(entry.ttl_seconds, 1));
+    }
+    
+    // Applied and logged under one lock, so no write to the key falls between
+    std::vector<KeyState> previous;
+    for (ReplicationCommand& command : commands) {
+        command.set_key(entry.key);
+        if (int64_t term = write_term_) {
+            command.set_term(term);
+        }
+        previous.push_back(TakeKeyState(partition, command));
+        ApplyCommand(partition, command);
+    }
+    size_t written = 0;
+    int64_t logged = wal_->AppendBatch(commands, &written);
+    CommitLogged(commands, std::vector<size_t>(commands.size(), PartitionIndex(entry.key)), previous, written);
+    lock.unlock();
+    
+    wal_->WaitDurable(logged);
+    if (sequence) *sequence = logged != 0 ? logged : wal_->LastSequence();
+    // Written once the copy's value is logged; an expired leftover's delete comes first
+    return written > (present ? 1u : 0u);
+}
+
 void Storage::SetReplicationManager(std::shared_ptr<ReplicationManager> replication_manager) {
     replication_manager_ = replication_manager;
+    replication_manager->AttachLog(wal_.get());
+    
+    // Replication is a consumer of the log: every mutation reaches it once,
+    // already sequenced, in log order
+    std::weak_ptr<ReplicationManager> consumer = replication_manager;
+    wal_->Subscribe([consumer](const ReplicationCommand& command) {
+        if (auto manager = consumer.lock()) {
+            manager->Publish(command);
+        }
+    });
+}
+
+void Storage::SubscribeToLog(std::function<void(const ReplicationCommand& command)> subscriber) {
+    wal_->Subscribe(std::move(subscriber));
+}
+
+void Storage::ResetReplicationPosition() {
+    if (ReplicaApplier* applier = Applier()) {
+        applier->Drain();
+        applier->Reset(wal_->LastSequence());
+    }
 }
 
 } // namespace kvstore
@@ -2,64 +2,273 @@
 
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <array>
+#include <mutex>
 #include <shared_mutex>
 #include <optional>
 #include <chrono>
 #include <memory>
 #include <atomic>
 #include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include "../persistence/file_writer.h"
+#include "kvstore.pb.h"
 
 namespace kvstore {
 
-class AOFPersistence;
+struct StorageOptions {
+    IOBackend io_backend = IOBackend::STREAM;  // Backend for AOF and RDB writes
+    bool aof_fsync_always = false;             // fsync the AOF after every command
+    uint64_t wal_segment_bytes = 64ull << 20;  // Size at which a new AOF segment is started
+    int max_delta_snapshots = 10;              // Deltas written before merging into a new base (0 = always full)
+    int snapshot_interval_seconds = 60;        // Background snapshot period used by the server
+    bool lazy_load = false;                    // Load the dataset in the background instead of in the constructor
+    // Workers applying replicated commands (0 = on the receiving thread);
+    // extra threads only pay off with cores to spare
+    size_t replica_apply_threads = std::min<size_t>(4, std::thread::hardware_concurrency() / 2);
+};
+
+class WriteAheadLog;
 class RDBPersistence;
+class ReplicaApplier;
 class ReplicationManager;
 
 class Storage {
 public:
-    explicit Storage(const std::string& rdb_filename = "", const std::string& aof_filename = "");
+    enum class ReplicationResult {
+        APPLIED,
+        DUPLICATE,  // Already applied; ignored
+        GAP         // Earlier commands are missing; nothing applied
+    };
+
+    struct SnapshotEntry {
+        std::string key;
+        std::optional<std::string> value;  // nullopt for deleted or expired keys
+        int ttl_seconds;
+    };
+    
+    // Receives one partition's live keys; return false to stop
+    using ExportCallback = std::function<bool(int64_t sequence, size_t partition,
+                                              const std::vector<SnapshotEntry>& entries)>;
+    // Receives the matching keys of one partition; return false to stop
+    using ScanCallback = std::function<bool(const std::vector<SnapshotEntry>& entries)>;
+
+    struct LoadProgress {
+        bool loading;
+        uint64_t bytes_loaded;
+        uint64_t bytes_total;
+        size_t partitions_loaded;
+        size_t partitions_total;
+    };
+
+    explicit Storage(const std::string& rdb_filename = "", const std::string& aof_filename = "",
+                     const StorageOptions& options = StorageOptions());
     ~Storage();
 
     Storage(const Storage&) = delete;
     Storage& operator=(const Storage&) = delete;
 
-    void Set(const std::string& key, const std::string& value);
-    void SetFromReplication(const std::string& key, const std::string& value);
+    // Writes store their log sequence in `sequence` if given (the last
+    // sequence so far if nothing changed), for waiting on replicas
+    void Set(const std::string& key, const std::string& value, int64_t* sequence = nullptr);
 
     std::optional<std::string> Get(const std::string& key) const;
     bool Contains(const std::string& key) const;
     
-    bool Delete(const std::string& key);
-    bool DeleteFromReplication(const std::string& key);
+    bool Delete(const std::string& key, int64_t* sequence = nullptr);
     
     size_t Size() const;
     
-    bool Expire(const std::string& key, int seconds);
-    bool ExpireFromReplication(const std::string& key, int seconds);
+    bool Expire(const std::string& key, int seconds, int64_t* sequence = nullptr);
+    
+    // Several writes as if made one after another, but applied under one
+    // lock per partition and logged with a single wait for durability.
+    // MultiDelete reports whether each key existed in `found`.
+    void MultiSet(const std::vector<std::pair<std::string, std::string>>& entries, int64_t* sequence = nullptr);
+    void MultiDelete(const std::vector<std::string>& keys, std::vector<bool>* found, int64_t* sequence = nullptr);
+    
+    // Apply a command from the master under the master's sequence number
+    ReplicationResult ApplyReplicated(const ReplicationCommand& command);
+    // Apply consecutive commands, locking each partition they touch once.
+    // GAP if the batch skips a sequence; the commands before it are applied.
+    // With replica_apply_threads the commands are only queued: they are
+    // applied in parallel and LastSequence() advances as they complete.
+    ReplicationResult ApplyReplicated(const ReplicationBatch& batch);
+    // False while a lazy load has not yet reached what the command depends on
+    bool CanApplyReplicated(const ReplicationCommand& command) const;
+    bool CanApplyReplicated(const ReplicationBatch& batch) const;
+    // Sequence of the last mutation logged. On replicas every command up to
+    // it has been applied; later ones may still be queued.
+    int64_t LastSequence() const;
+    // Replicas only take writes from their master
+    bool IsReadOnly() const;
     
     int TTL(const std::string& key) const;
+    
+    // While loading lazily: false if the key's partition has not been loaded
+    // yet and the key was not written since startup. Callers should retry.
+    bool IsLoaded(const std::string& key) const;
+    // False until the persisted sequence is known and writes can be logged
+    bool IsWritable() const { return writable_; }
+    // True once the log could not write or sync a record; writes are
+    // refused from then on
+    bool LogFailed() const;
+    LoadProgress GetLoadProgress() const;
 
+    // Write a full base snapshot, merging away any deltas
     void SaveSnapshot();
+    // Write only the keys changed since the last snapshot (full if there is no base yet)
+    void SaveDeltaSnapshot();
     void StartBackgroundSnapshot(int interval_seconds);
     void StopBackgroundSnapshot();
     
     void SetReplicationManager(std::shared_ptr<ReplicationManager> replication_manager);
+    // Receive every logged command, in log order, under the log's lock
+    void SubscribeToLog(std::function<void(const ReplicationCommand& command)> subscriber);
+    
+    // Consensus mode: the term client writes are logged under while this
+    // node leads its shard
+    void SetWriteTerm(int64_t term) { write_term_ = term; }
+    // After a role change: wait for replicated commands still being applied,
+    // then expect the next one right after the log's last sequence
+    void ResetReplicationPosition();
+    
+    /**
+     * Full resync, master side: copy each partition under a short shared
+     * lock and pass it to the callback. Every partition holds at least the
+     * commands up to `sequence`, so a replica that loads the copies and then
+     * replays the log after `sequence` ends up with the master's data. The
+     * log keeps those commands until the export finishes.
+     * @return false if the callback stopped the export, or a full resync of
+     *         this node (a replica serving sub-replicas) replaced the data
+     */
+    bool ExportPartitions(const ExportCallback& visit);
+    
+    /**
+     * Full resync, replica side: BeginFullSync() discards the dataset and
+     * reports every partition as not loaded; LoadSyncChunk() may then be
+     * called from several threads (a partition's chunks in order);
+     * FinishFullSync() continues the log from the master's sequence and
+     * writes a full snapshot.
+     */
+    void BeginFullSync();
+    void LoadSyncChunk(const SnapshotChunk& chunk);
+    void FinishFullSync(int64_t sequence);
+    
+    /**
+     * Resharding, old owner: pass the live keys `match` accepts to the
+     * callback, a partition at a time (partitions with none are skipped),
+     * each copied under a short shared lock
+     * @return false if the callback stopped the scan
+     */
+    bool ScanKeys(const std::function<bool(const std::string& key)>& match, const ScanCallback& visit) const;
+    
+    /**
+     * Resharding, new owner: write a key copied from its old owner, with
+     * its TTL, unless the key is already here. A write that reached the
+     * new owner first is newer than the copy, so it is kept.
+     * @return true if the key was written
+     */
+    bool Import(const SnapshotEntry& entry, int64_t* sequence = nullptr);
 
 private:
     using TimePoint = std::chrono::steady_clock::time_point;
     
-    bool IsExpired(const std::string& key) const;
+    static constexpr size_t kPartitionCount = 64;
+    
+    // Keys are spread over independently locked partitions. Each partition
+    // also remembers which of its keys changed since the last snapshot.
+    struct alignas(64) Partition {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, std::string> data;
+        std::unordered_map<std::string, TimePoint> expiration;
+        std::unordered_set<std::string> dirty;
+        
+        // Until the loader reaches this partition, keys written since startup
+        // are recorded so that older persisted values do not overwrite them
+        bool loaded{false};
+        std::unordered_set<std::string> written_during_load;
+    };
+    
+    static size_t PartitionIndex(const std::string& key);
+    Partition& PartitionFor(const std::string& key) const;
+    bool IsExpired(const Partition& partition, const std::string& key) const;
     void RemoveExpired(const std::string& key) const;
+    void MarkDirty(Partition& partition, const std::string& key) const;
+    
+    // What a command is about to overwrite, so a write the log refuses can
+    // be undone before the partition is unlocked
+    struct KeyState {
+        bool has_value{false};
+        std::string value;
+        std::optional<TimePoint> expiration;
+    };
+
+    // Apply a command to a locked partition; false if it changed nothing
+    bool ApplyCommand(Partition& partition, const ReplicationCommand& command);
+    // Take what the command will overwrite (the old value is moved out, as
+    // the command replaces or erases it), then RestoreKey() to undo it
+    KeyState TakeKeyState(Partition& partition, const ReplicationCommand& command);
+    void RestoreKey(Partition& partition, const ReplicationCommand& command, KeyState& state);
+    // After appending commands applied to locked partitions (`indexes`):
+    // mark the first `written` dirty and undo the rest, newest first
+    void CommitLogged(const std::vector<ReplicationCommand>& commands, const std::vector<size_t>& indexes,
+                      std::vector<KeyState>& previous, size_t written);
+    // Apply a replicated command without logging it (the applier logs it later)
+    void ApplyUnlogged(const ReplicationCommand& command);
+    // Created on first use; nullptr when replicated commands are applied inline
+    ReplicaApplier* Applier();
+    // Apply and log a mutation; returns its sequence, or 0 if a client
+    // write changed nothing and was not logged
+    int64_t Apply(ReplicationCommand& command, bool replicated);
+    // Apply and log a client write, reporting its sequence
+    bool Write(ReplicationCommand& command, int64_t* sequence);
+    // Write() for several commands at once; `changed` gets each one's result
+    void WriteBatch(std::vector<ReplicationCommand>& commands, std::vector<bool>* changed, int64_t* sequence);
+    // Exclusive locks on the given partitions, taken in index order
+    std::vector<std::unique_lock<std::shared_mutex>> LockPartitions(std::vector<size_t> indexes);
+    
+    void LoadDataset();
+    void ApplyLoaded(const std::vector<SnapshotEntry>& entries);
+    
+    bool WriteFullSnapshot(int64_t sequence);
+    bool WriteDeltaSnapshot(int64_t sequence);
     void SnapshotLoop();
 
-    mutable std::shared_mutex mutex_;
-    std::unordered_map<std::string, std::string> data_;
-    std::unordered_map<std::string, TimePoint> expiration_;
-    std::unique_ptr<AOFPersistence> aof_;
+    mutable std::array<Partition, kPartitionCount> partitions_;
+    std::unique_ptr<WriteAheadLog> wal_;
     std::unique_ptr<RDBPersistence> rdb_;
+    size_t replica_apply_threads_{0};
+    std::once_flag applier_once_;
+    std::unique_ptr<ReplicaApplier> applier_;    // Declared after wal_ so it drains into it first
     std::shared_ptr<ReplicationManager> replication_manager_;
     
+    bool track_dirty_{false};
+    mutable std::atomic<size_t> dirty_count_{0};
+    int max_delta_snapshots_{0};
+    std::mutex snapshot_mutex_;         // Serialises snapshot writers
+    bool force_full_snapshot_{false};   // Set when a failed snapshot lost dirty keys
+    
+    // Dataset loading
+    std::atomic<bool> loading_{true};
+    std::atomic<bool> initial_load_done_{false};
+    std::atomic<bool> writable_{false};
+    std::atomic<bool> load_cancelled_{false};
+    std::atomic<size_t> partitions_loaded_{0};
+    std::atomic<uint64_t> load_bytes_total_{0};
+    std::atomic<uint64_t> wal_bytes_loaded_{0};
+    std::atomic<uint64_t> full_syncs_{0};   // Full resyncs begun; an export in progress is abandoned
+    std::atomic<int64_t> write_term_{0};
+    std::unique_ptr<std::thread> load_thread_;
+    
     std::atomic<bool> snapshot_running_{false};
+    std::mutex snapshot_wait_mutex_;    // Lets StopBackgroundSnapshot() cut the wait short
+    std::condition_variable snapshot_cv_;
     std::unique_ptr<std::thread> snapshot_thread_;
     int snapshot_interval_{0};
 };
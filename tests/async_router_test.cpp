@@ -0,0 +1,140 @@
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include "../src/sharding/shard_router.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+// Usage: async_router_test <master> [count]
+//
+// Drives ShardRouter's asynchronous API against a one-shard cluster: every
+// operation through its future, <count> callback GETs in flight at once,
+// the same over a pool of channels, and a router destroyed with calls still
+// in flight.
+
+using namespace kvstore;
+
+namespace {
+
+std::shared_ptr<HashRing> SingleShard(const std::string& master) {
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", master);
+    return hash_ring;
+}
+
+bool CheckOperations(ShardRouter& router) {
+    if (!router.SetAsync("async:op", "value").get()) {
+        std::cout << "✗ SetAsync failed" << std::endl;
+        return false;
+    }
+    if (router.GetAsync("async:op").get() != "value" || !router.ContainsAsync("async:op").get()) {
+        std::cout << "✗ GetAsync/ContainsAsync did not see the write" << std::endl;
+        return false;
+    }
+    if (!router.ExpireAsync("async:op", 100).get() || router.TTLAsync("async:op").get() <= 0) {
+        std::cout << "✗ ExpireAsync/TTLAsync failed" << std::endl;
+        return false;
+    }
+    if (!router.DeleteAsync("async:op").get() || router.GetAsync("async:op").get().has_value() ||
+        router.TTLAsync("async:op").get() != -2) {
+        std::cout << "✗ DeleteAsync failed" << std::endl;
+        return false;
+    }
+    std::cout << "✓ Every operation completes through its future" << std::endl;
+    return true;
+}
+
+bool CheckConcurrent(ShardRouter& router, int count) {
+    for (int i = 0; i < count; ++i) {
+        router.SetAsync("async:" + std::to_string(i), "value-" + std::to_string(i));
+    }
+    // Futures of calls in flight can be dropped; wait on the last write
+    if (!router.SetAsync("async:done", "x").get()) {
+        std::cout << "✗ SetAsync failed" << std::endl;
+        return false;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int completed = 0;
+    std::atomic<int> wrong{0};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+        std::string expected = "value-" + std::to_string(i);
+        router.GetAsync("async:" + std::to_string(i), [&, expected](std::optional<std::string> value) {
+            if (value != expected) wrong++;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++completed == count) cv.notify_all();
+        });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!cv.wait_for(lock, std::chrono::seconds(30), [&] { return completed == count; })) {
+        std::cout << "✗ " << count - completed << " GETs never completed" << std::endl;
+        return false;
+    }
+    if (wrong > 0) {
+        std::cout << "✗ " << wrong << " GETs returned wrong data" << std::endl;
+        return false;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "✓ " << count << " concurrent GETs in " << elapsed.count() << " ms" << std::endl;
+    return true;
+}
+
+bool CheckChannelPool(const std::string& master, int count) {
+    ChannelPoolOptions pool;
+    pool.channels_per_shard = 4;
+    pool.selection = ChannelSelection::LEAST_LOADED;
+    ShardRouter router(SingleShard(master), ShardRouter::kDefaultCompletionThreads, pool);
+
+    // Warm-up connected all of them before the first request
+    size_t ready = router.ReadyChannels("shard-1");
+    if (ready != pool.channels_per_shard) {
+        std::cout << "✗ " << ready << " of " << pool.channels_per_shard << " channels connected" << std::endl;
+        return false;
+    }
+    if (!CheckConcurrent(router, count)) {
+        return false;
+    }
+    std::cout << "✓ A pool of " << pool.channels_per_shard << " channels serves the same requests" << std::endl;
+    return true;
+}
+
+bool CheckShutdown(const std::string& master, int count) {
+    std::atomic<int> completed{0};
+    {
+        ShardRouter router(SingleShard(master));
+        for (int i = 0; i < count; ++i) {
+            router.GetAsync("async:" + std::to_string(i), [&](std::optional<std::string>) { completed++; });
+        }
+    }
+    // Every callback ran, successfully or cancelled, before the router went
+    if (completed != count) {
+        std::cout << "✗ " << count - completed << " callbacks were lost at shutdown" << std::endl;
+        return false;
+    }
+    std::cout << "✓ Calls in flight complete when the router is destroyed" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string master = argc > 1 ? argv[1] : "localhost:50051";
+    int count = argc > 2 ? std::stoi(argv[2]) : 5000;
+
+    ShardRouter router(SingleShard(master));
+    if (!CheckOperations(router) || !CheckConcurrent(router, count) || !CheckChannelPool(master, count) ||
+        !CheckShutdown(master, count)) {
+        return 1;
+    }
+    auto stats = router.GetStats();
+    if (stats.failed_requests != 0) {
+        std::cout << "✗ " << stats.failed_requests << " requests failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
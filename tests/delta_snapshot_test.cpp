@@ -0,0 +1,176 @@
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+
+// Usage: delta_snapshot_test <address> write
+//        delta_snapshot_test <address> churn
+//        delta_snapshot_test <address> verify [churned]
+//
+// Run against a server taking a snapshot every second. "write" changes the
+// store in rounds a few seconds apart, so a base snapshot is followed by
+// deltas holding overwrites, deletes and TTLs; its last round is left to
+// the AOF tail. "churn" keeps overwriting a few keys, for a server whose
+// --max-deltas makes it merge the chain. "verify" checks what a restarted
+// server recovered ("churned" once churn has run).
+
+namespace {
+
+constexpr int kKeys = 200;
+constexpr int kChurnRounds = 6;
+
+std::unique_ptr<kvstore::KeyValueStore::Stub> stub;
+
+std::string Key(int i) {
+    return "delta:" + std::to_string(i);
+}
+
+bool Set(int i, const std::string& value) {
+    kvstore::SetRequest request;
+    request.set_key(Key(i));
+    request.set_value(value);
+    kvstore::SetResponse response;
+    grpc::ClientContext context;
+    if (!stub->Set(&context, request, &response).ok()) {
+        std::cout << "✗ SET " << Key(i) << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Delete(int i) {
+    kvstore::DeleteRequest request;
+    request.set_key(Key(i));
+    kvstore::DeleteResponse response;
+    grpc::ClientContext context;
+    if (!stub->Delete(&context, request, &response).ok() || !response.found()) {
+        std::cout << "✗ DELETE " << Key(i) << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Expire(int i, int seconds) {
+    kvstore::ExpireRequest request;
+    request.set_key(Key(i));
+    request.set_seconds(seconds);
+    kvstore::ExpireResponse response;
+    grpc::ClientContext context;
+    if (!stub->Expire(&context, request, &response).ok() || !response.success()) {
+        std::cout << "✗ EXPIRE " << Key(i) << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Long enough for the server's next snapshot to pick up a round
+void WaitForSnapshot() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+}
+
+// What each key holds after "write" (and "churn"); empty if it is gone
+std::string Expected(int i, bool churned) {
+    if (i == 0) return "";                                     // Deleted in the tail
+    if (churned && i >= 60 && i < 70) return "churn" + std::to_string(kChurnRounds) + "-" + std::to_string(i);
+    if (i < 20) return "delta-" + std::to_string(i);           // Overwritten in a delta
+    if (i < 40) return "";                                     // Deleted, or expired
+    if (i >= 50 && i < 60) return "tail-" + std::to_string(i); // Overwritten in the tail
+    return "base-" + std::to_string(i);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string server_address = argc > 1 ? argv[1] : "localhost:50051";
+    std::string mode = argc > 2 ? argv[2] : "verify";
+    bool churned = argc > 3 && std::string(argv[3]) == "churned";
+
+    auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+    stub = kvstore::KeyValueStore::NewStub(channel);
+
+    if (mode == "write") {
+        // Base snapshot
+        for (int i = 0; i < kKeys; ++i) {
+            if (!Set(i, "base-" + std::to_string(i))) return 1;
+        }
+        WaitForSnapshot();
+
+        // A delta per round, each changing far less than half the keys
+        for (int i = 0; i < 20; ++i) {
+            if (!Set(i, "delta-" + std::to_string(i))) return 1;
+        }
+        WaitForSnapshot();
+        for (int i = 20; i < 30; ++i) {
+            if (!Delete(i)) return 1;
+        }
+        WaitForSnapshot();
+        for (int i = 30; i < 40; ++i) {
+            if (!Expire(i, 1)) return 1;
+        }
+        for (int i = 40; i < 50; ++i) {
+            if (!Expire(i, 3600)) return 1;
+        }
+        WaitForSnapshot();
+
+        // Left to the AOF tail: the server is killed right after
+        for (int i = 50; i < 60; ++i) {
+            if (!Set(i, "tail-" + std::to_string(i))) return 1;
+        }
+        if (!Delete(0)) return 1;
+
+        std::cout << "✓ Wrote " << kKeys << " keys, then overwrote, deleted and expired some" << std::endl;
+        return 0;
+    }
+
+    if (mode == "churn") {
+        for (int round = 1; round <= kChurnRounds; ++round) {
+            for (int i = 60; i < 70; ++i) {
+                if (!Set(i, "churn" + std::to_string(round) + "-" + std::to_string(i))) return 1;
+            }
+            WaitForSnapshot();
+        }
+        std::cout << "✓ Overwrote 10 keys in " << kChurnRounds << " rounds" << std::endl;
+        return 0;
+    }
+
+    for (int i = 0; i < kKeys; ++i) {
+        kvstore::GetRequest request;
+        request.set_key(Key(i));
+        kvstore::GetResponse response;
+        grpc::ClientContext context;
+        if (!stub->Get(&context, request, &response).ok()) {
+            std::cout << "✗ GET " << Key(i) << " failed" << std::endl;
+            return 1;
+        }
+
+        std::string expected = Expected(i, churned);
+        if (expected.empty() ? response.found() : !response.found() || response.value() != expected) {
+            std::cout << "✗ " << Key(i) << ": expected "
+                      << (expected.empty() ? "no key" : expected) << ", got "
+                      << (response.found() ? response.value() : "no key") << std::endl;
+            return 1;
+        }
+    }
+
+    // Only the long TTLs survive the restart, still counting down
+    for (int i = 40; i < 60; ++i) {
+        kvstore::TTLRequest request;
+        request.set_key(Key(i));
+        kvstore::TTLResponse response;
+        grpc::ClientContext context;
+        if (!stub->TTL(&context, request, &response).ok()) {
+            std::cout << "✗ TTL " << Key(i) << " failed" << std::endl;
+            return 1;
+        }
+        bool ok = i < 50 ? response.seconds() > 0 && response.seconds() <= 3600 : response.seconds() == -1;
+        if (!ok) {
+            std::cout << "✗ TTL " << Key(i) << " is " << response.seconds() << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "✓ Recovered every key, delete and TTL from the base, its deltas and the AOF tail" << std::endl;
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include "../src/sharding/shard_router.h"
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Usage: failover_test <members> leader
+//        failover_test <members> write <prefix> <count>
+//        failover_test <members> verify <prefix> <count>
+//        failover_test <members> check <address> <prefix> <count>
+//
+// <members> is a comma-separated list of a consensus shard's members.
+// leader: wait for the members that answer to agree on one leader, and
+//         print its address
+// write / verify: route through ShardRouter, which starts out with the
+//         first member as primary and has to find the elected leader
+// check:  read every key from one member directly, waiting for it to
+//         catch up
+
+using namespace kvstore;
+
+namespace {
+
+constexpr auto kTimeout = std::chrono::seconds(15);
+
+std::vector<std::string> SplitList(const std::string& list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = list.find(',', start);
+        if (comma == std::string::npos) comma = list.size();
+        if (comma > start) items.push_back(list.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return items;
+}
+
+std::unique_ptr<KeyValueStore::Stub> Connect(const std::string& address) {
+    return KeyValueStore::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+}
+
+int FindLeader(const std::vector<std::string>& members) {
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        // Votes per leader among the members that answer; the leader has to
+        // confirm it takes writes
+        std::map<std::string, int> named;
+        std::map<std::string, std::string> roles;
+        int answered = 0;
+        for (const std::string& member : members) {
+            grpc::ClientContext context;
+            context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(500));
+            StatsRequest request;
+            StatsResponse response;
+            if (!Connect(member)->GetStats(&context, request, &response).ok()) continue;
+            answered++;
+            roles[member] = response.role();
+            if (!response.leader().empty()) named[response.leader()]++;
+        }
+        for (const auto& [leader, count] : named) {
+            if (count == answered && 2 * count > static_cast<int>(members.size()) &&
+                roles[leader] == "master") {
+                std::cout << leader << std::endl;
+                return 0;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::cerr << "✗ No leader agreed on within " << kTimeout.count() << " s" << std::endl;
+    return 1;
+}
+
+std::shared_ptr<HashRing> ShardOf(const std::vector<std::string>& members) {
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", members[0], std::vector<std::string>(members.begin() + 1, members.end()));
+    return hash_ring;
+}
+
+int Write(const std::vector<std::string>& members, const std::string& prefix, int count) {
+    ShardRouter router(ShardOf(members));
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+        // Writes fail while the shard has no leader; the router finds the
+        // next one once it is elected
+        auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        while (!router.Set(prefix + ":" + std::to_string(i), "value-" + std::to_string(i))) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                std::cout << "✗ SET " << prefix << ":" << i << " kept failing" << std::endl;
+                return 1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "✓ Wrote " << count << " keys in " << elapsed.count() << " ms ("
+              << router.GetStats().leader_changes << " leader changes followed)" << std::endl;
+    return 0;
+}
+
+int Verify(const std::vector<std::string>& members, const std::string& prefix, int count) {
+    ShardRouter router(ShardOf(members));
+    for (int i = 0; i < count; ++i) {
+        std::string key = prefix + ":" + std::to_string(i);
+        if (router.Get(key) != "value-" + std::to_string(i)) {
+            std::cout << "✗ " << key << " was lost" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "✓ All " << count << " acknowledged writes survived" << std::endl;
+    return 0;
+}
+
+int Check(const std::string& address, const std::string& prefix, int count) {
+    auto stub = Connect(address);
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    for (int i = 0; i < count; ++i) {
+        GetRequest request;
+        request.set_key(prefix + ":" + std::to_string(i));
+        while (true) {
+            grpc::ClientContext context;
+            GetResponse response;
+            if (stub->Get(&context, request, &response).ok() && response.value() == "value-" + std::to_string(i)) {
+                break;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                std::cout << "✗ " << address << " is missing " << request.key() << std::endl;
+                return 1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    std::cout << "✓ " << address << " has all " << count << " keys" << std::endl;
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <members> leader|write|verify|check ..." << std::endl;
+        return 1;
+    }
+    std::vector<std::string> members = SplitList(argv[1]);
+    std::string mode = argv[2];
+
+    if (mode == "leader") {
+        return FindLeader(members);
+    }
+    if ((mode == "write" || mode == "verify") && argc >= 5) {
+        int count = std::stoi(argv[4]);
+        return mode == "write" ? Write(members, argv[3], count) : Verify(members, argv[3], count);
+    }
+    if (mode == "check" && argc >= 6) {
+        return Check(argv[3], argv[4], std::stoi(argv[5]));
+    }
+    std::cerr << "Unknown mode or missing arguments: " << mode << std::endl;
+    return 1;
+}
@@ -0,0 +1,203 @@
+#include "../src/sharding/shard_router.h"
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+// Usage: health_test <shard-1> <shard-1-replica> <shard-2> <shard-1-pid>
+//
+// Pauses shard-1's primary (SIGSTOP) under a router with short deadlines
+// and fast probes. Its circuit must open within a few calls, after which
+// writes to it are refused at once, its reads are served by its replica,
+// and shard-2 carries on. Once it is resumed, probes must close the
+// circuit again.
+
+using namespace kvstore;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kKeys = 200;
+
+std::string Key(int i) {
+    return "health:" + std::to_string(i);
+}
+
+std::string Value(int i) {
+    return "value-" + std::to_string(i);
+}
+
+int64_t MillisSince(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+}
+
+bool WaitFor(const std::function<bool()>& condition, int64_t timeout_ms) {
+    auto start = Clock::now();
+    while (!condition()) {
+        if (MillisSince(start) > timeout_ms) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return true;
+}
+
+// Whether every thread of a process is stopped. SIGSTOP reaches them one
+// at a time, and until it has, a thread woken by a request can answer it.
+bool AllThreadsStopped(pid_t pid) {
+    std::error_code error;
+    for (const auto& task : std::filesystem::directory_iterator("/proc/" + std::to_string(pid) + "/task", error)) {
+        std::ifstream status(task.path() / "status");
+        std::string field;
+        std::string state;
+        while (status >> field && field != "State:") {
+        }
+        // "T (stopped)"
+        if (!(status >> state) || state != "T") {
+            return false;
+        }
+    }
+    return !error;
+}
+
+// Pauses a process, and resumes it however the test ends
+class Pause {
+public:
+    explicit Pause(pid_t pid) : pid_(pid) {
+        kill(pid_, SIGSTOP);
+        WaitFor([this] { return AllThreadsStopped(pid_); }, 5000);
+    }
+    ~Pause() { Resume(); }
+
+    void Resume() {
+        if (pid_ > 0) {
+            kill(pid_, SIGCONT);
+            pid_ = 0;
+        }
+    }
+
+private:
+    pid_t pid_;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " <shard-1> <shard-1-replica> <shard-2> <shard-1-pid>" << std::endl;
+        return 1;
+    }
+
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", argv[1], {argv[2]});
+    hash_ring->AddShard("shard-2", argv[3]);
+    HealthOptions health;
+    health.read_deadline_ms = 500;
+    health.write_deadline_ms = 500;
+    health.probe_interval_ms = 100;
+    health.probe_timeout_ms = 200;
+    health.open_ms = 300;
+    ShardRouter router(hash_ring, ShardRouter::kDefaultCompletionThreads, ChannelPoolOptions(),
+                       LatencyHistogram::kDefaultPrecisionBits, health);
+
+    std::vector<int> first;
+    std::vector<int> second;
+    for (int i = 0; i < kKeys; ++i) {
+        if (!router.Set(Key(i), Value(i))) {
+            std::cout << "✗ Could not write " << Key(i) << std::endl;
+            return 1;
+        }
+        (hash_ring->GetShardForKey(Key(i)) == "shard-1" ? first : second).push_back(i);
+    }
+    ReadOptions any;
+    any.consistency = ReadConsistency::ANY;
+    bool replicated = WaitFor([&] {
+        for (int i : first) {
+            if (router.Get(Key(i), any) != Value(i)) return false;
+        }
+        return true;
+    }, 10000);
+    if (!replicated) {
+        std::cout << "✗ shard-1's replica did not catch up" << std::endl;
+        return 1;
+    }
+    std::cout << "✓ Wrote " << kKeys << " keys, " << first.size() << " on shard-1 and its replica" << std::endl;
+
+    Pause pause(std::stoi(argv[4]));
+
+    // Calls give up at the deadline until the circuit opens
+    auto start = Clock::now();
+    int64_t slowest = 0;
+    for (size_t n = 0; hash_ring->GetShard("shard-1")->is_available; ++n) {
+        auto call = Clock::now();
+        if (router.Set(Key(first[n % first.size()]), "paused")) {
+            std::cout << "✗ A write to the paused shard succeeded" << std::endl;
+            return 1;
+        }
+        slowest = std::max(slowest, MillisSince(call));
+        if (MillisSince(start) > 5000 || slowest > health.write_deadline_ms + 500) {
+            std::cout << "✗ After " << MillisSince(start) << " ms shard-1 is still available (slowest write "
+                      << slowest << " ms)" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "✓ shard-1 marked unavailable " << MillisSince(start) << " ms after it was paused (slowest write "
+              << slowest << " ms)" << std::endl;
+
+    // Open: writes refused at once (bar a trial now and then), reads from
+    // the replica, shard-2 unaffected
+    auto before = router.GetStats();
+    start = Clock::now();
+    for (int i : first) {
+        router.Set(Key(i), "paused");
+        if (router.Get(Key(i)) != Value(i)) {
+            std::cout << "✗ " << Key(i) << " did not read from the replica" << std::endl;
+            return 1;
+        }
+    }
+    int64_t open_ms = MillisSince(start);
+    auto stats = router.GetStats();
+    uint64_t shed = stats.shed_requests - before.shed_requests;
+    uint64_t replica_reads = stats.replica_reads - before.replica_reads;
+    if (shed < first.size() / 2 || replica_reads != first.size()) {
+        std::cout << "✗ " << shed << " writes shed and " << replica_reads << " reads from the replica of "
+                  << first.size() << std::endl;
+        return 1;
+    }
+    for (int i : second) {
+        if (!router.Set(Key(i), Value(i) + "-2") || router.Get(Key(i)) != Value(i) + "-2") {
+            std::cout << "✗ shard-2 failed while shard-1 was paused" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "✓ While open: " << shed << " writes shed, " << replica_reads << " reads from the replica in "
+              << open_ms << " ms; shard-2 unaffected" << std::endl;
+
+    // Probes find it answering again
+    pause.Resume();
+    start = Clock::now();
+    if (!WaitFor([&] { return hash_ring->GetShard("shard-1")->is_available; }, 5000) ||
+        router.GetCircuitState("shard-1") != CircuitState::CLOSED) {
+        std::cout << "✗ shard-1 was not marked available again after it resumed" << std::endl;
+        return 1;
+    }
+    int64_t recovered_ms = MillisSince(start);
+    for (int i : first) {
+        if (!router.Set(Key(i), Value(i) + "-2") || router.Get(Key(i)) != Value(i) + "-2") {
+            std::cout << "✗ " << Key(i) << " failed after shard-1 resumed" << std::endl;
+            return 1;
+        }
+    }
+    stats = router.GetStats();
+    std::cout << "✓ shard-1 available again " << recovered_ms << " ms after it resumed ("
+              << stats.circuit_opens << " circuit opens, " << stats.shed_requests << " calls shed in all)"
+              << std::endl;
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+
+// Usage: lazy_load_test <address> write <count>
+//        lazy_load_test <address> verify <count>
+//        lazy_load_test <address> wait <replicas>
+//        lazy_load_test <address> replicas <replicas>
+//
+// "write" fills the store; "verify" runs against a server restarted with
+// --lazy-load and reads every key back, retrying while the key's partition
+// is still loading. "wait" asks a master to wait until <replicas> replicas
+// have acknowledged everything written so far. "replicas" checks that the
+// master's stats list <replicas> connected replicas that have caught up.
+
+int main(int argc, char** argv) {
+    std::string server_address = argc > 1 ? argv[1] : "localhost:50051";
+    std::string mode = argc > 2 ? argv[2] : "verify";
+    int count = argc > 3 ? std::stoi(argv[3]) : 20000;
+
+    auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+    auto stub = kvstore::KeyValueStore::NewStub(channel);
+
+    if (mode == "write") {
+        for (int i = 0; i < count; ++i) {
+            kvstore::SetRequest request;
+            request.set_key("lazy:" + std::to_string(i));
+            request.set_value("value-" + std::to_string(i));
+            kvstore::SetResponse response;
+            grpc::ClientContext context;
+            if (!stub->Set(&context, request, &response).ok()) {
+                std::cout << "✗ SET failed at key " << i << std::endl;
+                return 1;
+            }
+        }
+        std::cout << "✓ Wrote " << count << " keys" << std::endl;
+        return 0;
+    }
+
+    if (mode == "wait") {
+        kvstore::WaitRequest request;
+        request.set_replicas(count);
+        request.set_timeout_ms(5000);
+        kvstore::WaitResponse response;
+        grpc::ClientContext context;
+        if (!stub->Wait(&context, request, &response).ok() || response.replicas() < count) {
+            std::cout << "✗ WAIT: " << response.replicas() << "/" << count
+                      << " replicas acknowledged sequence " << response.sequence() << std::endl;
+            return 1;
+        }
+        std::cout << "✓ WAIT: " << response.replicas() << " replicas acknowledged sequence "
+                  << response.sequence() << std::endl;
+        return 0;
+    }
+
+    if (mode == "replicas") {
+        auto caught_up = [](const kvstore::ReplicaStats& replica) {
+            return replica.connected() && replica.lag_sequences() == 0 && replica.lag_ms() == 0 &&
+                   replica.commands_sent() > 0;
+        };
+        kvstore::StatsResponse stats;
+        int replicas = 0;
+        for (int attempt = 0; attempt < 50 && replicas < count; ++attempt) {
+            if (attempt > 0) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            kvstore::StatsRequest request;
+            grpc::ClientContext context;
+            stats.Clear();
+            if (!stub->GetStats(&context, request, &stats).ok()) {
+                std::cout << "✗ STATS failed" << std::endl;
+                return 1;
+            }
+            replicas = 0;
+            for (const auto& replica : stats.replicas()) {
+                if (caught_up(replica)) replicas++;
+            }
+        }
+        for (const auto& replica : stats.replicas()) {
+            std::cout << "  " << replica.replica_id() << " (" << replica.mode() << "): "
+                      << (replica.connected() ? "connected" : "disconnected")
+                      << ", acked " << replica.acked_sequence() << ", lag " << replica.lag_sequences()
+                      << " ops / " << replica.lag_ms() << " ms, " << replica.commands_sent()
+                      << " commands in " << replica.batches_sent() << " batches, "
+                      << replica.reconnects() << " reconnects" << std::endl;
+        }
+        if (replicas < count) {
+            std::cout << "✗ STATS: " << replicas << "/" << count << " replicas caught up" << std::endl;
+            return 1;
+        }
+        std::cout << "✓ STATS: " << replicas << " replicas caught up" << std::endl;
+        return 0;
+    }
+
+    int retries = 0;
+    for (int i = 0; i < count; ++i) {
+        kvstore::GetRequest request;
+        request.set_key("lazy:" + std::to_string(i));
+        kvstore::GetResponse response;
+        grpc::ClientContext context;
+
+        grpc::Status status = stub->Get(&context, request, &response);
+        if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
+            retries++;
+            --i;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            continue;
+        }
+        if (!status.ok() || !response.found() || response.value() != "value-" + std::to_string(i)) {
+            std::cout << "✗ GET lazy:" << i << " returned wrong data" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "✓ Read " << count << " keys (" << retries << " retries while loading)" << std::endl;
+
+    // Loading has to finish and report the whole dataset
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        kvstore::StatsRequest request;
+        kvstore::StatsResponse response;
+        grpc::ClientContext context;
+
+        if (stub->GetStats(&context, request, &response).ok() && !response.loading()) {
+            std::cout << "✓ Load complete: " << response.load_bytes_loaded() << "/"
+                      << response.load_bytes_total() << " bytes, "
+                      << response.partitions_loaded() << "/" << response.partitions_total()
+                      << " partitions, " << response.key_count() << " keys" << std::endl;
+            return response.key_count() >= count ? 0 : 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    std::cout << "✗ Load did not complete" << std::endl;
+    return 1;
+}
@@ -0,0 +1,291 @@
+#include "../src/sharding/shard_router.h"
+#include <atomic>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Usage: multi_key_test <shard-1> <shard-2> <shard-3> [keys]
+//
+// MultiGet, MultiSet and MultiDelete through ShardRouter: results in key
+// order across two shards and more than one batch per shard, per-key
+// failures when one shard is down, calls made while a third shard is
+// being added, and keys co-located by hash tags.
+
+using namespace kvstore;
+
+namespace {
+
+std::string Key(int i) {
+    return "multi:" + std::to_string(i);
+}
+
+std::string Value(int i) {
+    return "value-" + std::to_string(i);
+}
+
+std::vector<std::pair<std::string, std::string>> Entries(int from, int to) {
+    std::vector<std::pair<std::string, std::string>> entries;
+    for (int i = from; i < to; ++i) {
+        entries.emplace_back(Key(i), Value(i));
+    }
+    return entries;
+}
+
+bool AllOk(const std::vector<ShardRouter::KeyResult>& results) {
+    for (const auto& result : results) {
+        if (!result.ok) return false;
+    }
+    return true;
+}
+
+bool CheckOperations(ShardRouter& router, int keys) {
+    uint64_t requests = router.GetStats().total_requests;
+    if (!AllOk(router.MultiSet(Entries(0, keys)))) {
+        std::cout << "✗ MultiSet failed" << std::endl;
+        return false;
+    }
+    // A batch per shard per kMaxBatchKeys keys, not a request per key
+    uint64_t sent = router.GetStats().total_requests - requests;
+    if (sent > 2 * (keys / ShardRouter::kMaxBatchKeys + 1)) {
+        std::cout << "✗ MultiSet of " << keys << " keys made " << sent << " requests" << std::endl;
+        return false;
+    }
+
+    // Present and missing keys interleaved, one of them twice
+    std::vector<std::string> wanted;
+    for (int i = keys - 1; i >= 0; i -= 3) {
+        wanted.push_back(Key(i));
+        wanted.push_back("multi:missing:" + std::to_string(i));
+    }
+    wanted.push_back(Key(keys - 1));
+    auto results = router.MultiGet(wanted);
+    if (results.size() != wanted.size() || !AllOk(results)) {
+        std::cout << "✗ MultiGet failed" << std::endl;
+        return false;
+    }
+    for (size_t j = 0; j < wanted.size(); ++j) {
+        bool missing = wanted[j].rfind("multi:missing:", 0) == 0;
+        int i = missing ? -1 : std::stoi(wanted[j].substr(6));
+        if (missing ? results[j].found : !results[j].found || results[j].value != Value(i)) {
+            std::cout << "✗ MultiGet result " << j << " (" << wanted[j] << ") is out of place" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "✓ " << keys << " keys written in " << sent << " requests, read back in order" << std::endl;
+
+    std::vector<std::string> doomed;
+    for (int i = 0; i < keys; i += 2) {
+        doomed.push_back(Key(i));
+    }
+    doomed.push_back("multi:missing");
+    results = router.MultiDelete(doomed);
+    if (!AllOk(results) || results.back().found) {
+        std::cout << "✗ MultiDelete failed" << std::endl;
+        return false;
+    }
+    for (size_t j = 0; j + 1 < results.size(); ++j) {
+        if (!results[j].found) {
+            std::cout << "✗ MultiDelete did not find " << doomed[j] << std::endl;
+            return false;
+        }
+    }
+    for (int i = 0; i < keys; ++i) {
+        auto value = router.Get(Key(i));
+        if (i % 2 == 0 ? value.has_value() : value != Value(i)) {
+            std::cout << "✗ " << Key(i) << " is wrong after MultiDelete" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "✓ MultiDelete removed every other key and reported which existed" << std::endl;
+    return true;
+}
+
+bool CheckShardDown(const std::string& live) {
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", live);
+    hash_ring->AddShard("shard-down", "127.0.0.1:1");
+    ChannelPoolOptions pool;
+    pool.warm_up_timeout_ms = 100;
+    ShardRouter router(hash_ring, ShardRouter::kDefaultCompletionThreads, pool);
+
+    std::vector<std::pair<std::string, std::string>> entries;
+    for (int i = 0; i < 200; ++i) {
+        entries.emplace_back("down:" + std::to_string(i), Value(i));
+    }
+    auto written = router.MultiSet(entries);
+    std::vector<std::string> keys;
+    for (const auto& entry : entries) {
+        keys.push_back(entry.first);
+    }
+    auto read = router.MultiGet(keys);
+
+    int up = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        bool on_live = hash_ring->GetShardForKey(keys[i]) == "shard-1";
+        if (written[i].ok != on_live || read[i].ok != on_live ||
+            (on_live && read[i].value != entries[i].second)) {
+            std::cout << "✗ " << keys[i] << " has the wrong result with one shard down" << std::endl;
+            return false;
+        }
+        up += on_live;
+    }
+    std::cout << "✓ With one shard down, its keys fail and the other " << up << " succeed" << std::endl;
+    return true;
+}
+
+bool CheckDuringMigration(ShardRouter& router, const std::string& address, int keys) {
+    // As CheckOperations left them: the odd keys
+    std::vector<std::string> all;
+    std::vector<std::optional<std::string>> expected;
+    for (int i = 0; i < keys; ++i) {
+        all.push_back(Key(i));
+        expected.push_back(i % 2 == 1 ? std::optional<std::string>(Value(i)) : std::nullopt);
+    }
+
+    // Slow enough for a good number of rounds
+    MigrationOptions options;
+    options.batch_keys = 20;
+    options.max_keys_per_second = keys / 5;
+    std::atomic<bool> moved{false};
+    std::atomic<bool> finished{false};
+    std::thread migration([&] {
+        moved = router.AddShard("shard-3", address, {}, 1.0, options);
+        finished = true;
+    });
+
+    // Rewrite or delete a key a round while the keys move, and read them all
+    int wrong = 0;
+    int rounds = 0;
+    while (!finished) {
+        int i = (rounds * 7) % keys;
+        if (rounds % 2 == 0) {
+            std::string value = "rewritten-" + std::to_string(rounds);
+            if (!AllOk(router.MultiSet({{Key(i), value}}))) wrong++;
+            expected[i] = value;
+        } else {
+            if (!AllOk(router.MultiDelete({Key(i)}))) wrong++;
+            expected[i] = std::nullopt;
+        }
+        auto results = router.MultiGet(all);
+        for (int k = 0; k < keys; ++k) {
+            if (!results[k].ok || results[k].found != expected[k].has_value() ||
+                (expected[k] && results[k].value != *expected[k])) {
+                wrong++;
+            }
+        }
+        rounds++;
+    }
+    migration.join();
+    if (!moved || wrong > 0) {
+        std::cout << "✗ " << wrong << " multi-key results were wrong during the migration" << std::endl;
+        return false;
+    }
+    std::cout << "✓ " << rounds << " rounds of multi-key calls stayed right while shard-3 was added" << std::endl;
+    return true;
+}
+
+// On a ring with hash tags: each tag's keys go in one request, and stay
+// together when the shard is added
+bool CheckHashTags(const std::string& first, const std::string& second, const std::string& third) {
+    auto hash_ring = std::make_shared<HashRing>(150, nullptr, true);
+    hash_ring->AddShard("shard-1", first);
+    hash_ring->AddShard("shard-2", second);
+    ShardRouter router(hash_ring);
+
+    const int users = 200;
+    auto group = [](int user) {
+        std::string tag = "tagged:{" + std::to_string(user) + "}:";
+        return std::vector<std::string>{tag + "profile", tag + "cart", tag + "orders"};
+    };
+    auto check = [&](const char* when) {
+        uint64_t requests = router.GetStats().total_requests;
+        for (int user = 0; user < users; ++user) {
+            auto keys = group(user);
+            auto results = router.MultiGet(keys);
+            for (size_t j = 0; j < keys.size(); ++j) {
+                if (!results[j].found || results[j].value != Value(user)) {
+                    std::cout << "✗ " << keys[j] << " is wrong " << when << std::endl;
+                    return false;
+                }
+            }
+            if (router.CrossesShards(keys)) {
+                std::cout << "✗ " << keys[0] << " and the rest of its tag span shards " << when << std::endl;
+                return false;
+            }
+        }
+        uint64_t sent = router.GetStats().total_requests - requests;
+        if (sent != users || router.GetStats().cross_shard_calls != 0) {
+            std::cout << "✗ " << users << " tags read in " << sent << " requests " << when << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    for (int user = 0; user < users; ++user) {
+        std::vector<std::pair<std::string, std::string>> entries;
+        for (const auto& key : group(user)) {
+            entries.emplace_back(key, Value(user));
+        }
+        if (!AllOk(router.MultiSet(entries))) {
+            std::cout << "✗ MultiSet of tag " << user << " failed" << std::endl;
+            return false;
+        }
+    }
+    if (!check("after writing")) {
+        return false;
+    }
+
+    // Untagged keys spread, and a call across shards is counted
+    std::vector<std::string> untagged;
+    for (int user = 0; user < users; ++user) {
+        untagged.push_back("untagged:" + std::to_string(user));
+    }
+    if (!router.CrossesShards(untagged)) {
+        std::cout << "✗ Untagged keys never crossed shards" << std::endl;
+        return false;
+    }
+    router.MultiGet(untagged);
+    if (router.GetStats().cross_shard_calls != 1) {
+        std::cout << "✗ A MultiGet across shards was not counted" << std::endl;
+        return false;
+    }
+    router.ResetStats();
+
+    // The old owners scan for the moving tags by their hash
+    MigrationOptions options;
+    options.max_keys_per_second = 0;
+    if (!router.AddShard("shard-3", third, {}, 1.0, options)) {
+        std::cout << "✗ Adding shard-3 to the tagged ring failed" << std::endl;
+        return false;
+    }
+    if (!check("after adding shard-3")) {
+        return false;
+    }
+    std::cout << "✓ " << users << " hash tags read in one request each, before and after a shard was added"
+              << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " <shard-1> <shard-2> <shard-3> [keys]" << std::endl;
+        return 1;
+    }
+    int keys = argc > 4 ? std::stoi(argv[4]) : 2500;
+
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", argv[1]);
+    hash_ring->AddShard("shard-2", argv[2]);
+    ShardRouter router(hash_ring);
+
+    if (!CheckOperations(router, keys) || !CheckShardDown(argv[1]) ||
+        !CheckDuringMigration(router, argv[3], keys) || !CheckHashTags(argv[1], argv[2], argv[3])) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include "../src/sharding/shard_router.h"
+#include <iostream>
+#include <string>
+
+// Usage: replica_read_test <master> <replica> [count]
+//
+// Routes reads for a one-shard cluster through ShardRouter with the
+// replica (and an unreachable second replica) listed for the shard, and
+// checks each consistency level.
+
+using namespace kvstore;
+
+int main(int argc, char** argv) {
+    std::string master = argc > 1 ? argv[1] : "localhost:50051";
+    std::string replica = argc > 2 ? argv[2] : "localhost:50052";
+    int count = argc > 3 ? std::stoi(argv[3]) : 1000;
+
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("shard-1", master, {replica, "localhost:50099"});
+    ShardRouter router(hash_ring);
+
+    // Bounded by 0 sequences: every read sees the write just before it,
+    // from the replica if it has applied it, else from the primary
+    ReadOptions read_your_writes;
+    read_your_writes.consistency = ReadConsistency::BOUNDED;
+    read_your_writes.max_lag_sequences = 0;
+
+    for (int i = 0; i < count; ++i) {
+        std::string key = "replica-read:" + std::to_string(i);
+        std::string value = "value-" + std::to_string(i);
+        if (!router.Set(key, value)) {
+            std::cout << "✗ SET " << key << " failed" << std::endl;
+            return 1;
+        }
+        auto read = router.Get(key, read_your_writes);
+        if (read != value) {
+            std::cout << "✗ Bounded GET " << key << " returned stale data" << std::endl;
+            return 1;
+        }
+    }
+    auto stats = router.GetStats();
+    std::cout << "✓ Read your writes: " << stats.replica_reads << " from the replica, "
+              << stats.replica_fallbacks << " redone on the primary" << std::endl;
+
+    // Let the replica catch up, then every bounded read can stay on it
+    auto stub = KeyValueStore::NewStub(grpc::CreateChannel(master, grpc::InsecureChannelCredentials()));
+    WaitRequest wait;
+    wait.set_replicas(1);
+    wait.set_timeout_ms(5000);
+    WaitResponse waited;
+    grpc::ClientContext context;
+    if (!stub->Wait(&context, wait, &waited).ok() || waited.replicas() < 1) {
+        std::cout << "✗ Replica did not catch up" << std::endl;
+        return 1;
+    }
+
+    ReadOptions recent;
+    recent.consistency = ReadConsistency::BOUNDED;
+    recent.max_lag_ms = 1000;
+    router.ResetStats();
+    for (int i = 0; i < count; ++i) {
+        auto read = router.Get("replica-read:" + std::to_string(i), recent);
+        if (read != "value-" + std::to_string(i)) {
+            std::cout << "✗ Bounded GET replica-read:" << i << " returned wrong data" << std::endl;
+            return 1;
+        }
+    }
+    stats = router.GetStats();
+    if (stats.replica_reads == 0) {
+        std::cout << "✗ No reads were served by the replica" << std::endl;
+        return 1;
+    }
+    std::cout << "✓ Bounded by 1000 ms: " << stats.replica_reads << "/" << count
+              << " from the replica" << std::endl;
+
+    ReadOptions any;
+    any.consistency = ReadConsistency::ANY;
+    router.ResetStats();
+    for (int i = 0; i < count; ++i) {
+        router.Get("replica-read:" + std::to_string(i), any);
+    }
+    stats = router.GetStats();
+    std::cout << "✓ Any replica: " << stats.replica_reads << "/" << count << " from the replica" << std::endl;
+
+    router.ResetStats();
+    for (int i = 0; i < count; ++i) {
+        router.Get("replica-read:" + std::to_string(i));
+    }
+    stats = router.GetStats();
+    if (stats.replica_reads != 0) {
+        std::cout << "✗ Primary reads went to a replica" << std::endl;
+        return 1;
+    }
+    std::cout << "✓ Primary only: " << stats.successful_requests << "/" << count
+              << " from the primary" << std::endl;
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <grpcpp/grpcpp.h>
+#include "kvstore.grpc.pb.h"
+#include "../src/sharding/shard_router.h"
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Usage: resharding_test <shard-1> <shard-2> <shard-3> [keys]
+//
+// Starts a router on shard-1 and shard-2, writes <keys> keys, then adds
+// shard-3 and removes shard-1 while another thread reads, writes,
+// deletes and renews TTLs through the router. After each move every key must read back
+// with its value and TTL, deleted keys must stay deleted, and each key
+// must be stored on its owner and nowhere else it could be read from.
+
+using namespace kvstore;
+using grpc::ClientContext;
+
+namespace {
+
+std::string Key(int i) {
+    return "reshard:" + std::to_string(i);
+}
+
+std::string Value(int i) {
+    return "value-" + std::to_string(i);
+}
+
+// Deleted by the foreground thread while keys are moving
+bool Deleted(int i) {
+    return i % 50 == 0;
+}
+
+// Given a TTL before the move
+bool Expiring(int i) {
+    return i % 50 == 1;
+}
+
+// Reads, writes and deletes through the router for as long as a migration runs
+class Foreground {
+public:
+    Foreground(ShardRouter& router, int keys) : router_(router), keys_(keys), thread_([this] { Run(); }) {}
+
+    // Returns the number of reads that saw a wrong value
+    int Stop() {
+        done_ = true;
+        thread_.join();
+        return wrong_;
+    }
+
+    int Writes() const { return writes_; }
+
+private:
+    void Run() {
+        // Deletes first, while the copy has barely begun (again on the
+        // second move, when they are already gone)
+        for (int i = 0; i < keys_; i += 50) {
+            if (i % 100 == 0) {
+                router_.DeleteAsync(Key(i)).get();
+            } else {
+                router_.Delete(Key(i));
+            }
+            if (router_.Get(Key(i)).has_value()) wrong_++;
+        }
+        // TTLs renewed asynchronously: a key not copied yet is copied first
+        for (int i = 1; i < keys_; i += 50) {
+            if (!router_.ExpireAsync(Key(i), 600).get()) wrong_++;
+        }
+        int n = 0;
+        while (!done_) {
+            std::string key = "live:" + std::to_string(n);
+            bool set = n % 3 == 0 ? router_.SetAsync(key, "live").get() : router_.Set(key, "live");
+            if (!set || router_.Get(key) != "live") wrong_++;
+            writes_++;
+
+            int i = (n * 7919) % keys_;
+            auto value = n % 2 == 0 ? router_.GetAsync(Key(i)).get() : router_.Get(Key(i));
+            if (Deleted(i) ? value.has_value() : value != Value(i)) wrong_++;
+            n++;
+        }
+    }
+
+    ShardRouter& router_;
+    int keys_;
+    std::atomic<bool> done_{false};
+    std::atomic<int> wrong_{0};
+    std::atomic<int> writes_{0};
+    std::thread thread_;
+};
+
+class Cluster {
+public:
+    explicit Cluster(const std::vector<std::string>& addresses) {
+        for (size_t i = 0; i < addresses.size(); ++i) {
+            std::string shard_id = "shard-" + std::to_string(i + 1);
+            addresses_[shard_id] = addresses[i];
+            stubs_[shard_id] = KeyValueStore::NewStub(
+                grpc::CreateChannel(addresses[i], grpc::InsecureChannelCredentials()));
+        }
+    }
+
+    const std::string& Address(const std::string& shard_id) { return addresses_[shard_id]; }
+
+    // Whether a shard holds the key, asked directly
+    bool Holds(const std::string& shard_id, const std::string& key) {
+        ContainsRequest request;
+        request.set_key(key);
+        ContainsResponse response;
+        ClientContext context;
+        return stubs_[shard_id]->Contains(&context, request, &response).ok() && response.exists();
+    }
+
+private:
+    std::map<std::string, std::string> addresses_;
+    std::map<std::string, std::unique_ptr<KeyValueStore::Stub>> stubs_;
+};
+
+// Every key through the router, then where it is stored. A shard that has
+// left the ring keeps its data and is not checked.
+bool Verify(ShardRouter& router, HashRing& ring, Cluster& cluster, int keys) {
+    int wrong = 0;
+    int misplaced = 0;
+    for (int i = 0; i < keys; ++i) {
+        auto value = router.Get(Key(i));
+        if (Deleted(i) ? value.has_value() : value != Value(i)) {
+            if (wrong++ < 5) std::cout << "  " << Key(i) << " reads " << value.value_or("(none)") << std::endl;
+        }
+        if (Expiring(i) && router.TTL(Key(i)) <= 0) {
+            if (wrong++ < 5) std::cout << "  " << Key(i) << " lost its TTL" << std::endl;
+        }
+        if (Deleted(i)) continue;
+
+        const std::string& owner = ring.GetShardForKey(Key(i));
+        for (const ShardInfo& shard : ring.GetAllShards()) {
+            if (cluster.Holds(shard.shard_id, Key(i)) != (shard.shard_id == owner)) misplaced++;
+        }
+    }
+    if (wrong > 0 || misplaced > 0) {
+        std::cout << "✗ " << wrong << " keys read wrong, " << misplaced << " stored on the wrong shard" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool CheckMove(ShardRouter& router, HashRing& ring, Cluster& cluster, int keys, const char* what,
+               const std::function<bool()>& move) {
+    Foreground foreground(router, keys);
+    bool moved = move();
+    int wrong = foreground.Stop();
+
+    MigrationStats stats = router.GetMigrationStats();
+    if (!moved || !stats.complete) {
+        std::cout << "✗ " << what << " did not complete" << std::endl;
+        return false;
+    }
+    if (wrong > 0) {
+        std::cout << "✗ " << wrong << " foreground requests failed or read wrong during the move" << std::endl;
+        return false;
+    }
+    if (!Verify(router, ring, cluster, keys)) {
+        return false;
+    }
+    std::cout << "✓ " << what << ": " << stats.keys_copied << " keys copied (" << stats.keys_skipped
+              << " skipped), " << stats.keys_dropped << " dropped from their old owners in "
+              << stats.copy_seconds << "s, alongside " << foreground.Writes() << " foreground writes" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " <shard-1> <shard-2> <shard-3> [keys]" << std::endl;
+        return 1;
+    }
+    int keys = argc > 4 ? std::stoi(argv[4]) : 5000;
+    Cluster cluster({argv[1], argv[2], argv[3]});
+
+    auto ring = std::make_shared<HashRing>(150);
+    ring->AddShard("shard-1", cluster.Address("shard-1"));
+    ring->AddShard("shard-2", cluster.Address("shard-2"));
+    ShardRouter router(ring);
+
+    for (int i = 0; i < keys; ++i) {
+        if (!router.Set(Key(i), Value(i)) || (Expiring(i) && !router.Expire(Key(i), 600))) {
+            std::cout << "✗ Could not write " << Key(i) << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "✓ Wrote " << keys << " keys to 2 shards" << std::endl;
+
+    // Slow enough that the foreground runs against a migration in progress
+    MigrationOptions options;
+    options.batch_keys = 100;
+    options.max_keys_per_second = keys;
+
+    if (!CheckMove(router, *ring, cluster, keys, "Added shard-3", [&] {
+            return router.AddShard("shard-3", cluster.Address("shard-3"), {}, 1.0, options);
+        })) {
+        return 1;
+    }
+    if (!CheckMove(router, *ring, cluster, keys, "Removed shard-1", [&] {
+            return router.RemoveShard("shard-1", options);
+        })) {
+        return 1;
+    }
+
+    auto stats = router.GetStats();
+    std::cout << "✓ " << stats.migration_reads << " reads answered by an old owner during the moves" << std::endl;
+    return 0;
+}
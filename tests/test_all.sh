@@ -16,8 +16,8 @@ TESTS_FAILED=0
 
 cleanup() {
     pkill -f kvstore_server 2>/dev/null
-    rm -f kvstore.rdb kvstore.aof
-    rm -rf replica1 replica2
+    rm -f kvstore.rdb* kvstore.aof*
+    rm -rf replica1 replica2 node1 node2 node3
     sleep 1
 }
 
@@ -59,8 +59,13 @@ test_shard_router() {
     ../build/test_shard_router
 }
 
+test_persistence_units() {
+    ../build/test_persistence
+}
+
 run_test "Hash Ring" test_hash_ring
 run_test "Shard Router" test_shard_router
+run_test "Persistence" test_persistence_units
 
 # Integration tests (require server)
 echo ""
@@ -100,7 +105,7 @@ test_persistence() {
     ../build/snapshot_test localhost:50051
     
     echo 'Verifying persistence files exist...'
-    if [ ! -f kvstore.rdb ] || [ ! -f kvstore.aof ]; then
+    if [ ! -f kvstore.rdb ] || ! ls kvstore.aof.* >/dev/null 2>&1; then
         echo 'Error: Persistence files not created'
         kill $SERVER_PID 2>/dev/null
         wait $SERVER_PID 2>/dev/null
@@ -126,11 +131,107 @@ test_persistence() {
     return $RESULT
 }
 
+test_delta_snapshots() {
+    echo 'Starting server with a snapshot every second...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 --snapshot-interval 1 &
+    local SERVER_PID=$!
+    sleep 2
+    
+    echo 'Writing a base snapshot, then deltas...'
+    ../build/delta_snapshot_test localhost:50051 write
+    local RESULT=$?
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    sleep 1
+    
+    local DELTAS=$(ls kvstore.rdb.delta.* 2>/dev/null | wc -l)
+    echo "Snapshot files: base + $DELTAS deltas"
+    if [ $RESULT -ne 0 ] || [ ! -f kvstore.rdb ] || [ $DELTAS -lt 2 ]; then
+        echo 'Error: Expected a base snapshot and at least 2 deltas'
+        return 1
+    fi
+    
+    # A delta no newer than the one before it is left over from an older
+    # chain; it must be discarded, not applied over newer data
+    echo 'Planting a stale delta...'
+    cp kvstore.rdb.delta.1 kvstore.rdb.delta.$((DELTAS + 1))
+    
+    echo 'Restarting server...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 --snapshot-interval 1 --max-deltas 2 &
+    SERVER_PID=$!
+    sleep 2
+    
+    ../build/delta_snapshot_test localhost:50051 verify || RESULT=1
+    if [ -f kvstore.rdb.delta.$((DELTAS + 1)) ]; then
+        echo 'Error: Stale delta was not discarded'
+        RESULT=1
+    fi
+    
+    echo 'Overwriting keys until --max-deltas 2 merges the chain...'
+    local BASE_SEQUENCE=$(sed -n 2p kvstore.rdb)
+    ../build/delta_snapshot_test localhost:50051 churn || RESULT=1
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    sleep 1
+    
+    echo "Base: $BASE_SEQUENCE -> $(sed -n 2p kvstore.rdb), $(ls kvstore.rdb.delta.* 2>/dev/null | wc -l) deltas"
+    if [ "$(sed -n 2p kvstore.rdb)" = "$BASE_SEQUENCE" ] || [ -f kvstore.rdb.delta.3 ]; then
+        echo 'Error: Delta chain was not merged into a new base'
+        RESULT=1
+    fi
+    
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    SERVER_PID=$!
+    sleep 2
+    ../build/delta_snapshot_test localhost:50051 verify churned || RESULT=1
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    sleep 1
+    
+    # Without their base, deltas cannot be applied to anything
+    echo 'Orphaning a delta...'
+    mv kvstore.rdb kvstore.rdb.delta.1
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    SERVER_PID=$!
+    sleep 2
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    if [ -f kvstore.rdb.delta.1 ]; then
+        echo 'Error: Orphaned delta was not discarded'
+        RESULT=1
+    fi
+    
+    return $RESULT
+}
+
+test_lazy_load() {
+    echo 'Writing dataset...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    local SERVER_PID=$!
+    sleep 2
+    ../build/lazy_load_test localhost:50051 write 20000
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    sleep 1
+    
+    echo 'Restarting server with --lazy-load...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 --lazy-load &
+    SERVER_PID=$!
+    sleep 1
+    
+    ../build/lazy_load_test localhost:50051 verify 20000
+    local RESULT=$?
+    
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+    return $RESULT
+}
+
 test_replication() {
     mkdir -p replica1 replica2
     
-    echo 'Starting master on port 50051...'
-    ../build/kvstore_server --master --address 0.0.0.0:50051 --replicas localhost:50052,localhost:50053 &
+    echo 'Starting master on port 50051 (metrics on 9100)...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 --metrics-port 9100 &
     local MASTER_PID=$!
     sleep 2
     
@@ -143,14 +244,17 @@ test_replication() {
     
     echo 'Starting replica 2 on port 50053...'
     cd replica2
-    ../../build/kvstore_server --replica --address 0.0.0.0:50053 --master-address localhost:50051 &
+    ../../build/kvstore_server --replica --address 0.0.0.0:50053 --master-address localhost:50051 --apply-threads 2 &
     local REPLICA2_PID=$!
     cd ..
     sleep 2
     
     echo 'Writing to master...'
     ../build/kvstore_client localhost:50051
-    sleep 2
+    
+    echo 'Waiting for both replicas to acknowledge...'
+    ../build/lazy_load_test localhost:50051 wait 2
+    local RESULT0=$?
     
     echo 'Reading from replicas...'
     ../build/read_test localhost:50052
@@ -158,9 +262,119 @@ test_replication() {
     ../build/read_test localhost:50053
     local RESULT2=$?
     
+    echo 'Checking per-replica metrics...'
+    ../build/lazy_load_test localhost:50051 replicas 2 && \
+        [ "$(curl -s localhost:9100/metrics | grep -c '^kvstore_replica_connected{.*} 1$')" -eq 2 ]
+    local RESULT3=$?
+    
+    kill $MASTER_PID $REPLICA1_PID $REPLICA2_PID 2>/dev/null
+    wait $MASTER_PID $REPLICA1_PID $REPLICA2_PID 2>/dev/null
+    rm -rf replica1 replica2 node1 node2 node3
+    
+    if [ $RESULT0 -eq 0 ] && [ $RESULT1 -eq 0 ] && [ $RESULT2 -eq 0 ] && [ $RESULT3 -eq 0 ]; then
+        return 0
+    else
+        return 1
+    fi
+}
+
+test_replica_catch_up() {
+    mkdir -p replica1
+    
+    echo 'Starting master with replica 1 not yet running...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 --replicas localhost:50052 --replica-buffer-mb 1 &
+    local MASTER_PID=$!
+    sleep 2
+    
+    echo 'Writing to master while the replica is down...'
+    ../build/lazy_load_test localhost:50051 write 5000
+    
+    echo 'Starting replica 1 on port 50052...'
+    cd replica1
+    ../../build/kvstore_server --replica --address 0.0.0.0:50052 --master-address localhost:50051 --replication-mode push &
+    local REPLICA1_PID=$!
+    cd ..
+    
+    echo 'Waiting for the replica to acknowledge...'
+    ../build/lazy_load_test localhost:50051 wait 1 && \
+        ../build/lazy_load_test localhost:50052 verify 5000
+    local RESULT=$?
+    
+    kill $MASTER_PID $REPLICA1_PID 2>/dev/null
+    wait $MASTER_PID $REPLICA1_PID 2>/dev/null
+    rm -rf replica1
+    return $RESULT
+}
+
+test_full_resync() {
+    mkdir -p replica1 replica2
+    
+    echo 'Starting master with a 1 MB backlog and 1 s snapshots...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 --replicas localhost:50053 --backlog-mb 1 --snapshot-interval 1 &
+    local MASTER_PID=$!
+    sleep 2
+    
+    echo 'Writing to master, then waiting for the log to be truncated...'
+    ../build/lazy_load_test localhost:50051 write 20000
+    sleep 3
+    
+    echo 'Starting streaming replica 1 and push replica 2...'
+    cd replica1
+    ../../build/kvstore_server --replica --address 0.0.0.0:50052 --master-address localhost:50051 &
+    local REPLICA1_PID=$!
+    cd ../replica2
+    ../../build/kvstore_server --replica --address 0.0.0.0:50053 --master-address localhost:50051 --replication-mode push &
+    local REPLICA2_PID=$!
+    cd ..
+    sleep 5
+    
+    echo 'Reading from replicas...'
+    ../build/lazy_load_test localhost:50052 verify 20000 && \
+        ../build/lazy_load_test localhost:50053 verify 20000
+    local RESULT=$?
+    
+    kill $MASTER_PID $REPLICA1_PID $REPLICA2_PID 2>/dev/null
+    wait $MASTER_PID $REPLICA1_PID $REPLICA2_PID 2>/dev/null
+    rm -rf replica1 replica2 node1 node2 node3
+    return $RESULT
+}
+
+test_cascading_replication() {
+    mkdir -p replica1 replica2
+    
+    echo 'Starting master, replica 1 and replica 2 (streaming from replica 1)...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    local MASTER_PID=$!
+    cd replica1
+    ../../build/kvstore_server --replica --address 0.0.0.0:50052 --master-address localhost:50051 &
+    local REPLICA1_PID=$!
+    cd ../replica2
+    ../../build/kvstore_server --replica --address 0.0.0.0:50053 --master-address localhost:50052 &
+    local REPLICA2_PID=$!
+    cd ..
+    sleep 2
+    
+    echo 'Writing to master...'
+    ../build/lazy_load_test localhost:50051 write 5000
+    sleep 1
+    ../build/lazy_load_test localhost:50053 verify 5000
+    local RESULT1=$?
+    
+    echo 'Writing while replica 2 is down, then restarting it...'
+    kill $REPLICA2_PID 2>/dev/null
+    wait $REPLICA2_PID 2>/dev/null
+    ../build/lazy_load_test localhost:50051 write 8000
+    cd replica2
+    ../../build/kvstore_server --replica --address 0.0.0.0:50053 --master-address localhost:50052 &
+    REPLICA2_PID=$!
+    cd ..
+    sleep 2
+    ../build/lazy_load_test localhost:50053 verify 8000
+    local RESULT2=$?
+    
     kill $MASTER_PID $REPLICA1_PID $REPLICA2_PID 2>/dev/null
     wait $MASTER_PID $REPLICA1_PID $REPLICA2_PID 2>/dev/null
-    rm -rf replica1 replica2
+    rm -rf replica1 replica2 node1 node2 node3
     
     if [ $RESULT1 -eq 0 ] && [ $RESULT2 -eq 0 ]; then
         return 0
@@ -169,6 +383,170 @@ test_replication() {
     fi
 }
 
+test_replica_reads() {
+    mkdir -p replica1
+    
+    echo 'Starting master and replica...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    local MASTER_PID=$!
+    cd replica1
+    ../../build/kvstore_server --replica --address 0.0.0.0:50052 --master-address localhost:50051 &
+    local REPLICA1_PID=$!
+    cd ..
+    sleep 2
+    
+    echo 'Routing reads at each consistency level...'
+    ../build/replica_read_test localhost:50051 localhost:50052
+    local RESULT=$?
+    
+    kill $MASTER_PID $REPLICA1_PID 2>/dev/null
+    wait $MASTER_PID $REPLICA1_PID 2>/dev/null
+    rm -rf replica1
+    return $RESULT
+}
+
+test_async_router() {
+    echo 'Starting master...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    local MASTER_PID=$!
+    sleep 2
+    
+    echo 'Routing asynchronous calls...'
+    ../build/async_router_test localhost:50051 5000
+    local RESULT=$?
+    
+    kill $MASTER_PID 2>/dev/null
+    wait $MASTER_PID 2>/dev/null
+    return $RESULT
+}
+
+test_automatic_failover() {
+    local MEMBERS=127.0.0.1:50051,127.0.0.1:50052,127.0.0.1:50053
+    local PIDS=()
+    start_member() {
+        mkdir -p node$1
+        cd node$1
+        ../../build/kvstore_server --address 127.0.0.1:5005$1 --cluster $MEMBERS &
+        PIDS[$1]=$!
+        cd ..
+    }
+    
+    echo 'Starting a 3-member shard in consensus mode...'
+    start_member 1
+    start_member 2
+    start_member 3
+    local LEADER=$(../build/failover_test $MEMBERS leader)
+    echo "Elected: $LEADER"
+    ../build/failover_test $MEMBERS write before 1000
+    local RESULT1=$?
+    
+    echo "Killing the leader ($LEADER)..."
+    local DEAD=${LEADER: -1}
+    kill -9 ${PIDS[$DEAD]} 2>/dev/null
+    wait ${PIDS[$DEAD]} 2>/dev/null
+    local NEW_LEADER=$(../build/failover_test $MEMBERS leader)
+    echo "Elected: $NEW_LEADER"
+    ../build/failover_test $MEMBERS write after 1000 && \
+        ../build/failover_test $MEMBERS verify before 1000
+    local RESULT2=$?
+    
+    echo 'Restarting the old leader as a follower...'
+    start_member $DEAD
+    ../build/failover_test $MEMBERS check $LEADER after 1000
+    local RESULT3=$?
+    
+    echo "Pausing the new leader ($NEW_LEADER) and resuming it after the next election..."
+    local PAUSED=${NEW_LEADER: -1}
+    kill -STOP ${PIDS[$PAUSED]}
+    ../build/failover_test $MEMBERS leader && \
+        ../build/failover_test $MEMBERS write paused 500
+    local RESULT4=$?
+    kill -CONT ${PIDS[$PAUSED]}
+    ../build/failover_test $MEMBERS check $NEW_LEADER paused 500
+    local RESULT5=$?
+    
+    kill ${PIDS[1]} ${PIDS[2]} ${PIDS[3]} 2>/dev/null
+    wait ${PIDS[1]} ${PIDS[2]} ${PIDS[3]} 2>/dev/null
+    rm -rf node1 node2 node3
+    
+    if [ "$NEW_LEADER" != "$LEADER" ] && [ $RESULT1 -eq 0 ] && [ $RESULT2 -eq 0 ] && \
+       [ $RESULT3 -eq 0 ] && [ $RESULT4 -eq 0 ] && [ $RESULT5 -eq 0 ]; then
+        return 0
+    else
+        return 1
+    fi
+}
+
+test_resharding() {
+    local PIDS=()
+    echo 'Starting 3 standalone shards...'
+    for i in 1 2 3; do
+        mkdir -p node$i
+        cd node$i
+        ../../build/kvstore_server --master --address 0.0.0.0:5005$i &
+        PIDS[$i]=$!
+        cd ..
+    done
+    sleep 2
+    
+    echo 'Adding a shard and removing one under load...'
+    ../build/resharding_test localhost:50051 localhost:50052 localhost:50053 5000
+    local RESULT=$?
+    
+    kill ${PIDS[1]} ${PIDS[2]} ${PIDS[3]} 2>/dev/null
+    wait ${PIDS[1]} ${PIDS[2]} ${PIDS[3]} 2>/dev/null
+    rm -rf node1 node2 node3
+    return $RESULT
+}
+
+test_multi_key() {
+    local PIDS=()
+    echo 'Starting 3 standalone shards...'
+    for i in 1 2 3; do
+        mkdir -p node$i
+        cd node$i
+        ../../build/kvstore_server --master --address 0.0.0.0:5005$i &
+        PIDS[$i]=$!
+        cd ..
+    done
+    sleep 2
+    
+    echo 'Running multi-key operations...'
+    ../build/multi_key_test localhost:50051 localhost:50052 localhost:50053 2500
+    local RESULT=$?
+    
+    kill ${PIDS[1]} ${PIDS[2]} ${PIDS[3]} 2>/dev/null
+    wait ${PIDS[1]} ${PIDS[2]} ${PIDS[3]} 2>/dev/null
+    rm -rf node1 node2 node3
+    return $RESULT
+}
+
+test_shard_health() {
+    mkdir -p replica1 node2
+    
+    echo 'Starting shard 1 (master and replica) and shard 2...'
+    ../build/kvstore_server --master --address 0.0.0.0:50051 &
+    local MASTER_PID=$!
+    cd replica1
+    ../../build/kvstore_server --replica --address 0.0.0.0:50052 --master-address localhost:50051 &
+    local REPLICA1_PID=$!
+    cd ../node2
+    ../../build/kvstore_server --master --address 0.0.0.0:50053 &
+    local SHARD2_PID=$!
+    cd ..
+    sleep 2
+    
+    echo "Pausing shard 1's primary, then resuming it..."
+    ../build/health_test localhost:50051 localhost:50052 localhost:50053 $MASTER_PID
+    local RESULT=$?
+    
+    kill -CONT $MASTER_PID 2>/dev/null
+    kill $MASTER_PID $REPLICA1_PID $SHARD2_PID 2>/dev/null
+    wait $MASTER_PID $REPLICA1_PID $SHARD2_PID 2>/dev/null
+    rm -rf replica1 node2
+    return $RESULT
+}
+
 test_concurrent_clients() {
     ../build/kvstore_server --master --address 0.0.0.0:50051 &
     local SERVER_PID=$!
@@ -190,7 +568,18 @@ test_concurrent_clients() {
 run_test "Basic Operations" test_basic_operations
 run_test "TTL & Expiration" test_ttl_expiration
 run_test "Persistence (RDB + AOF)" test_persistence
+run_test "Delta Snapshots" test_delta_snapshots
+run_test "Lazy Background Load" test_lazy_load
 run_test "Master-Replica Replication" test_replication
+run_test "Replica Catch-Up" test_replica_catch_up
+run_test "Full Resync" test_full_resync
+run_test "Cascading Replication" test_cascading_replication
+run_test "Replica Reads" test_replica_reads
+run_test "Async Router" test_async_router
+run_test "Automatic Failover" test_automatic_failover
+run_test "Online Resharding" test_resharding
+run_test "Multi-Key Operations" test_multi_key
+run_test "Shard Health" test_shard_health
 run_test "Concurrent Clients" test_concurrent_clients
 
 # Summary
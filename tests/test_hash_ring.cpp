@@ -1,10 +1,47 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <unordered_map>
 #include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
 #include "../src/sharding/hash_ring.h"
 
 using namespace kvstore;
 
+// The compiled table against a lower_bound on the ring it came from, at
+// every virtual node, either side of each, and random hashes
+bool CheckRoutingTable(int ring_size, std::mt19937& rng) {
+    std::map<uint32_t, std::string> ring;
+    while (static_cast<int>(ring.size()) < ring_size) {
+        ring[rng()] = "shard-" + std::to_string(ring.size() % 7);
+    }
+    RoutingTable table(ring);
+    
+    std::vector<uint32_t> hashes = {0, UINT32_MAX};
+    for (const auto& [hash, shard_id] : ring) {
+        hashes.push_back(hash);
+        hashes.push_back(hash - 1);
+        hashes.push_back(hash + 1);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        hashes.push_back(rng());
+    }
+    
+    for (uint32_t hash : hashes) {
+        auto it = ring.lower_bound(hash);
+        const std::string& expected = it == ring.end() ? ring.begin()->second : it->second;
+        if (table.ShardId(table.Lookup(hash)) != expected) {
+            std::cout << "  ✗ Ring of " << ring_size << ": hash " << hash << " -> "
+                      << table.ShardId(table.Lookup(hash)) << ", expected " << expected << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 void PrintDistribution(const HashRing& ring, int num_keys) {
     std::unordered_map<std::string, int> distribution;
     
@@ -35,6 +72,267 @@ void PrintDistribution(const HashRing& ring, int num_keys) {
     std::cout << "----------------------------------------" << std::endl;
 }
 
+// A strategy places every key on a shard of the ring; adding a shard only
+// moves keys onto it (bounded-load may shuffle a few more, within its
+// bound); and no shard gets more than `max_share` times the mean
+bool CheckStrategy(std::shared_ptr<const PlacementStrategy> strategy, double max_share) {
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    HashRing ring(150, strategy);
+    for (int i = 1; i <= 5; ++i) {
+        ring.AddShard("shard-" + std::to_string(i), "localhost:" + std::to_string(50050 + i));
+    }
+    std::vector<std::string> before;
+    std::unordered_map<std::string, int> load;
+    for (int i = 0; i < 50000; ++i) {
+        before.push_back(ring.GetShardForKey("key_" + std::to_string(i)));
+        load[before.back()]++;
+    }
+    ring.AddShard("shard-6", "localhost:50056");
+    std::cout.rdbuf(out);
+    
+    if (load.size() != 5) {
+        std::cout << "  ✗ " << strategy->Name() << ": keys on " << load.size() << " of 5 shards" << std::endl;
+        return false;
+    }
+    for (const auto& [shard_id, count] : load) {
+        if (count > max_share * 50000 / 5) {
+            std::cout << "  ✗ " << strategy->Name() << ": " << shard_id << " has " << count << " keys" << std::endl;
+            return false;
+        }
+    }
+    bool only_to_new = std::string(strategy->Name()).rfind("bounded-load", 0) != 0;
+    for (int i = 0; i < 50000; ++i) {
+        const std::string& after = ring.GetShardForKey("key_" + std::to_string(i));
+        if (only_to_new && after != before[i] && after != "shard-6") {
+            std::cout << "  ✗ " << strategy->Name() << ": key_" << i << " moved from " << before[i]
+                      << " to " << after << std::endl;
+            return false;
+        }
+    }
+    std::cout << "  " << strategy->Name() << ": keys on every shard, none over "
+              << max_share << "x the mean" << std::endl;
+    return true;
+}
+
+// Shares follow weights, and a weight change only moves keys onto the
+// reweighted shard (raised) or off it (lowered)
+bool CheckWeights(std::shared_ptr<const PlacementStrategy> strategy, double tolerance) {
+    const int keys = 50000;
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    HashRing ring(150, strategy);
+    ring.AddShard("shard-1", "localhost:50051", {}, 1.0);
+    ring.AddShard("shard-2", "localhost:50052", {}, 1.0);
+    ring.AddShard("shard-3", "localhost:50053", {}, 2.0);
+    bool rejected = !ring.SetWeight("shard-1", 0) && !ring.AddShard("shard-4", "localhost:50054", {}, -1);
+    
+    auto assign = [&] {
+        std::vector<std::string> owners;
+        for (int i = 0; i < keys; ++i) {
+            owners.push_back(ring.GetShardForKey("key_" + std::to_string(i)));
+        }
+        return owners;
+    };
+    std::vector<std::string> before = assign();
+    ring.SetWeight("shard-1", 2.0);
+    std::vector<std::string> raised = assign();
+    ring.SetWeight("shard-1", 0.5);
+    std::vector<std::string> lowered = assign();
+    std::cout.rdbuf(out);
+    
+    std::string name = strategy->Name();
+    if (!rejected) {
+        std::cout << "  ✗ " << name << ": a non-positive weight was accepted" << std::endl;
+        return false;
+    }
+    if (ring.GetShard("shard-3")->virtual_nodes != 300 || ring.GetShard("shard-1")->virtual_nodes != 75) {
+        std::cout << "  ✗ " << name << ": virtual nodes not in proportion to weight" << std::endl;
+        return false;
+    }
+    double share = static_cast<double>(std::count(before.begin(), before.end(), "shard-3")) / keys;
+    if (std::abs(share - 0.5) > tolerance) {
+        std::cout << "  ✗ " << name << ": weight 2 of 4 owns " << share << " of keys" << std::endl;
+        return false;
+    }
+    for (int i = 0; i < keys; ++i) {
+        if ((raised[i] != before[i] && raised[i] != "shard-1") ||
+            (lowered[i] != raised[i] && raised[i] != "shard-1")) {
+            std::cout << "  ✗ " << name << ": key_" << i << " moved between other shards" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "  " << name << ": shares follow weights, reweighting moves only that shard's keys" << std::endl;
+    return true;
+}
+
+// Every key whose owner differs between a ring and a changed clone lies in
+// a moved range, with that range's old and new owners, and no other does.
+// With hash tags, keys lie at their tag's hash.
+bool CheckMovedRanges(std::shared_ptr<const PlacementStrategy> strategy, bool hash_tags = false) {
+    const int keys = 50000;
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    HashRing ring(150, strategy, hash_tags);
+    ring.AddShard("shard-1", "localhost:50051");
+    ring.AddShard("shard-2", "localhost:50052");
+    ring.AddShard("shard-3", "localhost:50053");
+    auto grown = ring.Clone();
+    grown->AddShard("shard-4", "localhost:50054");
+    auto shrunk = ring.Clone();
+    shrunk->RemoveShard("shard-2");
+    std::cout.rdbuf(out);
+    
+    std::string name = strategy->Name();
+    if (ring.GetAllShards().size() != 3) {
+        std::cout << "  ✗ " << name << ": changing a clone changed the ring" << std::endl;
+        return false;
+    }
+    for (const HashRing* target : {grown.get(), shrunk.get()}) {
+        std::vector<HashRing::MovedRange> ranges;
+        if (!ring.MovedRanges(*target, &ranges)) {
+            std::cout << "  ✗ " << name << ": no moved ranges" << std::endl;
+            return false;
+        }
+        for (int i = 0; i < keys; ++i) {
+            std::string key = hash_tags ? "key_{" + std::to_string(i / 3) + "}_" + std::to_string(i)
+                                        : "key_" + std::to_string(i);
+            uint32_t hash = RingHash(ring.PlacementKey(key), ring.GetStrategy().HashVersion());
+            const HashRing::MovedRange* found = nullptr;
+            for (const auto& range : ranges) {
+                bool inside = range.start < range.end ? hash > range.start && hash <= range.end
+                                                      : hash > range.start || hash <= range.end;
+                if (inside) found = &range;
+            }
+            const std::string& from = ring.GetShardForKey(key);
+            const std::string& to = target->GetShardForKey(key);
+            bool right = found ? found->from == from && found->to == to : from == to;
+            if (!right) {
+                std::cout << "  ✗ " << name << ": " << key << " (" << from << " -> " << to
+                          << ") is not covered by its moved range" << std::endl;
+                return false;
+            }
+        }
+    }
+    std::cout << "  " << name << (hash_tags ? " (hash tags)" : "")
+              << ": moved ranges cover exactly the keys that change owner" << std::endl;
+    return true;
+}
+
+// Tag parsing, and keys sharing a tag on one shard under each strategy
+bool CheckHashTags(std::shared_ptr<const PlacementStrategy> strategy) {
+    const std::pair<const char*, const char*> cases[] = {
+        {"user:{42}:profile", "42"}, {"{42}", "42"}, {"user:42", "user:42"}, {"{}x", "{}x"},
+        {"x{", "x{"}, {"x}y{", "x}y{"}, {"{a}{b}", "a"}, {"a{b{c}d", "b{c"}, {"x{}{y}", "x{}{y}"}};
+    for (const auto& [key, tag] : cases) {
+        if (HashTag(key) != tag) {
+            std::cout << "  ✗ HashTag(\"" << key << "\") is \"" << HashTag(key) << "\", not \"" << tag << "\""
+                      << std::endl;
+            return false;
+        }
+    }
+    
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    HashRing tagged(150, strategy, true);
+    HashRing plain(150, strategy);
+    for (HashRing* ring : {&tagged, &plain}) {
+        for (int s = 1; s <= 4; ++s) {
+            ring->AddShard("shard-" + std::to_string(s), "localhost:5005" + std::to_string(s));
+        }
+    }
+    auto clone = tagged.Clone();
+    std::cout.rdbuf(out);
+    
+    std::string name = strategy->Name();
+    const int groups = 5000;
+    int split = 0;
+    std::unordered_map<std::string, int> per_shard;
+    for (int i = 0; i < groups; ++i) {
+        std::string tag = "{" + std::to_string(i) + "}";
+        const std::string& owner = tagged.GetShardForKey("user:" + tag + ":profile");
+        for (const char* suffix : {":cart", ":orders"}) {
+            std::string key = "user:" + tag + suffix;
+            if (tagged.GetShardForKey(key) != owner || clone->GetShardForKey(key) != owner) {
+                std::cout << "  ✗ " << name << ": " << key << " is not with the rest of its tag" << std::endl;
+                return false;
+            }
+        }
+        if (plain.GetShardForKey("user:" + tag + ":profile") != plain.GetShardForKey("user:" + tag + ":cart")) {
+            split++;
+        }
+        per_shard[owner]++;
+    }
+    // Tags still spread evenly, and without them the same keys split up
+    for (const auto& [shard_id, count] : per_shard) {
+        if (count > groups / 4 * 1.3) {
+            std::cout << "  ✗ " << name << ": " << shard_id << " has " << count << " of " << groups << " tags"
+                      << std::endl;
+            return false;
+        }
+    }
+    if (split == 0) {
+        std::cout << "  ✗ " << name << ": keys without hash tags never split" << std::endl;
+        return false;
+    }
+    std::cout << "  " << name << ": keys sharing a tag share a shard (" << split << " of " << groups
+              << " groups split without tags)" << std::endl;
+    return true;
+}
+
+// Lookups on several threads while another keeps changing the ring, so
+// placements are replaced (and freed) under them. Every owner read must
+// be a shard the ring has had, and stay readable after the changes.
+bool CheckConcurrentChanges(std::shared_ptr<const PlacementStrategy> strategy) {
+    std::ostringstream discard;
+    std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+    HashRing ring(150, strategy);
+    for (int s = 1; s <= 3; ++s) {
+        ring.AddShard("shard-" + std::to_string(s), "localhost:5005" + std::to_string(s));
+    }
+    
+    std::atomic<bool> done{false};
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> readers;
+    std::vector<const std::string*> first(4);
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t] {
+            first[t] = &ring.GetShardForKey("first:" + std::to_string(t));
+            for (int i = 0; !done; ++i) {
+                const std::string& owner = ring.GetShardForKey("key_" + std::to_string(i % 10000));
+                if (owner.compare(0, 6, "shard-") != 0) {
+                    wrong++;
+                }
+            }
+        });
+    }
+    for (int change = 0; change < 200; ++change) {
+        ring.SetWeight("shard-1", change % 2 == 0 ? 2.0 : 1.0);
+        if (change % 20 == 0) {
+            ring.RemoveShard("shard-3");
+            ring.AddShard("shard-3", "localhost:50053");
+        }
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    std::cout.rdbuf(out);
+    
+    std::string name = strategy->Name();
+    for (const std::string* owner : first) {
+        if (owner->compare(0, 6, "shard-") != 0) {
+            wrong++;
+        }
+    }
+    if (wrong > 0) {
+        std::cout << "  ✗ " << name << ": " << wrong << " lookups read a wrong owner during changes" << std::endl;
+        return false;
+    }
+    std::cout << "  " << name << ": lookups stayed valid through 200 changes" << std::endl;
+    return true;
+}
+
 int main() {
     std::cout << "==================================" << std::endl;
     std::cout << "Hash Ring Test" << std::endl;
@@ -85,6 +383,77 @@ int main() {
                   << (shard.is_available ? " (available)" : " (unavailable)") << std::endl;
     }
     
+    std::cout << "\n[Test 7] Checking the compiled routing table..." << std::endl;
+    std::mt19937 rng(42);
+    for (int ring_size : {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 100, 450, 1500}) {
+        if (!CheckRoutingTable(ring_size, rng)) {
+            return 1;
+        }
+    }
+    std::cout << "  Lookups match the ring for every size" << std::endl;
+    
+    std::cout << "\n[Test 8] Checking placement strategies..." << std::endl;
+    if (!CheckStrategy(std::make_shared<RingStrategy>(), 2.0) ||
+        !CheckStrategy(std::make_shared<RingStrategy>(RingHashVersion::FNV1A_FINALIZED), 1.3) ||
+        !CheckStrategy(std::make_shared<JumpHashStrategy>(), 1.05) ||
+        !CheckStrategy(std::make_shared<RendezvousStrategy>(), 1.05) ||
+        !CheckStrategy(std::make_shared<BoundedLoadStrategy>(), 1.3) ||
+        !CheckStrategy(std::make_shared<BoundedLoadStrategy>(0.1, RingHashVersion::FNV1A_FINALIZED), 1.15)) {
+        return 1;
+    }
+    // Rings keep placing keys by plain FNV-1a unless told otherwise
+    if (RingHash("hello") != 0x4f9f2cabu || HashRing().GetStrategy().HashVersion() != RingHashVersion::FNV1A ||
+        RingHash("hello", RingHashVersion::FNV1A_FINALIZED) == 0x4f9f2cabu) {
+        std::cout << "  ✗ The default ring hash is not FNV-1a" << std::endl;
+        return 1;
+    }
+    std::cout << "  The default ring hash is FNV-1a" << std::endl;
+    
+    std::cout << "\n[Test 9] Checking weighted shards..." << std::endl;
+    if (!CheckWeights(std::make_shared<RingStrategy>(RingHashVersion::FNV1A_FINALIZED), 0.05) ||
+        !CheckWeights(std::make_shared<RendezvousStrategy>(), 0.02)) {
+        return 1;
+    }
+    
+    std::cout << "\n[Test 10] Checking moved ranges..." << std::endl;
+    if (!CheckMovedRanges(std::make_shared<RingStrategy>()) ||
+        !CheckMovedRanges(std::make_shared<RingStrategy>(RingHashVersion::FNV1A_FINALIZED)) ||
+        !CheckMovedRanges(std::make_shared<BoundedLoadStrategy>(0.1))) {
+        return 1;
+    }
+    {
+        std::ostringstream discard;
+        std::streambuf* out = std::cout.rdbuf(discard.rdbuf());
+        HashRing jump(150, std::make_shared<JumpHashStrategy>());
+        jump.AddShard("shard-1", "localhost:50051");
+        auto target = jump.Clone();
+        target->AddShard("shard-2", "localhost:50052");
+        std::vector<HashRing::MovedRange> ranges;
+        bool found = jump.MovedRanges(*target, &ranges);
+        std::cout.rdbuf(out);
+        if (found) {
+            std::cout << "  ✗ jump: reported ranges for a placement without a ring" << std::endl;
+            return 1;
+        }
+        std::cout << "  jump: no ranges, every shard is scanned instead" << std::endl;
+    }
+    
+    std::cout << "\n[Test 11] Checking hash tags..." << std::endl;
+    if (!CheckHashTags(std::make_shared<RingStrategy>(RingHashVersion::FNV1A_FINALIZED)) ||
+        !CheckHashTags(std::make_shared<JumpHashStrategy>()) ||
+        !CheckHashTags(std::make_shared<RendezvousStrategy>()) ||
+        !CheckHashTags(std::make_shared<BoundedLoadStrategy>(0.1, RingHashVersion::FNV1A_FINALIZED)) ||
+        !CheckMovedRanges(std::make_shared<RingStrategy>(), true)) {
+        return 1;
+    }
+    
+    std::cout << "\n[Test 12] Checking lookups during changes..." << std::endl;
+    if (!CheckConcurrentChanges(std::make_shared<RingStrategy>()) ||
+        !CheckConcurrentChanges(std::make_shared<JumpHashStrategy>()) ||
+        !CheckConcurrentChanges(std::make_shared<RendezvousStrategy>())) {
+        return 1;
+    }
+    
     std::cout << "\n==================================" << std::endl;
     std::cout << "All tests completed!" << std::endl;
     std::cout << "==================================" << std::endl;
@@ -0,0 +1,579 @@
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../src/persistence/file_writer.h"
+#include "../src/persistence/wal.h"
+#include "../src/storage/storage.h"
+
+using namespace kvstore;
+
+namespace {
+
+// A fresh directory per check, so files left by one cannot satisfy another
+std::string MakeDirectory() {
+    char path[] = "/tmp/kvstore_test_XXXXXX";
+    if (!mkdtemp(path)) {
+        std::perror("mkdtemp");
+        std::exit(1);
+    }
+    return path;
+}
+
+void RemoveDirectory(const std::string& dir) {
+    std::system(("rm -rf '" + dir + "'").c_str());
+}
+
+std::string SegmentPath(const std::string& aof, int64_t first_sequence) {
+    std::ostringstream oss;
+    oss << aof << "." << std::setw(20) << std::setfill('0') << first_sequence;
+    return oss.str();
+}
+
+// The segment a write at `sequence` starts fails every write: it is /dev/full
+void FailSegment(const std::string& aof, int64_t sequence) {
+    if (symlink("/dev/full", SegmentPath(aof, sequence).c_str()) != 0) {
+        std::perror("symlink");
+        std::exit(1);
+    }
+}
+
+bool FileExists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+off_t FileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+ReplicationCommand MakeSet(const std::string& key, const std::string& value) {
+    ReplicationCommand command;
+    command.set_type(ReplicationCommand::SET);
+    command.set_key(key);
+    command.set_value(value);
+    return command;
+}
+
+// Every record after `after`; `complete` gets Read()'s result
+std::vector<ReplicationCommand> ReadAll(WriteAheadLog& wal, int64_t after, bool* complete = nullptr) {
+    std::vector<ReplicationCommand> commands;
+    bool ok = wal.Read(after, [&](const ReplicationCommand& command) {
+        commands.push_back(command);
+        return true;
+    });
+    if (complete) *complete = ok;
+    return commands;
+}
+
+StorageOptions RollEveryRecord() {
+    StorageOptions options;
+    options.wal_segment_bytes = 1;
+    options.replica_apply_threads = 0;
+    return options;
+}
+
+bool Expect(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cout << "  ✗ " << what << std::endl;
+    }
+    return condition;
+}
+
+} // namespace
+
+// A write the log cannot take is undone before any reader can see it
+bool CheckUnloggedWrites() {
+    std::string dir = MakeDirectory();
+    std::string aof = dir + "/kvstore.aof";
+    bool ok = true;
+
+    {
+        Storage storage("", aof, RollEveryRecord());
+        storage.Set("key", "logged");
+        FailSegment(aof, 2);
+        storage.Set("key", "unlogged");
+        storage.Set("other", "unlogged");
+        ok &= Expect(storage.LogFailed(), "Set: the log did not fail");
+        ok &= Expect(storage.Get("key") == std::optional<std::string>("logged"), "Set: an unlogged overwrite is visible");
+        ok &= Expect(!storage.Contains("other"), "Set: an unlogged key is visible");
+    }
+    RemoveDirectory(dir);
+
+    dir = MakeDirectory();
+    aof = dir + "/kvstore.aof";
+    {
+        Storage storage("", aof, RollEveryRecord());
+        storage.Set("key", "value");
+        storage.Expire("key", 100);
+        FailSegment(aof, 3);
+        ok &= Expect(!storage.Delete("key"), "Delete: reported an unlogged delete");
+        ok &= Expect(storage.Get("key") == std::optional<std::string>("value"), "Delete: an unlogged delete is visible");
+        ok &= Expect(storage.TTL("key") > 0, "Delete: the key lost its TTL");
+    }
+    RemoveDirectory(dir);
+
+    // The batch is logged up to the failed record; what follows is undone,
+    // including a second write to the same key
+    dir = MakeDirectory();
+    aof = dir + "/kvstore.aof";
+    {
+        Storage storage("", aof, RollEveryRecord());
+        storage.Set("key", "first");
+        FailSegment(aof, 3);
+        storage.MultiSet({{"key", "second"}, {"other", "value"}, {"key", "third"}});
+        ok &= Expect(storage.Get("key") == std::optional<std::string>("second"), "MultiSet: the logged part was lost or the rest is visible");
+        ok &= Expect(!storage.Contains("other"), "MultiSet: an unlogged key is visible");
+
+        std::vector<bool> found;
+        storage.MultiDelete({"key"}, &found);
+        ok &= Expect(found.size() == 1 && !found[0], "MultiDelete: reported an unlogged delete");
+        ok &= Expect(storage.Contains("key"), "MultiDelete: an unlogged delete is visible");
+    }
+    RemoveDirectory(dir);
+
+    dir = MakeDirectory();
+    aof = dir + "/kvstore.aof";
+    {
+        Storage storage("", aof, RollEveryRecord());
+        FailSegment(aof, 1);
+        ok &= Expect(!storage.Import({"key", std::string("copied"), 60}), "Import: reported an unlogged copy");
+        ok &= Expect(!storage.Contains("key"), "Import: an unlogged copy is visible");
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Writes the log refused are not visible" << std::endl;
+    }
+    return ok;
+}
+
+// A record cut off part way (a crash mid-write) or failing its checksum
+// ends the log: Open() drops it, and appends carry on from the record before
+bool CheckTornTail() {
+    std::string dir = MakeDirectory();
+    std::string aof = dir + "/kvstore.aof";
+    std::string segment = SegmentPath(aof, 1);
+    bool ok = true;
+
+    {
+        WriteAheadLog wal(aof);
+        wal.Open();
+        for (int i = 1; i <= 3; ++i) {
+            ReplicationCommand command = MakeSet("key" + std::to_string(i), "value");
+            wal.Append(command);
+        }
+    }
+    // The records are the same size
+    off_t intact = FileSize(segment) / 3 * 2;
+    if (truncate(segment.c_str(), FileSize(segment) - 3) != 0) {
+        std::perror("truncate");
+        std::exit(1);
+    }
+
+    {
+        WriteAheadLog wal(aof);
+        ok &= Expect(wal.Open(), "Torn: Open failed");
+        ok &= Expect(wal.LastSequence() == 2, "Torn: the torn record's sequence was recovered");
+        ok &= Expect(FileSize(segment) == intact, "Torn: the torn record was not cut off");
+        ReplicationCommand command = MakeSet("key3", "rewritten");
+        ok &= Expect(wal.Append(command) == 3, "Torn: the next append did not reuse the torn record's sequence");
+    }
+    {
+        WriteAheadLog wal(aof);
+        wal.Open();
+        auto commands = ReadAll(wal, 0);
+        ok &= Expect(commands.size() == 3 && commands[2].value() == "rewritten",
+                     "Torn: the record appended after recovery was lost");
+    }
+
+    // Flip the last byte: the record is whole, but fails its checksum
+    {
+        std::fstream file(segment, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekg(-1, std::ios::end);
+        char last = static_cast<char>(file.get());
+        file.seekp(-1, std::ios::end);
+        file.put(static_cast<char>(last ^ 0xFF));
+    }
+    {
+        WriteAheadLog wal(aof);
+        wal.Open();
+        ok &= Expect(wal.LastSequence() == 2, "CRC: a corrupt record's sequence was recovered");
+        ok &= Expect(ReadAll(wal, 0).size() == 2, "CRC: a corrupt record was replayed");
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Torn and corrupt records are cut off the tail" << std::endl;
+    }
+    return ok;
+}
+
+// Segments are named after their first sequence; Truncate() deletes those a
+// snapshot covers, except after a retained position
+bool CheckSegments() {
+    std::string dir = MakeDirectory();
+    std::string aof = dir + "/kvstore.aof";
+    bool ok = true;
+
+    {
+        WriteAheadLog wal(aof, IOBackend::STREAM, false, 1);
+        wal.Open();
+        for (int i = 1; i <= 5; ++i) {
+            ReplicationCommand command = MakeSet("key" + std::to_string(i), "value");
+            wal.Append(command);
+            ok &= Expect(FileExists(SegmentPath(aof, i)), "Rollover: record " + std::to_string(i) + " did not start a segment");
+        }
+
+        wal.Truncate(3);
+        ok &= Expect(!FileExists(SegmentPath(aof, 3)) && FileExists(SegmentPath(aof, 4)),
+                     "Truncate: removed the wrong segments");
+        bool complete = false;
+        auto commands = ReadAll(wal, 3, &complete);
+        ok &= Expect(complete && commands.size() == 2 && commands[0].sequence_id() == 4,
+                     "Truncate: the records after the snapshot were not kept");
+        ReadAll(wal, 1, &complete);
+        ok &= Expect(!complete, "Truncate: reading from a truncated position reported success");
+
+        wal.Retain(4);
+        wal.Truncate(5);
+        ok &= Expect(FileExists(SegmentPath(aof, 5)), "Retain: a retained record was truncated");
+        wal.Release(4);
+
+        // The segment being appended to is rolled over so it can go too
+        wal.Truncate(5);
+        ok &= Expect(!FileExists(SegmentPath(aof, 5)) && FileSize(SegmentPath(aof, 6)) == 0,
+                     "Truncate: a fully covered log was not emptied");
+    }
+
+    // With every record gone, the next sequence comes from the empty segment's name
+    {
+        WriteAheadLog wal(aof, IOBackend::STREAM, false, 1);
+        wal.Open();
+        ok &= Expect(wal.LastSequence() == 5, "Truncate: the sequence was not recovered after a restart");
+        ReplicationCommand command = MakeSet("key6", "value");
+        ok &= Expect(wal.Append(command) == 6, "Truncate: a sequence was reused after a restart");
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Segments roll over, truncate and keep their sequences" << std::endl;
+    }
+    return ok;
+}
+
+// A text AOF from before the log is converted into a segment, keeping the
+// sequences it has
+bool CheckLegacyAof() {
+    bool ok = true;
+
+    for (int64_t snapshot_sequence : {0, 4}) {
+        std::string dir = MakeDirectory();
+        std::string aof = dir + "/kvstore.aof";
+        {
+            std::ofstream legacy(aof);
+            legacy << "SET a 1\n"
+                   << "5 SET b two\\nlines\n"
+                   << "6 DELETE a\n"
+                   << "7 EXPIRE b 100\n";
+        }
+
+        WriteAheadLog wal(aof);
+        ok &= Expect(wal.Open(snapshot_sequence), "Legacy: Open failed");
+        ok &= Expect(!FileExists(aof), "Legacy: the text AOF was kept");
+        ok &= Expect(wal.LastSequence() == 7, "Legacy: the last sequence was not recovered");
+
+        auto commands = ReadAll(wal, snapshot_sequence);
+        // A snapshot with a sequence was taken after every unsequenced line
+        size_t first = snapshot_sequence > 0 ? 0 : 1;
+        ok &= Expect(commands.size() == first + 3, "Legacy: wrong number of commands converted");
+        if (commands.size() == first + 3) {
+            if (first == 1) {
+                ok &= Expect(commands[0].sequence_id() == 1 && commands[0].value() == "1",
+                             "Legacy: an unsequenced SET was not given the next sequence");
+            }
+            ok &= Expect(commands[first].sequence_id() == 5 && commands[first].value() == "two\nlines",
+                         "Legacy: SET lost its sequence or escaped newline");
+            ok &= Expect(commands[first + 1].type() == ReplicationCommand::DELETE && commands[first + 1].key() == "a",
+                         "Legacy: DELETE was not converted");
+            ok &= Expect(commands[first + 2].type() == ReplicationCommand::EXPIRE && commands[first + 2].seconds() == 100,
+                         "Legacy: EXPIRE was not converted");
+        }
+        RemoveDirectory(dir);
+    }
+
+    if (ok) {
+        std::cout << "  A text AOF is converted, dropping lines a snapshot covers" << std::endl;
+    }
+    return ok;
+}
+
+// A restarted store recovers its data and sequence from the log, and
+// sequences new writes after it
+bool CheckRestart() {
+    std::string dir = MakeDirectory();
+    std::string aof = dir + "/kvstore.aof";
+    bool ok = true;
+
+    int64_t last = 0;
+    {
+        Storage storage("", aof, RollEveryRecord());
+        storage.Set("a", "1");
+        storage.Set("b", "2");
+        storage.Expire("b", 100);
+        storage.Delete("a", &last);
+    }
+    for (int restart = 1; restart <= 2; ++restart) {
+        Storage storage("", aof, RollEveryRecord());
+        ok &= Expect(!storage.Contains("a") && storage.Get("b") == std::optional<std::string>("2") && storage.TTL("b") > 0,
+                     "Restart: the data was not recovered");
+        ok &= Expect(storage.LastSequence() == last, "Restart: the sequence was not recovered");
+
+        int64_t sequence = 0;
+        storage.Set("c" + std::to_string(restart), "3", &sequence);
+        ok &= Expect(sequence == last + 1, "Restart: a write after the restart did not follow on");
+        last = sequence;
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Sequences continue across restarts" << std::endl;
+    }
+    return ok;
+}
+
+// Recovery replays only the log records after the snapshot's sequence; one
+// the snapshot covers would undo a later write it holds
+bool CheckSnapshotTail() {
+    std::string dir = MakeDirectory();
+    std::string rdb = dir + "/kvstore.rdb";
+    std::string aof = dir + "/kvstore.aof";
+    bool ok = true;
+
+    {
+        Storage storage(rdb, aof, RollEveryRecord());
+        storage.Set("a", "old");
+        std::system(("cp '" + SegmentPath(aof, 1) + "' '" + dir + "/covered'").c_str());
+        storage.Set("a", "new");
+        storage.Set("b", "1");
+        storage.Expire("b", 100);
+        storage.SaveSnapshot();
+        ok &= Expect(!FileExists(SegmentPath(aof, 1)), "Tail: the snapshot did not truncate the log");
+
+        // Put a covered segment back, as if the truncation had not got to it
+        std::rename((dir + "/covered").c_str(), SegmentPath(aof, 1).c_str());
+        storage.Set("c", "tail");
+        storage.Delete("b");
+    }
+    {
+        Storage storage(rdb, aof, RollEveryRecord());
+        ok &= Expect(storage.Get("a") == std::optional<std::string>("new"), "Tail: a record the snapshot covers was replayed");
+        ok &= Expect(!storage.Contains("b"), "Tail: a delete after the snapshot was not replayed");
+        ok &= Expect(storage.Get("c") == std::optional<std::string>("tail"), "Tail: a write after the snapshot was not replayed");
+        ok &= Expect(storage.LastSequence() == 6, "Tail: the sequence was not recovered");
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Only the log after the snapshot is replayed" << std::endl;
+    }
+    return ok;
+}
+
+// Every backend writes exactly what was appended, across buffer wraps,
+// flushes, syncs and a reopen, and reports a write that lands short
+bool CheckFileWriters() {
+    struct Backend {
+        const char* name;
+        IOBackend backend;
+        bool direct_io;
+    };
+    const Backend backends[] = {
+        {"stream", IOBackend::STREAM, false},
+        {"pwrite", IOBackend::PWRITE, false},
+        {"io_uring", IOBackend::IO_URING, false},
+        {"io_uring (direct I/O)", IOBackend::IO_URING, true},
+    };
+    // Odd sizes, block-sized ones and ones larger than an io_uring buffer
+    const size_t sizes[] = {1, 100, 4095, 4096, 4097, 70000, 300000};
+
+    std::string dir = MakeDirectory();
+    std::string path = dir + "/file";
+    bool ok = true;
+
+    for (const Backend& backend : backends) {
+        std::string expected;
+        auto append = [&](FileWriter& writer, size_t size) {
+            std::string chunk(size, '\0');
+            for (char& c : chunk) {
+                c = static_cast<char>((expected.size() + (&c - &chunk[0])) * 131 % 251);
+            }
+            expected += chunk;
+            return writer.Append(chunk);
+        };
+
+        // Over 2 MB in each pass, so io_uring's buffers are reused
+        bool written = true;
+        for (bool reopen : {false, true}) {
+            auto writer = CreateFileWriter(backend.backend, backend.direct_io);
+            written &= writer->Open(path, reopen);
+            for (int round = 0; round < 4; ++round) {
+                for (size_t size : sizes) {
+                    written &= append(*writer, size) && writer->Flush();
+                }
+                written &= writer->Sync();
+            }
+            writer->Close();
+        }
+
+        std::ifstream in(path, std::ios::binary);
+        std::string actual((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        ok &= Expect(written, std::string(backend.name) + ": a write failed");
+        ok &= Expect(actual == expected, std::string(backend.name) + ": the file does not hold what was appended");
+
+        // A write crossing the file size limit is cut short by the kernel
+        struct rlimit limit;
+        getrlimit(RLIMIT_FSIZE, &limit);
+        struct rlimit small = limit;
+        small.rlim_cur = 10000;
+        std::signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &small);
+        {
+            auto writer = CreateFileWriter(backend.backend, backend.direct_io);
+            writer->Open(path, false);
+            // As the log syncs: outside the writer where it can, so no
+            // linked fsync is there to fail in the write's place
+            bool appended = writer->Append(std::string(20000, 'x'));
+            int fd = writer->PrepareSync();
+            bool synced = appended && (fd >= 0 ? fdatasync(fd) == 0 : writer->Sync());
+            ok &= Expect(!synced, std::string(backend.name) + ": a short write was reported as written");
+            writer->Close();
+        }
+        setrlimit(RLIMIT_FSIZE, &limit);
+        std::signal(SIGXFSZ, SIG_DFL);
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Every backend writes what was appended and reports short writes" << std::endl;
+    }
+    return ok;
+}
+
+// A read that cannot deliver every record it should (one is corrupt, or a
+// segment has gone) reports the log incomplete; so does a truncation whose
+// rollover fails, which keeps every segment
+bool CheckIncompleteReads() {
+    bool ok = true;
+
+    for (const char* damage : {"corrupt", "missing", "missing tail"}) {
+        std::string dir = MakeDirectory();
+        std::string aof = dir + "/kvstore.aof";
+        WriteAheadLog wal(aof, IOBackend::STREAM, false, 1);
+        wal.Open();
+        for (int i = 1; i <= 4; ++i) {
+            ReplicationCommand command = MakeSet("key" + std::to_string(i), "value");
+            wal.Append(command);
+        }
+
+        std::string what = damage;
+        if (what == "corrupt") {
+            std::fstream file(SegmentPath(aof, 2), std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(-1, std::ios::end);
+            file.put('\xFF');
+        } else {
+            std::remove(SegmentPath(aof, what == "missing" ? 2 : 4).c_str());
+        }
+
+        bool complete = true;
+        auto commands = ReadAll(wal, 0, &complete);
+        ok &= Expect(!complete, "Read: a " + what + " segment was reported as a complete log");
+        ok &= Expect(!commands.empty() && commands[0].sequence_id() == 1,
+                     "Read: the records before a " + what + " segment were not delivered");
+        RemoveDirectory(dir);
+    }
+
+    std::string dir = MakeDirectory();
+    std::string aof = dir + "/kvstore.aof";
+    {
+        WriteAheadLog wal(aof);
+        wal.Open();
+        for (int i = 1; i <= 2; ++i) {
+            ReplicationCommand command = MakeSet("key" + std::to_string(i), "value");
+            wal.Append(command);
+        }
+        // The segment the rollover would start cannot be created
+        mkdir(SegmentPath(aof, 3).c_str(), 0755);
+        ok &= Expect(!wal.Truncate(2), "Truncate: a failed rollover was reported as success");
+        ok &= Expect(wal.HasFailed(), "Truncate: the log did not fail with its segment closed");
+        ok &= Expect(FileExists(SegmentPath(aof, 1)), "Truncate: a segment was deleted after a failed rollover");
+        ReplicationCommand command = MakeSet("key3", "value");
+        ok &= Expect(wal.Append(command) == 0, "Truncate: an append was taken after a failed rollover");
+    }
+    RemoveDirectory(dir);
+
+    if (ok) {
+        std::cout << "  Corrupt and missing segments make a read incomplete" << std::endl;
+    }
+    return ok;
+}
+
+int main() {
+    std::cout << "==================================" << std::endl;
+    std::cout << "Persistence Test" << std::endl;
+    std::cout << "==================================" << std::endl;
+
+    std::cout << "\n[Test 1] Failing log writes..." << std::endl;
+    if (!CheckUnloggedWrites()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 2] Torn and corrupt records..." << std::endl;
+    if (!CheckTornTail()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 3] Segment rollover and truncation..." << std::endl;
+    if (!CheckSegments()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 4] Text AOF conversion..." << std::endl;
+    if (!CheckLegacyAof()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 5] Restarts..." << std::endl;
+    if (!CheckRestart()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 6] Snapshot and log tail..." << std::endl;
+    if (!CheckSnapshotTail()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 7] File writer backends..." << std::endl;
+    if (!CheckFileWriters()) {
+        return 1;
+    }
+
+    std::cout << "\n[Test 8] Incomplete reads..." << std::endl;
+    if (!CheckIncompleteReads()) {
+        return 1;
+    }
+
+    std::cout << "\n==================================" << std::endl;
+    std::cout << "All tests completed!" << std::endl;
+    std::cout << "==================================" << std::endl;
+
+    return 0;
+}
@@ -2,6 +2,11 @@
 #include <iomanip>
 #include <thread>
 #include <chrono>
+#include <cmath>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "../src/sharding/shard_router.h"
 
 using namespace kvstore;
@@ -17,14 +22,280 @@ void PrintStats(const ShardRouter& router) {
     
     for (const auto& [shard_id, count] : stats.per_shard_requests) {
         double percentage = (100.0 * count) / stats.total_requests;
+        const auto& set = stats.per_shard.at(shard_id).latency[static_cast<size_t>(RouterOp::SET)];
         std::cout << "  " << std::setw(12) << shard_id << ": " 
                   << std::setw(5) << count << " requests (" 
                   << std::fixed << std::setprecision(1) << percentage << "%)" 
+                  << ", SET p50 " << set.Percentile(0.5) << " us, p99 " << set.Percentile(0.99) << " us"
                   << std::endl;
     }
     std::cout << "========================================\n" << std::endl;
 }
 
+// Bucket bounds, and percentiles of a known distribution within the
+// histogram's precision
+bool CheckHistogram() {
+    for (int bits : {1, 5, 10}) {
+        uint64_t previous = 0;
+        for (size_t bucket = 1; bucket < LatencyHistogram::BucketCount(bits); ++bucket) {
+            uint64_t upper = LatencyHistogram::BucketUpperBound(bucket, bits);
+            if (upper <= previous || LatencyHistogram::BucketFor(upper, bits) != bucket ||
+                LatencyHistogram::BucketFor(previous + 1, bits) != bucket) {
+                std::cout << "  ✗ Bucket " << bucket << " at " << bits << " bits is out of order" << std::endl;
+                return false;
+            }
+            previous = upper;
+        }
+    }
+    
+    LatencyHistogram histogram(5);
+    for (uint64_t micros = 1; micros <= 100000; ++micros) {
+        histogram.Record(micros);
+    }
+    histogram.Record(uint64_t{1} << 40);   // Past the range: the top bucket
+    LatencySnapshot snapshot = histogram.Snapshot();
+    for (double p : {0.5, 0.9, 0.99, 0.999}) {
+        double exact = p * 100001;
+        double error = std::abs(static_cast<double>(snapshot.Percentile(p)) - exact) / exact;
+        if (error > 1.0 / 32) {
+            std::cout << "  ✗ p" << p * 100 << " is " << snapshot.Percentile(p) << ", not about " << exact << std::endl;
+            return false;
+        }
+    }
+    if (snapshot.count != 100001 || snapshot.Max() < (uint64_t{1} << LatencyHistogram::kRangeBits) - 1) {
+        std::cout << "  ✗ Histogram holds " << snapshot.count << " samples up to " << snapshot.Max() << std::endl;
+        return false;
+    }
+    std::cout << "  Percentiles of 1..100000 us within 1/32 at 5 bits" << std::endl;
+    return true;
+}
+
+// Counts from many threads add up exactly, with no lock
+bool CheckConcurrentCounts() {
+    const int threads = 8;
+    const int per_thread = 100000;
+    RouterMetrics metrics;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&metrics, t] {
+            ShardMetrics& shard = metrics.ForShard("shard-" + std::to_string(t % 3));
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < per_thread; ++i) {
+                shard.Add(ShardCounter::IN_FLIGHT);
+                shard.Add(ShardCounter::REQUESTS);
+                shard.RecordLatency(RouterOp::GET, start, start + std::chrono::microseconds(i % 1000));
+                shard.Add(ShardCounter::IN_FLIGHT, -1);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    
+    int64_t requests = 0;
+    uint64_t timed = 0;
+    for (const auto& [shard_id, shard] : metrics.All()) {
+        requests += shard->Sum(ShardCounter::REQUESTS);
+        timed += shard->Latency(RouterOp::GET).count;
+        if (shard->Sum(ShardCounter::IN_FLIGHT) != 0) {
+            std::cout << "  ✗ " << shard_id << " has requests left in flight" << std::endl;
+            return false;
+        }
+    }
+    if (requests != threads * per_thread || timed != static_cast<uint64_t>(threads * per_thread)) {
+        std::cout << "  ✗ " << requests << " requests and " << timed << " latencies counted, not "
+                  << threads * per_thread << std::endl;
+        return false;
+    }
+    std::cout << "  " << threads << " threads counted " << requests << " requests exactly" << std::endl;
+    return true;
+}
+
+// Failures in a row open the circuit; after open_ms one trial goes
+// through, and closes or reopens it. Probes open and close it too.
+bool CheckCircuitBreaker() {
+    HealthOptions options;
+    options.consecutive_failures = 3;
+    options.unhealthy_probes = 2;
+    options.open_ms = 50;
+    CircuitBreaker breaker(options);
+    
+    breaker.RecordFailure();
+    breaker.RecordFailure();
+    breaker.RecordSuccess();
+    breaker.RecordFailure();
+    breaker.RecordFailure();
+    if (!breaker.Allow() || breaker.RecordFailure() != CircuitChange::OPENED || breaker.Allow()) {
+        std::cout << "  ✗ Circuit did not open on 3 failures in a row, or only on 4 with a success between" << std::endl;
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    if (!breaker.Allow() || breaker.Allow() || breaker.State() != CircuitState::HALF_OPEN) {
+        std::cout << "  ✗ An open circuit did not let exactly one trial through" << std::endl;
+        return false;
+    }
+    breaker.RecordFailure();
+    if (breaker.State() != CircuitState::OPEN || breaker.Allow()) {
+        std::cout << "  ✗ A failed trial did not reopen the circuit" << std::endl;
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    if (!breaker.Allow() || breaker.RecordSuccess() != CircuitChange::CLOSED || !breaker.Allow()) {
+        std::cout << "  ✗ A successful trial did not close the circuit" << std::endl;
+        return false;
+    }
+    
+    if (breaker.RecordProbe(false) != CircuitChange::NONE || breaker.RecordProbe(false) != CircuitChange::OPENED ||
+        breaker.RecordProbe(true) != CircuitChange::CLOSED) {
+        std::cout << "  ✗ Probes did not open and close the circuit" << std::endl;
+        return false;
+    }
+    std::cout << "  Circuit opens, lets one trial through, and closes" << std::endl;
+    return true;
+}
+
+// Retries stop once half the budget is spent, and resume as successes
+// earn it back; backoffs stay under their doubling cap and spread out
+bool CheckRetryBudget() {
+    HealthOptions options;
+    options.retry_tokens = 10;
+    options.retry_token_ratio = 0.5;
+    RetryBudget budget(options);
+    for (int i = 0; i < 4; ++i) {
+        budget.RecordFailure();
+    }
+    bool before = budget.AllowRetry();
+    budget.RecordFailure();
+    bool spent = budget.AllowRetry();
+    budget.RecordSuccess();
+    budget.RecordSuccess();
+    if (!before || spent || !budget.AllowRetry()) {
+        std::cout << "  ✗ Retry budget allowed " << before << spent << budget.AllowRetry()
+                  << " after 4, 5 failures and 2 successes" << std::endl;
+        return false;
+    }
+    
+    for (int retry = 0; retry < 5; ++retry) {
+        int64_t cap = std::min<int64_t>(200, 20 << retry);
+        int64_t low = cap;
+        int64_t high = 0;
+        for (int i = 0; i < 1000; ++i) {
+            int64_t backoff = RetryBackoffMs(retry, 20, 200);
+            low = std::min(low, backoff);
+            high = std::max(high, backoff);
+        }
+        if (low < 0 || high > cap || high - low < cap / 2) {
+            std::cout << "  ✗ Backoffs for retry " << retry << " ran " << low << "-" << high
+                      << " ms, not across 0-" << cap << std::endl;
+            return false;
+        }
+    }
+    std::cout << "  Retry budget runs out and refills; backoffs jittered under their cap" << std::endl;
+    return true;
+}
+
+// A router's calls to a shard that refuses connections and one that
+// accepts them and never answers
+bool CheckUnhealthyShards() {
+    // Listening, but never accepting: connections open and hang
+    int hung = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(hung, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(hung, 128) != 0 ||
+        getsockname(hung, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        std::cout << "  ✗ Could not listen" << std::endl;
+        return false;
+    }
+    
+    auto hash_ring = std::make_shared<HashRing>(150);
+    hash_ring->AddShard("refused", "127.0.0.1:1");
+    hash_ring->AddShard("hung", "127.0.0.1:" + std::to_string(ntohs(address.sin_port)));
+    ChannelPoolOptions pool;
+    pool.warm_up_timeout_ms = 0;
+    HealthOptions health;
+    health.read_deadline_ms = 200;
+    health.write_deadline_ms = 200;
+    health.probe_interval_ms = 0;
+    health.consecutive_failures = 1000;   // Retries alone first
+    ShardRouter router(hash_ring, ShardRouter::kDefaultCompletionThreads, pool,
+                       LatencyHistogram::kDefaultPrecisionBits, health);
+    
+    std::vector<std::string> refused_keys;
+    std::string hung_key;
+    for (int i = 0; refused_keys.size() < 20 || hung_key.empty(); ++i) {
+        std::string key = "health:" + std::to_string(i);
+        if (hash_ring->GetShardForKey(key) == "refused") {
+            refused_keys.push_back(key);
+        } else if (hung_key.empty()) {
+            hung_key = key;
+        }
+    }
+    
+    // Retries run out with the budget, not per read
+    for (const auto& key : refused_keys) {
+        router.Get(key);
+    }
+    auto stats = router.GetStats();
+    if (stats.retries == 0 || stats.retries > 10) {
+        std::cout << "  ✗ " << stats.retries << " retries for " << refused_keys.size() << " failed reads" << std::endl;
+        return false;
+    }
+    
+    // A shard that never answers fails at the deadline, blocking and async
+    auto start = std::chrono::steady_clock::now();
+    bool set = router.Set(hung_key, "value");
+    bool async_set = router.SetAsync(hung_key, "value").get();
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    if (set || async_set || waited.count() > 2000) {
+        std::cout << "  ✗ Two writes to a hung shard took " << waited.count() << " ms" << std::endl;
+        return false;
+    }
+    std::cout << "  " << stats.retries << " retries for " << refused_keys.size()
+              << " failed reads; two writes to a hung shard gave up in " << waited.count() << " ms" << std::endl;
+    
+    // With the circuit breaker: open after 5 failures, then refused at once
+    health.consecutive_failures = 5;
+    ShardRouter breaking(hash_ring, ShardRouter::kDefaultCompletionThreads, pool,
+                         LatencyHistogram::kDefaultPrecisionBits, health);
+    for (int i = 0; i < 5; ++i) {
+        breaking.Set(hung_key, "value");
+    }
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; ++i) {
+        breaking.Set(hung_key, "value");
+        breaking.GetAsync(hung_key).get();
+    }
+    waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    stats = breaking.GetStats();
+    bool available = hash_ring->GetShard("hung")->is_available;
+    if (breaking.GetCircuitState("hung") != CircuitState::OPEN || available || stats.circuit_opens != 1 ||
+        stats.shed_requests != 200 || waited.count() > 500) {
+        std::cout << "  ✗ Hung shard's circuit: " << static_cast<int>(breaking.GetCircuitState("hung"))
+                  << ", available " << available << ", " << stats.shed_requests << " shed in "
+                  << waited.count() << " ms" << std::endl;
+        return false;
+    }
+    std::cout << "  Circuit opened on the hung shard: 200 calls refused in " << waited.count() << " ms" << std::endl;
+    close(hung);
+    return true;
+}
+
+// The last shard cannot be removed: its keys would have nowhere to go
+bool CheckLastShard() {
+    auto ring = std::make_shared<HashRing>(10);
+    ring->AddShard("only", "localhost:1");
+    ShardRouter router(ring);
+    
+    if (router.RemoveShard("only") || !ring->GetShard("only") || ring->GetShardCount() != 1) {
+        std::cout << "  ✗ The last shard was removed" << std::endl;
+        return false;
+    }
+    std::cout << "  Removing the last shard is refused" << std::endl;
+    return true;
+}
+
 int main() {
     std::cout << "==================================" << std::endl;
     std::cout << "Shard Router Test" << std::endl;
@@ -101,6 +372,32 @@ int main() {
     }
     std::cout << "✓ Same shard every time (consistent hashing!)" << std::endl;
     
+    // Step 7: Statistics
+    std::cout << "\n[Step 7] Checking lock-free statistics..." << std::endl;
+    if (!CheckHistogram() || !CheckConcurrentCounts()) {
+        return 1;
+    }
+    auto stats = router.GetStats();
+    uint64_t timed = stats.latency[static_cast<size_t>(RouterOp::SET)].count;
+    if (stats.in_flight != 0 || timed != stats.total_requests) {
+        std::cout << "  ✗ Router has " << stats.in_flight << " requests in flight and " << timed
+                  << " timed of " << stats.total_requests << std::endl;
+        return 1;
+    }
+    std::cout << "  Router: every request timed, none left in flight" << std::endl;
+    
+    // Step 8: Shard health
+    std::cout << "\n[Step 8] Checking circuit breaking, retries and deadlines..." << std::endl;
+    if (!CheckCircuitBreaker() || !CheckRetryBudget() || !CheckUnhealthyShards()) {
+        return 1;
+    }
+    
+    // Step 9: Resharding
+    std::cout << "\n[Step 9] Checking shard removal..." << std::endl;
+    if (!CheckLastShard()) {
+        return 1;
+    }
+    
     std::cout << "\n==================================" << std::endl;
     std::cout << "Router test completed!" << std::endl;
     std::cout << "==================================" << std::endl;